@@ -0,0 +1,63 @@
+// arena.c - bump-pointer allocator owning the AST
+
+#include "pLLVM.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define ARENA_ALIGN      8
+#define ARENA_HEADER     ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct ArenaBlock {
+    ArenaBlock* next;
+};
+
+_Thread_local Arena ast_arena;
+
+static ArenaBlock* new_block(size_t payload) {
+    ArenaBlock* block = malloc(ARENA_HEADER + payload);
+    if (!block) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return block;
+}
+
+void* arena_alloc(Arena* a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if ((size_t)(a->end - a->ptr) >= size) {
+        void* p = a->ptr;
+        a->ptr += size;
+        return p;
+    }
+    if (size > ARENA_BLOCK_SIZE / 4) {
+        // Oversized requests get a block of their own behind the current one,
+        // so the rest of the current block stays usable
+        ArenaBlock* block = new_block(size);
+        if (a->head) {
+            block->next = a->head->next;
+            a->head->next = block;
+        } else {
+            block->next = NULL;
+            a->head = block;
+        }
+        return (char*)block + ARENA_HEADER;
+    }
+    ArenaBlock* block = new_block(ARENA_BLOCK_SIZE);
+    block->next = a->head;
+    a->head = block;
+    a->ptr = (char*)block + ARENA_HEADER + size;
+    a->end = (char*)block + ARENA_HEADER + ARENA_BLOCK_SIZE;
+    return (char*)block + ARENA_HEADER;
+}
+
+void arena_free(Arena* a) {
+    ArenaBlock* block = a->head;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    memset(a, 0, sizeof(*a));
+}
@@ -0,0 +1,392 @@
+// array.c - array values and their vectorized element-wise lowering
+//
+// An array is the value { i32 length, T* data } with T i32 or float. The data
+// is heap allocated and shared on assignment. Element-wise operators and the
+// reductions run over <W x T> vectors, W sized for the host's widest vector
+// registers, followed by a scalar loop for the remaining elements.
+
+#include "pLLVM.h"
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    LLVMBasicBlockRef preBB;
+    LLVMBasicBlockRef condBB;
+    LLVMBasicBlockRef endBB;
+    LLVMValueRef      index;
+    LLVMValueRef      test;
+} Loop;
+
+int is_array_type(LLVMTypeRef t) {
+    return LLVMGetTypeKind(t) == LLVMStructTypeKind;
+}
+
+LLVMTypeRef array_type(LLVMTypeRef elem) {
+    LLVMTypeRef fields[] = { LLVMInt32TypeInContext(context), LLVMPointerType(elem, 0) };
+    return LLVMStructTypeInContext(context, fields, 2, 0);
+}
+
+static LLVMTypeRef element_type(LLVMTypeRef arrayTy) {
+    return LLVMGetElementType(LLVMStructGetTypeAtIndex(arrayTy, 1));
+}
+
+// Lanes per vector: 512-bit registers with AVX-512, 256-bit with AVX, else
+// 128-bit (SSE2 is the x86-64 baseline). The interpreter folds float
+// reductions in the same lane order
+unsigned lanes_for_features(const char* features) {
+    unsigned bits = strstr(features, "+avx512f") ? 512 : strstr(features, "+avx") ? 256 : 128;
+    return bits / 32;
+}
+
+static unsigned vector_width(void) {
+    char* features = LLVMGetTargetMachineFeatureString(targetMachine);
+    unsigned width = lanes_for_features(features);
+    LLVMDisposeMessage(features);
+    return width;
+}
+
+static LLVMValueRef get_malloc(void) {
+    LLVMValueRef fn = LLVMGetNamedFunction(module, "malloc");
+    if (!fn) {
+        LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+        LLVMTypeRef i8ptr = LLVMPointerType(LLVMInt8TypeInContext(context), 0);
+        fn = LLVMAddFunction(module, "malloc", LLVMFunctionType(i8ptr, &i64, 1, 0));
+    }
+    return fn;
+}
+
+// Stops the program, as the interpreter does, when malloc fails
+static void check_allocation(LLVMValueRef raw, LLVMValueRef length) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMTypeRef fnTy = LLVMFunctionType(LLVMVoidTypeInContext(context), &i32, 1, 0);
+    LLVMValueRef fail = LLVMGetNamedFunction(module, "chain_out_of_memory");
+    if (!fail) {
+        fail = get_runtime_function("chain_out_of_memory", fnTy);
+        add_function_attribute(fail, "noreturn");
+        add_function_attribute(fail, "cold");
+    }
+    LLVMBasicBlockRef failBB = LLVMAppendBasicBlockInContext(context, currentFunction, "array.oom");
+    LLVMBasicBlockRef okBB = LLVMAppendBasicBlockInContext(context, currentFunction, "array.ok");
+    LLVMBuildCondBr(builder, LLVMBuildIsNull(builder, raw, ""), failBB, okBB);
+    LLVMPositionBuilderAtEnd(builder, failBB);
+    LLVMBuildCall2(builder, fnTy, fail, &length, 1, "");
+    LLVMBuildUnreachable(builder);
+    LLVMPositionBuilderAtEnd(builder, okBB);
+}
+
+// The data is never freed: arrays are shared on assignment with no record
+// of who else holds them (see README)
+static LLVMValueRef allocate_array(LLVMTypeRef elem, LLVMValueRef length) {
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+    LLVMValueRef bytes = LLVMBuildMul(builder, LLVMBuildSExt(builder, length, i64, ""),
+                                      LLVMSizeOf(elem), "array.bytes");
+    // malloc(0) may return NULL, which is not a failure
+    LLVMValueRef empty = LLVMBuildICmp(builder, LLVMIntEQ, bytes, LLVMConstInt(i64, 0, 0), "");
+    bytes = LLVMBuildSelect(builder, empty, LLVMConstInt(i64, 1, 0), bytes, "");
+    LLVMValueRef malloc_fn = get_malloc();
+    LLVMValueRef raw = LLVMBuildCall2(builder, LLVMGetElementType(LLVMTypeOf(malloc_fn)),
+                                      malloc_fn, &bytes, 1, "");
+    check_allocation(raw, length);
+    LLVMValueRef data = LLVMBuildBitCast(builder, raw, LLVMPointerType(elem, 0), "array.data");
+    LLVMValueRef a = LLVMGetUndef(array_type(elem));
+    a = LLVMBuildInsertValue(builder, a, length, 0, "");
+    return LLVMBuildInsertValue(builder, a, data, 1, "array");
+}
+
+// for (index = start; index < limit; index += step); leaves the builder in
+// the body
+static Loop begin_loop(LLVMValueRef start, LLVMValueRef limit, const char* name) {
+    char label[32];
+    Loop l;
+    l.preBB = LLVMGetInsertBlock(builder);
+    snprintf(label, sizeof(label), "%s.cond", name);
+    l.condBB = LLVMAppendBasicBlockInContext(context, currentFunction, label);
+    snprintf(label, sizeof(label), "%s.body", name);
+    LLVMBasicBlockRef bodyBB = LLVMAppendBasicBlockInContext(context, currentFunction, label);
+    snprintf(label, sizeof(label), "%s.end", name);
+    l.endBB = LLVMAppendBasicBlockInContext(context, currentFunction, label);
+    LLVMBuildBr(builder, l.condBB);
+    LLVMPositionBuilderAtEnd(builder, l.condBB);
+    l.index = LLVMBuildPhi(builder, LLVMInt32TypeInContext(context), "i");
+    LLVMAddIncoming(l.index, &start, &l.preBB, 1);
+    l.test = LLVMBuildICmp(builder, LLVMIntSLT, l.index, limit, "");
+    LLVMBuildCondBr(builder, l.test, bodyBB, l.endBB);
+    LLVMPositionBuilderAtEnd(builder, bodyBB);
+    return l;
+}
+
+// A value carried around the loop; the caller adds the back-edge incoming
+// from the block end_loop() returns
+static LLVMValueRef loop_phi(Loop* l, LLVMTypeRef ty, LLVMValueRef init, const char* name) {
+    LLVMBasicBlockRef here = LLVMGetInsertBlock(builder);
+    LLVMPositionBuilderBefore(builder, l->test);
+    LLVMValueRef phi = LLVMBuildPhi(builder, ty, name);
+    LLVMAddIncoming(phi, &init, &l->preBB, 1);
+    LLVMPositionBuilderAtEnd(builder, here);
+    return phi;
+}
+
+static LLVMBasicBlockRef end_loop(Loop* l, unsigned step) {
+    LLVMBasicBlockRef latch = LLVMGetInsertBlock(builder);
+    LLVMValueRef next = LLVMBuildAdd(builder, l->index,
+                                     LLVMConstInt(LLVMInt32TypeInContext(context), step, 0), "");
+    LLVMBuildBr(builder, l->condBB);
+    LLVMAddIncoming(l->index, &next, &latch, 1);
+    LLVMPositionBuilderAtEnd(builder, l->endBB);
+    return latch;
+}
+
+static LLVMValueRef splat(LLVMValueRef scalar, unsigned width) {
+    LLVMTypeRef vecTy = LLVMVectorType(LLVMTypeOf(scalar), width);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMValueRef one = LLVMBuildInsertElement(builder, LLVMGetUndef(vecTy), scalar,
+                                              LLVMConstInt(i32, 0, 0), "");
+    return LLVMBuildShuffleVector(builder, one, LLVMGetUndef(vecTy),
+                                  LLVMConstNull(LLVMVectorType(i32, width)), "splat");
+}
+
+// Pointer to width elements of data starting at index, typed for a vector
+// access when width > 1
+static LLVMValueRef lanes_ptr(LLVMValueRef data, LLVMValueRef index, unsigned width) {
+    LLVMTypeRef elem = LLVMGetElementType(LLVMTypeOf(data));
+    LLVMValueRef ptr = LLVMBuildGEP2(builder, elem, data, &index, 1, "");
+    if (width == 1)
+        return ptr;
+    return LLVMBuildBitCast(builder, ptr, LLVMPointerType(LLVMVectorType(elem, width), 0), "");
+}
+
+static LLVMValueRef load_lanes(LLVMValueRef data, LLVMValueRef index, unsigned width) {
+    LLVMValueRef ptr = lanes_ptr(data, index, width);
+    LLVMValueRef v = LLVMBuildLoad2(builder, LLVMGetElementType(LLVMTypeOf(ptr)), ptr, "");
+    LLVMSetAlignment(v, 4);
+    return v;
+}
+
+static void store_lanes(LLVMValueRef data, LLVMValueRef index, LLVMValueRef value, unsigned width) {
+    LLVMValueRef ptr = lanes_ptr(data, index, width);
+    LLVMSetAlignment(LLVMBuildStore(builder, value, ptr), 4);
+}
+
+// One operator on scalars or vectors; comparisons give 0/1 in resultTy
+static LLVMValueRef element_op(BinOp op, int isFloat, LLVMValueRef a, LLVMValueRef b,
+                               LLVMTypeRef resultTy) {
+    static const LLVMIntPredicate ipred[] = { LLVMIntEQ, LLVMIntNE, LLVMIntSLT, LLVMIntSGT,
+                                              LLVMIntSLE, LLVMIntSGE };
+    static const LLVMRealPredicate fpred[] = { LLVMRealOEQ, LLVMRealONE, LLVMRealOLT, LLVMRealOGT,
+                                               LLVMRealOLE, LLVMRealOGE };
+    switch (op) {
+        case OP_ADD: return isFloat ? LLVMBuildFAdd(builder, a, b, "") : LLVMBuildAdd(builder, a, b, "");
+        case OP_SUB: return isFloat ? LLVMBuildFSub(builder, a, b, "") : LLVMBuildSub(builder, a, b, "");
+        case OP_MUL: return isFloat ? LLVMBuildFMul(builder, a, b, "") : LLVMBuildMul(builder, a, b, "");
+        case OP_DIV: return isFloat ? LLVMBuildFDiv(builder, a, b, "") : LLVMBuildSDiv(builder, a, b, "");
+        case OP_EQ:
+        case OP_NE:
+        case OP_LT:
+        case OP_GT:
+        case OP_LE:
+        case OP_GE: {
+            LLVMValueRef cmp = isFloat ? LLVMBuildFCmp(builder, fpred[op - OP_EQ], a, b, "")
+                                       : LLVMBuildICmp(builder, ipred[op - OP_EQ], a, b, "");
+            return LLVMBuildZExt(builder, cmp, resultTy, "");
+        }
+        default:
+            compile_error("Unsupported array operator\n");
+            compile_failed();
+    }
+}
+
+LLVMValueRef generate_array_literal(ExprList elems, LLVMBasicBlockRef catchBB) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMValueRef* vals = malloc((elems.count + 1) * sizeof(LLVMValueRef));
+    LLVMTypeRef elem = i32;
+    for (int i = 0; i < elems.count; i++) {
+        vals[i] = generate_expression(elems.exprs[i], catchBB);
+        if (LLVMTypeOf(vals[i]) == LLVMInt1TypeInContext(context))
+            vals[i] = LLVMBuildZExt(builder, vals[i], i32, "");
+        if (i == 0)
+            elem = LLVMTypeOf(vals[0]);
+        if (LLVMTypeOf(vals[i]) != elem || (elem != i32 && elem != LLVMFloatTypeInContext(context))) {
+            compile_error("Array elements must be all int or all float\n");
+            compile_failed();
+        }
+    }
+    LLVMValueRef a = allocate_array(elem, LLVMConstInt(i32, elems.count, 0));
+    LLVMValueRef data = LLVMBuildExtractValue(builder, a, 1, "");
+    for (int i = 0; i < elems.count; i++)
+        store_lanes(data, LLVMConstInt(i32, i, 0), vals[i], 1);
+    free(vals);
+    return a;
+}
+
+// array(n): n zeroed ints
+LLVMValueRef generate_array_new(LLVMValueRef length) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    if (LLVMTypeOf(length) != i32) {
+        compile_error("array(n) takes an int length\n");
+        compile_failed();
+    }
+    LLVMValueRef zero = LLVMConstInt(i32, 0, 0);
+    length = LLVMBuildSelect(builder, LLVMBuildICmp(builder, LLVMIntSLT, length, zero, ""),
+                             zero, length, "array.len");
+    LLVMValueRef a = allocate_array(i32, length);
+    LLVMValueRef data = LLVMBuildBitCast(builder, LLVMBuildExtractValue(builder, a, 1, ""),
+                                         LLVMPointerType(LLVMInt8TypeInContext(context), 0), "");
+    LLVMValueRef bytes = LLVMBuildMul(builder, LLVMBuildZExt(builder, length, LLVMInt64TypeInContext(context), ""),
+                                      LLVMConstInt(LLVMInt64TypeInContext(context), 4, 0), "");
+    LLVMBuildMemSet(builder, data, LLVMConstInt(LLVMInt8TypeInContext(context), 0, 0), bytes, 4);
+    return a;
+}
+
+// read_ints(n) and read_floats(n): up to n numbers from the input, in an
+// array as long as the number read
+LLVMValueRef generate_array_input(int isFloat, LLVMValueRef length) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    if (LLVMTypeOf(length) != i32) {
+        compile_error("%s(n) takes an int count\n", isFloat ? "read_floats" : "read_ints");
+        compile_failed();
+    }
+    LLVMValueRef zero = LLVMConstInt(i32, 0, 0);
+    length = LLVMBuildSelect(builder, LLVMBuildICmp(builder, LLVMIntSLT, length, zero, ""),
+                             zero, length, "array.len");
+    LLVMTypeRef elem = isFloat ? LLVMFloatTypeInContext(context) : i32;
+    LLVMValueRef a = allocate_array(elem, length);
+    LLVMTypeRef params[] = { LLVMPointerType(elem, 0), i32 };
+    LLVMTypeRef fnTy = LLVMFunctionType(i32, params, 2, 0);
+    const char* name = isFloat ? "chain_read_floats" : "chain_read_ints";
+    LLVMValueRef args[] = { LLVMBuildExtractValue(builder, a, 1, ""), length };
+    LLVMValueRef count = LLVMBuildCall2(builder, fnTy, get_runtime_function(name, fnTy), args, 2, "read");
+    return LLVMBuildInsertValue(builder, a, count, 0, "array");
+}
+
+// Address of a[index]; inside try an out-of-range index branches to catch
+LLVMValueRef array_element_ptr(LLVMValueRef a, LLVMValueRef index, LLVMBasicBlockRef catchBB) {
+    if (!is_array_type(LLVMTypeOf(a)) || LLVMTypeOf(index) != LLVMInt32TypeInContext(context)) {
+        compile_error("Indexing needs an array and an int index\n");
+        compile_failed();
+    }
+    if (catchBB) {
+        LLVMValueRef length = LLVMBuildExtractValue(builder, a, 0, "len");
+        branch_to_catch(LLVMBuildICmp(builder, LLVMIntUGE, index, length, "outOfRange"),
+                        catchBB, "index");
+    }
+    return lanes_ptr(LLVMBuildExtractValue(builder, a, 1, ""), index, 1);
+}
+
+LLVMValueRef generate_array_binop(BinOp op, LLVMValueRef left, LLVMValueRef right) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    int leftArray = is_array_type(LLVMTypeOf(left));
+    int rightArray = is_array_type(LLVMTypeOf(right));
+    LLVMTypeRef elem = element_type(LLVMTypeOf(leftArray ? left : right));
+    LLVMTypeRef other = leftArray && rightArray ? element_type(LLVMTypeOf(right))
+                                                : LLVMTypeOf(leftArray ? right : left);
+    if (other != elem) {
+        compile_error("Array operands must have the same element type\n");
+        compile_failed();
+    }
+    int isFloat = elem == LLVMFloatTypeInContext(context);
+    LLVMTypeRef resultElem = op >= OP_EQ ? i32 : elem;
+    unsigned width = vector_width();
+
+    // Arrays of different lengths combine over the shorter one
+    LLVMValueRef length = LLVMBuildExtractValue(builder, leftArray ? left : right, 0, "len");
+    if (leftArray && rightArray) {
+        LLVMValueRef rlen = LLVMBuildExtractValue(builder, right, 0, "len");
+        length = LLVMBuildSelect(builder, LLVMBuildICmp(builder, LLVMIntSLT, rlen, length, ""),
+                                 rlen, length, "len");
+    }
+    LLVMValueRef ldata = leftArray ? LLVMBuildExtractValue(builder, left, 1, "") : NULL;
+    LLVMValueRef rdata = rightArray ? LLVMBuildExtractValue(builder, right, 1, "") : NULL;
+    LLVMValueRef lsplat = leftArray ? NULL : splat(left, width);
+    LLVMValueRef rsplat = rightArray ? NULL : splat(right, width);
+    LLVMValueRef result = allocate_array(resultElem, length);
+    LLVMValueRef dst = LLVMBuildExtractValue(builder, result, 1, "");
+
+    LLVMValueRef vecEnd = LLVMBuildAnd(builder, length, LLVMConstInt(i32, ~(width - 1), 1), "vec.end");
+    Loop v = begin_loop(LLVMConstInt(i32, 0, 0), vecEnd, "vec");
+    LLVMValueRef a = leftArray ? load_lanes(ldata, v.index, width) : lsplat;
+    LLVMValueRef b = rightArray ? load_lanes(rdata, v.index, width) : rsplat;
+    store_lanes(dst, v.index, element_op(op, isFloat, a, b, LLVMVectorType(i32, width)), width);
+    end_loop(&v, width);
+
+    Loop s = begin_loop(vecEnd, length, "tail");
+    a = leftArray ? load_lanes(ldata, s.index, 1) : left;
+    b = rightArray ? load_lanes(rdata, s.index, 1) : right;
+    store_lanes(dst, s.index, element_op(op, isFloat, a, b, i32), 1);
+    end_loop(&s, 1);
+    return result;
+}
+
+int is_array_builtin(const char* name) {
+    return !strcmp(name, "len") || !strcmp(name, "sum") || !strcmp(name, "min") || !strcmp(name, "max");
+}
+
+// Sum, min or max of scalars or of vectors lane by lane
+static LLVMValueRef combine(char kind, int isFloat, LLVMValueRef acc, LLVMValueRef x) {
+    if (kind == 's')
+        return isFloat ? LLVMBuildFAdd(builder, acc, x, "") : LLVMBuildAdd(builder, acc, x, "");
+    LLVMValueRef keep = isFloat ? LLVMBuildFCmp(builder, kind == 'n' ? LLVMRealOLT : LLVMRealOGT, acc, x, "")
+                                : LLVMBuildICmp(builder, kind == 'n' ? LLVMIntSLT : LLVMIntSGT, acc, x, "");
+    return LLVMBuildSelect(builder, keep, acc, x, "");
+}
+
+// len(a), and sum/min/max of the elements (min and max of an empty array are 0)
+LLVMValueRef generate_array_builtin(const char* name, LLVMValueRef arr) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMValueRef length = LLVMBuildExtractValue(builder, arr, 0, "len");
+    if (!strcmp(name, "len"))
+        return length;
+
+    char kind = !strcmp(name, "sum") ? 's' : !strcmp(name, "min") ? 'n' : 'x';
+    LLVMTypeRef elem = element_type(LLVMTypeOf(arr));
+    int isFloat = elem == LLVMFloatTypeInContext(context);
+    LLVMValueRef identity;
+    if (kind == 's')
+        identity = LLVMConstNull(elem);
+    else if (isFloat)
+        identity = LLVMConstReal(elem, kind == 'n' ? HUGE_VAL : -HUGE_VAL);
+    else
+        identity = LLVMConstInt(i32, kind == 'n' ? INT_MAX : INT_MIN, 1);
+    unsigned width = vector_width();
+    LLVMValueRef data = LLVMBuildExtractValue(builder, arr, 1, "");
+
+    LLVMValueRef vecEnd = LLVMBuildAnd(builder, length, LLVMConstInt(i32, ~(width - 1), 1), "vec.end");
+    Loop v = begin_loop(LLVMConstInt(i32, 0, 0), vecEnd, "reduce.vec");
+    LLVMValueRef vacc = loop_phi(&v, LLVMVectorType(elem, width), LLVMConstVector(
+                                     (LLVMValueRef[16]){ identity, identity, identity, identity,
+                                                         identity, identity, identity, identity,
+                                                         identity, identity, identity, identity,
+                                                         identity, identity, identity, identity },
+                                     width), "acc.vec");
+    LLVMValueRef next = combine(kind, isFloat, vacc, load_lanes(data, v.index, width));
+    LLVMBasicBlockRef latch = end_loop(&v, width);
+    LLVMAddIncoming(vacc, &next, &latch, 1);
+
+    // Fold the lanes together, then finish the tail one element at a time
+    LLVMValueRef acc = LLVMBuildExtractElement(builder, vacc, LLVMConstInt(i32, 0, 0), "");
+    for (unsigned i = 1; i < width; i++)
+        acc = combine(kind, isFloat, acc, LLVMBuildExtractElement(builder, vacc, LLVMConstInt(i32, i, 0), ""));
+    Loop s = begin_loop(vecEnd, length, "reduce.tail");
+    LLVMValueRef sacc = loop_phi(&s, elem, acc, "acc");
+    next = combine(kind, isFloat, sacc, load_lanes(data, s.index, 1));
+    latch = end_loop(&s, 1);
+    LLVMAddIncoming(sacc, &next, &latch, 1);
+
+    if (kind == 's')
+        return sacc;
+    LLVMValueRef empty = LLVMBuildICmp(builder, LLVMIntEQ, length, LLVMConstInt(i32, 0, 0), "");
+    return LLVMBuildSelect(builder, empty, LLVMConstNull(elem), sacc, name);
+}
+
+// output of an array prints one element per line
+void generate_array_output(LLVMValueRef arr) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMValueRef length = LLVMBuildExtractValue(builder, arr, 0, "len");
+    LLVMValueRef data = LLVMBuildExtractValue(builder, arr, 1, "");
+
+    Loop l = begin_loop(LLVMConstInt(i32, 0, 0), length, "print");
+    generate_output_value(load_lanes(data, l.index, 1));
+    end_loop(&l, 1);
+}
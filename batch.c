@@ -0,0 +1,174 @@
+// batch.c - many programs in one process: input files on the command line,
+// or a request stream on stdin (--batch), compiled -j at a time so LLVM and
+// target setup are paid once
+
+#include "pLLVM.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int batch_jobs = 1;
+_Thread_local jmp_buf* compile_recovery = NULL;
+_Thread_local ErrorPos error_pos;
+
+static char**      batch_files;
+static int         batch_count;
+static int         batch_next;
+static int         batch_stdin;
+static int         batch_failed;
+static pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Outside batch mode a compile error ends the process; in batch mode it
+// unwinds to compile_one(), and only that input fails
+_Noreturn void compile_failed(void) {
+    if (compile_recovery)
+        longjmp(*compile_recovery, 1);
+    exit(1);
+}
+
+ErrorPos error_enter(int line, int column) {
+    ErrorPos outer = error_pos;
+    error_pos = (ErrorPos){ line, column };
+    return outer;
+}
+
+void error_leave(ErrorPos outer) {
+    error_pos = outer;
+}
+
+// Semantic errors are reported like parse errors, as name:line:col: at the
+// node given or the one being checked; without a node, as for main, by name
+static void report(int line, int column, const char* fmt, va_list ap) {
+    const char* name = debug_source ? debug_source : "<stdin>";
+    if (line > 0)
+        fprintf(stderr, "%s:%d:%d: ", name, line, column);
+    else
+        fprintf(stderr, "%s: ", name);
+    vfprintf(stderr, fmt, ap);
+}
+
+void compile_error_at(int line, int column, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    report(line, column, fmt, ap);
+    va_end(ap);
+}
+
+void compile_error(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    report(error_pos.line, error_pos.column, fmt, ap);
+    va_end(ap);
+}
+
+// The input's name with its extension replaced to suit --emit (no
+// extension for executables)
+char* output_name(const char* input) {
+    static const char* extensions[] = { ".ll", ".bc", ".o", "" };
+    const char* ext = extensions[emit_format];
+    const char* slash = strrchr(input, '/');
+    const char* dot = strrchr(input, '.');
+    size_t stem = dot && dot > (slash ? slash : input) ? (size_t)(dot - input) : strlen(input);
+    char* out = malloc(stem + strlen(ext) + 1);
+    memcpy(out, input, stem);
+    strcpy(out + stem, ext);
+    return out;
+}
+
+// The next input and its output path, from the command line and then from
+// stdin, where each line is "input" or "input<TAB>output". 0 when done
+static int next_request(char** input, char** output) {
+    pthread_mutex_lock(&input_lock);
+    int found = 0;
+    *output = NULL;
+    if (batch_next < batch_count) {
+        *input = strdup(batch_files[batch_next++]);
+        found = 1;
+    }
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while (!found && batch_stdin && (len = getline(&line, &cap, stdin)) > 0) {
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (!len)
+            continue;
+        char* tab = strchr(line, '\t');
+        if (tab) {
+            *tab = '\0';
+            *output = strdup(tab + 1);
+        }
+        *input = strdup(line);
+        found = 1;
+    }
+    free(line);
+    pthread_mutex_unlock(&input_lock);
+    if (found && !*output)
+        *output = output_name(*input);
+    return found;
+}
+
+// 0 when the program compiled. A failure has already been reported on
+// stderr, and leaves this thread ready for the next input
+static int compile_one(const char* input, const char* output) {
+    output_path = output;
+    jmp_buf recovery;
+    int status;
+    compile_recovery = &recovery;
+    if (setjmp(recovery)) {
+        abandon_compile();
+        status = 1;
+    } else {
+        status = compile_file(input);
+    }
+    compile_recovery = NULL;
+    output_path = NULL;
+    return status;
+}
+
+// Reports "ok <input> <output>" or "error <input>" on stdout as each
+// program finishes, so a client streaming requests can follow along
+static void* batch_worker(void* arg) {
+    (void)arg;
+    begin_codegen_thread();
+    char *input, *output;
+    while (next_request(&input, &output)) {
+        int status = compile_one(input, output);
+        pthread_mutex_lock(&report_lock);
+        if (status) {
+            batch_failed = 1;
+            printf("error %s\n", input);
+        } else {
+            printf("ok %s %s\n", input, output);
+        }
+        fflush(stdout);
+        pthread_mutex_unlock(&report_lock);
+        free(input);
+        free(output);
+    }
+    end_codegen_thread();
+    return NULL;
+}
+
+// Returns 1 if any program failed to compile
+int run_batch(char** files, int count, int from_stdin) {
+    batch_files = files;
+    batch_count = count;
+    batch_stdin = from_stdin;
+    int worker_count = batch_jobs;
+    if (!from_stdin && count < worker_count)
+        worker_count = count;
+    pthread_t* workers = malloc(worker_count * sizeof(pthread_t));
+    for (int i = 0; i < worker_count; i++)
+        if (pthread_create(&workers[i], NULL, batch_worker, NULL)) {
+            fprintf(stderr, "Could not start batch worker\n");
+            exit(1);
+        }
+    for (int i = 0; i < worker_count; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    return batch_failed;
+}
@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+"""bench.py - compiler scaling and runtime kernel benchmarks for ChainLang
+
+  bench.py compile   sweep gen.py programs along one axis at a time (statement
+                     count, nesting depth, functions, variables, comparisons
+                     per condition) and report compile time, lexer throughput
+                     and peak RSS
+  bench.py runtime   build each bench/kernels/*.chain at -O0..-O3 and time the
+                     executables
+
+The compiler is $CHAINC (default ./chainlang); runtime needs --emit=exe to
+find a C compiler ($CC, default cc).
+"""
+
+import argparse
+import glob
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+import gen  # noqa: E402
+
+# Each axis varies from the gen.py defaults with the other parameters fixed
+AXES = {
+    "statements": [250, 500, 1000, 2000, 4000, 8000],
+    "depth":      [1, 2, 3, 4, 5],
+    "functions":  [10, 50, 100, 200, 400],
+    "variables":  [10, 50, 100, 200, 400, 800],
+    "logic":      [1, 2, 4, 8, 16],
+}
+BASE = {"statements": 1000, "depth": 2, "functions": 10, "variables": 50, "logic": 2, "seed": 1}
+
+
+def generate(params):
+    return gen.Generator(argparse.Namespace(**params)).program()
+
+
+# Runs one compile of a file, as a build would (the compiler maps it rather
+# than reading a pipe); the JSON --time-report is the last line of stderr
+def compile_once(chainc, path, extra, timeout):
+    cmd = [chainc, "--time-report=json", "-o", os.devnull] + extra + [path]
+    try:
+        r = subprocess.run(cmd, capture_output=True, text=True, timeout=timeout)
+    except subprocess.TimeoutExpired:
+        return None, "timeout"
+    if r.returncode != 0:
+        return None, r.stderr.strip().splitlines()[-1] if r.stderr.strip() else "exit %d" % r.returncode
+    return json.loads(r.stderr.strip().splitlines()[-1]), None
+
+
+def run_compile(args):
+    extra = ["-O%d" % args.opt] + args.compiler_args
+    axes = args.axis or list(AXES)
+    rows = []
+    if not args.json:
+        print("%-11s %6s %9s %10s %9s %10s %10s %10s %11s %12s %12s" % (
+            "axis", "value", "bytes", "wall ms", "lex MB/s", "parse ms", "codegen ms", "opt ms",
+            "peak KiB", "lookups", "instructions"))
+    for axis in axes:
+        for value in AXES[axis]:
+            params = dict(BASE, **{axis: value})
+            source = generate(params)
+            best, error = None, None
+            with tempfile.NamedTemporaryFile("w", suffix=".chain") as f:
+                f.write(source)
+                f.flush()
+                for _ in range(args.repeat):
+                    report, error = compile_once(args.chainc, f.name, extra, args.timeout)
+                    if error:
+                        break
+                    if not best or report["total"]["wall_ms"] < best["total"]["wall_ms"]:
+                        best = report
+            row = {"axis": axis, "value": value, "bytes": len(source)}
+            if error:
+                row["error"] = error
+            else:
+                phases = best["phases"]
+                lex_ms = phases.get("lex", {}).get("wall_ms", 0)
+                row.update({
+                    "wall_ms": best["total"]["wall_ms"],
+                    "cpu_ms": best["total"]["cpu_ms"],
+                    "peak_rss_kb": best["total"]["peak_rss_kb"],
+                    "phases_ms": {name: p["wall_ms"] for name, p in phases.items()},
+                    "counters": best["counters"],
+                    # Includes mapping the input; the lexer reads it in place
+                    "lex_mb_s": best["counters"]["source_bytes"] / lex_ms / 1e3 if lex_ms else 0,
+                })
+            rows.append(row)
+            if args.json:
+                continue
+            if error:
+                print("%-11s %6d %9d  %s" % (axis, value, len(source), error))
+                continue
+            ms = row["phases_ms"]
+            print("%-11s %6d %9d %10.1f %9.1f %10.1f %10.1f %10.1f %11d %12d %12d" % (
+                axis, value, len(source), row["wall_ms"], row["lex_mb_s"], ms.get("parse", 0),
+                ms.get("codegen", 0), ms.get("optimize", 0), row["peak_rss_kb"],
+                row["counters"]["symbol_lookups"], row["counters"]["instructions"]))
+            sys.stdout.flush()
+    return rows
+
+
+def run_kernel(exe, timeout):
+    start = time.perf_counter()
+    r = subprocess.run([exe], capture_output=True, text=True, timeout=timeout)
+    return time.perf_counter() - start, r.stdout
+
+
+def run_runtime(args):
+    kernels = sorted(glob.glob(os.path.join(HERE, "kernels", "*.chain")))
+    if args.kernel:
+        kernels = [k for k in kernels if os.path.basename(k)[:-6] in args.kernel]
+    rows = []
+    if not args.json:
+        print("%-10s %5s %12s %12s" % ("kernel", "opt", "compile ms", "run ms"))
+    with tempfile.TemporaryDirectory() as tmp:
+        for path in kernels:
+            name = os.path.basename(path)[:-6]
+            expected = None
+            for level in range(4):
+                exe = os.path.join(tmp, "%s-O%d" % (name, level))
+                cmd = [args.chainc, "-O%d" % level, "--emit=exe", "-o", exe] + args.compiler_args
+                with open(path) as f:
+                    start = time.perf_counter()
+                    r = subprocess.run(cmd, stdin=f, capture_output=True, text=True)
+                    compile_s = time.perf_counter() - start
+                row = {"kernel": name, "opt": level, "compile_ms": compile_s * 1e3}
+                if r.returncode != 0:
+                    row["error"] = r.stderr.strip() or "exit %d" % r.returncode
+                else:
+                    try:
+                        times = []
+                        for _ in range(args.repeat):
+                            elapsed, out = run_kernel(exe, args.timeout)
+                            times.append(elapsed)
+                        row["run_ms"] = min(times) * 1e3
+                        # Every level has to print the same thing, or the timing means nothing
+                        if expected is None:
+                            expected = out
+                        elif out != expected:
+                            row["error"] = "output differs from -O0"
+                    except subprocess.TimeoutExpired:
+                        row["error"] = "timeout"
+                rows.append(row)
+                if args.json:
+                    continue
+                if "error" in row and "run_ms" not in row:
+                    print("%-10s %5s %12.1f  %s" % (name, "-O%d" % level, row["compile_ms"], row["error"]))
+                else:
+                    print("%-10s %5s %12.1f %12.1f%s" % (
+                        name, "-O%d" % level, row["compile_ms"], row["run_ms"],
+                        "  " + row["error"] if "error" in row else ""))
+                sys.stdout.flush()
+    return rows
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    p.add_argument("--chainc", default=os.environ.get("CHAINC", "./chainlang"),
+                   help="compiler to benchmark (default $CHAINC or ./chainlang)")
+    p.add_argument("--repeat", type=int, default=3, help="runs per measurement; the fastest counts")
+    p.add_argument("--timeout", type=float, default=60, help="seconds before a run is abandoned")
+    p.add_argument("--json", action="store_true", help="print one JSON array instead of a table")
+    p.add_argument("-X", dest="compiler_args", action="append", default=[], metavar="ARG",
+                   help="extra compiler argument (repeatable), e.g. -X=--ssa -X=-j4")
+    sub = p.add_subparsers(dest="mode", required=True)
+    c = sub.add_parser("compile", help="compile time and peak RSS against program size")
+    c.add_argument("--axis", action="append", choices=list(AXES),
+                   help="sweep only this axis (repeatable)")
+    c.add_argument("-O", dest="opt", type=int, default=0, choices=range(4),
+                   help="optimization level for the sweep (default 0)")
+    r = sub.add_parser("runtime", help="kernel run time at -O0..-O3")
+    r.add_argument("--kernel", action="append", help="run only this kernel (repeatable)")
+    args = p.parse_args()
+
+    rows = run_compile(args) if args.mode == "compile" else run_runtime(args)
+    if args.json:
+        json.dump(rows, sys.stdout, indent=1)
+        print()
+    return 1 if any("error" in row for row in rows) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
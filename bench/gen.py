@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""gen.py - synthetic ChainLang programs for compiler scaling benchmarks
+
+Writes one program to stdout, sized by:
+  -n  top-level statements      -d  if/for nesting depth
+  -f  functions                 -v  variables
+  -l  comparisons per &&/|| condition
+
+The program is deterministic for a given --seed and ends by printing a
+checksum of every variable, so nothing it computes is dead.
+"""
+
+import argparse
+import random
+import sys
+
+
+class Generator:
+    def __init__(self, args):
+        self.args = args
+        self.rng = random.Random(args.seed)
+        self.loop_depth = 0
+        self.callable = 0
+
+    def var(self):
+        return "v%d" % self.rng.randrange(self.args.variables)
+
+    def operand(self):
+        if self.rng.random() < 0.3:
+            return str(self.rng.randrange(1, 100))
+        return self.var()
+
+    def arith(self):
+        op = self.rng.choice(["+", "-", "*"])
+        return "%s %s %s" % (self.operand(), op, self.operand())
+
+    def condition(self):
+        parts = []
+        for i in range(self.args.logic):
+            if i:
+                parts.append(self.rng.choice(["&&", "||"]))
+            parts.append("%s %s %s" % (self.var(), self.rng.choice(["<", ">", "==", "<=", ">="]),
+                                       self.operand()))
+        return " ".join(parts)
+
+    def simple(self):
+        kind = self.rng.random()
+        if kind < 0.15 and self.callable:
+            return "%s = f%d(%s, %s)" % (self.var(), self.rng.randrange(self.callable),
+                                         self.operand(), self.operand())
+        if kind < 0.25:
+            return "try %s = %s / (%s - %s) catch %s = 0 end" % (
+                self.var(), self.operand(), self.var(), self.var(), self.var())
+        return "%s = %s" % (self.var(), self.arith())
+
+    def block(self, depth, indent):
+        count = self.rng.randrange(1, 3)
+        return (" ->\n" + indent).join(self.statement(depth, indent) for _ in range(count))
+
+    def statement(self, depth, indent):
+        if depth <= 0 or self.rng.random() < 0.5:
+            return self.simple()
+        inner = indent + "  "
+        if self.rng.random() < 0.8 or self.loop_depth >= 3:
+            return "if %s then\n%s%s\n%selse\n%s%s\n%sdone" % (
+                self.condition(), inner, self.block(depth - 1, inner), indent,
+                inner, self.block(depth - 1, inner), indent)
+        self.loop_depth += 1
+        body = self.block(depth - 1, inner)
+        self.loop_depth -= 1
+        return "for i%d in 1..%d\n%s%s\n%sdone" % (
+            self.loop_depth, self.rng.randrange(2, 5), inner, body, indent)
+
+    def function(self, index):
+        # Functions see only their parameters, and make no calls, so the
+        # program cannot recurse
+        saved = self.args.variables
+        lines = ["function f%d(v0, v1)" % index]
+        self.args.variables = 2
+        for _ in range(3):
+            lines.append("  " + self.statement(min(self.args.depth, 2), "  ") + " ->")
+        lines.append("  return v0 + v1")
+        lines.append("end")
+        self.args.variables = saved
+        return "\n".join(lines)
+
+    def program(self):
+        stmts = [self.function(i) for i in range(self.args.functions)]
+        self.callable = self.args.functions
+        stmts += ["let v%d = %d" % (i, i) for i in range(self.args.variables)]
+        stmts += [self.statement(self.args.depth, "") for _ in range(self.args.statements)]
+        stmts.append("let checksum = 0")
+        names = ["v%d" % i for i in range(self.args.variables)]
+        for i in range(0, len(names), 32):
+            stmts.append("checksum = checksum + " + " + ".join(names[i:i + 32]))
+        stmts.append("output checksum")
+        return " ->\n".join(stmts) + "\n"
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    p.add_argument("-n", "--statements", type=int, default=1000)
+    p.add_argument("-d", "--depth", type=int, default=2)
+    p.add_argument("-f", "--functions", type=int, default=10)
+    p.add_argument("-v", "--variables", type=int, default=50)
+    p.add_argument("-l", "--logic", type=int, default=2)
+    p.add_argument("--seed", type=int, default=1)
+    args = p.parse_args()
+    if args.variables < 2 or args.logic < 1:
+        p.error("need at least 2 variables and 1 comparison per condition")
+    sys.stdout.write(Generator(args).program())
+
+
+if __name__ == "__main__":
+    main()
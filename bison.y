@@ -1,22 +1,26 @@
+%code requires {
+typedef struct TokenStream TokenStream;
+}
+
 %{
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "pLLVM.h"
-extern int yylex();
-void yyerror(const char *s) {
-    fprintf(stderr,"Parse error: %s\n",s);
-    exit(1);
-}
-
-extern LLVMBuilderRef builder;
-extern LLVMContextRef context;
-extern LLVMModuleRef module;
-extern StmtList global_program;
 %}
 
+// Pure, so several threads can parse at once (batch mode); each parse reads
+// its own token buffer, filled by lex_input()
+%define api.pure full
+%locations
+%parse-param {TokenStream* ts}
+%lex-param   {TokenStream* ts}
+
 %union {
     int       ival;
+    long long lval;
     float     fval;
     char     *sval;
     Expr*     expr;
@@ -27,15 +31,18 @@ extern StmtList global_program;
 }
 
 %token <ival>   INT
+%token <lval>   LONG
 %token <fval>   FLOAT
 %token <sval>   ID
 %token          CHAIN LET ASSIGN IF THEN ELSE DONE FOR IN OUTPUT
 %token          EQ NE GE LE GT LT
 %token          PLUS MINUS MUL DIV
 %token          AND OR NOT
-%token          LPAREN RPAREN COMMA DOTS
+%token          LPAREN RPAREN COMMA DOTS LBRACKET RBRACKET
 %token          FUNCTION END TRY CATCH UNKNOWN RETURN WHILE DO
+%token          PIPE PARALLEL MEMO
 
+%precedence PIPE
 %left OR
 %left AND
 %left EQ NE
@@ -43,6 +50,7 @@ extern StmtList global_program;
 %left PLUS MINUS
 %left MUL DIV
 %right NOT
+%precedence LBRACKET
 
 %type  <slist>  program statement_sequence statement_list
 %type  <stmt>   statement
@@ -50,15 +58,53 @@ extern StmtList global_program;
 %type  <plist>  param_list
 %type  <elist>  arg_list
 
+%{
+typedef struct {
+    int     kind;
+    YYSTYPE value;
+    YYLTYPE loc;        // lines and columns from 1; last_column is one past the end
+} Token;
+
+struct TokenStream {
+    Token*      tokens;
+    int         count;
+    int         next;
+    const char* name;   // for messages
+    StmtList    program;
+};
+
+static int next_token(YYSTYPE* value, YYLTYPE* loc, TokenStream* ts);
+static void free_tokens(TokenStream* ts);
+#define yylex next_token
+
+// Nodes start where their rule does; binary operators and indexing are
+// placed at the operator, so -g tells apart several on one line
+static Expr* expr_at(Expr* e, YYLTYPE loc) {
+    e->line = loc.first_line;
+    e->column = loc.first_column;
+    return e;
+}
+
+static Stmt* stmt_at(Stmt* s, YYLTYPE loc) {
+    s->line = loc.first_line;
+    s->column = loc.first_column;
+    return s;
+}
+
+void yyerror(YYLTYPE* loc, TokenStream* ts, const char *s) {
+    fprintf(stderr,"%s:%d:%d: Parse error: %s\n", ts->name, loc->first_line, loc->first_column, s);
+    free_tokens(ts);
+    compile_failed();
+}
+%}
+
 %start program
 %%
 
 program:
     statement_sequence
     {
-        global_program = $1;
-        generate_program($1);
-        finalize_codegen();
+        ts->program = $1;
     }
 ;
 
@@ -87,217 +133,179 @@ statement_list:
 statement:
     LET ID ASSIGN expression
     {
-        Stmt* s = malloc(sizeof(Stmt));
-        s->type = STMT_LET;
+        Stmt* s = new_stmt(STMT_LET);
         s->let.name = $2;
         s->let.expr = $4;
-        $$ = s;
+        $$ = stmt_at(s, @$);
+    }
+  | ID LBRACKET expression RBRACKET ASSIGN expression
+    {
+        Stmt* s = new_stmt(STMT_INDEX_ASSIGN);
+        s->index_assign.name = $1;
+        s->index_assign.index = $3;
+        s->index_assign.expr = $6;
+        $$ = stmt_at(s, @$);
     }
   | ID ASSIGN expression
     {
-        Stmt* s = malloc(sizeof(Stmt));
-        s->type = STMT_ASSIGN;
+        Stmt* s = new_stmt(STMT_ASSIGN);
         s->assign.name = $1;
         s->assign.expr = $3;
-        $$ = s;
+        $$ = stmt_at(s, @$);
     }
   | OUTPUT expression
     {
-        Stmt* s = malloc(sizeof(Stmt));
-        s->type = STMT_OUTPUT;
+        Stmt* s = new_stmt(STMT_OUTPUT);
         s->output.expr = $2;
-        $$ = s;
+        $$ = stmt_at(s, @$);
     }
   | IF expression THEN statement_list ELSE statement_list DONE
     {
-        Stmt* s = malloc(sizeof(Stmt));
-        s->type = STMT_IF;
+        Stmt* s = new_stmt(STMT_IF);
         s->if_stmt.cond = $2;
         s->if_stmt.then_stmt = $4;
         s->if_stmt.else_stmt = $6;
-        $$ = s;
+        $$ = stmt_at(s, @$);
     }
   | FOR ID IN INT DOTS INT statement_list DONE
     {
-        Stmt* s = malloc(sizeof(Stmt));
-        s->type = STMT_FOR;
+        Stmt* s = new_stmt(STMT_FOR);
         s->for_stmt.var = $2;
         s->for_stmt.start = $4;
         s->for_stmt.end = $6;
         s->for_stmt.body = $7;
-        $$ = s;
+        s->for_stmt.parallel = 0;
+        $$ = stmt_at(s, @$);
+    }
+  | PARALLEL FOR ID IN INT DOTS INT statement_list DONE
+    {
+        Stmt* s = new_stmt(STMT_FOR);
+        s->for_stmt.var = $3;
+        s->for_stmt.start = $5;
+        s->for_stmt.end = $7;
+        s->for_stmt.body = $8;
+        s->for_stmt.parallel = 1;
+        $$ = stmt_at(s, @$);
     }
   | FUNCTION ID LPAREN param_list RPAREN statement_list END
     {
-        Stmt* s = malloc(sizeof(Stmt));
-        s->type = STMT_FUNC_DECL;
+        Stmt* s = new_stmt(STMT_FUNC_DECL);
         s->func_decl.name = $2;
         s->func_decl.params = $4;
         s->func_decl.body = $6;
-        $$ = s;
+        s->func_decl.memo = 0;
+        $$ = stmt_at(s, @$);
+    }
+  | MEMO FUNCTION ID LPAREN param_list RPAREN statement_list END
+    {
+        Stmt* s = new_stmt(STMT_FUNC_DECL);
+        s->func_decl.name = $3;
+        s->func_decl.params = $5;
+        s->func_decl.body = $7;
+        s->func_decl.memo = 1;
+        $$ = stmt_at(s, @$);
     }
   | RETURN expression
     {
-        Stmt* s = malloc(sizeof(Stmt));
-        s->type = STMT_RETURN;
+        Stmt* s = new_stmt(STMT_RETURN);
         s->return_stmt.expr = $2;
-        $$ = s;
+        $$ = stmt_at(s, @$);
     }
   | TRY statement_list CATCH statement_list END
     {
-        Stmt* s = malloc(sizeof(Stmt));
-        s->type = STMT_TRY_CATCH;
+        Stmt* s = new_stmt(STMT_TRY_CATCH);
         s->try_catch.try_stmt = $2;
         s->try_catch.catch_stmt = $4;
-        $$ = s;
+        $$ = stmt_at(s, @$);
     }
   | WHILE expression DO statement_list DONE
     {
-        Stmt* s = malloc(sizeof(Stmt));
-        s->type = STMT_WHILE;
+        Stmt* s = new_stmt(STMT_WHILE);
         s->while_stmt.cond = $2;
         s->while_stmt.body = $4;
-        $$ = s;
+        $$ = stmt_at(s, @$);
     }
 ;
 
 expression:
     INT
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_INT;
+        Expr* e = new_expr(EXPR_INT);
         e->ival = $1;
-        $$ = e;
+        $$ = expr_at(e, @$);
+    }
+  | LONG
+    {
+        Expr* e = new_expr(EXPR_LONG);
+        e->lval = $1;
+        $$ = expr_at(e, @$);
     }
   | FLOAT
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_FLOAT;
+        Expr* e = new_expr(EXPR_FLOAT);
         e->fval = $1;
-        $$ = e;
+        $$ = expr_at(e, @$);
     }
   | ID
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_VAR;
+        Expr* e = new_expr(EXPR_VAR);
         e->var_name = $1;
-        $$ = e;
+        $$ = expr_at(e, @$);
     }
   | expression PLUS expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = "+";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_ADD, $1, $3), @2);
     }
   | expression MINUS expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = "-";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_SUB, $1, $3), @2);
     }
   | expression MUL expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = "*";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_MUL, $1, $3), @2);
     }
   | expression DIV expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = "/";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_DIV, $1, $3), @2);
     }
   | expression EQ expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = "==";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_EQ, $1, $3), @2);
     }
   | expression NE expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = "!=";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_NE, $1, $3), @2);
     }
   | expression LT expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = "<";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_LT, $1, $3), @2);
     }
   | expression GT expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = ">";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_GT, $1, $3), @2);
     }
   | expression LE expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = "<=";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_LE, $1, $3), @2);
     }
   | expression GE expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = ">=";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_GE, $1, $3), @2);
     }
   | expression AND expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = "&&";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_AND, $1, $3), @2);
     }
   | expression OR expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_BINOP;
-        e->binop.op = "||";
-        e->binop.left = $1;
-        e->binop.right = $3;
-        $$ = e;
+        $$ = expr_at(new_binop(OP_OR, $1, $3), @2);
     }
   | NOT expression
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_UNARYOP;
-        e->unaryop.op = "!";
+        Expr* e = new_expr(EXPR_UNARYOP);
+        e->unaryop.op = OP_NOT;
         e->unaryop.operand = $2;
-        $$ = e;
+        $$ = expr_at(e, @$);
     }
   | LPAREN expression RPAREN
     {
@@ -305,27 +313,57 @@ expression:
     }
   | ID LPAREN arg_list RPAREN
     {
-        Expr* e = malloc(sizeof(Expr));
-        e->type = EXPR_FUNC_CALL;
+        Expr* e = new_expr(EXPR_FUNC_CALL);
         e->func_call.func_name = $1;
         e->func_call.args = $3;
-        $$ = e;
+        $$ = expr_at(e, @$);
+    }
+  | ID LPAREN RPAREN
+    {
+        Expr* e = new_expr(EXPR_FUNC_CALL);
+        e->func_call.func_name = $1;
+        e->func_call.args = (ExprList){ NULL, 0, 0 };
+        $$ = expr_at(e, @$);
+    }
+  | LBRACKET arg_list RBRACKET
+    {
+        Expr* e = new_expr(EXPR_ARRAY);
+        e->array.elems = $2;
+        $$ = expr_at(e, @$);
+    }
+  | LBRACKET RBRACKET
+    {
+        Expr* e = new_expr(EXPR_ARRAY);
+        e->array.elems = (ExprList){ NULL, 0, 0 };
+        $$ = expr_at(e, @$);
+    }
+  | expression LBRACKET expression RBRACKET
+    {
+        Expr* e = new_expr(EXPR_INDEX);
+        e->index.array = $1;
+        e->index.index = $3;
+        $$ = expr_at(e, @2);
+    }
+  | expression PIPE ID LPAREN ID RPAREN
+    {
+        $$ = expr_at(add_pipeline_stage($1, $3, $5), @$);
+    }
+  | expression PIPE ID
+    {
+        $$ = expr_at(add_pipeline_stage($1, $3, NULL), @$);
     }
 ;
 
 param_list:
     ID
     {
-        ParamList list;
-        list.args = malloc(sizeof(char*));
-        list.args[0] = $1;
-        list.count = 1;
+        ParamList list = { NULL, 0, 0 };
+        add_param(&list, $1);
         $$ = list;
     }
   | param_list COMMA ID
     {
-        $1.args = realloc($1.args, ($1.count + 1) * sizeof(char*));
-        $1.args[$1.count++] = $3;
+        add_param(&$1, $3);
         $$ = $1;
     }
 ;
@@ -333,23 +371,281 @@ param_list:
 arg_list:
     expression
     {
-        ExprList list;
-        list.exprs = malloc(sizeof(Expr*));
-        list.exprs[0] = $1;
-        list.count = 1;
+        ExprList list = { NULL, 0, 0 };
+        add_expr(&list, $1);
         $$ = list;
     }
   | arg_list COMMA expression
     {
-        $1.exprs = realloc($1.exprs, ($1.count + 1) * sizeof(Expr*));
-        $1.exprs[$1.count++] = $3;
+        add_expr(&$1, $3);
         $$ = $1;
     }
 ;
 
 %%
 
-int main() {
-    init_codegen();
-    return yyparse();
+#undef yylex
+
+// The reentrant flex scanner (proj.l); its extra data is the input's name
+typedef void* yyscan_t;
+int yylex_init_extra(const char* name, yyscan_t* scanner);
+int yylex_destroy(yyscan_t scanner);
+void* yy_scan_buffer(char* base, size_t size, yyscan_t scanner);
+int yylex(YYSTYPE* value, YYLTYPE* loc, yyscan_t scanner);
+
+// The stream this thread is parsing, for abandon_compile()
+static _Thread_local TokenStream* parsing;
+
+// Lexes the whole input up front, so lexing and parsing are separate
+// phases for --time-report. The scanner reads src in place
+static void lex_input(TokenStream* ts, Source* src) {
+    int cap = 0;
+    yyscan_t scanner;
+    YYLTYPE loc = { 1, 1, 1, 1 };
+    yylex_init_extra(ts->name, &scanner);
+    yy_scan_buffer(src->text, src->size + 2, scanner);
+    for (;;) {
+        if (ts->count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            ts->tokens = realloc(ts->tokens, cap * sizeof(Token));
+        }
+        Token* t = &ts->tokens[ts->count++];
+        t->kind = yylex(&t->value, &loc, scanner);
+        t->loc = loc;
+        if (!t->kind)
+            break;
+    }
+    yylex_destroy(scanner);
+    lexed_tokens += ts->count - 1;
+    lexed_bytes += src->size;
+}
+
+static int next_token(YYSTYPE* value, YYLTYPE* loc, TokenStream* ts) {
+    Token* t = &ts->tokens[ts->next < ts->count - 1 ? ts->next++ : ts->count - 1];
+    *value = t->value;
+    *loc = t->loc;
+    return t->kind;
+}
+
+static void free_tokens(TokenStream* ts) {
+    free(ts->tokens);
+    ts->tokens = NULL;
+    ts->count = ts->next = 0;
+}
+
+// Compiles the program in path, or on stdin if path is NULL, to output_path
+// (or runs it with --run or --interp). Errors call compile_failed(), which
+// exits, or in batch mode unwinds to the caller, which then calls
+// abandon_compile()
+int compile_file(const char* path) {
+    TokenStream ts = { NULL, 0, 0, path ? path : "<stdin>", { NULL, 0, 0 } };
+    int fd = path ? open(path, O_RDONLY) : 0;
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    Source src;
+    phase_begin(PHASE_LEX);
+    int failed = load_source(&src, fd);
+    if (failed)
+        perror(ts.name);
+    if (path)
+        close(fd);
+    if (!failed) {
+        lex_input(&ts, &src);
+        release_source(&src);
+    }
+    phase_end(PHASE_LEX);
+    if (failed)
+        return 1;
+    parsing = &ts;
+    debug_source = ts.name;
+    if (!interp_mode) {
+        phase_begin(PHASE_SETUP);
+        init_codegen();
+        phase_end(PHASE_SETUP);
+    }
+    phase_begin(PHASE_PARSE);
+    int status = yyparse(&ts);
+    phase_end(PHASE_PARSE);
+    free_tokens(&ts);
+    if (status) {
+        abandon_compile();
+        return status;
+    }
+    phase_begin(PHASE_FOLD);
+    fold_program(&ts.program);
+    infer_program(ts.program);
+    pure_program(ts.program);
+    phase_end(PHASE_FOLD);
+    global_program = ts.program;
+    if (interp_mode) {
+        exit_status = interpret_program(ts.program);
+    } else {
+        phase_begin(PHASE_CODEGEN);
+        generate_program(ts.program);
+        phase_end(PHASE_CODEGEN);
+        finalize_codegen();
+    }
+    arena_free(&ast_arena);
+    free_interned();
+    global_program = (StmtList){ NULL, 0, 0 };
+    parsing = NULL;
+    return 0;
+}
+
+void abandon_compile(void) {
+    if (parsing)
+        free_tokens(parsing);
+    parsing = NULL;
+    arena_free(&ast_arena);
+    global_program = (StmtList){ NULL, 0, 0 };
+    abandon_codegen();
+    free_interned();
+}
+
+int main(int argc, char** argv) {
+    char** files = malloc(argc * sizeof(char*));
+    int file_count = 0;
+    int batch = 0;
+    int opt_given = 0;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (arg[0] != '-' && arg[0]) {
+            files[file_count++] = argv[i];
+        } else if (!strcmp(arg, "--batch")) {
+            batch = 1;
+        } else if (arg[0] == '-' && arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '3' && !arg[3]) {
+            opt_level = arg[2] - '0';
+            opt_given = 1;
+        } else if (!strcmp(arg, "--opt-report")) {
+            opt_report = 1;
+        } else if (!strcmp(arg, "--run")) {
+            run_jit = 1;
+        } else if (!strcmp(arg, "-g")) {
+            debug_info = 1;
+        } else if (!strcmp(arg, "--perf-map")) {
+            perf_map = 1;
+        } else if (!strcmp(arg, "--jitdump")) {
+            jitdump = 1;
+        } else if (!strcmp(arg, "--interp")) {
+            interp_mode = 1;
+        } else if (!strcmp(arg, "--tier")) {
+            interp_mode = 1;
+            tier_threshold = 1000;
+        } else if (!strncmp(arg, "--tier=", 7) && atoi(arg + 7) > 0) {
+            interp_mode = 1;
+            tier_threshold = atoi(arg + 7);
+        } else if (!strcmp(arg, "--ssa")) {
+            ssa_mode = 1;
+        } else if (!strcmp(arg, "-j") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            codegen_jobs = atoi(argv[++i]);
+        } else if (arg[0] == '-' && arg[1] == 'j' && atoi(arg + 2) > 0) {
+            codegen_jobs = atoi(arg + 2);
+        } else if (!strcmp(arg, "-o") && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (!strcmp(arg, "--emit=ll")) {
+            emit_format = EMIT_LL;
+        } else if (!strcmp(arg, "--emit=bc")) {
+            emit_format = EMIT_BC;
+        } else if (!strcmp(arg, "--emit=obj")) {
+            emit_format = EMIT_OBJ;
+        } else if (!strcmp(arg, "--emit=exe")) {
+            emit_format = EMIT_EXE;
+        } else if (!strcmp(arg, "--time-report")) {
+            time_report = REPORT_TEXT;
+        } else if (!strcmp(arg, "--time-report=json")) {
+            time_report = REPORT_JSON;
+        } else if (!strcmp(arg, "--stats")) {
+            stats_report = REPORT_TEXT;
+        } else if (!strcmp(arg, "--stats=json")) {
+            stats_report = REPORT_JSON;
+        } else if (!strcmp(arg, "--profile-generate")) {
+            profile_generate = "chainlang.profile";
+        } else if (!strncmp(arg, "--profile-generate=", 19) && arg[19]) {
+            profile_generate = arg + 19;
+        } else if (!strcmp(arg, "--profile-use")) {
+            profile_use = "chainlang.profile";
+        } else if (!strncmp(arg, "--profile-use=", 14) && arg[14]) {
+            profile_use = arg + 14;
+        } else if (!strcmp(arg, "--cache")) {
+            cache_dir = "";
+        } else if (!strncmp(arg, "--cache=", 8) && arg[8]) {
+            cache_dir = arg + 8;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            fprintf(stderr, "Usage: %s [-O0|-O1|-O2|-O3] [--opt-report] [--ssa] [-j N] [--run | --interp | --tier[=N]] [-g] [--perf-map] [--jitdump] [--emit=ll|bc|obj|exe] [-o file] [--time-report[=json]] [--stats[=json]] [--cache[=dir]] [--profile-generate[=file] | --profile-use[=file]] [file.chain | < program.chain]\n"
+                            "       %s [options] file.chain... | --batch < list\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if ((perf_map || jitdump) && !run_jit && !tier_threshold) {
+        fprintf(stderr, "%s needs --run or --tier\n", perf_map ? "--perf-map" : "--jitdump");
+        return 1;
+    }
+    const char* profiling = profile_generate ? "--profile-generate" : "--profile-use";
+    if (profile_generate && profile_use) {
+        fprintf(stderr, "--profile-generate and --profile-use are separate builds\n");
+        return 1;
+    }
+    if ((profile_generate || profile_use) && interp_mode) {
+        fprintf(stderr, "%s needs compiled code, not --interp or --tier\n", profiling);
+        return 1;
+    }
+    // Several inputs (or --batch) compile in this one process, with -j
+    // programs at a time rather than -j functions per program
+    int many = batch || file_count > 1;
+    if (many) {
+        if (profile_generate || profile_use) {
+            fprintf(stderr, "%s takes a single program\n", profiling);
+            return 1;
+        }
+        if (run_jit || interp_mode) {
+            fprintf(stderr, "%s takes a single program\n", interp_mode ? "--interp" : "--run");
+            return 1;
+        }
+        if (output_path) {
+            fprintf(stderr, "-o needs a single input file\n");
+            return 1;
+        }
+        if (time_report && codegen_jobs > 1) {
+            fprintf(stderr, "--time-report cannot time programs compiled side by side; use -j 1\n");
+            return 1;
+        }
+        batch_jobs = codegen_jobs;
+        codegen_jobs = 1;
+    }
+    // The interpreter runs the program itself, and needs LLVM only once
+    // --tier finds something hot (tier_function() sets it up then)
+    if (interp_mode) {
+        run_jit = 0;
+        if (tier_threshold && !opt_given)
+            opt_level = 2;
+    } else {
+        phase_begin(PHASE_SETUP);
+        init_target();
+        begin_codegen_thread();
+        if (profile_use)
+            load_profile();
+        if (cache_dir)
+            cache_init();
+        phase_end(PHASE_SETUP);
+    }
+    int status;
+    if (many) {
+        status = run_batch(files, file_count, batch);
+    } else {
+        char* named = NULL;
+        if (file_count && !output_path && !run_jit && !interp_mode)
+            output_path = named = output_name(files[0]);
+        status = compile_file(file_count ? files[0] : NULL);
+        if (!status)
+            status = exit_status;
+        free(named);
+    }
+    end_codegen_thread();
+    free(files);
+    if (time_report || stats_report)
+        print_reports();
+    return status;
 }
@@ -0,0 +1,341 @@
+// cache.c - --cache: optimized bitcode for each function and for main, kept
+// on disk under a hash of its AST and the options that shape its code
+
+#include "pLLVM.h"
+#include <llvm-c/BitWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char* cache_dir = NULL;
+
+static CacheKey        options_key;
+static _Thread_local int hash_positions;   // -g code carries where each node was
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;  // -j workers look up too
+
+// Two independent 64-bit lanes (FNV-1a and a multiply-rotate hash), so a
+// stale hit needs both to collide
+static void hash_bytes(CacheKey* k, const void* data, size_t len) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < len; i++) {
+        k->a = (k->a ^ p[i]) * 1099511628211ull;
+        k->b = (k->b ^ p[i]) * 0x9e3779b97f4a7c15ull;
+        k->b = (k->b << 27) | (k->b >> 37);
+    }
+}
+
+static void hash_int(CacheKey* k, long long v) {
+    hash_bytes(k, &v, sizeof(v));
+}
+
+// Length-prefixed, so "ab","c" and "a","bc" differ; NULL differs from ""
+static void hash_str(CacheKey* k, const char* s) {
+    hash_int(k, s ? (long long)strlen(s) : -1);
+    if (s)
+        hash_bytes(k, s, strlen(s));
+}
+
+static void hash_list(CacheKey* k, StmtList list, int bodies, int callees);
+
+// The versions of decl that inference made (see infer.c): its callers'
+// code depends on their signatures and on what pure.c found, its own code on
+// its variables' types too
+static void hash_instances(CacheKey* k, Stmt* decl, int vars) {
+    if (!decl) {
+        hash_int(k, -1);
+        return;
+    }
+    for (Instance* inst = decl->func_decl.instances; inst; inst = inst->next) {
+        hash_bytes(k, inst->params, decl->func_decl.params.count * sizeof(TypeKind));
+        hash_int(k, inst->ret);
+        hash_int(k, inst->pure);
+        if (vars)
+            hash_bytes(k, inst->vars, inst->var_count * sizeof(TypeKind));
+    }
+    hash_int(k, decl->func_decl.memo);
+    hash_int(k, decl->func_decl.returns);
+    hash_int(k, -2);
+}
+
+// callees: also hash the prototype each called function resolves to, which
+// is not part of a function's own AST
+static void hash_expr(CacheKey* k, Expr* e, int callees) {
+    hash_int(k, e->type);
+    if (hash_positions) {
+        hash_int(k, e->line);
+        hash_int(k, e->column);
+    }
+    switch (e->type) {
+        case EXPR_INT:
+        case EXPR_BOOL:
+            hash_int(k, e->ival);
+            break;
+        case EXPR_FLOAT:
+            hash_bytes(k, &e->fval, sizeof(e->fval));
+            break;
+        case EXPR_LONG:
+            hash_int(k, e->lval);
+            break;
+        case EXPR_VAR:
+            hash_str(k, e->var_name);
+            break;
+        case EXPR_BINOP:
+            hash_int(k, e->binop.op);
+            hash_expr(k, e->binop.left, callees);
+            hash_expr(k, e->binop.right, callees);
+            break;
+        case EXPR_UNARYOP:
+            hash_int(k, e->unaryop.op);
+            hash_expr(k, e->unaryop.operand, callees);
+            break;
+        case EXPR_FUNC_CALL:
+            hash_str(k, e->func_call.func_name);
+            if (callees)
+                hash_int(k, callee_arity(e->func_call.func_name));
+            hash_instances(k, e->func_call.decl, 0);
+            hash_int(k, e->func_call.args.count);
+            for (int i = 0; i < e->func_call.args.count; i++)
+                hash_expr(k, e->func_call.args.exprs[i], callees);
+            break;
+        case EXPR_PIPELINE:
+            hash_expr(k, e->pipeline.from, callees);
+            hash_expr(k, e->pipeline.to, callees);
+            hash_int(k, e->pipeline.stages.count);
+            for (int i = 0; i < e->pipeline.stages.count; i++) {
+                Stage* st = &e->pipeline.stages.stages[i];
+                hash_int(k, st->kind);
+                hash_str(k, st->func_name);
+                if (callees)
+                    hash_int(k, callee_arity(st->func_name));
+                hash_instances(k, st->decl, 0);
+            }
+            hash_int(k, e->pipeline.sink);
+            break;
+        case EXPR_ARRAY:
+            hash_int(k, e->array.elems.count);
+            for (int i = 0; i < e->array.elems.count; i++)
+                hash_expr(k, e->array.elems.exprs[i], callees);
+            break;
+        case EXPR_INDEX:
+            hash_expr(k, e->index.array, callees);
+            hash_expr(k, e->index.index, callees);
+            break;
+    }
+}
+
+// bodies: 0 hashes a function declaration by its prototype only, as main
+// sees it
+static void hash_stmt(CacheKey* k, Stmt* s, int bodies, int callees) {
+    hash_int(k, s->type);
+    if (hash_positions) {
+        hash_int(k, s->line);
+        hash_int(k, s->column);
+    }
+    switch (s->type) {
+        case STMT_LET:
+            hash_str(k, s->let.name);
+            hash_expr(k, s->let.expr, callees);
+            break;
+        case STMT_ASSIGN:
+            hash_str(k, s->assign.name);
+            hash_expr(k, s->assign.expr, callees);
+            break;
+        case STMT_OUTPUT:
+            hash_expr(k, s->output.expr, callees);
+            break;
+        case STMT_IF:
+            hash_expr(k, s->if_stmt.cond, callees);
+            hash_list(k, s->if_stmt.then_stmt, bodies, callees);
+            hash_list(k, s->if_stmt.else_stmt, bodies, callees);
+            break;
+        case STMT_FOR:
+            hash_str(k, s->for_stmt.var);
+            hash_int(k, s->for_stmt.start);
+            hash_int(k, s->for_stmt.end);
+            hash_int(k, s->for_stmt.parallel);
+            hash_list(k, s->for_stmt.body, bodies, callees);
+            break;
+        case STMT_FUNC_DECL:
+            hash_str(k, s->func_decl.name);
+            hash_int(k, s->func_decl.params.count);
+            for (int i = 0; i < s->func_decl.params.count; i++)
+                hash_str(k, s->func_decl.params.args[i]);
+            hash_instances(k, s, bodies);
+            if (bodies)
+                hash_list(k, s->func_decl.body, bodies, callees);
+            break;
+        case STMT_RETURN:
+            hash_int(k, s->return_stmt.expr != NULL);
+            if (s->return_stmt.expr)
+                hash_expr(k, s->return_stmt.expr, callees);
+            break;
+        case STMT_TRY_CATCH:
+            hash_list(k, s->try_catch.try_stmt, bodies, callees);
+            hash_list(k, s->try_catch.catch_stmt, bodies, callees);
+            break;
+        case STMT_WHILE:
+            hash_expr(k, s->while_stmt.cond, callees);
+            hash_list(k, s->while_stmt.body, bodies, callees);
+            break;
+        case STMT_INDEX_ASSIGN:
+            hash_str(k, s->index_assign.name);
+            hash_expr(k, s->index_assign.index, callees);
+            hash_expr(k, s->index_assign.expr, callees);
+            break;
+    }
+}
+
+static void hash_list(CacheKey* k, StmtList list, int bodies, int callees) {
+    hash_int(k, list.count);
+    for (int i = 0; i < list.count; i++)
+        hash_stmt(k, list.stmts[i], bodies, callees);
+}
+
+// mkdir -p
+static void make_dirs(const char* path) {
+    char* p = strdup(path);
+    for (char* c = p + 1; ; c++) {
+        if (*c != '/' && *c)
+            continue;
+        char saved = *c;
+        *c = '\0';
+        if (mkdir(p, 0755) && errno != EEXIST) {
+            fprintf(stderr, "Cannot create cache directory %s: %s\n", p, strerror(errno));
+            exit(1);
+        }
+        *c = saved;
+        if (!saved)
+            break;
+    }
+    free(p);
+}
+
+// Everything outside the AST that changes generated code: the options, the
+// target, the LLVM release, and the compiler binary itself
+void cache_init(void) {
+    if (!*cache_dir) {
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        static char path[4096];
+        if (xdg && *xdg)
+            snprintf(path, sizeof(path), "%s/chainlang", xdg);
+        else
+            snprintf(path, sizeof(path), "%s/.cache/chainlang", home && *home ? home : "/tmp");
+        cache_dir = path;
+    }
+    make_dirs(cache_dir);
+
+    options_key = (CacheKey){ 14695981039346656037ull, 0x243f6a8885a308d3ull };
+    hash_int(&options_key, opt_level);
+    hash_int(&options_key, ssa_mode);
+    hash_int(&options_key, debug_info);
+    hash_str(&options_key, profile_generate);
+    hash_str(&options_key, profile_use);
+    struct stat st;
+    if (profile_use && !stat(profile_use, &st)) {
+        hash_int(&options_key, st.st_size);
+        hash_int(&options_key, st.st_mtim.tv_sec);
+        hash_int(&options_key, st.st_mtim.tv_nsec);
+    }
+    char* triple = LLVMGetTargetMachineTriple(targetMachine);
+    char* cpu = LLVMGetTargetMachineCPU(targetMachine);
+    char* features = LLVMGetTargetMachineFeatureString(targetMachine);
+    hash_str(&options_key, triple);
+    hash_str(&options_key, cpu);
+    hash_str(&options_key, features);
+    LLVMDisposeMessage(triple);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(features);
+    hash_str(&options_key, LLVM_VERSION_STRING);
+    if (!stat("/proc/self/exe", &st)) {
+        hash_int(&options_key, st.st_size);
+        hash_int(&options_key, st.st_mtim.tv_sec);
+        hash_int(&options_key, st.st_mtim.tv_nsec);
+    }
+}
+
+// A function's key covers its declaration, nested functions included, and
+// the prototypes its calls resolve to (see callee_arity())
+CacheKey cache_key_function(Stmt* decl) {
+    CacheKey k = options_key;
+    hash_int(&k, 'f');
+    if (debug_info)
+        hash_str(&k, debug_source);
+    hash_positions = debug_info;
+    hash_stmt(&k, decl, 1, 1);
+    return k;
+}
+
+// main's key covers the top level with function bodies left out, since they
+// are cached on their own
+CacheKey cache_key_main(StmtList program) {
+    CacheKey k = options_key;
+    hash_int(&k, 'm');
+    if (debug_info)
+        hash_str(&k, debug_source);
+    hash_positions = debug_info;
+    hash_list(&k, program, 0, 0);
+    hash_bytes(&k, main_instance->vars, main_instance->var_count * sizeof(TypeKind));
+    return k;
+}
+
+// The same ASTs without options or positions, which --profile-use checks
+// its counts against. --ssa folds branches on known values, so it places
+// counters differently
+unsigned long long checksum_function(Stmt* decl) {
+    CacheKey k = { 14695981039346656037ull, ssa_mode };
+    hash_positions = 0;
+    hash_stmt(&k, decl, 1, 0);
+    return k.a ^ k.b;
+}
+
+unsigned long long checksum_main(StmtList program) {
+    CacheKey k = { 14695981039346656037ull, ssa_mode };
+    hash_positions = 0;
+    hash_list(&k, program, 0, 0);
+    return k.a ^ k.b;
+}
+
+static void cache_path(CacheKey key, char* path, size_t size) {
+    snprintf(path, size, "%s/%016llx%016llx.bc", cache_dir,
+             (unsigned long long)key.a, (unsigned long long)key.b);
+}
+
+// The cached bitcode, or NULL on a miss
+LLVMMemoryBufferRef cache_load(CacheKey key) {
+    char path[4096];
+    cache_path(key, path, sizeof(path));
+    LLVMMemoryBufferRef buf = NULL;
+    char* err = NULL;
+    int missed = LLVMCreateMemoryBufferWithContentsOfFile(path, &buf, &err);
+    if (missed) {
+        LLVMDisposeMessage(err);
+        buf = NULL;
+    }
+    pthread_mutex_lock(&cache_lock);
+    if (missed)
+        stats.cache_misses++;
+    else
+        stats.cache_hits++;
+    pthread_mutex_unlock(&cache_lock);
+    return buf;
+}
+
+// Written to a temporary name and renamed into place, so concurrent
+// compilers never read a partial entry. Failing to store is not an error
+void cache_store(CacheKey key, LLVMModuleRef m) {
+    char path[4096], tmp[4096];
+    cache_path(key, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s/tmpXXXXXX", cache_dir);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return;
+    if (LLVMWriteBitcodeToFD(m, fd, 1, 0) || rename(tmp, path))
+        unlink(tmp);
+}
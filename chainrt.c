@@ -0,0 +1,644 @@
+// chainrt.c - work-stealing thread pool behind parallel for, buffered output,
+// the number reader behind input, and --profile-generate's profile writer
+
+#include "chainrt.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+#define CHUNKS_PER_THREAD 8
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define MAX_LINE 64                 // longest line output can format (FLT_MAX as %f)
+#define INPUT_BLOCK_SIZE (1024 * 1024)
+#define MAX_NUMBER 64               // longest number input keeps whole across blocks
+
+// Each participant (slot 0 is the thread that started the loop) owns the
+// unrun part of a range. It runs grain-sized pieces off the front; when it
+// runs dry it steals the back half of another participant's range.
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    long long lo, hi;               // unrun iterations [lo, hi)
+} Slot;
+
+static Slot*           slots;
+static int             slot_count;  // pool threads + 1, or 0 before the first loop
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;  // one loop at a time
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  done = PTHREAD_COND_INITIALIZER;
+static unsigned long   generation;  // bumped under wake_lock to start a loop
+static int             job_exited;  // pool threads out of run_slot() this loop, under wake_lock
+
+static chain_body_fn   job_body;
+static void*           job_env;
+static long long       job_grain;
+static atomic_llong    job_left;    // iterations not yet finished
+
+static _Thread_local int in_pool;   // pool threads, and the caller while its loop runs
+
+static int take(Slot* s, long long* lo, long long* hi) {
+    pthread_mutex_lock(&s->lock);
+    int found = s->lo < s->hi;
+    if (found) {
+        *lo = s->lo;
+        *hi = s->hi - s->lo > job_grain ? s->lo + job_grain : s->hi;
+        s->lo = *hi;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+// Moves the back half of the first non-empty range after self's into self's slot
+static int steal(int self) {
+    for (int k = 1; k < slot_count; k++) {
+        Slot* victim = &slots[(self + k) % slot_count];
+        pthread_mutex_lock(&victim->lock);
+        long long left = victim->hi - victim->lo;
+        if (left <= 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        long long lo = victim->hi - (left + 1) / 2, hi = victim->hi;
+        victim->hi = lo;
+        pthread_mutex_unlock(&victim->lock);
+
+        pthread_mutex_lock(&slots[self].lock);
+        slots[self].lo = lo;
+        slots[self].hi = hi;
+        pthread_mutex_unlock(&slots[self].lock);
+        return 1;
+    }
+    return 0;
+}
+
+static void run_slot(int self) {
+    long long lo, hi;
+    for (;;) {
+        if (!take(&slots[self], &lo, &hi)) {
+            if (!steal(self))
+                return;
+            continue;
+        }
+        job_body((int)lo, (int)(hi - 1), job_env);
+        if (atomic_fetch_sub(&job_left, hi - lo) == hi - lo) {
+            pthread_mutex_lock(&wake_lock);
+            pthread_cond_broadcast(&done);
+            pthread_mutex_unlock(&wake_lock);
+        }
+    }
+}
+
+static void* worker_main(void* arg) {
+    int self = (int)(intptr_t)arg;
+    unsigned long seen = 0;
+    in_pool = 1;
+    for (;;) {
+        pthread_mutex_lock(&wake_lock);
+        while (generation == seen)
+            pthread_cond_wait(&wake, &wake_lock);
+        seen = generation;
+        pthread_mutex_unlock(&wake_lock);
+        run_slot(self);
+        pthread_mutex_lock(&wake_lock);
+        if (++job_exited == slot_count - 1)
+            pthread_cond_broadcast(&done);
+        pthread_mutex_unlock(&wake_lock);
+    }
+    return NULL;
+}
+
+static void start_pool(void) {
+    const char* env = getenv("CHAIN_THREADS");
+    long n = env && *env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > MAX_THREADS)
+        n = MAX_THREADS;
+    slots = aligned_alloc(_Alignof(Slot), n * sizeof(Slot));
+    memset(slots, 0, n * sizeof(Slot));
+    for (long i = 0; i < n; i++)
+        pthread_mutex_init(&slots[i].lock, NULL);
+    // Workers only look at slot_count once woken, after this returns
+    slot_count = 1;
+    for (long i = 1; i < n; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, (void*)(intptr_t)i) != 0)
+            break;
+        pthread_detach(thread);
+        slot_count++;
+    }
+}
+
+void chain_parallel_for(int start, int end, chain_body_fn body, void* env) {
+    if (start > end)
+        return;
+    if (in_pool) {
+        body(start, end, env);
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    if (!slot_count)
+        start_pool();
+    long long total = (long long)end - start + 1;
+    if (slot_count == 1 || total == 1) {
+        pthread_mutex_unlock(&pool_lock);
+        in_pool = 1;
+        body(start, end, env);
+        in_pool = 0;
+        return;
+    }
+
+    job_body = body;
+    job_env = env;
+    job_grain = total / ((long long)slot_count * CHUNKS_PER_THREAD);
+    if (job_grain < 1)
+        job_grain = 1;
+    atomic_store(&job_left, total);
+    // Even split up front; stealing evens out uneven iterations
+    long long share = total / slot_count, lo = start;
+    for (int i = 0; i < slot_count; i++) {
+        long long hi = i == slot_count - 1 ? (long long)end + 1 : lo + share;
+        pthread_mutex_lock(&slots[i].lock);
+        slots[i].lo = lo;
+        slots[i].hi = hi;
+        pthread_mutex_unlock(&slots[i].lock);
+        lo = hi;
+    }
+
+    pthread_mutex_lock(&wake_lock);
+    generation++;
+    job_exited = 0;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&wake_lock);
+
+    in_pool = 1;
+    run_slot(0);
+    in_pool = 0;
+
+    // Every iteration has run, but a pool thread can still be in steal();
+    // refilling the slots under it for the next loop would lose a range
+    pthread_mutex_lock(&wake_lock);
+    while (atomic_load(&job_left) > 0 || job_exited < slot_count - 1)
+        pthread_cond_wait(&done, &wake_lock);
+    pthread_mutex_unlock(&wake_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void chain_out_of_memory(int count) {
+    fprintf(stderr, "Out of memory allocating an array of %d elements\n", count);
+    exit(1);
+}
+
+static char            out_buf[OUTPUT_BUFFER_SIZE];
+static size_t          out_len;
+static int             out_started;
+static int             out_tty;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void write_buffer(void) {
+    fwrite(out_buf, 1, out_len, stdout);
+    fflush(stdout);
+    out_len = 0;
+}
+
+// Only parallel for bodies output from more than one thread
+static int lock_output(void) {
+    int locked = slot_count > 1;
+    if (locked)
+        pthread_mutex_lock(&out_lock);
+    if (!out_started) {
+        out_started = 1;
+        out_tty = isatty(STDOUT_FILENO);
+        atexit(chain_flush);
+    }
+    if (OUTPUT_BUFFER_SIZE - out_len < MAX_LINE)
+        write_buffer();
+    return locked;
+}
+
+static void unlock_output(char* end, int locked) {
+    *end++ = '\n';
+    out_len = end - out_buf;
+    if (out_tty)
+        write_buffer();
+    if (locked)
+        pthread_mutex_unlock(&out_lock);
+}
+
+static char* format_unsigned(char* p, unsigned long long u) {
+    char tmp[20];
+    char* t = tmp + sizeof(tmp);
+    while (u >= 100) {
+        const char* d = &digit_pairs[(u % 100) * 2];
+        u /= 100;
+        *--t = d[1];
+        *--t = d[0];
+    }
+    if (u >= 10) {
+        *--t = digit_pairs[u * 2 + 1];
+        *--t = digit_pairs[u * 2];
+    } else {
+        *--t = (char)('0' + u);
+    }
+    size_t n = tmp + sizeof(tmp) - t;
+    memcpy(p, t, n);
+    return p + n;
+}
+
+void chain_output_int(int value) {
+    int locked = lock_output();
+    char* p = out_buf + out_len;
+    unsigned u = (unsigned)value;
+    if (value < 0) {
+        *p++ = '-';
+        u = 0u - u;
+    }
+    unlock_output(format_unsigned(p, u), locked);
+}
+
+void chain_output_long(long long value) {
+    int locked = lock_output();
+    char* p = out_buf + out_len;
+    unsigned long long u = (unsigned long long)value;
+    if (value < 0) {
+        *p++ = '-';
+        u = 0ull - u;
+    }
+    unlock_output(format_unsigned(p, u), locked);
+}
+
+// Same text as printf("%f"): a float times 10^6 is exact in a double (24 +
+// 14 significant bits), so rounding it half-to-even to an integer gives the
+// correctly rounded six decimals
+void chain_output_float(float value) {
+    int locked = lock_output();
+    char* p = out_buf + out_len;
+    double scaled = fabs((double)value * 1e6);
+    if (!isfinite(value) || scaled >= 1e19) {
+        p += snprintf(p, MAX_LINE, "%f", value);
+        unlock_output(p, locked);
+        return;
+    }
+    unsigned long long u = (unsigned long long)scaled;
+    double rest = scaled - (double)u;
+    if (rest > 0.5 || (rest == 0.5 && (u & 1)))
+        u++;
+    if (signbit(value))
+        *p++ = '-';
+    p = format_unsigned(p, u / 1000000);
+    *p++ = '.';
+    unsigned frac = (unsigned)(u % 1000000);
+    for (int i = 5; i >= 0; i--) {
+        p[i] = (char)('0' + frac % 10);
+        frac /= 10;
+    }
+    unlock_output(p + 6, locked);
+}
+
+void chain_flush(void) {
+    pthread_mutex_lock(&out_lock);
+    write_buffer();
+    pthread_mutex_unlock(&out_lock);
+}
+
+// input reads from $CHAIN_INPUT, or stdin. A regular file is mapped whole;
+// anything else is read in INPUT_BLOCK_SIZE blocks, and a number cut off at
+// the end of a block is moved to the front before the next read
+static const char*     in_pos;      // unread input
+static const char*     in_end;
+static char*           in_buf;      // the block, or NULL when the input is mapped
+static int             in_fd = -1;
+static int             in_eof;      // in_end is the end of the input
+static pthread_mutex_t in_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void open_input(void) {
+    const char* path = getenv("CHAIN_INPUT");
+    in_fd = path && *path ? open(path, O_RDONLY) : STDIN_FILENO;
+    if (in_fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    struct stat st;
+    off_t offset = lseek(in_fd, 0, SEEK_CUR);
+    if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset) {
+        char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            in_pos = map + offset;
+            in_end = map + st.st_size;
+            in_eof = 1;
+            return;
+        }
+    }
+    in_buf = malloc(INPUT_BLOCK_SIZE);
+    if (!in_buf) {
+        fprintf(stderr, "Out of memory for the input buffer\n");
+        exit(1);
+    }
+    in_pos = in_end = in_buf;
+}
+
+// Keeps the unread bytes and reads once after them
+static void refill(void) {
+    size_t kept = in_end - in_pos;
+    memmove(in_buf, in_pos, kept);
+    in_pos = in_buf;
+    in_end = in_buf + kept;
+    ssize_t n;
+    do {
+        n = read(in_fd, in_buf + kept, INPUT_BLOCK_SIZE - kept);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        in_eof = 1;
+    else
+        in_end += n;
+}
+
+static int lock_input(void) {
+    int locked = slot_count > 1;
+    if (locked)
+        pthread_mutex_lock(&in_lock);
+    if (in_fd < 0)
+        open_input();
+    return locked;
+}
+
+static void unlock_input(int locked) {
+    if (locked)
+        pthread_mutex_unlock(&in_lock);
+}
+
+static int is_digit(char c) {
+    return (unsigned char)(c - '0') < 10;
+}
+
+static int is_number_char(char c) {
+    return is_digit(c) || c == '.' || c == '-' || c == '+' || c == 'e' || c == 'E';
+}
+
+// A digit, or a sign and/or point followed by one
+static int starts_number(const char* p) {
+    if (p < in_end && (*p == '-' || *p == '+'))
+        p++;
+    if (p < in_end && *p == '.')
+        p++;
+    return p < in_end && is_digit(*p);
+}
+
+// Moves in_pos to the next number, with all of it in the buffer; 0 at the
+// end of the input. Only a short tail is scanned for the number's end, so a
+// terminal or pipe is not read past the line that completes it
+static int next_number(void) {
+    for (;;) {
+        const char* p = in_pos;
+        int found = 0;
+        for (; p < in_end; p++) {
+            if ((found = starts_number(p)))
+                break;
+            // A sign or point the next block may put a digit after
+            if (!in_eof && in_end - p <= 2 && (*p == '-' || *p == '+' || *p == '.'))
+                break;
+        }
+        in_pos = p;
+        if (found)
+            break;
+        if (in_eof)
+            return 0;
+        refill();
+    }
+    while (!in_eof && in_end - in_pos < MAX_NUMBER) {
+        const char* p = in_pos;
+        while (p < in_end && is_number_char(*p))
+            p++;
+        if (p < in_end)
+            break;
+        refill();
+    }
+    return 1;
+}
+
+// Eight ASCII digits at once, as in simdjson: the 8 bytes are loaded as a
+// little-endian word, checked together, and combined pairwise
+static int eight_digits(const char* p, uint32_t* value) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    if (((v & 0xF0F0F0F0F0F0F0F0ull) | (((v + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4)) !=
+        0x3333333333333333ull)
+        return 0;
+    v -= 0x3030303030303030ull;
+    v = v * 10 + (v >> 8);
+    v = ((v & 0x000000FF000000FFull) * (100 + (1000000ull << 32)) +
+         ((v >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32))) >> 32;
+    *value = (uint32_t)v;
+    return 1;
+}
+
+// Digits at p into *value (wrapping), returning the first byte after them
+static const char* parse_digits(const char* p, uint64_t* value, int* count) {
+    uint64_t u = *value;
+    uint32_t eight;
+    int n = 0;
+    while (in_end - p >= 8 && eight_digits(p, &eight)) {
+        u = u * 100000000u + eight;
+        p += 8;
+        n += 8;
+    }
+    while (p < in_end && is_digit(*p)) {
+        u = u * 10 + (unsigned)(*p++ - '0');
+        n++;
+    }
+    *value = u;
+    *count = n;
+    return p;
+}
+
+// The fraction and exponent of a number input() reads as an int
+static const char* skip_fraction(const char* p) {
+    if (p < in_end && *p == '.')
+        while (++p < in_end && is_digit(*p))
+            ;
+    if (p < in_end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        if (q < in_end && (*q == '-' || *q == '+'))
+            q++;
+        if (q < in_end && is_digit(*q)) {
+            while (q < in_end && is_digit(*q))
+                q++;
+            p = q;
+        }
+    }
+    return p;
+}
+
+// In 32 bits, wrapping as the arithmetic does; a fraction is dropped
+static int read_int(void) {
+    const char* p = in_pos;
+    int negative = *p == '-';
+    if (*p == '-' || *p == '+')
+        p++;
+    uint64_t u = 0;
+    int n;
+    p = parse_digits(p, &u, &n);
+    in_pos = skip_fraction(p);
+    return (int)(uint32_t)(negative ? 0 - u : u);
+}
+
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// m * 10^e when that rounds correctly without strtof(): with m below 2^53
+// and |e| at most 22 both are exact doubles, so one multiply or divide
+// rounds the double correctly, and rounding that to float is then correct
+// unless it lands exactly halfway between two floats
+static int exact_float(uint64_t m, int e, float* out) {
+    if (m >= (1ull << 53) || e < -22 || e > 22)
+        return 0;
+    double d = e < 0 ? (double)m / powers_of_ten[-e] : (double)m * powers_of_ten[e];
+    float f = (float)d;
+    if ((double)f != d) {
+        uint32_t bits;
+        float other;
+        memcpy(&bits, &f, 4);
+        bits += (double)f < d ? 1 : -1;
+        memcpy(&other, &bits, 4);
+        if ((double)f + (double)other == 2 * d)
+            return 0;
+    }
+    *out = f;
+    return 1;
+}
+
+static float read_float(void) {
+    const char* start = in_pos;
+    const char* p = start;
+    int negative = *p == '-';
+    if (*p == '-' || *p == '+')
+        p++;
+    uint64_t m = 0;
+    int whole, fraction = 0, exponent = 0;
+    p = parse_digits(p, &m, &whole);
+    if (p < in_end && *p == '.')
+        p = parse_digits(p + 1, &m, &fraction);
+    const char* end = skip_fraction(p);
+    if (p < end) {
+        const char* q = p + 1;
+        int negative_exponent = *q == '-';
+        if (*q == '-' || *q == '+')
+            q++;
+        for (; q < end && exponent < 100000; q++)
+            exponent = exponent * 10 + (*q - '0');
+        if (negative_exponent)
+            exponent = -exponent;
+    }
+    in_pos = end;
+    float f;
+    if (whole + fraction <= 19 && exact_float(m, exponent - fraction, &f))
+        return negative ? -f : f;
+    char text[MAX_NUMBER + 1];
+    size_t len = end - start < MAX_NUMBER ? (size_t)(end - start) : MAX_NUMBER;
+    memcpy(text, start, len);
+    text[len] = 0;
+    return strtof(text, NULL);
+}
+
+int chain_has_input(void) {
+    int locked = lock_input();
+    int more = next_number();
+    unlock_input(locked);
+    return more;
+}
+
+int chain_input_int(void) {
+    int locked = lock_input();
+    int value = next_number() ? read_int() : 0;
+    unlock_input(locked);
+    return value;
+}
+
+float chain_input_float(void) {
+    int locked = lock_input();
+    float value = next_number() ? read_float() : 0.0f;
+    unlock_input(locked);
+    return value;
+}
+
+int chain_read_ints(int* dst, int n) {
+    int locked = lock_input();
+    int count = 0;
+    while (count < n && next_number())
+        dst[count++] = read_int();
+    unlock_input(locked);
+    return count;
+}
+
+int chain_read_floats(float* dst, int n) {
+    int locked = lock_input();
+    int count = 0;
+    while (count < n && next_number())
+        dst[count++] = read_float();
+    unlock_input(locked);
+    return count;
+}
+
+// One line per function: name, checksum (hex), count, then the counts. A
+// profile from other code, or an older version of a function, is replaced
+void chain_profile_write(const char* path, ChainProfile* const* functions, int count) {
+    FILE* in = fopen(path, "r");
+    if (in) {
+        char* line = NULL;
+        size_t size = 0;
+        if (getline(&line, &size, in) >= 0 && !strcmp(line, CHAIN_PROFILE_HEADER "\n")) {
+            while (getline(&line, &size, in) > 0) {
+                char* p = strchr(line, ' ');
+                if (!p)
+                    break;
+                *p++ = 0;
+                unsigned long long checksum = strtoull(p, &p, 16);
+                unsigned long long n = strtoull(p, &p, 10);
+                for (int i = 0; i < count; i++) {
+                    ChainProfile* f = functions[i];
+                    if (f->checksum != checksum || f->count != n || strcmp(f->name, line))
+                        continue;
+                    for (unsigned long long k = 0; k < n; k++)
+                        f->counts[k] += strtoull(p, &p, 10);
+                    break;
+                }
+            }
+        }
+        free(line);
+        fclose(in);
+    }
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return;
+    }
+    fputs(CHAIN_PROFILE_HEADER "\n", out);
+    for (int i = 0; i < count; i++) {
+        ChainProfile* f = functions[i];
+        fprintf(out, "%s %llx %llu", f->name, f->checksum, f->count);
+        for (unsigned long long k = 0; k < f->count; k++)
+            fprintf(out, " %llu", f->counts[k]);
+        fputc('\n', out);
+    }
+    fclose(out);
+}
@@ -0,0 +1,53 @@
+// chainrt.h - runtime support linked into compiled ChainLang programs
+//
+// Plain C with no LLVM dependency: --emit=exe builds chainrt.c into the
+// executable, and --run resolves these symbols from the compiler itself.
+
+#ifndef CHAINRT_H
+#define CHAINRT_H
+
+// Runs body over chunks [lo, hi] (inclusive) of [start, end]
+typedef void (*chain_body_fn)(int lo, int hi, void* env);
+
+// Splits [start, end] across a work-stealing pool of CHAIN_THREADS threads
+// (default: one per online CPU) and returns once every iteration has run.
+// Nested calls run serially on the calling thread.
+void chain_parallel_for(int start, int end, chain_body_fn body, void* env);
+
+// Array data comes from malloc; codegen calls this when it fails. The
+// message matches the interpreter's, and exit() still flushes output
+void chain_out_of_memory(int count);
+
+// output: one line per value into a process-wide buffer, written out when
+// it fills, at exit, or per line when stdout is a terminal
+void chain_output_int(int value);
+void chain_output_long(long long value);
+void chain_output_float(float value);
+void chain_flush(void);
+
+// input: numbers from the file $CHAIN_INPUT names, or stdin. Anything that
+// is not part of a number separates numbers. At the end of the input
+// has_input is 0 and reads give 0; the array reads return how many they got
+int   chain_has_input(void);
+int   chain_input_int(void);
+float chain_input_float(void);
+int   chain_read_ints(int* dst, int n);
+int   chain_read_floats(float* dst, int n);
+
+// --profile-generate: each function's counters, found through a descriptor
+// codegen emits as CHAIN_PROFILE_PREFIX followed by the function's name
+#define CHAIN_PROFILE_HEADER "chainlang-profile 1"
+#define CHAIN_PROFILE_PREFIX "chain.prof."
+
+typedef struct {
+    const char*        name;
+    unsigned long long checksum;    // of the function's AST, to spot stale counts
+    unsigned long long count;
+    unsigned long long counts[];
+} ChainProfile;
+
+// Adds the counts of the count functions to those path already has for the
+// same code, and writes the sum back; main calls it before returning
+void chain_profile_write(const char* path, ChainProfile* const* functions, int count);
+
+#endif
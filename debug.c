@@ -0,0 +1,222 @@
+// debug.c - -g: DWARF line tables for generated code, and --perf-map /
+// --jitdump, so perf can name and annotate code the JIT produces
+
+#include "pLLVM.h"
+#include <llvm-c/DebugInfo.h>
+#include <llvm-c/ExecutionEngine.h>
+#include <llvm-c/OrcEE.h>
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int debug_info = 0;
+int perf_map = 0;
+int jitdump = 0;
+_Thread_local const char* debug_source = NULL;   // the input's name, for the compile unit
+
+// One per module being generated: modules nest when --run gives each
+// function its own, so the builders form a stack
+typedef struct DebugModule {
+    LLVMDIBuilderRef    dib;
+    LLVMMetadataRef     file;
+    struct DebugModule* outer;
+} DebugModule;
+
+static _Thread_local DebugModule*    debugModule;
+static _Thread_local LLVMMetadataRef debugScope;   // the current function's DISubprogram
+
+static void add_module_flag(LLVMModuleRef m, const char* key, unsigned value) {
+    LLVMValueRef v = LLVMConstInt(LLVMInt32TypeInContext(context), value, 0);
+    LLVMAddModuleFlag(m, LLVMModuleFlagBehaviorWarning, key, strlen(key), LLVMValueAsMetadata(v));
+}
+
+void debug_begin_module(LLVMModuleRef m) {
+    if (!debug_info)
+        return;
+    static _Thread_local char cwd[4096];
+    if (!cwd[0] && !getcwd(cwd, sizeof(cwd)))
+        strcpy(cwd, ".");
+    const char* name = debug_source ? debug_source : "<stdin>";
+    DebugModule* d = malloc(sizeof(DebugModule));
+    d->dib = LLVMCreateDIBuilder(m);
+    d->file = LLVMDIBuilderCreateFile(d->dib, name, strlen(name), cwd, strlen(cwd));
+    LLVMDIBuilderCreateCompileUnit(d->dib, LLVMDWARFSourceLanguageC, d->file, "chainlang", 9,
+                                   opt_level > 0, "", 0, 0, "", 0, LLVMDWARFEmissionFull, 0, 0, 0,
+                                   "", 0, "", 0);
+    d->outer = debugModule;
+    debugModule = d;
+    add_module_flag(m, "Debug Info Version", LLVMDebugMetadataVersion());
+    add_module_flag(m, "Dwarf Version", 4);
+}
+
+// Before the module is verified
+void debug_end_module(void) {
+    DebugModule* d = debugModule;
+    if (!d)
+        return;
+    LLVMDIBuilderFinalize(d->dib);
+    LLVMDisposeDIBuilder(d->dib);
+    debugModule = d->outer;
+    free(d);
+    if (!debugModule)
+        debugScope = NULL;
+}
+
+// A failed compile, or the end of --tier, drops the modules unfinished
+void debug_abandon(void) {
+    while (debugModule) {
+        DebugModule* d = debugModule;
+        LLVMDisposeDIBuilder(d->dib);
+        debugModule = d->outer;
+        free(d);
+    }
+    debugScope = NULL;
+}
+
+// fn gets a subprogram starting at line, and instructions built from here
+// on belong to it
+DebugScope debug_begin_function(LLVMValueRef fn, int line) {
+    DebugScope outer = { debugScope, NULL };
+    if (!debugModule)
+        return outer;
+    outer.location = LLVMGetCurrentDebugLocation2(builder);
+    size_t len;
+    const char* name = LLVMGetValueName2(fn, &len);
+    LLVMMetadataRef type = LLVMDIBuilderCreateSubroutineType(debugModule->dib, debugModule->file,
+                                                             NULL, 0, LLVMDIFlagZero);
+    debugScope = LLVMDIBuilderCreateFunction(debugModule->dib, debugModule->file, name, len, name,
+                                             len, debugModule->file, line, type,
+                                             LLVMGetLinkage(fn) == LLVMInternalLinkage, 1, line,
+                                             LLVMDIFlagZero, opt_level > 0);
+    LLVMSetSubprogram(fn, debugScope);
+    LLVMSetCurrentDebugLocation2(builder, NULL);
+    return outer;
+}
+
+void debug_end_function(DebugScope outer) {
+    if (!debugModule)
+        return;
+    debugScope = outer.scope;
+    LLVMSetCurrentDebugLocation2(builder, outer.location);
+}
+
+// Instructions built until debug_leave() come from line:column; returns the
+// location to go back to. Nodes fold made (line 0) keep the enclosing one
+LLVMMetadataRef debug_enter(int line, int column) {
+    if (!debugScope)
+        return NULL;
+    LLVMMetadataRef outer = LLVMGetCurrentDebugLocation2(builder);
+    if (line)
+        LLVMSetCurrentDebugLocation2(builder, LLVMDIBuilderCreateDebugLocation(context, line, column,
+                                                                               debugScope, NULL));
+    return outer;
+}
+
+void debug_leave(LLVMMetadataRef outer) {
+    if (debugScope)
+        LLVMSetCurrentDebugLocation2(builder, outer);
+}
+
+/*
+ * JIT support. Objects the JIT loads are published through the GDB JIT
+ * interface (with -g, gdb can then step through ChainLang lines), which
+ * --perf-map reads back, and with --jitdump LLVM's perf listener writes
+ * jit-<pid>.dump for `perf inject --jit`.
+ */
+
+static LLVMOrcObjectLayerRef create_object_layer(void* ctx, LLVMOrcExecutionSessionRef session,
+                                                 const char* triple) {
+    (void)ctx;
+    (void)triple;
+    LLVMOrcObjectLayerRef layer =
+        LLVMOrcCreateRTDyldObjectLinkingLayerWithSectionMemoryManager(session);
+    if (debug_info || perf_map)
+        LLVMOrcRTDyldObjectLinkingLayerRegisterJITEventListener(layer,
+                                                                LLVMCreateGDBRegistrationListener());
+    if (jitdump) {
+        LLVMJITEventListenerRef listener = LLVMCreatePerfJITEventListener();
+        if (listener)
+            LLVMOrcRTDyldObjectLinkingLayerRegisterJITEventListener(layer, listener);
+        else
+            fprintf(stderr, "--jitdump: this LLVM was built without perf support\n");
+    }
+    return layer;
+}
+
+// NULL when the JIT's default setup will do
+LLVMOrcLLJITBuilderRef create_jit_builder(void) {
+    if (!debug_info && !perf_map && !jitdump)
+        return NULL;
+    LLVMOrcLLJITBuilderRef b = LLVMOrcCreateLLJITBuilder();
+    LLVMOrcLLJITBuilderSetObjectLinkingLayerCreator(b, create_object_layer, NULL);
+    return b;
+}
+
+// The GDB JIT interface, as documented in the GDB manual; LLVM defines the
+// descriptor
+struct jit_code_entry {
+    struct jit_code_entry* next_entry;
+    struct jit_code_entry* prev_entry;
+    const char*            symfile_addr;
+    uint64_t               symfile_size;
+};
+
+struct jit_descriptor {
+    uint32_t               version;
+    uint32_t               action_flag;
+    struct jit_code_entry* relevant_entry;
+    struct jit_code_entry* first_entry;
+};
+
+extern struct jit_descriptor __jit_debug_descriptor;
+
+// The functions in one loaded object. Its copy for debuggers has each
+// section's load address in sh_addr, and symbols are relative to their
+// section
+static void map_object(FILE* out, const char* obj, uint64_t size) {
+    const Elf64_Ehdr* eh = (const Elf64_Ehdr*)obj;
+    if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+        eh->e_ident[EI_CLASS] != ELFCLASS64)
+        return;
+    const Elf64_Shdr* sh = (const Elf64_Shdr*)(obj + eh->e_shoff);
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB)
+            continue;
+        const Elf64_Sym* syms = (const Elf64_Sym*)(obj + sh[i].sh_offset);
+        const char* names = obj + sh[sh[i].sh_link].sh_offset;
+        for (size_t j = 0; j < sh[i].sh_size / sizeof(Elf64_Sym); j++) {
+            const Elf64_Sym* s = &syms[j];
+            if (ELF64_ST_TYPE(s->st_info) != STT_FUNC || !s->st_size || s->st_shndx == SHN_UNDEF ||
+                s->st_shndx >= eh->e_shnum)
+                continue;
+            // --run compiles f's body as f.impl behind a stub; perf shows it as f
+            const char* name = names + s->st_name;
+            size_t len = strlen(name);
+            if (len > 5 && !strcmp(name + len - 5, ".impl"))
+                len -= 5;
+            fprintf(out, "%llx %llx %.*s\n",
+                    (unsigned long long)(sh[s->st_shndx].sh_addr + s->st_value),
+                    (unsigned long long)s->st_size, (int)len, name);
+        }
+    }
+}
+
+// /tmp/perf-<pid>.map, which perf reads to name JIT code. Written while the
+// JIT is still up, since its objects are unregistered when it goes
+void write_perf_map(void) {
+    if (!perf_map)
+        return;
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    FILE* out = fopen(path, "a");
+    if (!out) {
+        perror(path);
+        return;
+    }
+    for (struct jit_code_entry* e = __jit_debug_descriptor.first_entry; e; e = e->next_entry)
+        map_object(out, e->symfile_addr, e->symfile_size);
+    fclose(out);
+}
@@ -0,0 +1,367 @@
+// fold.c - AST constant folding and simplification, run between parsing and codegen
+
+#include "pLLVM.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static Expr* make_int(int v) {
+    Expr* e = new_expr(EXPR_INT);
+    e->ival = v;
+    return e;
+}
+
+static Expr* make_float(float v) {
+    Expr* e = new_expr(EXPR_FLOAT);
+    e->fval = v;
+    return e;
+}
+
+static Expr* make_bool(int v) {
+    Expr* e = new_expr(EXPR_BOOL);
+    e->ival = v != 0;
+    return e;
+}
+
+// Expressions codegen produces as i1
+static int is_bool(Expr* e) {
+    switch (e->type) {
+        case EXPR_BOOL:
+        case EXPR_UNARYOP:
+            return 1;
+        case EXPR_BINOP:
+            return e->binop.op >= OP_EQ;
+        default:
+            return 0;
+    }
+}
+
+// Literals usable as a condition; floats are not (codegen only tests ints)
+static int is_truth_literal(Expr* e, int* value) {
+    if (e->type != EXPR_INT && e->type != EXPR_BOOL)
+        return 0;
+    *value = e->ival != 0;
+    return 1;
+}
+
+// No calls, no integer division and no indexing (which may jump to a catch
+// block)
+static int is_pure(Expr* e) {
+    switch (e->type) {
+        case EXPR_BINOP:
+            return e->binop.op != OP_DIV && is_pure(e->binop.left) && is_pure(e->binop.right);
+        case EXPR_UNARYOP:
+            return is_pure(e->unaryop.operand);
+        case EXPR_FUNC_CALL:
+        case EXPR_PIPELINE:
+        case EXPR_ARRAY:
+        case EXPR_INDEX:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+static Expr* fold_expr(Expr* e, int in_try);
+
+static Expr* fold_logical(Expr* e, int in_try) {
+    int is_and = e->binop.op == OP_AND;
+    int lv, rv;
+    Expr* left = fold_expr(e->binop.left, in_try);
+    if (is_truth_literal(left, &lv)) {
+        // false && x, true || x: x is never evaluated
+        if (lv != is_and)
+            return make_bool(lv);
+        Expr* right = fold_expr(e->binop.right, in_try);
+        if (is_truth_literal(right, &rv))
+            return make_bool(rv);
+        if (is_bool(right))
+            return right;
+        e->binop.left = make_bool(lv);
+        e->binop.right = right;
+        return e;
+    }
+    Expr* right = fold_expr(e->binop.right, in_try);
+    if (is_truth_literal(right, &rv)) {
+        // x && true, x || false
+        if (rv == is_and && is_bool(left))
+            return left;
+        // x && false, x || true, when x has no effects
+        if (rv != is_and && is_pure(left))
+            return make_bool(rv);
+    }
+    e->binop.left = left;
+    e->binop.right = right;
+    return e;
+}
+
+static Expr* fold_int_binop(BinOp op, int a, int b) {
+    // Wrap like the i32 arithmetic codegen would emit
+    switch (op) {
+        case OP_ADD: return make_int((int)((unsigned)a + (unsigned)b));
+        case OP_SUB: return make_int((int)((unsigned)a - (unsigned)b));
+        case OP_MUL: return make_int((int)((unsigned)a * (unsigned)b));
+        case OP_DIV:
+            if (b == 0 || (a == INT_MIN && b == -1))
+                return NULL;
+            return make_int(a / b);
+        case OP_EQ:  return make_bool(a == b);
+        case OP_NE:  return make_bool(a != b);
+        case OP_LT:  return make_bool(a < b);
+        case OP_GT:  return make_bool(a > b);
+        case OP_LE:  return make_bool(a <= b);
+        case OP_GE:  return make_bool(a >= b);
+        default:     return NULL;
+    }
+}
+
+static Expr* fold_float_binop(BinOp op, float a, float b) {
+    // Comparisons are ordered, matching the fcmp o* predicates codegen uses
+    switch (op) {
+        case OP_ADD: return make_float(a + b);
+        case OP_SUB: return make_float(a - b);
+        case OP_MUL: return make_float(a * b);
+        case OP_DIV: return make_float(a / b);
+        case OP_EQ:  return make_bool(a == b);
+        case OP_NE:  return make_bool(a < b || a > b);
+        case OP_LT:  return make_bool(a < b);
+        case OP_GT:  return make_bool(a > b);
+        case OP_LE:  return make_bool(a <= b);
+        case OP_GE:  return make_bool(a >= b);
+        default:     return NULL;
+    }
+}
+
+static Expr* fold_expr(Expr* e, int in_try) {
+    switch (e->type) {
+        case EXPR_BINOP: {
+            BinOp op = e->binop.op;
+            if (op == OP_AND || op == OP_OR)
+                return fold_logical(e, in_try);
+            Expr* left = fold_expr(e->binop.left, in_try);
+            Expr* right = fold_expr(e->binop.right, in_try);
+            e->binop.left = left;
+            e->binop.right = right;
+
+            if (op == OP_DIV && right->type == EXPR_INT && right->ival == 0) {
+                // Inside try this is the catch path, so leave it to codegen
+                if (in_try)
+                    return e;
+                compile_error_at(e->line, e->column, "Division by zero\n");
+                compile_failed();
+            }
+            if (left->type == EXPR_INT && right->type == EXPR_INT) {
+                Expr* folded = fold_int_binop(op, left->ival, right->ival);
+                return folded ? folded : e;
+            }
+            if (left->type == EXPR_FLOAT && right->type == EXPR_FLOAT)
+                return fold_float_binop(op, left->fval, right->fval);
+
+            // No x+0 or x*1: folding runs before types are known, and with a
+            // float x those are type errors that must not depend on the literal
+            return e;
+        }
+        case EXPR_UNARYOP: {
+            Expr* operand = fold_expr(e->unaryop.operand, in_try);
+            int v;
+            if (is_truth_literal(operand, &v))
+                return make_bool(!v);
+            // !!x is x once x is already a truth value
+            if (operand->type == EXPR_UNARYOP && is_bool(operand->unaryop.operand))
+                return operand->unaryop.operand;
+            e->unaryop.operand = operand;
+            return e;
+        }
+        case EXPR_FUNC_CALL:
+            for (int i = 0; i < e->func_call.args.count; i++)
+                e->func_call.args.exprs[i] = fold_expr(e->func_call.args.exprs[i], in_try);
+            return e;
+        case EXPR_ARRAY:
+            for (int i = 0; i < e->array.elems.count; i++)
+                e->array.elems.exprs[i] = fold_expr(e->array.elems.exprs[i], in_try);
+            return e;
+        case EXPR_INDEX:
+            e->index.array = fold_expr(e->index.array, in_try);
+            e->index.index = fold_expr(e->index.index, in_try);
+            return e;
+        case EXPR_PIPELINE:
+            e->pipeline.from = fold_expr(e->pipeline.from, in_try);
+            e->pipeline.to = fold_expr(e->pipeline.to, in_try);
+            // An empty range never calls a stage
+            if (e->pipeline.sink != SINK_NONE && e->pipeline.from->type == EXPR_INT &&
+                e->pipeline.to->type == EXPR_INT && e->pipeline.from->ival > e->pipeline.to->ival)
+                return make_int(0);
+            return e;
+        default:
+            return e;
+    }
+}
+
+static int may_throw(Expr* e) {
+    switch (e->type) {
+        case EXPR_BINOP:
+            return e->binop.op == OP_DIV || may_throw(e->binop.left) || may_throw(e->binop.right);
+        case EXPR_UNARYOP:
+            return may_throw(e->unaryop.operand);
+        case EXPR_FUNC_CALL:
+            for (int i = 0; i < e->func_call.args.count; i++)
+                if (may_throw(e->func_call.args.exprs[i]))
+                    return 1;
+            return 0;
+        case EXPR_PIPELINE:
+            return may_throw(e->pipeline.from) || may_throw(e->pipeline.to);
+        case EXPR_ARRAY:
+            for (int i = 0; i < e->array.elems.count; i++)
+                if (may_throw(e->array.elems.exprs[i]))
+                    return 1;
+            return 0;
+        case EXPR_INDEX:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Whether any statement can reach a catch block; function bodies never do
+static int list_may_throw(StmtList list) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_LET:    if (may_throw(s->let.expr)) return 1; break;
+            case STMT_ASSIGN: if (may_throw(s->assign.expr)) return 1; break;
+            case STMT_OUTPUT: if (may_throw(s->output.expr)) return 1; break;
+            case STMT_RETURN: if (may_throw(s->return_stmt.expr)) return 1; break;
+            case STMT_IF:
+                if (may_throw(s->if_stmt.cond) || list_may_throw(s->if_stmt.then_stmt) ||
+                    list_may_throw(s->if_stmt.else_stmt))
+                    return 1;
+                break;
+            case STMT_FOR:
+                if (list_may_throw(s->for_stmt.body)) return 1;
+                break;
+            case STMT_WHILE:
+                if (may_throw(s->while_stmt.cond) || list_may_throw(s->while_stmt.body))
+                    return 1;
+                break;
+            case STMT_TRY_CATCH:
+                if (list_may_throw(s->try_catch.try_stmt) || list_may_throw(s->try_catch.catch_stmt))
+                    return 1;
+                break;
+            case STMT_INDEX_ASSIGN:
+                return 1;
+            case STMT_FUNC_DECL:
+                break;
+        }
+    }
+    return 0;
+}
+
+static int list_returns(StmtList list);
+
+static int stmt_returns(Stmt* s) {
+    if (s->type == STMT_RETURN)
+        return 1;
+    if (s->type != STMT_IF)
+        return 0;
+    int v;
+    if (is_truth_literal(s->if_stmt.cond, &v))
+        return list_returns(v ? s->if_stmt.then_stmt : s->if_stmt.else_stmt);
+    return list_returns(s->if_stmt.then_stmt) && list_returns(s->if_stmt.else_stmt);
+}
+
+static int list_returns(StmtList list) {
+    for (int i = 0; i < list.count; i++)
+        if (stmt_returns(list.stmts[i]))
+            return 1;
+    return 0;
+}
+
+static StmtList fold_list(StmtList list, int in_try);
+
+// Returns NULL when the statement has no effect
+static Stmt* fold_stmt(Stmt* s, int in_try) {
+    int v;
+    switch (s->type) {
+        case STMT_LET:
+            s->let.expr = fold_expr(s->let.expr, in_try);
+            return s;
+        case STMT_ASSIGN:
+            s->assign.expr = fold_expr(s->assign.expr, in_try);
+            return s;
+        case STMT_OUTPUT:
+            s->output.expr = fold_expr(s->output.expr, in_try);
+            return s;
+        case STMT_RETURN:
+            s->return_stmt.expr = fold_expr(s->return_stmt.expr, in_try);
+            return s;
+        case STMT_INDEX_ASSIGN:
+            s->index_assign.index = fold_expr(s->index_assign.index, in_try);
+            s->index_assign.expr = fold_expr(s->index_assign.expr, in_try);
+            return s;
+        case STMT_IF:
+            s->if_stmt.cond = fold_expr(s->if_stmt.cond, in_try);
+            if (is_truth_literal(s->if_stmt.cond, &v)) {
+                // Codegen emits only the taken branch (still in its own scope)
+                StmtList* taken = v ? &s->if_stmt.then_stmt : &s->if_stmt.else_stmt;
+                StmtList* dead = v ? &s->if_stmt.else_stmt : &s->if_stmt.then_stmt;
+                *taken = fold_list(*taken, in_try);
+                *dead = (StmtList){ NULL, 0, 0 };
+                s->if_stmt.cond = make_bool(v);
+                return taken->count ? s : NULL;
+            }
+            s->if_stmt.then_stmt = fold_list(s->if_stmt.then_stmt, in_try);
+            s->if_stmt.else_stmt = fold_list(s->if_stmt.else_stmt, in_try);
+            if (!s->if_stmt.then_stmt.count && !s->if_stmt.else_stmt.count && is_pure(s->if_stmt.cond))
+                return NULL;
+            return s;
+        case STMT_FOR:
+            if (s->for_stmt.start > s->for_stmt.end)
+                return NULL;
+            s->for_stmt.body = fold_list(s->for_stmt.body, in_try);
+            return s;
+        case STMT_WHILE:
+            s->while_stmt.cond = fold_expr(s->while_stmt.cond, in_try);
+            if (is_truth_literal(s->while_stmt.cond, &v)) {
+                if (!v)
+                    return NULL;
+                s->while_stmt.cond = make_bool(1);
+            }
+            s->while_stmt.body = fold_list(s->while_stmt.body, in_try);
+            return s;
+        case STMT_TRY_CATCH:
+            s->try_catch.try_stmt = fold_list(s->try_catch.try_stmt, 1);
+            // Only integer division and array indexing branch to catch
+            if (list_may_throw(s->try_catch.try_stmt))
+                s->try_catch.catch_stmt = fold_list(s->try_catch.catch_stmt, 0);
+            else
+                s->try_catch.catch_stmt = (StmtList){ NULL, 0, 0 };
+            return s;
+        case STMT_FUNC_DECL:
+            s->func_decl.body = fold_list(s->func_decl.body, 0);
+            return s;
+    }
+    return s;
+}
+
+// Compacts the list in place, dropping no-op statements and anything after
+// an unconditional return (function declarations are kept)
+static StmtList fold_list(StmtList list, int in_try) {
+    int kept = 0, returned = 0;
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        if (returned && s->type != STMT_FUNC_DECL)
+            continue;
+        s = fold_stmt(s, in_try);
+        if (!s)
+            continue;
+        list.stmts[kept++] = s;
+        if (stmt_returns(s))
+            returned = 1;
+    }
+    list.count = kept;
+    return list;
+}
+
+void fold_program(StmtList* program) {
+    *program = fold_list(*program, 0);
+}
@@ -0,0 +1,531 @@
+// infer.c - static types for variables, results and calls, and the
+// specializations (instances) of each function the program calls: f(2) and
+// f(2.5) become two functions, each working in its own native types
+
+#include "pLLVM.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Thread_local Instance* main_instance = NULL;
+
+// Functions by name, open addressing. A name declared twice resolves to the
+// first declaration, as LLVMGetNamedFunction() does
+static _Thread_local Stmt** decl_map;
+static _Thread_local int    decl_map_cap;
+static _Thread_local Stmt** decls;
+static _Thread_local int    decl_count, decl_cap;
+
+// Every instance, in the order they were found; each pass reanalyzes them
+// all until no type changes
+static _Thread_local Instance** instances;
+static _Thread_local int        instance_count, instance_cap;
+static _Thread_local int        changed;
+static _Thread_local StmtList   program;
+
+// The variables in scope while a body is analyzed. For counters are fixed
+// ints; lets and parameters widen with what is assigned to them
+typedef struct {
+    const char* name;
+    TypeKind*   type;
+    int         fixed;
+} TypedName;
+
+static _Thread_local TypedName* scope;
+static _Thread_local int        scope_count, scope_cap;
+static _Thread_local SymbolTable scope_names;   // scope[i] is bound as scope_names.symbols[i]
+static _Thread_local Instance*  current;
+
+static void* grow(void* items, int count, int* cap, size_t elem) {
+    if (count < *cap)
+        return items;
+    *cap = *cap ? *cap * 2 : 16;
+    return realloc(items, *cap * elem);
+}
+
+static Stmt* find_decl(const char* name) {
+    if (!decl_map_cap)
+        return NULL;
+    unsigned i = hash_name(name) & (decl_map_cap - 1);
+    while (decl_map[i]) {
+        if (decl_map[i]->func_decl.name == name)
+            return decl_map[i];
+        i = (i + 1) & (decl_map_cap - 1);
+    }
+    return NULL;
+}
+
+static void collect_decls(StmtList list) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_FUNC_DECL:
+                decls = grow(decls, decl_count, &decl_cap, sizeof(Stmt*));
+                decls[decl_count++] = s;
+                collect_decls(s->func_decl.body);
+                break;
+            case STMT_IF:
+                collect_decls(s->if_stmt.then_stmt);
+                collect_decls(s->if_stmt.else_stmt);
+                break;
+            case STMT_FOR:
+                collect_decls(s->for_stmt.body);
+                break;
+            case STMT_WHILE:
+                collect_decls(s->while_stmt.body);
+                break;
+            case STMT_TRY_CATCH:
+                collect_decls(s->try_catch.try_stmt);
+                collect_decls(s->try_catch.catch_stmt);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void build_decl_map(void) {
+    decl_map_cap = 16;
+    while (decl_map_cap < 2 * decl_count)
+        decl_map_cap *= 2;
+    decl_map = calloc(decl_map_cap, sizeof(Stmt*));
+    for (int i = 0; i < decl_count; i++) {
+        const char* name = decls[i]->func_decl.name;
+        if (find_decl(name))
+            continue;
+        unsigned slot = hash_name(name) & (decl_map_cap - 1);
+        while (decl_map[slot])
+            slot = (slot + 1) & (decl_map_cap - 1);
+        decl_map[slot] = decls[i];
+    }
+}
+
+/*
+ * Resolution: calls and pipeline stages are bound to the declarations they
+ * name, and the lets of each body (main's, or a function's after its
+ * parameters) are numbered into slots of Instance.vars.
+ */
+
+static void resolve_expr(Expr* e) {
+    switch (e->type) {
+        case EXPR_BINOP:
+            resolve_expr(e->binop.left);
+            resolve_expr(e->binop.right);
+            break;
+        case EXPR_UNARYOP:
+            resolve_expr(e->unaryop.operand);
+            break;
+        case EXPR_FUNC_CALL:
+            e->func_call.decl = find_decl(e->func_call.func_name);
+            for (int i = 0; i < e->func_call.args.count; i++)
+                resolve_expr(e->func_call.args.exprs[i]);
+            break;
+        case EXPR_PIPELINE:
+            resolve_expr(e->pipeline.from);
+            resolve_expr(e->pipeline.to);
+            for (int i = 0; i < e->pipeline.stages.count; i++)
+                e->pipeline.stages.stages[i].decl = find_decl(e->pipeline.stages.stages[i].func_name);
+            break;
+        case EXPR_ARRAY:
+            for (int i = 0; i < e->array.elems.count; i++)
+                resolve_expr(e->array.elems.exprs[i]);
+            break;
+        case EXPR_INDEX:
+            resolve_expr(e->index.array);
+            resolve_expr(e->index.index);
+            break;
+        default:
+            break;
+    }
+}
+
+static void resolve_list(StmtList list, int* slots) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_LET:
+                s->let.slot = (*slots)++;
+                resolve_expr(s->let.expr);
+                break;
+            case STMT_ASSIGN:
+                resolve_expr(s->assign.expr);
+                break;
+            case STMT_INDEX_ASSIGN:
+                resolve_expr(s->index_assign.index);
+                resolve_expr(s->index_assign.expr);
+                break;
+            case STMT_OUTPUT:
+                resolve_expr(s->output.expr);
+                break;
+            case STMT_IF:
+                resolve_expr(s->if_stmt.cond);
+                resolve_list(s->if_stmt.then_stmt, slots);
+                resolve_list(s->if_stmt.else_stmt, slots);
+                break;
+            case STMT_FOR:
+                resolve_list(s->for_stmt.body, slots);
+                break;
+            case STMT_WHILE:
+                resolve_expr(s->while_stmt.cond);
+                resolve_list(s->while_stmt.body, slots);
+                break;
+            case STMT_TRY_CATCH:
+                resolve_list(s->try_catch.try_stmt, slots);
+                resolve_list(s->try_catch.catch_stmt, slots);
+                break;
+            case STMT_RETURN:
+                if (s->return_stmt.expr)
+                    resolve_expr(s->return_stmt.expr);
+                break;
+            case STMT_FUNC_DECL: {
+                int inner = s->func_decl.params.count;
+                resolve_list(s->func_decl.body, &inner);
+                s->func_decl.var_count = inner;
+                s->func_decl.instances = NULL;
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Instances. Types only move up (unknown to known, bool to int, int to
+ * long), so repeating the passes reaches a fixed point; a variable given
+ * both an int and a float keeps the first, and codegen reports the other.
+ */
+
+static int is_array_kind(TypeKind t) {
+    return t == TY_INT_ARRAY || t == TY_FLOAT_ARRAY;
+}
+
+// How a value travels as an argument or result
+static TypeKind passed(TypeKind t) {
+    return t == TY_BOOL ? TY_INT : t;
+}
+
+static void join(TypeKind* slot, TypeKind t) {
+    if (t == TY_NONE || *slot == t)
+        return;
+    if (*slot == TY_NONE || (*slot == TY_BOOL && (t == TY_INT || t == TY_LONG)) ||
+        (*slot == TY_INT && t == TY_LONG)) {
+        *slot = t;
+        changed = 1;
+    }
+}
+
+Instance* find_instance(Stmt* decl, const TypeKind* args) {
+    size_t size = decl->func_decl.params.count * sizeof(TypeKind);
+    for (Instance* inst = decl->func_decl.instances; inst; inst = inst->next)
+        if (!memcmp(inst->params, args, size))
+            return inst;
+    return NULL;
+}
+
+// One letter per parameter: i int, l long, f float, I int array, F float
+// array
+static char* mangle(const char* name, const TypeKind* args, int count) {
+    static const char codes[] = "?bilfIF";
+    int all_int = 1;
+    for (int i = 0; i < count; i++)
+        all_int &= args[i] == TY_INT;
+    if (all_int)
+        return (char*)name;
+    size_t len = strlen(name);
+    char* symbol = arena_alloc(&ast_arena, len + count + 2);
+    memcpy(symbol, name, len);
+    symbol[len] = '.';
+    for (int i = 0; i < count; i++)
+        symbol[len + 1 + i] = codes[args[i]];
+    symbol[len + 1 + count] = '\0';
+    return symbol;
+}
+
+static Instance* instantiate(Stmt* decl, const TypeKind* args) {
+    Instance* inst = find_instance(decl, args);
+    if (inst)
+        return inst;
+    int count = decl->func_decl.params.count;
+    int vars = decl->func_decl.var_count;
+    inst = arena_alloc(&ast_arena, sizeof(Instance));
+    inst->decl = decl;
+    inst->params = arena_alloc(&ast_arena, (count + 1) * sizeof(TypeKind));
+    memcpy(inst->params, args, count * sizeof(TypeKind));
+    inst->ret = TY_NONE;
+    inst->vars = arena_alloc(&ast_arena, (vars + 1) * sizeof(TypeKind));
+    for (int i = 0; i < vars; i++)
+        inst->vars[i] = i < count ? args[i] : TY_NONE;
+    inst->var_count = vars;
+    inst->symbol = mangle(decl->func_decl.name, args, count);
+    inst->next = NULL;
+    Instance** tail = &decl->func_decl.instances;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = inst;
+    instances = grow(instances, instance_count, &instance_cap, sizeof(Instance*));
+    instances[instance_count++] = inst;
+    changed = 1;
+    return inst;
+}
+
+static void bind(const char* name, TypeKind* type, int fixed) {
+    scope = grow(scope, scope_count, &scope_cap, sizeof(TypedName));
+    scope[scope_count++] = (TypedName){ name, type, fixed };
+    table_bind(&scope_names, name, NULL);
+}
+
+static void unbind(int mark) {
+    scope_count = mark;
+    table_truncate(&scope_names, mark);
+}
+
+static TypedName* lookup(const char* name) {
+    int i = table_lookup(&scope_names, name);
+    return i >= 0 ? &scope[i] : NULL;
+}
+
+static TypeKind infer_expr(Expr* e);
+
+// Builtins are picked as codegen picks them (see generate_node())
+static TypeKind infer_call(Expr* e) {
+    const char* name = e->func_call.func_name;
+    ExprList args = e->func_call.args;
+    if (args.count == 1 && !strcmp(name, "array")) {
+        infer_expr(args.exprs[0]);
+        return TY_INT_ARRAY;
+    }
+    if (args.count == 1 && !strcmp(name, "long")) {
+        infer_expr(args.exprs[0]);
+        return TY_LONG;
+    }
+    InputKind input = input_builtin(name, args.count);
+    if (input) {
+        if (args.count)
+            infer_expr(args.exprs[0]);
+        return input == INPUT_FLOAT  ? TY_FLOAT
+             : input == INPUT_INTS   ? TY_INT_ARRAY
+             : input == INPUT_FLOATS ? TY_FLOAT_ARRAY
+                                     : TY_INT;
+    }
+    TypeKind* types = malloc((args.count + 1) * sizeof(TypeKind));
+    int known = 1;
+    for (int i = 0; i < args.count; i++) {
+        types[i] = passed(infer_expr(args.exprs[i]));
+        known &= types[i] != TY_NONE;
+    }
+    TypeKind result = TY_NONE;
+    Stmt* decl = e->func_call.decl;
+    if (args.count == 1 && is_array_builtin(name) && is_array_kind(types[0]))
+        result = !strcmp(name, "len") ? TY_INT : types[0] == TY_INT_ARRAY ? TY_INT : TY_FLOAT;
+    else if (known && decl && decl->func_decl.params.count == args.count)
+        result = instantiate(decl, types)->ret;
+    free(types);
+    return result;
+}
+
+static TypeKind infer_expr(Expr* e) {
+    switch (e->type) {
+        case EXPR_INT:
+            return TY_INT;
+        case EXPR_LONG:
+            return TY_LONG;
+        case EXPR_FLOAT:
+            return TY_FLOAT;
+        case EXPR_BOOL:
+            return TY_BOOL;
+        case EXPR_VAR: {
+            TypedName* var = lookup(e->var_name);
+            return var ? *var->type : TY_NONE;
+        }
+        case EXPR_BINOP: {
+            TypeKind l = infer_expr(e->binop.left);
+            TypeKind r = infer_expr(e->binop.right);
+            BinOp op = e->binop.op;
+            if (op == OP_AND || op == OP_OR)
+                return TY_BOOL;
+            if (is_array_kind(l) || is_array_kind(r))
+                return op >= OP_EQ ? TY_INT_ARRAY : is_array_kind(l) ? l : r;
+            if (op >= OP_EQ)
+                return TY_BOOL;
+            if (l == TY_NONE || r == TY_NONE)
+                return TY_NONE;
+            if (l == TY_FLOAT || r == TY_FLOAT)
+                return TY_FLOAT;
+            return l == TY_LONG || r == TY_LONG ? TY_LONG : TY_INT;
+        }
+        case EXPR_UNARYOP:
+            infer_expr(e->unaryop.operand);
+            return TY_BOOL;
+        case EXPR_FUNC_CALL:
+            return infer_call(e);
+        case EXPR_PIPELINE: {
+            infer_expr(e->pipeline.from);
+            infer_expr(e->pipeline.to);
+            // Stages are called with each int of the range
+            TypeKind arg = TY_INT;
+            for (int i = 0; i < e->pipeline.stages.count; i++) {
+                Stmt* decl = e->pipeline.stages.stages[i].decl;
+                if (decl && decl->func_decl.params.count == 1)
+                    instantiate(decl, &arg);
+            }
+            return TY_INT;
+        }
+        case EXPR_ARRAY: {
+            TypeKind first = TY_INT;
+            for (int i = 0; i < e->array.elems.count; i++) {
+                TypeKind t = infer_expr(e->array.elems.exprs[i]);
+                if (i == 0)
+                    first = t;
+            }
+            return first == TY_FLOAT ? TY_FLOAT_ARRAY : TY_INT_ARRAY;
+        }
+        case EXPR_INDEX: {
+            TypeKind a = infer_expr(e->index.array);
+            infer_expr(e->index.index);
+            return a == TY_FLOAT_ARRAY ? TY_FLOAT : a == TY_INT_ARRAY ? TY_INT : TY_NONE;
+        }
+    }
+    return TY_NONE;
+}
+
+static void infer_list(StmtList list);
+
+// A nested scope, as codegen pushes one for each branch and loop body
+static void infer_scoped(StmtList list) {
+    int mark = scope_count;
+    infer_list(list);
+    unbind(mark);
+}
+
+static void infer_stmt(Stmt* s) {
+    switch (s->type) {
+        case STMT_LET: {
+            TypeKind* slot = &current->vars[s->let.slot];
+            join(slot, infer_expr(s->let.expr));
+            bind(s->let.name, slot, 0);
+            break;
+        }
+        case STMT_ASSIGN: {
+            TypeKind t = infer_expr(s->assign.expr);
+            TypedName* var = lookup(s->assign.name);
+            if (var && !var->fixed)
+                join(var->type, t);
+            break;
+        }
+        case STMT_INDEX_ASSIGN:
+            infer_expr(s->index_assign.index);
+            infer_expr(s->index_assign.expr);
+            break;
+        case STMT_OUTPUT:
+            infer_expr(s->output.expr);
+            break;
+        case STMT_IF:
+            infer_expr(s->if_stmt.cond);
+            infer_scoped(s->if_stmt.then_stmt);
+            infer_scoped(s->if_stmt.else_stmt);
+            break;
+        case STMT_FOR: {
+            static TypeKind counter = TY_INT;
+            int mark = scope_count;
+            bind(s->for_stmt.var, &counter, 1);
+            infer_scoped(s->for_stmt.body);
+            unbind(mark);
+            break;
+        }
+        case STMT_WHILE:
+            infer_expr(s->while_stmt.cond);
+            infer_scoped(s->while_stmt.body);
+            break;
+        case STMT_TRY_CATCH:
+            infer_scoped(s->try_catch.try_stmt);
+            infer_scoped(s->try_catch.catch_stmt);
+            break;
+        case STMT_RETURN:
+            if (s->return_stmt.expr) {
+                TypeKind t = infer_expr(s->return_stmt.expr);
+                if (current->decl)   // main always returns an int status
+                    join(&current->ret, passed(t));
+            }
+            break;
+        case STMT_FUNC_DECL:
+            // Analyzed once per instance
+            break;
+    }
+}
+
+static void infer_list(StmtList list) {
+    for (int i = 0; i < list.count; i++)
+        infer_stmt(list.stmts[i]);
+}
+
+static void infer_instance(Instance* inst) {
+    current = inst;
+    unbind(0);
+    if (!inst->decl) {
+        infer_list(program);
+        return;
+    }
+    ParamList params = inst->decl->func_decl.params;
+    for (int i = 0; i < params.count; i++)
+        bind(params.args[i], &inst->vars[i], 0);
+    infer_list(inst->decl->func_decl.body);
+}
+
+// After fold, before codegen (and before the interpreter, whose --tier
+// generates the all-int instances)
+void infer_program(StmtList list) {
+    program = list;
+    collect_decls(list);
+    build_decl_map();
+    int slots = 0;
+    resolve_list(list, &slots);
+
+    main_instance = arena_alloc(&ast_arena, sizeof(Instance));
+    main_instance->decl = NULL;
+    main_instance->params = NULL;
+    main_instance->ret = TY_INT;
+    main_instance->vars = arena_alloc(&ast_arena, (slots + 1) * sizeof(TypeKind));
+    for (int i = 0; i < slots; i++)
+        main_instance->vars[i] = TY_NONE;
+    main_instance->var_count = slots;
+    main_instance->symbol = "main";
+    main_instance->next = NULL;
+    instances = grow(instances, instance_count, &instance_cap, sizeof(Instance*));
+    instances[instance_count++] = main_instance;
+
+    do {
+        do {
+            changed = 0;
+            for (int i = 0; i < instance_count; i++)
+                infer_instance(instances[i]);
+        } while (changed);
+        // Functions nothing calls are still generated, taking ints
+        for (int i = 0; i < decl_count; i++) {
+            Stmt* decl = decls[i];
+            if (decl->func_decl.instances)
+                continue;
+            int count = decl->func_decl.params.count;
+            TypeKind* ints = malloc((count + 1) * sizeof(TypeKind));
+            for (int j = 0; j < count; j++)
+                ints[j] = TY_INT;
+            instantiate(decl, ints);
+            free(ints);
+        }
+    } while (changed);
+
+    // Functions that never return a value return 0
+    for (int i = 0; i < instance_count; i++)
+        if (instances[i]->ret == TY_NONE)
+            instances[i]->ret = TY_INT;
+
+    free(decls);
+    free(decl_map);
+    free(instances);
+    free(scope);
+    table_free(&scope_names);
+    decls = NULL;
+    decl_map = NULL;
+    instances = NULL;
+    scope = NULL;
+    decl_count = decl_cap = decl_map_cap = instance_count = instance_cap = scope_count = scope_cap = 0;
+    current = NULL;
+}
@@ -0,0 +1,1518 @@
+// interp.c - --interp: runs a program without LLVM. The folded AST is
+// compiled to a compact register bytecode, with the same static types and
+// checks as codegen, and executed by a threaded dispatch loop. With --tier,
+// functions and while loops that get hot are handed to the LLVM JIT (see
+// tier_loop() in pLLVM.c) and run natively from then on.
+
+#include "pLLVM.h"
+#include "chainrt.h"
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int      interp_mode = 0;
+unsigned tier_threshold = 0;    // --tier: calls or loop iterations before code goes native
+
+/*
+ * Instructions are { op, x, a, b, c }: a is the destination register unless
+ * noted, b and c the operands, and jump targets are instruction indices.
+ *
+ *   CONST a=imm(b)            float constants are stored as their bits
+ *   ADDK  a=b+imm(c)          x + literal, and x - literal negated
+ *   Jcc   if (a cc b) goto c  int compare and branch; JLEK compares a with imm(b)
+ *   JZ/JNZ a, goto b
+ *   CHECK_ZERO a, goto b      inside try: a zero divisor goes to catch
+ *   CHECK_INDEX array a, index b, goto c
+ *   CALL  a=function b(args in registers c...)
+ *   STORE array a[index b] = c
+ *   ARRAY a=[registers b..b+c-1]
+ *   ARRAY_OP a=b op c         x holds the BinOp and ARR_* flags
+ *   REDUCE a=sum/min/max(b)   x holds RED_* and RED_FLOAT
+ *   INPUT a=input x(count b)  x is the InputKind
+ *   TIER_LOOP loop a, exit b, catch c: a while loop's header under --tier
+ */
+typedef enum {
+    I_MOVE, I_CONST,
+    I_ADD, I_SUB, I_MUL, I_DIV, I_ADDK,
+    I_FADD, I_FSUB, I_FMUL, I_FDIV,
+    I_EQ, I_NE, I_LT, I_GT, I_LE, I_GE,
+    I_FEQ, I_FNE, I_FLT, I_FGT, I_FLE, I_FGE,
+    I_NOT,
+    I_JUMP, I_JZ, I_JNZ,
+    I_JEQ, I_JNE, I_JLT, I_JGT, I_JLE, I_JGE, I_JLEK,
+    I_CHECK_ZERO, I_CHECK_INDEX,
+    I_CALL, I_RET, I_RET0,
+    I_OUT_INT, I_OUT_FLOAT, I_OUT_INTS, I_OUT_FLOATS,
+    I_NEW_ARRAY, I_ARRAY, I_LEN, I_INDEX, I_STORE, I_ARRAY_OP, I_REDUCE,
+    I_INPUT,
+    I_TIER_LOOP,
+    I_COUNT
+} Opcode;
+
+#define ARR_FLOAT 0x10
+#define ARR_LEFT  0x20      // left operand is an array
+#define ARR_RIGHT 0x40
+#define RED_SUM   0
+#define RED_MIN   1
+#define RED_MAX   2
+#define RED_FLOAT 4
+
+// Natively compiled functions are called with at most this many arguments
+#define MAX_NATIVE_ARGS 6
+
+typedef struct {
+    uint16_t op, x;
+    int32_t  a, b, c;
+} Insn;
+
+typedef union {
+    int32_t i;              // ints, and bools as 0/1
+    float   f;
+    struct {
+        int32_t len;
+        void*   data;
+    } arr;                  // laid out like the generated { i32, T* }
+} Value;
+
+// One per instance inference made of a function (see find_instance()), so
+// float and array arguments specialize as they do in codegen
+typedef struct {
+    const char* name;       // the instance's symbol
+    int         arity;
+    ValueType*  params;
+    ValueType   ret;
+    Insn*       code;
+    int         code_count, code_cap;
+    int         nregs;
+    unsigned    calls;      // --tier: interpreted calls so far
+    void*       native;     // the JIT's entry point once hot
+} Function;
+
+// A function declaration; its instances are functions[first .. first + count)
+typedef struct {
+    const char* name;
+    int         arity;
+    int         first, count;
+} Declared;
+
+// A while loop that --tier may hand to the JIT, with the outer variables
+// it uses
+typedef struct {
+    Stmt*    stmt;
+    int      outer;         // bindings visible where the loop starts
+    int      in_try;
+    TierVar* vars;
+    int*     regs;
+    void**   ptrs;          // the registers, as passed to the native loop
+    int      count, cap;
+    unsigned iterations;
+    int    (*native)(void** vars);
+} HotLoop;
+
+static Function** functions;
+static int        function_count, function_cap;
+static Declared*  declared;
+static int        declared_count, declared_cap;
+static SymbolTable declared_names;  // declared[i] is bound as declared_names.symbols[i]
+static HotLoop*   loops;
+static int        loop_count, loop_cap;
+static unsigned   lanes;    // vector width the generated float reductions use
+
+typedef struct {
+    const char* name;
+    ValueType   type;
+    int         reg;
+    int         reduction;  // parallel for accumulator: only x = x + ...
+} Binding;
+
+typedef struct {
+    int* at;
+    int  count, cap;
+} JumpList;
+
+typedef struct {
+    Function* fn;
+    Binding*  vars;
+    int       var_count, var_cap;
+    SymbolTable names;      // vars[i] is bound as names.symbols[i]
+    int       locals;       // registers held by bindings and loop counters
+    int       next;         // first free temporary
+    JumpList* catch_jumps;  // inside try: the checks that go to catch
+    int*      open_loops;   // HotLoops being compiled
+    int       open_count, open_cap;
+} Compiler;
+
+typedef struct {
+    int var_count, locals;
+} Scope;
+
+static void* grow(void* items, int count, int* cap, size_t elem) {
+    if (count < *cap)
+        return items;
+    *cap = *cap ? *cap * 2 : 16;
+    return realloc(items, *cap * elem);
+}
+
+static int is_array(ValueType t) {
+    return t == VAL_INT_ARRAY || t == VAL_FLOAT_ARRAY;
+}
+
+static int emit_x(Compiler* c, Opcode op, int x, int a, int b, int cc) {
+    Function* f = c->fn;
+    f->code = grow(f->code, f->code_count, &f->code_cap, sizeof(Insn));
+    f->code[f->code_count] = (Insn){ op, x, a, b, cc };
+    return f->code_count++;
+}
+
+static int emit(Compiler* c, Opcode op, int a, int b, int cc) {
+    return emit_x(c, op, 0, a, b, cc);
+}
+
+static int here(Compiler* c) {
+    return c->fn->code_count;
+}
+
+static void add_jump(JumpList* list, int at) {
+    list->at = grow(list->at, list->count, &list->cap, sizeof(int));
+    list->at[list->count++] = at;
+}
+
+static void set_target(Compiler* c, int at, int target) {
+    Insn* in = &c->fn->code[at];
+    switch (in->op) {
+        case I_JUMP:
+            in->a = target;
+            break;
+        case I_JZ:
+        case I_JNZ:
+        case I_CHECK_ZERO:
+            in->b = target;
+            break;
+        default:
+            in->c = target;
+            break;
+    }
+}
+
+static void patch(Compiler* c, JumpList* list, int target) {
+    for (int i = 0; i < list->count; i++)
+        set_target(c, list->at[i], target);
+    free(list->at);
+    *list = (JumpList){ NULL, 0, 0 };
+}
+
+static void use_regs(Compiler* c, int count) {
+    c->next += count;
+    if (c->next > c->fn->nregs)
+        c->fn->nregs = c->next;
+}
+
+static int temp(Compiler* c) {
+    use_regs(c, 1);
+    return c->next - 1;
+}
+
+// The result register: the caller's, or a new temporary
+static int place(Compiler* c, int dst) {
+    return dst >= 0 ? dst : temp(c);
+}
+
+static int new_local(Compiler* c) {
+    c->next = c->locals;
+    use_regs(c, 1);
+    return c->locals++;
+}
+
+static Scope enter_scope(Compiler* c) {
+    return (Scope){ c->var_count, c->locals };
+}
+
+static void leave_scope(Compiler* c, Scope s) {
+    c->var_count = s.var_count;
+    table_truncate(&c->names, s.var_count);
+    c->locals = c->next = s.locals;
+}
+
+static void bind(Compiler* c, const char* name, ValueType type, int reg) {
+    c->vars = grow(c->vars, c->var_count, &c->var_cap, sizeof(Binding));
+    c->vars[c->var_count++] = (Binding){ name, type, reg, 0 };
+    table_bind(&c->names, name, NULL);
+}
+
+// Records an outer variable used inside each open loop, for --tier
+static void capture(Compiler* c, int index) {
+    for (int i = 0; i < c->open_count; i++) {
+        HotLoop* loop = &loops[c->open_loops[i]];
+        if (index >= loop->outer)
+            continue;
+        Binding* b = &c->vars[index];
+        int seen = 0;
+        for (int j = 0; j < loop->count && !seen; j++)
+            seen = loop->regs[j] == b->reg;
+        if (seen)
+            continue;
+        int cap = loop->cap;
+        loop->vars = grow(loop->vars, loop->count, &cap, sizeof(TierVar));
+        loop->regs = grow(loop->regs, loop->count, &loop->cap, sizeof(int));
+        loop->vars[loop->count] = (TierVar){ b->name, b->type };
+        loop->regs[loop->count++] = b->reg;
+    }
+}
+
+// Index of the innermost binding of name, or -1
+static int lookup(Compiler* c, const char* name) {
+    int i = table_lookup(&c->names, name);
+    if (i >= 0)
+        capture(c, i);
+    return i;
+}
+
+static int find_variable(Compiler* c, const char* name) {
+    int index = lookup(c, name);
+    if (index < 0) {
+        compile_error("Undefined variable: %s\n", name);
+        compile_failed();
+    }
+    return index;
+}
+
+static int read_variable(Compiler* c, const char* name) {
+    int index = find_variable(c, name);
+    if (c->vars[index].reduction) {
+        compile_error("%s can only be updated as %s = %s + ... inside parallel for\n",
+                name, name, name);
+        compile_failed();
+    }
+    return index;
+}
+
+// Index into declared, or -1. A name declared again keeps its first
+// declaration, the oldest binding behind the innermost
+static int find_function(const char* name) {
+    int i = table_lookup(&declared_names, name);
+    while (i >= 0 && declared_names.symbols[i].shadowed >= 0)
+        i = declared_names.symbols[i].shadowed;
+    return i;
+}
+
+// The instance of declared[decl] that takes arguments of these types;
+// bools are passed as ints
+static int specialization(int decl, const ValueType* types) {
+    Declared* d = &declared[decl];
+    for (int k = 0; k < d->count; k++) {
+        Function* f = functions[d->first + k];
+        int same = 1;
+        for (int i = 0; i < d->arity; i++)
+            same &= f->params[i] == (types[i] == VAL_BOOL ? VAL_INT : types[i]);
+        if (same)
+            return d->first + k;
+    }
+    compile_error("Function %s has no version for these argument types\n", d->name);
+    compile_failed();
+}
+
+static int expr(Compiler* c, Expr* e, int dst, ValueType* type);
+static void block(Compiler* c, StmtList list);
+static void statements(Compiler* c, StmtList list);
+
+// A binary operator on operands already in registers l and r
+static int operate(Compiler* c, BinOp op, int l, ValueType lt, int r, ValueType rt, int dst,
+                   ValueType* type) {
+    static const Opcode int_ops[] = { I_ADD, I_SUB, I_MUL, I_DIV, I_EQ, I_NE, I_LT, I_GT, I_LE, I_GE };
+    static const Opcode float_ops[] = { I_FADD, I_FSUB, I_FMUL, I_FDIV, I_FEQ, I_FNE,
+                                        I_FLT, I_FGT, I_FLE, I_FGE };
+    if (is_array(lt) || is_array(rt)) {
+        ValueType arrayType = is_array(lt) ? lt : rt;
+        ValueType elem = arrayType == VAL_INT_ARRAY ? VAL_INT : VAL_FLOAT;
+        ValueType other = is_array(lt) && is_array(rt) ? (rt == VAL_INT_ARRAY ? VAL_INT : VAL_FLOAT)
+                                                       : is_array(lt) ? rt : lt;
+        if (other != elem) {
+            compile_error("Array operands must have the same element type\n");
+            compile_failed();
+        }
+        if (op == OP_AND || op == OP_OR) {
+            compile_error("Unsupported array operator\n");
+            compile_failed();
+        }
+        int x = op | (elem == VAL_FLOAT ? ARR_FLOAT : 0) | (is_array(lt) ? ARR_LEFT : 0) |
+                (is_array(rt) ? ARR_RIGHT : 0);
+        int d = place(c, dst);
+        emit_x(c, I_ARRAY_OP, x, d, l, r);
+        *type = op >= OP_EQ ? VAL_INT_ARRAY : arrayType;
+        return d;
+    }
+    if (lt != VAL_INT && lt != VAL_FLOAT) {
+        compile_error("Unsupported binary operator or type\n");
+        compile_failed();
+    }
+    if (rt != lt) {
+        compile_error("Operands of a binary operator must have the same type\n");
+        compile_failed();
+    }
+    int isFloat = lt == VAL_FLOAT;
+    if (op == OP_DIV && !isFloat && c->catch_jumps)
+        add_jump(c->catch_jumps, emit(c, I_CHECK_ZERO, r, -1, 0));
+    int d = place(c, dst);
+    emit(c, isFloat ? float_ops[op] : int_ops[op], d, l, r);
+    *type = op >= OP_EQ ? VAL_BOOL : lt;
+    return d;
+}
+
+static void check_condition(ValueType t) {
+    if (t != VAL_BOOL && t != VAL_INT) {
+        compile_error("Condition must be an int or bool\n");
+        compile_failed();
+    }
+}
+
+// Jumps to list when e is true (sense 1) or false (sense 0), and falls
+// through otherwise. && and || short-circuit, and int comparisons become a
+// single compare-and-branch
+static void cond_jump(Compiler* c, Expr* e, int sense, JumpList* list) {
+    static const Opcode jumps[] = { I_JEQ, I_JNE, I_JLT, I_JGT, I_JLE, I_JGE };
+    static const BinOp negated[] = { OP_NE, OP_EQ, OP_GE, OP_LE, OP_GT, OP_LT };
+    int mark = c->next;
+    if (e->type == EXPR_BOOL || e->type == EXPR_INT) {
+        if ((e->ival != 0) == sense)
+            add_jump(list, emit(c, I_JUMP, -1, 0, 0));
+        return;
+    }
+    if (e->type == EXPR_UNARYOP) {
+        cond_jump(c, e->unaryop.operand, !sense, list);
+        return;
+    }
+    if (e->type == EXPR_BINOP && (e->binop.op == OP_AND || e->binop.op == OP_OR)) {
+        if ((e->binop.op == OP_AND) != sense) {
+            // a && b is false, or a || b is true, as soon as either says so
+            cond_jump(c, e->binop.left, sense, list);
+            cond_jump(c, e->binop.right, sense, list);
+        } else {
+            JumpList skip = { NULL, 0, 0 };
+            cond_jump(c, e->binop.left, !sense, &skip);
+            cond_jump(c, e->binop.right, sense, list);
+            patch(c, &skip, here(c));
+        }
+        return;
+    }
+    ValueType t;
+    int r;
+    if (e->type == EXPR_BINOP && e->binop.op >= OP_EQ && e->binop.op <= OP_GE) {
+        ValueType lt, rt;
+        int l = expr(c, e->binop.left, -1, &lt);
+        r = expr(c, e->binop.right, -1, &rt);
+        if (lt == VAL_INT && rt == VAL_INT) {
+            BinOp op = sense ? e->binop.op : negated[e->binop.op - OP_EQ];
+            add_jump(list, emit(c, jumps[op - OP_EQ], l, r, -1));
+            c->next = mark;
+            return;
+        }
+        r = operate(c, e->binop.op, l, lt, r, rt, -1, &t);
+    } else {
+        r = expr(c, e, -1, &t);
+    }
+    check_condition(t);
+    add_jump(list, emit(c, sense ? I_JNZ : I_JZ, r, -1, 0));
+    c->next = mark;
+}
+
+// && and || as values
+static int condition_value(Compiler* c, Expr* e, int dst, ValueType* type) {
+    JumpList no = { NULL, 0, 0 };
+    cond_jump(c, e, 0, &no);
+    int d = place(c, dst);
+    emit(c, I_CONST, d, 1, 0);
+    int done = emit(c, I_JUMP, -1, 0, 0);
+    patch(c, &no, here(c));
+    emit(c, I_CONST, d, 0, 0);
+    set_target(c, done, here(c));
+    *type = VAL_BOOL;
+    return d;
+}
+
+static int binop(Compiler* c, Expr* e, int dst, ValueType* type) {
+    BinOp op = e->binop.op;
+    if (op == OP_AND || op == OP_OR)
+        return condition_value(c, e, dst, type);
+    int mark = c->next;
+    ValueType lt, rt;
+    int l = expr(c, e->binop.left, -1, &lt);
+    Expr* right = e->binop.right;
+    if (lt == VAL_INT && (op == OP_ADD || op == OP_SUB) && right->type == EXPR_INT) {
+        c->next = mark;
+        int d = place(c, dst);
+        emit(c, I_ADDK, d, l, op == OP_ADD ? right->ival : (int)(0u - (unsigned)right->ival));
+        *type = VAL_INT;
+        return d;
+    }
+    int r = expr(c, right, -1, &rt);
+    c->next = mark;
+    return operate(c, op, l, lt, r, rt, dst, type);
+}
+
+static int call(Compiler* c, Expr* e, int dst, ValueType* type) {
+    const char* name = e->func_call.func_name;
+    ExprList args = e->func_call.args;
+    int mark = c->next;
+    ValueType t;
+    // Array builtins: array(n), and len/sum/min/max of an array
+    if (args.count == 1 && !strcmp(name, "array")) {
+        int n = expr(c, args.exprs[0], -1, &t);
+        if (t != VAL_INT) {
+            compile_error("array(n) takes an int length\n");
+            compile_failed();
+        }
+        c->next = mark;
+        int d = place(c, dst);
+        emit(c, I_NEW_ARRAY, d, n, 0);
+        *type = VAL_INT_ARRAY;
+        return d;
+    }
+    if (args.count == 1 && !strcmp(name, "long")) {
+        compile_error("64-bit ints need compiled code: long()\n");
+        compile_failed();
+    }
+    InputKind input = input_builtin(name, args.count);
+    if (input) {
+        int n = 0;
+        if (args.count) {
+            n = expr(c, args.exprs[0], -1, &t);
+            if (t != VAL_INT) {
+                compile_error("%s(n) takes an int count\n", name);
+                compile_failed();
+            }
+        }
+        c->next = mark;
+        int d = place(c, dst);
+        emit_x(c, I_INPUT, input, d, n, 0);
+        *type = input == INPUT_FLOAT  ? VAL_FLOAT
+              : input == INPUT_INTS   ? VAL_INT_ARRAY
+              : input == INPUT_FLOATS ? VAL_FLOAT_ARRAY
+                                      : VAL_INT;
+        return d;
+    }
+    int first = -1;
+    ValueType firstType = VAL_INT;
+    if (args.count == 1 && is_array_builtin(name)) {
+        first = expr(c, args.exprs[0], -1, &firstType);
+        if (is_array(firstType)) {
+            c->next = mark;
+            int d = place(c, dst);
+            if (!strcmp(name, "len")) {
+                emit(c, I_LEN, d, first, 0);
+                *type = VAL_INT;
+                return d;
+            }
+            int kind = !strcmp(name, "sum") ? RED_SUM : !strcmp(name, "min") ? RED_MIN : RED_MAX;
+            int isFloat = firstType == VAL_FLOAT_ARRAY;
+            emit_x(c, I_REDUCE, kind | (isFloat ? RED_FLOAT : 0), d, first, 0);
+            *type = isFloat ? VAL_FLOAT : VAL_INT;
+            return d;
+        }
+    }
+    int decl = find_function(name);
+    if (decl < 0) {
+        compile_error("Undefined function: %s\n", name);
+        compile_failed();
+    }
+    if (declared[decl].arity != args.count) {
+        compile_error("Function %s takes %d arguments\n", name, declared[decl].arity);
+        compile_failed();
+    }
+    int base = c->next;
+    use_regs(c, args.count);
+    ValueType types[args.count + 1];
+    for (int i = 0; i < args.count; i++) {
+        if (i == 0 && first >= 0) {
+            emit(c, I_MOVE, base, first, 0);
+            types[i] = firstType;
+        } else {
+            expr(c, args.exprs[i], base + i, &types[i]);
+        }
+    }
+    int index = specialization(decl, types);
+    c->next = mark;
+    int d = place(c, dst);
+    emit(c, I_CALL, d, index, base);
+    *type = functions[index]->ret;
+    return d;
+}
+
+// range(from, to) -> stages -> sink as one loop, like generate_pipeline()
+static int pipeline(Compiler* c, Expr* e, int dst, ValueType* type) {
+    if (e->pipeline.sink == SINK_NONE) {
+        compile_error("Pipeline must end in sum or count\n");
+        compile_failed();
+    }
+    StageList stages = e->pipeline.stages;
+    int* funcs = malloc((stages.count + 1) * sizeof(int));
+    for (int i = 0; i < stages.count; i++) {
+        int decl = find_function(stages.stages[i].func_name);
+        if (decl < 0) {
+            compile_error("Undefined function: %s\n", stages.stages[i].func_name);
+            compile_failed();
+        }
+        if (declared[decl].arity != 1) {
+            compile_error("Pipeline stage function must take one argument: %s\n",
+                    stages.stages[i].func_name);
+            compile_failed();
+        }
+        ValueType arg = VAL_INT;
+        funcs[i] = specialization(decl, &arg);
+        if (functions[funcs[i]]->ret != VAL_INT) {
+            compile_error("Pipeline stage function must return an int: %s\n",
+                    stages.stages[i].func_name);
+            compile_failed();
+        }
+    }
+    int mark = c->next;
+    ValueType ft, tt;
+    int index = temp(c);
+    expr(c, e->pipeline.from, index, &ft);
+    int to = expr(c, e->pipeline.to, -1, &tt);
+    if (ft != VAL_INT || tt != VAL_INT) {
+        compile_error("range() takes int bounds\n");
+        compile_failed();
+    }
+    int acc = temp(c);
+    int value = temp(c);
+    emit(c, I_CONST, acc, 0, 0);
+    int enter = emit(c, I_JUMP, -1, 0, 0);
+    int top = here(c);
+    JumpList rejected = { NULL, 0, 0 };
+    emit(c, I_MOVE, value, index, 0);
+    for (int i = 0; i < stages.count; i++) {
+        if (stages.stages[i].kind == STAGE_MAP) {
+            emit(c, I_CALL, value, funcs[i], value);
+            continue;
+        }
+        int keep = temp(c);
+        emit(c, I_CALL, keep, funcs[i], value);
+        add_jump(&rejected, emit(c, I_JZ, keep, -1, 0));
+    }
+    if (e->pipeline.sink == SINK_SUM)
+        emit(c, I_ADD, acc, acc, value);
+    else
+        emit(c, I_ADDK, acc, acc, 1);
+    patch(c, &rejected, here(c));
+    emit(c, I_ADDK, index, index, 1);
+    set_target(c, enter, here(c));
+    emit(c, I_JLE, index, to, top);
+    free(funcs);
+    c->next = mark;
+    int d = place(c, dst);
+    emit(c, I_MOVE, d, acc, 0);
+    *type = VAL_INT;
+    return d;
+}
+
+static int array_literal(Compiler* c, ExprList elems, int dst, ValueType* type) {
+    int mark = c->next;
+    int base = c->next;
+    use_regs(c, elems.count);
+    ValueType elem = VAL_INT;
+    for (int i = 0; i < elems.count; i++) {
+        ValueType t;
+        expr(c, elems.exprs[i], base + i, &t);
+        if (t == VAL_BOOL)
+            t = VAL_INT;
+        if (i == 0)
+            elem = t;
+        if (t != elem || (elem != VAL_INT && elem != VAL_FLOAT)) {
+            compile_error("Array elements must be all int or all float\n");
+            compile_failed();
+        }
+    }
+    c->next = mark;
+    int d = place(c, dst);
+    emit(c, I_ARRAY, d, base, elems.count);
+    *type = elem == VAL_FLOAT ? VAL_FLOAT_ARRAY : VAL_INT_ARRAY;
+    return d;
+}
+
+static void check_index(ValueType array, ValueType index) {
+    if (!is_array(array) || index != VAL_INT) {
+        compile_error("Indexing needs an array and an int index\n");
+        compile_failed();
+    }
+}
+
+// Compiles e, leaving its value in dst if dst >= 0; returns the register
+// that holds it. Only the last instruction writes dst, so x = f(x) + x reads
+// x before it changes
+static int expr_node(Compiler* c, Expr* e, int dst, ValueType* type) {
+    switch (e->type) {
+        case EXPR_INT:
+        case EXPR_BOOL: {
+            int d = place(c, dst);
+            emit(c, I_CONST, d, e->ival, 0);
+            *type = e->type == EXPR_INT ? VAL_INT : VAL_BOOL;
+            return d;
+        }
+        case EXPR_FLOAT: {
+            int d = place(c, dst), bits;
+            memcpy(&bits, &e->fval, sizeof(bits));
+            emit(c, I_CONST, d, bits, 0);
+            *type = VAL_FLOAT;
+            return d;
+        }
+        case EXPR_LONG:
+            compile_error("64-bit ints need compiled code: %lld\n", e->lval);
+            compile_failed();
+        case EXPR_VAR: {
+            Binding* b = &c->vars[read_variable(c, e->var_name)];
+            *type = b->type;
+            if (dst < 0)
+                return b->reg;
+            if (dst != b->reg)
+                emit(c, I_MOVE, dst, b->reg, 0);
+            return dst;
+        }
+        case EXPR_BINOP:
+            return binop(c, e, dst, type);
+        case EXPR_UNARYOP: {
+            int mark = c->next;
+            ValueType t;
+            int r = expr(c, e->unaryop.operand, -1, &t);
+            check_condition(t);
+            c->next = mark;
+            int d = place(c, dst);
+            emit(c, I_NOT, d, r, 0);
+            *type = VAL_BOOL;
+            return d;
+        }
+        case EXPR_FUNC_CALL:
+            return call(c, e, dst, type);
+        case EXPR_PIPELINE:
+            return pipeline(c, e, dst, type);
+        case EXPR_ARRAY:
+            return array_literal(c, e->array.elems, dst, type);
+        case EXPR_INDEX: {
+            int mark = c->next;
+            ValueType at, it;
+            int a = expr(c, e->index.array, -1, &at);
+            int i = expr(c, e->index.index, -1, &it);
+            check_index(at, it);
+            if (c->catch_jumps)
+                add_jump(c->catch_jumps, emit(c, I_CHECK_INDEX, a, i, -1));
+            c->next = mark;
+            int d = place(c, dst);
+            emit(c, I_INDEX, d, a, i);
+            *type = at == VAL_INT_ARRAY ? VAL_INT : VAL_FLOAT;
+            return d;
+        }
+    }
+    return -1;
+}
+
+// Errors found compiling e are reported at e
+static int expr(Compiler* c, Expr* e, int dst, ValueType* type) {
+    ErrorPos outer = error_enter(e->line, e->column);
+    int r = expr_node(c, e, dst, type);
+    error_leave(outer);
+    return r;
+}
+
+// Adds the terms of x + a + b, which parses as (x + a) + b, to x; 0 if e is
+// not of that shape
+static int reduction_terms(Compiler* c, Expr* e, int index) {
+    Binding* b = &c->vars[index];
+    if (e->type == EXPR_VAR && e->var_name == b->name)
+        return 1;
+    if (e->type != EXPR_BINOP || e->binop.op != OP_ADD)
+        return 0;
+    if (!reduction_terms(c, e->binop.left, index))
+        return 0;
+    int mark = c->next;
+    ValueType t;
+    int r = expr(c, e->binop.right, -1, &t);
+    if (t == VAL_BOOL)
+        t = VAL_INT;
+    b = &c->vars[index];
+    if (t != b->type) {
+        compile_error("Type mismatch in reduction %s\n", b->name);
+        compile_failed();
+    }
+    emit(c, t == VAL_FLOAT ? I_FADD : I_ADD, b->reg, b->reg, r);
+    c->next = mark;
+    return 1;
+}
+
+// The same restrictions as an outlined parallel for body (collect_names()
+// in pLLVM.c)
+static void check_parallel_body(StmtList list) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_IF:
+                check_parallel_body(s->if_stmt.then_stmt);
+                check_parallel_body(s->if_stmt.else_stmt);
+                break;
+            case STMT_FOR:
+                check_parallel_body(s->for_stmt.body);
+                break;
+            case STMT_WHILE:
+                check_parallel_body(s->while_stmt.body);
+                break;
+            case STMT_TRY_CATCH:
+                check_parallel_body(s->try_catch.try_stmt);
+                check_parallel_body(s->try_catch.catch_stmt);
+                break;
+            case STMT_RETURN:
+                compile_error("return is not allowed inside parallel for\n");
+                compile_failed();
+            case STMT_FUNC_DECL:
+                compile_error("Function %s cannot be declared inside parallel for\n",
+                        s->func_decl.name);
+                compile_failed();
+            default:
+                break;
+        }
+    }
+}
+
+// Marks the outer variables a parallel for body assigns as reductions;
+// returns the bindings newly marked, -1 terminated
+static int* mark_reductions(Compiler* c, StmtList list, int* marked, int* count, int* cap) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_ASSIGN: {
+                int index = lookup(c, s->assign.name);
+                if (index < 0 || c->vars[index].reduction)
+                    break;
+                ValueType t = c->vars[index].type;
+                if (t != VAL_INT && t != VAL_FLOAT) {
+                    compile_error("Only int and float variables can be reduced in parallel for: %s\n",
+                            s->assign.name);
+                    compile_failed();
+                }
+                c->vars[index].reduction = 1;
+                marked = grow(marked, *count, cap, sizeof(int));
+                marked[(*count)++] = index;
+                break;
+            }
+            case STMT_IF:
+                marked = mark_reductions(c, s->if_stmt.then_stmt, marked, count, cap);
+                marked = mark_reductions(c, s->if_stmt.else_stmt, marked, count, cap);
+                break;
+            case STMT_FOR:
+                marked = mark_reductions(c, s->for_stmt.body, marked, count, cap);
+                break;
+            case STMT_WHILE:
+                marked = mark_reductions(c, s->while_stmt.body, marked, count, cap);
+                break;
+            case STMT_TRY_CATCH:
+                marked = mark_reductions(c, s->try_catch.try_stmt, marked, count, cap);
+                marked = mark_reductions(c, s->try_catch.catch_stmt, marked, count, cap);
+                break;
+            default:
+                break;
+        }
+    }
+    return marked;
+}
+
+// A loop the JIT can run on its own: it cannot leave its function
+static int can_tier(StmtList list) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_RETURN:
+            case STMT_FUNC_DECL:
+                return 0;
+            case STMT_IF:
+                if (!can_tier(s->if_stmt.then_stmt) || !can_tier(s->if_stmt.else_stmt))
+                    return 0;
+                break;
+            case STMT_FOR:
+                if (!can_tier(s->for_stmt.body))
+                    return 0;
+                break;
+            case STMT_WHILE:
+                if (!can_tier(s->while_stmt.body))
+                    return 0;
+                break;
+            case STMT_TRY_CATCH:
+                if (!can_tier(s->try_catch.try_stmt) || !can_tier(s->try_catch.catch_stmt))
+                    return 0;
+                break;
+            default:
+                break;
+        }
+    }
+    return 1;
+}
+
+// for counts from start to end inclusive. parallel for runs serially here.
+// Its reductions sum into registers of their own, which are added to the
+// outer variables once the loop finishes; a failed check inside try skips
+// that, as the generated code drops the totals
+static void for_loop(Compiler* c, Stmt* s) {
+    int* marked = NULL;
+    int marked_count = 0, marked_cap = 0;
+    if (s->for_stmt.parallel) {
+        check_parallel_body(s->for_stmt.body);
+        marked = mark_reductions(c, s->for_stmt.body, NULL, &marked_count, &marked_cap);
+    }
+    Scope scope = enter_scope(c);
+    int* outer = malloc((marked_count + 1) * sizeof(int));
+    for (int i = 0; i < marked_count; i++) {
+        Binding* b = &c->vars[marked[i]];
+        outer[i] = b->reg;
+        b->reg = new_local(c);
+        emit(c, I_CONST, b->reg, 0, 0);     // 0.0f has the same bits
+    }
+    int counter = new_local(c);
+    bind(c, s->for_stmt.var, VAL_INT, counter);
+    emit(c, I_CONST, counter, s->for_stmt.start, 0);
+    int enter = emit(c, I_JUMP, -1, 0, 0);
+    int top = here(c);
+    block(c, s->for_stmt.body);
+    emit(c, I_ADDK, counter, counter, 1);
+    set_target(c, enter, here(c));
+    emit(c, I_JLEK, counter, s->for_stmt.end, top);
+    for (int i = 0; i < marked_count; i++) {
+        Binding* b = &c->vars[marked[i]];
+        emit(c, b->type == VAL_FLOAT ? I_FADD : I_ADD, outer[i], outer[i], b->reg);
+        b->reg = outer[i];
+        b->reduction = 0;
+    }
+    leave_scope(c, scope);
+    free(outer);
+    free(marked);
+}
+
+// The condition sits at the bottom, after the --tier header check, so each
+// iteration takes one branch
+static void while_loop(Compiler* c, Stmt* s) {
+    int loop = -1;
+    if (tier_threshold && can_tier(s->while_stmt.body)) {
+        loops = grow(loops, loop_count, &loop_cap, sizeof(HotLoop));
+        loop = loop_count++;
+        loops[loop] = (HotLoop){ .stmt = s, .outer = c->var_count, .in_try = c->catch_jumps != NULL };
+        c->open_loops = grow(c->open_loops, c->open_count, &c->open_cap, sizeof(int));
+        c->open_loops[c->open_count++] = loop;
+    }
+    int enter = emit(c, I_JUMP, -1, 0, 0);
+    int top = here(c);
+    block(c, s->while_stmt.body);
+    set_target(c, enter, here(c));
+    int header = -1;
+    if (loop >= 0) {
+        header = emit(c, I_TIER_LOOP, loop, -1, -1);
+        if (c->catch_jumps)
+            add_jump(c->catch_jumps, header);
+    }
+    JumpList again = { NULL, 0, 0 };
+    cond_jump(c, s->while_stmt.cond, 1, &again);
+    patch(c, &again, top);
+    if (loop >= 0) {
+        c->fn->code[header].b = here(c);
+        c->open_count--;
+    }
+}
+
+static Function* new_function(const char* name, int arity) {
+    Function* f = calloc(1, sizeof(Function));
+    f->name = name;
+    f->arity = arity;
+    f->nregs = arity;
+    return f;
+}
+
+// Bools are passed and returned as ints, and a function without a return
+// gives an int 0
+static ValueType value_type(TypeKind t, const char* symbol) {
+    switch (t) {
+        case TY_LONG:
+            compile_error("64-bit ints need compiled code: %s\n", symbol);
+            compile_failed();
+        case TY_FLOAT:       return VAL_FLOAT;
+        case TY_INT_ARRAY:   return VAL_INT_ARRAY;
+        case TY_FLOAT_ARRAY: return VAL_FLOAT_ARRAY;
+        default:             return VAL_INT;
+    }
+}
+
+// Functions see only their parameters and locals. All of a declaration's
+// instances are entered before any is compiled, so each can call the
+// others. A name declared twice keeps calling the first declaration, as
+// LLVMGetNamedFunction() does
+static void function(Stmt* s) {
+    int arity = s->func_decl.params.count;
+    Declared d = { s->func_decl.name, arity, function_count, 0 };
+    for (Instance* inst = s->func_decl.instances; inst; inst = inst->next) {
+        Function* f = new_function(inst->symbol, arity);
+        f->params = malloc((arity + 1) * sizeof(ValueType));
+        for (int i = 0; i < arity; i++)
+            f->params[i] = value_type(inst->params[i], inst->symbol);
+        f->ret = value_type(inst->ret, inst->symbol);
+        functions = grow(functions, function_count, &function_cap, sizeof(Function*));
+        functions[function_count++] = f;
+        d.count++;
+    }
+    table_bind(&declared_names, d.name, NULL);
+    declared = grow(declared, declared_count, &declared_cap, sizeof(Declared));
+    declared[declared_count++] = d;
+    for (int k = 0; k < d.count; k++) {
+        Function* f = functions[d.first + k];
+        Compiler inner = { .fn = f };
+        for (int i = 0; i < arity; i++) {
+            bind(&inner, s->func_decl.params.args[i], f->params[i], i);
+            inner.locals++;
+        }
+        inner.next = inner.locals;
+        statements(&inner, s->func_decl.body);
+        emit(&inner, I_RET0, 0, 0, 0);
+        free(inner.vars);
+        table_free(&inner.names);
+        free(inner.open_loops);
+    }
+}
+
+static void check_return(Compiler* c, ValueType t) {
+    if ((t == VAL_BOOL ? VAL_INT : t) != c->fn->ret) {
+        compile_error("Type mismatch in return from %s\n", c->fn->name);
+        compile_failed();
+    }
+}
+
+// return f(...) inside f, as codegen does it: the arguments go into the
+// parameter registers and the function starts over
+static int self_tail_call(Compiler* c, Expr* e) {
+    if (e->type != EXPR_FUNC_CALL)
+        return 0;
+    const char* name = e->func_call.func_name;
+    ExprList args = e->func_call.args;
+    int decl = find_function(name);
+    if (decl < 0 || args.count != c->fn->arity ||
+        input_builtin(name, args.count) || is_array_builtin(name) ||
+        (args.count == 1 && (!strcmp(name, "array") || !strcmp(name, "long"))))
+        return 0;
+    int self = 0;
+    for (int k = 0; k < declared[decl].count; k++)
+        self |= functions[declared[decl].first + k] == c->fn;
+    if (!self)
+        return 0;
+    int base = c->next;
+    use_regs(c, args.count);
+    ValueType types[args.count + 1];
+    for (int i = 0; i < args.count; i++)
+        expr(c, args.exprs[i], base + i, &types[i]);
+    int index = specialization(decl, types);
+    if (functions[index] != c->fn) {
+        // Another instance of the same function: an ordinary call
+        int d = temp(c);
+        check_return(c, functions[index]->ret);
+        emit(c, I_CALL, d, index, base);
+        emit(c, I_RET, d, 0, 0);
+        return 1;
+    }
+    for (int i = 0; i < args.count; i++)
+        emit(c, I_MOVE, i, base + i, 0);
+    emit(c, I_JUMP, 0, 0, 0);
+    return 1;
+}
+
+static void statement(Compiler* c, Stmt* s) {
+    ErrorPos outer = error_enter(s->line, s->column);
+    c->next = c->locals;
+    ValueType t;
+    switch (s->type) {
+        case STMT_LET: {
+            int reg = c->locals;
+            use_regs(c, 1);
+            expr(c, s->let.expr, reg, &t);
+            c->locals = c->next = reg + 1;
+            bind(c, s->let.name, t, reg);
+            break;
+        }
+        case STMT_ASSIGN: {
+            int index = find_variable(c, s->assign.name);
+            if (c->vars[index].reduction) {
+                if (!reduction_terms(c, s->assign.expr, index)) {
+                    const char* name = s->assign.name;
+                    compile_error("%s can only be updated as %s = %s + ... inside parallel for\n",
+                            name, name, name);
+                    compile_failed();
+                }
+                break;
+            }
+            expr(c, s->assign.expr, c->vars[index].reg, &t);
+            if (t != c->vars[index].type) {
+                compile_error("Type mismatch in assignment to %s\n", s->assign.name);
+                compile_failed();
+            }
+            break;
+        }
+        case STMT_INDEX_ASSIGN: {
+            Binding b = c->vars[read_variable(c, s->index_assign.name)];
+            ValueType it;
+            int i = expr(c, s->index_assign.index, -1, &it);
+            int v = expr(c, s->index_assign.expr, -1, &t);
+            check_index(b.type, it);
+            if (c->catch_jumps)
+                add_jump(c->catch_jumps, emit(c, I_CHECK_INDEX, b.reg, i, -1));
+            if (t == VAL_BOOL)
+                t = VAL_INT;
+            if (t != (b.type == VAL_INT_ARRAY ? VAL_INT : VAL_FLOAT)) {
+                compile_error("Element type mismatch in %s[...] =\n", s->index_assign.name);
+                compile_failed();
+            }
+            emit(c, I_STORE, b.reg, i, v);
+            break;
+        }
+        case STMT_OUTPUT: {
+            static const Opcode outputs[] = { I_OUT_INT, I_OUT_INT, I_OUT_FLOAT, I_OUT_INTS,
+                                              I_OUT_FLOATS };
+            int r = expr(c, s->output.expr, -1, &t);
+            emit(c, outputs[t], r, 0, 0);
+            break;
+        }
+        case STMT_IF: {
+            Expr* cond = s->if_stmt.cond;
+            if (cond->type == EXPR_BOOL || cond->type == EXPR_INT) {
+                // Like codegen, a constant condition compiles only the taken branch
+                block(c, cond->ival ? s->if_stmt.then_stmt : s->if_stmt.else_stmt);
+                break;
+            }
+            JumpList no = { NULL, 0, 0 };
+            cond_jump(c, cond, 0, &no);
+            block(c, s->if_stmt.then_stmt);
+            int done = emit(c, I_JUMP, -1, 0, 0);
+            patch(c, &no, here(c));
+            block(c, s->if_stmt.else_stmt);
+            set_target(c, done, here(c));
+            break;
+        }
+        case STMT_FOR:
+            for_loop(c, s);
+            break;
+        case STMT_FUNC_DECL:
+            function(s);
+            break;
+        case STMT_RETURN: {
+            if (self_tail_call(c, s->return_stmt.expr))
+                break;
+            int r = expr(c, s->return_stmt.expr, -1, &t);
+            check_return(c, t);
+            emit(c, I_RET, r, 0, 0);
+            break;
+        }
+        case STMT_TRY_CATCH: {
+            JumpList failed = { NULL, 0, 0 };
+            JumpList* outer = c->catch_jumps;
+            c->catch_jumps = &failed;
+            block(c, s->try_catch.try_stmt);
+            c->catch_jumps = NULL;
+            int done = emit(c, I_JUMP, -1, 0, 0);
+            patch(c, &failed, here(c));
+            // A failure inside catch is not caught again, as in codegen
+            block(c, s->try_catch.catch_stmt);
+            c->catch_jumps = outer;
+            set_target(c, done, here(c));
+            break;
+        }
+        case STMT_WHILE:
+            while_loop(c, s);
+            break;
+    }
+    error_leave(outer);
+}
+
+// Nothing after a return in the same list is reached
+static void statements(Compiler* c, StmtList list) {
+    for (int i = 0; i < list.count; i++) {
+        statement(c, list.stmts[i]);
+        if (list.stmts[i]->type == STMT_RETURN)
+            break;
+    }
+}
+
+static void block(Compiler* c, StmtList list) {
+    Scope scope = enter_scope(c);
+    statements(c, list);
+    leave_scope(c, scope);
+}
+
+/*
+ * Execution
+ */
+
+// Native code traps on these too, and the signal ends the program the same
+// way
+static _Noreturn void division_trap(void) {
+    raise(SIGFPE);
+    abort();
+}
+
+// Unchecked in compiled code outside try; here it stops the program
+static _Noreturn void index_error(int32_t index, int32_t length) {
+    chain_flush();
+    fprintf(stderr, "Array index %d out of range (length %d)\n", index, length);
+    exit(1);
+}
+
+static int32_t divide(int32_t a, int32_t b) {
+    if (b == 0 || (b == -1 && a == INT_MIN))
+        division_trap();
+    return a / b;
+}
+
+static void* allocate(int32_t count) {
+    void* data = calloc(count ? count : 1, sizeof(int32_t));
+    if (!data) {
+        fprintf(stderr, "Out of memory allocating an array of %d elements\n", count);
+        exit(1);
+    }
+    return data;
+}
+
+static int32_t int_element(BinOp op, int32_t a, int32_t b) {
+    switch (op) {
+        case OP_ADD: return (int32_t)((uint32_t)a + (uint32_t)b);
+        case OP_SUB: return (int32_t)((uint32_t)a - (uint32_t)b);
+        case OP_MUL: return (int32_t)((uint32_t)a * (uint32_t)b);
+        case OP_DIV: return divide(a, b);
+        case OP_EQ:  return a == b;
+        case OP_NE:  return a != b;
+        case OP_LT:  return a < b;
+        case OP_GT:  return a > b;
+        case OP_LE:  return a <= b;
+        case OP_GE:  return a >= b;
+        default:     return 0;
+    }
+}
+
+// Comparisons are ordered, so any comparison with NaN is 0 (!= included,
+// like LLVM's fcmp one)
+static void float_element(BinOp op, float a, float b, void* out) {
+    switch (op) {
+        case OP_ADD: *(float*)out = a + b; break;
+        case OP_SUB: *(float*)out = a - b; break;
+        case OP_MUL: *(float*)out = a * b; break;
+        case OP_DIV: *(float*)out = a / b; break;
+        case OP_EQ:  *(int32_t*)out = a == b; break;
+        case OP_NE:  *(int32_t*)out = a < b || a > b; break;
+        case OP_LT:  *(int32_t*)out = a < b; break;
+        case OP_GT:  *(int32_t*)out = a > b; break;
+        case OP_LE:  *(int32_t*)out = a <= b; break;
+        case OP_GE:  *(int32_t*)out = a >= b; break;
+        default:     break;
+    }
+}
+
+static Value array_op(int x, Value l, Value r) {
+    BinOp op = x & 0xf;
+    int leftArray = x & ARR_LEFT, rightArray = x & ARR_RIGHT;
+    int32_t length = leftArray ? l.arr.len : r.arr.len;
+    if (leftArray && rightArray && r.arr.len < length)
+        length = r.arr.len;
+    Value out;
+    out.arr.len = length;
+    out.arr.data = allocate(length);
+    int32_t* dst = out.arr.data;
+    for (int32_t k = 0; k < length; k++) {
+        if (x & ARR_FLOAT)
+            float_element(op, leftArray ? ((float*)l.arr.data)[k] : l.f,
+                          rightArray ? ((float*)r.arr.data)[k] : r.f, &dst[k]);
+        else
+            dst[k] = int_element(op, leftArray ? ((int32_t*)l.arr.data)[k] : l.i,
+                                 rightArray ? ((int32_t*)r.arr.data)[k] : r.i);
+    }
+    return out;
+}
+
+static float combine(int kind, float acc, float x) {
+    if (kind == RED_SUM)
+        return acc + x;
+    if (kind == RED_MIN)
+        return acc < x ? acc : x;
+    return acc > x ? acc : x;
+}
+
+// Float reductions add in the generated code's order (see
+// generate_array_builtin()): lane by lane, then the lanes, then the tail,
+// so the rounding matches
+static Value reduce(int x, Value v) {
+    int kind = x & 3;
+    int32_t length = v.arr.len;
+    Value out;
+    if (!(x & RED_FLOAT)) {
+        const int32_t* data = v.arr.data;
+        uint32_t sum = 0;
+        int32_t acc = kind == RED_MIN ? INT_MAX : INT_MIN;
+        for (int32_t k = 0; k < length; k++) {
+            sum += (uint32_t)data[k];
+            if (kind == RED_MIN ? data[k] < acc : data[k] > acc)
+                acc = data[k];
+        }
+        out.i = kind == RED_SUM ? (int32_t)sum : length ? acc : 0;
+        return out;
+    }
+    if (!lanes) {
+        char* features = LLVMGetHostCPUFeatures();
+        lanes = lanes_for_features(features);
+        LLVMDisposeMessage(features);
+    }
+    const float* data = v.arr.data;
+    float identity = kind == RED_SUM ? 0.0f : kind == RED_MIN ? (float)HUGE_VAL : (float)-HUGE_VAL;
+    float lane[16];
+    for (unsigned j = 0; j < lanes; j++)
+        lane[j] = identity;
+    int32_t vecEnd = length & ~(int32_t)(lanes - 1);
+    for (int32_t k = 0; k < vecEnd; k += lanes)
+        for (unsigned j = 0; j < lanes; j++)
+            lane[j] = combine(kind, lane[j], data[k + j]);
+    float acc = lane[0];
+    for (unsigned j = 1; j < lanes; j++)
+        acc = combine(kind, acc, lane[j]);
+    for (int32_t k = vecEnd; k < length; k++)
+        acc = combine(kind, acc, data[k]);
+    out.f = kind != RED_SUM && !length ? 0.0f : acc;
+    return out;
+}
+
+static Value execute(Function* f, Value* args);
+
+static int call_native(Function* f, Value* a) {
+    switch (f->arity) {
+        case 0: return ((int (*)(void))f->native)();
+        case 1: return ((int (*)(int))f->native)(a[0].i);
+        case 2: return ((int (*)(int, int))f->native)(a[0].i, a[1].i);
+        case 3: return ((int (*)(int, int, int))f->native)(a[0].i, a[1].i, a[2].i);
+        case 4: return ((int (*)(int, int, int, int))f->native)(a[0].i, a[1].i, a[2].i, a[3].i);
+        case 5: return ((int (*)(int, int, int, int, int))f->native)(a[0].i, a[1].i, a[2].i,
+                                                                      a[3].i, a[4].i);
+        default: return ((int (*)(int, int, int, int, int, int))f->native)(a[0].i, a[1].i, a[2].i,
+                                                                            a[3].i, a[4].i, a[5].i);
+    }
+}
+
+// Only all-int instances go native; the others keep their interpreted calls
+static int all_int(Function* f) {
+    int ints = f->ret == VAL_INT && f->arity <= MAX_NATIVE_ARGS;
+    for (int i = 0; i < f->arity; i++)
+        ints &= f->params[i] == VAL_INT;
+    return ints;
+}
+
+static Value call_function(Function* f, Value* args) {
+    if (f->native)
+        return (Value){ .i = call_native(f, args) };
+    if (tier_threshold && ++f->calls == tier_threshold && all_int(f)) {
+        f->native = tier_function(f->name);
+        return (Value){ .i = call_native(f, args) };
+    }
+    return execute(f, args);
+}
+
+// Runs the loop natively from its header; returns where to continue
+static int run_native_loop(HotLoop* loop, Value* regs, const Insn* header) {
+    if (!loop->native) {
+        loop->native = (int (*)(void**))tier_loop(loop->stmt, loop->vars, loop->count, loop->in_try);
+        loop->ptrs = malloc((loop->count + 1) * sizeof(void*));
+    }
+    // Native code never calls back into the interpreter, so one vars array
+    // per loop is enough even if its function recurses
+    for (int i = 0; i < loop->count; i++)
+        loop->ptrs[i] = &regs[loop->regs[i]];
+    return loop->native(loop->ptrs) ? header->c : header->b;
+}
+
+// Threaded dispatch: each handler jumps straight to the next one through
+// the label table rather than back to a central switch
+#define DISPATCH() goto *labels[pc->op]
+#define NEXT()     do { pc++; DISPATCH(); } while (0)
+#define JUMP(t)    do { pc = code + (t); DISPATCH(); } while (0)
+#define R(field)   regs[pc->field]
+
+static Value execute(Function* f, Value* args) {
+    static const void* const labels[I_COUNT] = {
+        [I_MOVE] = &&move, [I_CONST] = &&constant,
+        [I_ADD] = &&add, [I_SUB] = &&sub, [I_MUL] = &&mul, [I_DIV] = &&div, [I_ADDK] = &&addk,
+        [I_FADD] = &&fadd, [I_FSUB] = &&fsub, [I_FMUL] = &&fmul, [I_FDIV] = &&fdiv,
+        [I_EQ] = &&eq, [I_NE] = &&ne, [I_LT] = &&lt, [I_GT] = &&gt, [I_LE] = &&le, [I_GE] = &&ge,
+        [I_FEQ] = &&feq, [I_FNE] = &&fne, [I_FLT] = &&flt, [I_FGT] = &&fgt, [I_FLE] = &&fle,
+        [I_FGE] = &&fge,
+        [I_NOT] = &&not,
+        [I_JUMP] = &&jump, [I_JZ] = &&jz, [I_JNZ] = &&jnz,
+        [I_JEQ] = &&jeq, [I_JNE] = &&jne, [I_JLT] = &&jlt, [I_JGT] = &&jgt, [I_JLE] = &&jle,
+        [I_JGE] = &&jge, [I_JLEK] = &&jlek,
+        [I_CHECK_ZERO] = &&check_zero, [I_CHECK_INDEX] = &&check_index,
+        [I_CALL] = &&call, [I_RET] = &&ret, [I_RET0] = &&ret0,
+        [I_OUT_INT] = &&out_int, [I_OUT_FLOAT] = &&out_float, [I_OUT_INTS] = &&out_ints,
+        [I_OUT_FLOATS] = &&out_floats,
+        [I_NEW_ARRAY] = &&new_array, [I_ARRAY] = &&array, [I_LEN] = &&len, [I_INDEX] = &&index,
+        [I_STORE] = &&store, [I_ARRAY_OP] = &&array_op, [I_REDUCE] = &&reduce, [I_INPUT] = &&input,
+        [I_TIER_LOOP] = &&tier_loop,
+    };
+    Value regs[f->nregs ? f->nregs : 1];
+    if (f->arity)
+        memcpy(regs, args, f->arity * sizeof(Value));
+    const Insn* code = f->code;
+    const Insn* pc = code;
+    DISPATCH();
+
+move:     R(a) = R(b); NEXT();
+constant: R(a).i = pc->b; NEXT();
+add:      R(a).i = (int32_t)((uint32_t)R(b).i + (uint32_t)R(c).i); NEXT();
+sub:      R(a).i = (int32_t)((uint32_t)R(b).i - (uint32_t)R(c).i); NEXT();
+mul:      R(a).i = (int32_t)((uint32_t)R(b).i * (uint32_t)R(c).i); NEXT();
+div:      R(a).i = divide(R(b).i, R(c).i); NEXT();
+addk:     R(a).i = (int32_t)((uint32_t)R(b).i + (uint32_t)pc->c); NEXT();
+fadd:     R(a).f = R(b).f + R(c).f; NEXT();
+fsub:     R(a).f = R(b).f - R(c).f; NEXT();
+fmul:     R(a).f = R(b).f * R(c).f; NEXT();
+fdiv:     R(a).f = R(b).f / R(c).f; NEXT();
+eq:       R(a).i = R(b).i == R(c).i; NEXT();
+ne:       R(a).i = R(b).i != R(c).i; NEXT();
+lt:       R(a).i = R(b).i < R(c).i; NEXT();
+gt:       R(a).i = R(b).i > R(c).i; NEXT();
+le:       R(a).i = R(b).i <= R(c).i; NEXT();
+ge:       R(a).i = R(b).i >= R(c).i; NEXT();
+feq:      R(a).i = R(b).f == R(c).f; NEXT();
+fne:      R(a).i = R(b).f < R(c).f || R(b).f > R(c).f; NEXT();
+flt:      R(a).i = R(b).f < R(c).f; NEXT();
+fgt:      R(a).i = R(b).f > R(c).f; NEXT();
+fle:      R(a).i = R(b).f <= R(c).f; NEXT();
+fge:      R(a).i = R(b).f >= R(c).f; NEXT();
+not:      R(a).i = R(b).i == 0; NEXT();
+jump:     JUMP(pc->a);
+jz:       if (!R(a).i) JUMP(pc->b); NEXT();
+jnz:      if (R(a).i) JUMP(pc->b); NEXT();
+jeq:      if (R(a).i == R(b).i) JUMP(pc->c); NEXT();
+jne:      if (R(a).i != R(b).i) JUMP(pc->c); NEXT();
+jlt:      if (R(a).i < R(b).i) JUMP(pc->c); NEXT();
+jgt:      if (R(a).i > R(b).i) JUMP(pc->c); NEXT();
+jle:      if (R(a).i <= R(b).i) JUMP(pc->c); NEXT();
+jge:      if (R(a).i >= R(b).i) JUMP(pc->c); NEXT();
+jlek:     if (R(a).i <= pc->b) JUMP(pc->c); NEXT();
+check_zero:
+    if (!R(a).i)
+        JUMP(pc->b);
+    NEXT();
+check_index:
+    if ((uint32_t)R(b).i >= (uint32_t)R(a).arr.len)
+        JUMP(pc->c);
+    NEXT();
+call:
+    R(a) = call_function(functions[pc->b], &R(c));
+    NEXT();
+ret:
+    return R(a);
+ret0:
+    return (Value){ .i = 0 };
+out_int:   chain_output_int(R(a).i); NEXT();
+out_float: chain_output_float(R(a).f); NEXT();
+out_ints:
+    for (int32_t k = 0; k < R(a).arr.len; k++)
+        chain_output_int(((int32_t*)R(a).arr.data)[k]);
+    NEXT();
+out_floats:
+    for (int32_t k = 0; k < R(a).arr.len; k++)
+        chain_output_float(((float*)R(a).arr.data)[k]);
+    NEXT();
+new_array: {
+    int32_t length = R(b).i < 0 ? 0 : R(b).i;
+    R(a).arr.data = allocate(length);
+    R(a).arr.len = length;
+    NEXT();
+}
+array: {
+    int32_t* data = allocate(pc->c);
+    for (int k = 0; k < pc->c; k++)
+        data[k] = regs[pc->b + k].i;
+    R(a).arr.len = pc->c;
+    R(a).arr.data = data;
+    NEXT();
+}
+len: R(a).i = R(b).arr.len; NEXT();
+index: {
+    int32_t i = R(c).i;
+    if ((uint32_t)i >= (uint32_t)R(b).arr.len)
+        index_error(i, R(b).arr.len);
+    R(a).i = ((int32_t*)R(b).arr.data)[i];
+    NEXT();
+}
+store: {
+    int32_t i = R(b).i;
+    if ((uint32_t)i >= (uint32_t)R(a).arr.len)
+        index_error(i, R(a).arr.len);
+    ((int32_t*)R(a).arr.data)[i] = R(c).i;
+    NEXT();
+}
+array_op: R(a) = array_op(pc->x, R(b), R(c)); NEXT();
+reduce:   R(a) = reduce(pc->x, R(b)); NEXT();
+input:
+    switch (pc->x) {
+        case INPUT_INT:   R(a).i = chain_input_int(); break;
+        case INPUT_FLOAT: R(a).f = chain_input_float(); break;
+        case INPUT_MORE:  R(a).i = chain_has_input(); break;
+        default: {
+            int32_t length = R(b).i < 0 ? 0 : R(b).i;
+            void* data = allocate(length);
+            R(a).arr.len = pc->x == INPUT_INTS ? chain_read_ints(data, length) : chain_read_floats(data, length);
+            R(a).arr.data = data;
+            break;
+        }
+    }
+    NEXT();
+tier_loop: {
+    HotLoop* loop = &loops[pc->a];
+    if (!loop->native && ++loop->iterations < tier_threshold)
+        NEXT();
+    JUMP(run_native_loop(loop, regs, pc));
+}
+}
+
+#undef R
+
+// Compiles the whole program, then runs main; returns main's result, which
+// is the exit status
+int interpret_program(StmtList program) {
+    phase_begin(PHASE_CODEGEN);
+    Function* main = new_function("main", 0);
+    main->ret = VAL_INT;
+    Compiler top = { .fn = main };
+    statements(&top, program);
+    emit(&top, I_RET0, 0, 0, 0);
+    free(top.vars);
+    table_free(&top.names);
+    free(top.open_loops);
+    phase_end(PHASE_CODEGEN);
+
+    if (tier_threshold)
+        tier_begin(program);
+    phase_begin(PHASE_RUN);
+    int status = execute(main, NULL).i;
+    chain_flush();
+    phase_end(PHASE_RUN);
+    tier_end();
+
+    for (int i = 0; i < function_count; i++) {
+        free(functions[i]->params);
+        free(functions[i]->code);
+        free(functions[i]);
+    }
+    for (int i = 0; i < loop_count; i++) {
+        free(loops[i].vars);
+        free(loops[i].regs);
+        free(loops[i].ptrs);
+    }
+    free(main->code);
+    free(main);
+    free(functions);
+    free(declared);
+    table_free(&declared_names);
+    free(loops);
+    functions = NULL;
+    declared = NULL;
+    loops = NULL;
+    function_count = function_cap = declared_count = declared_cap = loop_count = loop_cap = 0;
+    return status;
+}
@@ -1,58 +1,710 @@
 #include "pLLVM.h"
+#include "chainrt.h"
 #include <llvm-c/Core.h>
 #include <llvm-c/Analysis.h>
+#include <llvm-c/BitReader.h>
+#include <llvm-c/BitWriter.h>
 #include <llvm-c/ExecutionEngine.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Linker.h>
+#include <llvm-c/Orc.h>
 #include <llvm-c/Target.h>
 #include <llvm-c/TargetMachine.h>
 #include <llvm-c/Transforms/Scalar.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-Symbol         symtab[128];
-int            symcount = 0;
-LLVMBuilderRef builder;
-LLVMContextRef context;
-LLVMModuleRef  module;
-LLVMValueRef   currentFunction;
-LLVMValueRef   printfFn;
-StmtList       global_program;
+_Thread_local LLVMBuilderRef builder;
+_Thread_local LLVMContextRef context;
+_Thread_local LLVMModuleRef  module;
+_Thread_local LLVMModuleRef  mainModule;
+_Thread_local LLVMValueRef   currentFunction;
+_Thread_local LLVMTargetMachineRef targetMachine;
+_Thread_local StmtList global_program;
+int            opt_level = 0;
+int            opt_report = 0;
+int            run_jit = 0;
+int            ssa_mode = 0;
+int            exit_status = 0;
+EmitFormat     emit_format = EMIT_LL;
+_Thread_local const char* output_path = NULL;
+int            codegen_jobs = 1;
 
-void init_codegen() {
+extern char **environ;
+
+// chainrt.c, built into executables that call the runtime. $CHAINRT
+// overrides it; a relative -DCHAINRT_SOURCE is found next to the chainlang
+// binary, so the compiler works from any directory
+#ifndef CHAINRT_SOURCE
+#define CHAINRT_SOURCE "chainrt.c"
+#endif
+
+// Runtime entry points: --run binds them to the copies linked into chainlang
+static const struct {
+    const char* name;
+    void*       address;
+} runtime_symbols[] = {
+    { "chain_parallel_for", (void*)chain_parallel_for },
+    { "chain_output_int",   (void*)chain_output_int },
+    { "chain_output_long",  (void*)chain_output_long },
+    { "chain_output_float", (void*)chain_output_float },
+    { "chain_flush",        (void*)chain_flush },
+    { "chain_has_input",    (void*)chain_has_input },
+    { "chain_input_int",    (void*)chain_input_int },
+    { "chain_input_float",  (void*)chain_input_float },
+    { "chain_read_ints",    (void*)chain_read_ints },
+    { "chain_read_floats",  (void*)chain_read_floats },
+    { "chain_profile_write", (void*)chain_profile_write },
+    { "chain_out_of_memory", (void*)chain_out_of_memory },
+};
+#define RUNTIME_SYMBOL_COUNT (sizeof(runtime_symbols) / sizeof(runtime_symbols[0]))
+
+// A user function generated into its own module: in --run mode so the JIT
+// can compile it lazily on first call, and with -j so a worker thread can
+// generate it in a private context
+typedef struct {
+    Stmt*                       decl;
+    LLVMModuleRef               module;
+    LLVMOrcThreadSafeContextRef jitContext;  // module's own context (-j), or NULL for the shared one
+    LLVMMemoryBufferRef         bitcode;     // worker output to link into mainModule
+    int                         optimized;   // already verified and optimized by its worker
+} FunctionUnit;
+
+static _Thread_local FunctionUnit* units = NULL;
+static _Thread_local int           unit_count = 0;
+static _Thread_local int           unit_cap = 0;
+static _Thread_local LLVMOrcThreadSafeContextRef jitContext;
+
+// -j: functions declared in the main program, in program order, and an
+// open-addressing name -> index map over them. Owned by the thread
+// compiling the program; its workers copy the table, which is fixed while
+// they run (see WorkerShare)
+static _Thread_local FunctionUnit* jobs = NULL;
+static _Thread_local int           job_count = 0;
+static _Thread_local int           job_cap = 0;
+static _Thread_local int*          job_map = NULL;
+static _Thread_local int           job_map_cap = 0;
+
+typedef struct {
+    FunctionUnit* jobs;
+    int           job_count;
+    int*          job_map;
+    int           job_map_cap;
+    atomic_int    next_job;
+    atomic_int    failed;     // a job hit a compile error; the others stop
+    int           recover;    // errors unwind (batch mode) instead of exiting
+    const char*   source;     // the input's name, for -g and --opt-report
+} WorkerShare;
+
+// On a worker, the number of jobs whose prototypes are visible (those
+// declared up to and including the one being generated); 0 on the main thread
+static _Thread_local int visible_jobs = 0;
+
+// The instance being generated (main_instance for main), whose slots give
+// each let its type; NULL in a loop --tier compiles
+static _Thread_local Instance* currentInstance;
+
+// Builds allocas at the top of the current function's entry block
+static _Thread_local LLVMBuilderRef allocaBuilder;
+
+// main has its return, and has been verified and optimized (on its own, with
+// --cache, or loaded already optimized from the cache)
+static _Thread_local int main_finished = 0;
+
+static LLVMModuleRef create_module(const char* name) {
+    LLVMModuleRef m = LLVMModuleCreateWithNameInContext(name, context);
+    char *triple = LLVMGetTargetMachineTriple(targetMachine);
+    LLVMTargetDataRef layout = LLVMCreateTargetDataLayout(targetMachine);
+    LLVMSetTarget(m, triple);
+    LLVMSetModuleDataLayout(m, layout);
+    LLVMDisposeTargetData(layout);
+    LLVMDisposeMessage(triple);
+    return m;
+}
+
+static void verify_module(LLVMModuleRef m) {
+    char *err = NULL;
+    if (LLVMVerifyModule(m, LLVMReturnStatusAction, &err)) {
+        fprintf(stderr, "Verification failed:\n%s\n", err);
+        LLVMDisposeMessage(err);
+        compile_failed();
+    }
+    LLVMDisposeMessage(err);
+}
+
+static void check_jit_error(LLVMErrorRef err, const char* what) {
+    if (!err)
+        return;
+    char *msg = LLVMGetErrorMessage(err);
+    fprintf(stderr, "JIT error (%s): %s\n", what, msg);
+    LLVMDisposeErrorMessage(msg);
+    exit(1);
+}
+
+// Targets the host CPU so the optimizer's cost model (and vectorizer) see
+// the real feature set
+static LLVMTargetMachineRef create_target_machine(void) {
+    char *triple = LLVMGetDefaultTargetTriple();
+    char *cpu = LLVMGetHostCPUName();
+    char *features = LLVMGetHostCPUFeatures();
+    LLVMTargetRef target;
+    char *err = NULL;
+    if (LLVMGetTargetFromTriple(triple, &target, &err)) {
+        fprintf(stderr, "Target lookup failed: %s\n", err);
+        LLVMDisposeMessage(err);
+        exit(1);
+    }
+    LLVMCodeGenOptLevel cgLevel = opt_level == 0 ? LLVMCodeGenLevelNone
+                                : opt_level == 1 ? LLVMCodeGenLevelLess
+                                : opt_level == 2 ? LLVMCodeGenLevelDefault
+                                                 : LLVMCodeGenLevelAggressive;
+    LLVMTargetMachineRef tm = LLVMCreateTargetMachine(target, triple, cpu, features, cgLevel,
+                                                      LLVMRelocPIC, LLVMCodeModelDefault);
+    LLVMDisposeMessage(triple);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(features);
+    return tm;
+}
+
+// Once per process, before any thread generates code
+void init_target(void) {
     LLVMInitializeNativeTarget();
     LLVMInitializeNativeAsmPrinter();
     LLVMInitializeNativeAsmParser();
-    context = LLVMContextCreate();
-    module = LLVMModuleCreateWithNameInContext("chainlang", context);
+}
+
+// Every thread that generates code has its own target machine, kept for all
+// the programs (or -j functions) it compiles
+void begin_codegen_thread(void) {
+    targetMachine = create_target_machine();
+}
+
+void end_codegen_thread(void) {
+    if (targetMachine)
+        LLVMDisposeTargetMachine(targetMachine);
+    targetMachine = NULL;
+    free_symtab();
+    merge_thread_stats();
+}
+
+// Per program: a fresh context and main module
+void init_codegen() {
+    main_finished = 0;
+    if (run_jit) {
+        // The JIT takes shared ownership of the context through the modules
+        jitContext = LLVMOrcCreateNewThreadSafeContext();
+        context = LLVMOrcThreadSafeContextGetContext(jitContext);
+    } else {
+        context = LLVMContextCreate();
+    }
+
+    module = mainModule = create_module("chainlang");
     builder = LLVMCreateBuilderInContext(context);
-    LLVMTypeRef i8Ptr = LLVMPointerType(LLVMInt8TypeInContext(context), 0);
-    LLVMTypeRef printfTy = LLVMFunctionType(LLVMInt32TypeInContext(context), &i8Ptr, 1, 1);
-    printfFn = LLVMAddFunction(module, "printf", printfTy);
-    LLVMSetLinkage(printfFn, LLVMExternalLinkage);
+    allocaBuilder = LLVMCreateBuilderInContext(context);
     LLVMTypeRef mainTy = LLVMFunctionType(LLVMInt32TypeInContext(context), NULL, 0, 0);
     LLVMValueRef mainFn = LLVMAddFunction(module, "main", mainTy);
     currentFunction = mainFn;
     LLVMBasicBlockRef entryBB = LLVMAppendBasicBlockInContext(context, mainFn, "entry");
     LLVMPositionBuilderAtEnd(builder, entryBB);
+    debug_begin_module(mainModule);
+    debug_begin_function(mainFn, 1);
 }
 
-void finalize_codegen() {
+// The JIT --run and --tier use: every user function sits behind a lazy
+// call-through stub, so a function body is only compiled the first time it
+// is actually called
+typedef struct {
+    LLVMOrcLLJITRef                  jit;
+    LLVMOrcJITDylibRef               dylib;
+    LLVMOrcLazyCallThroughManagerRef callThrough;
+    LLVMOrcIndirectStubsManagerRef   stubs;
+} LazyJIT;
+
+static void start_lazy_jit(LazyJIT* lj) {
+    LLVMOrcLLJITRef jit;
+    check_jit_error(LLVMOrcCreateLLJIT(&jit, create_jit_builder()), "create");
+    LLVMOrcExecutionSessionRef session = LLVMOrcLLJITGetExecutionSession(jit);
+    LLVMOrcJITDylibRef dylib = LLVMOrcLLJITGetMainJITDylib(jit);
+    const char* triple = LLVMOrcLLJITGetTripleString(jit);
+
+    // Resolve malloc and friends from the compiler process itself
+    LLVMOrcDefinitionGeneratorRef processSymbols;
+    check_jit_error(LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(
+                        &processSymbols, LLVMOrcLLJITGetGlobalPrefix(jit), NULL, NULL),
+                    "process symbols");
+    LLVMOrcJITDylibAddGenerator(dylib, processSymbols);
+
+    // chainlang does not export its own symbols, so the runtime is defined
+    // explicitly rather than found by the process generator
+    LLVMJITCSymbolMapPair runtime[RUNTIME_SYMBOL_COUNT];
+    for (size_t i = 0; i < RUNTIME_SYMBOL_COUNT; i++) {
+        runtime[i].Name = LLVMOrcLLJITMangleAndIntern(jit, runtime_symbols[i].name);
+        runtime[i].Sym.Address = (LLVMOrcJITTargetAddress)(uintptr_t)runtime_symbols[i].address;
+        runtime[i].Sym.Flags.GenericFlags = LLVMJITSymbolGenericFlagsExported |
+                                            LLVMJITSymbolGenericFlagsCallable;
+        runtime[i].Sym.Flags.TargetFlags = 0;
+    }
+    check_jit_error(LLVMOrcJITDylibDefine(dylib, LLVMOrcAbsoluteSymbols(runtime, RUNTIME_SYMBOL_COUNT)),
+                    "runtime symbols");
+
+    LLVMOrcLazyCallThroughManagerRef callThrough;
+    check_jit_error(LLVMOrcCreateLocalLazyCallThroughManager(triple, session, 0, &callThrough),
+                    "call-through manager");
+    LLVMOrcIndirectStubsManagerRef stubs = LLVMOrcCreateLocalIndirectStubsManager(triple);
+
+    // f is exported as a stub that compiles and jumps to f.impl. A unit
+    // holds one instance of its function (--run), or all of them (-j)
+    int alias_count = 0;
+    for (int i = 0; i < unit_count; i++)
+        for (Instance* inst = units[i].decl->func_decl.instances; inst; inst = inst->next)
+            alias_count++;
+    LLVMOrcCSymbolAliasMapPairs aliases = malloc((alias_count + 1) * sizeof(*aliases));
+    alias_count = 0;
+    for (int i = 0; i < unit_count; i++) {
+        for (Instance* inst = units[i].decl->func_decl.instances; inst; inst = inst->next) {
+            const char* name = inst->symbol;
+            LLVMValueRef fn = LLVMGetNamedFunction(units[i].module, name);
+            if (!fn || LLVMIsDeclaration(fn))
+                continue;
+            char* impl = malloc(strlen(name) + sizeof(".impl"));
+            sprintf(impl, "%s.impl", name);
+            LLVMOrcCSymbolAliasMapPair* alias = &aliases[alias_count++];
+            alias->Name = LLVMOrcLLJITMangleAndIntern(jit, name);
+            alias->Entry.Name = LLVMOrcLLJITMangleAndIntern(jit, impl);
+            alias->Entry.Flags.GenericFlags = LLVMJITSymbolGenericFlagsExported |
+                                              LLVMJITSymbolGenericFlagsCallable;
+            alias->Entry.Flags.TargetFlags = 0;
+            LLVMSetValueName2(fn, impl, strlen(impl));
+            free(impl);
+        }
+        LLVMOrcThreadSafeContextRef tsc = units[i].jitContext ? units[i].jitContext : jitContext;
+        check_jit_error(LLVMOrcLLJITAddLLVMIRModule(jit, dylib,
+                            LLVMOrcCreateNewThreadSafeModule(units[i].module, tsc)),
+                        "add function");
+        // The module now holds the only reference a worker context needs
+        if (units[i].jitContext)
+            LLVMOrcDisposeThreadSafeContext(units[i].jitContext);
+    }
+    if (alias_count > 0)
+        check_jit_error(LLVMOrcJITDylibDefine(dylib,
+                            LLVMOrcLazyReexports(callThrough, stubs, dylib, aliases, alias_count)),
+                        "lazy reexports");
+    free(aliases);
+    *lj = (LazyJIT){ jit, dylib, callThrough, stubs };
+}
+
+static void stop_lazy_jit(LazyJIT* lj) {
+    write_perf_map();
+    // Stubs and the call-through manager go first, as in LLVM's own LLLazyJIT;
+    // tearing them down after the session corrupts the heap
+    LLVMOrcDisposeIndirectStubsManager(lj->stubs);
+    LLVMOrcDisposeLazyCallThroughManager(lj->callThrough);
+    check_jit_error(LLVMOrcDisposeLLJIT(lj->jit), "dispose");
+}
+
+// Compiles main eagerly and runs it
+static int run_in_jit(void) {
+    LazyJIT lj;
+    start_lazy_jit(&lj);
+    check_jit_error(LLVMOrcLLJITAddLLVMIRModule(lj.jit, lj.dylib,
+                        LLVMOrcCreateNewThreadSafeModule(mainModule, jitContext)),
+                    "add main");
+    LLVMOrcJITTargetAddress mainAddr;
+    check_jit_error(LLVMOrcLLJITLookup(lj.jit, &mainAddr, "main"), "lookup main");
+
+    int (*mainPtr)(void) = (int (*)(void))(uintptr_t)mainAddr;
+    int status = mainPtr();
+    chain_flush();
+    stop_lazy_jit(&lj);
+    return status;
+}
+
+// Ends main with return 0 if it falls off the end, then verifies and
+// optimizes it
+static void finish_main(void) {
     LLVMBasicBlockRef BB = LLVMGetInsertBlock(builder);
     if (!LLVMGetBasicBlockTerminator(BB))
         LLVMBuildRet(builder, LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0));
-    char *err = NULL;
-    if (LLVMVerifyModule(module, LLVMReturnStatusAction, &err)) {
-        fprintf(stderr, "Verification failed:\n%s\n", err);
-        LLVMDisposeMessage(err);
-        exit(1);
+    profile_end_function();
+    profile_finish_main();
+    debug_end_module();
+    phase_begin(PHASE_VERIFY);
+    verify_module(mainModule);
+    phase_end(PHASE_VERIFY);
+    if (opt_level > 0) {
+        phase_begin(PHASE_OPTIMIZE);
+        optimize_module(mainModule);
+        phase_end(PHASE_OPTIMIZE);
     }
-    if (LLVMPrintModuleToFile(module, "output.ll", &err) != 0) {
-        fprintf(stderr, "Error writing IR:\n%s\n", err);
-        LLVMDisposeMessage(err);
-        exit(1);
+    main_finished = 1;
+}
+
+void finalize_codegen() {
+    if (!main_finished)
+        finish_main();
+    phase_begin(PHASE_VERIFY);
+    for (int i = 0; i < unit_count; i++)
+        if (!units[i].optimized)
+            verify_module(units[i].module);
+    phase_end(PHASE_VERIFY);
+    if (opt_level > 0) {
+        phase_begin(PHASE_OPTIMIZE);
+        for (int i = 0; i < unit_count; i++)
+            if (!units[i].optimized)
+                optimize_module(units[i].module);
+        phase_end(PHASE_OPTIMIZE);
+        count_generated(mainModule, 1);
+        for (int i = 0; i < unit_count; i++)
+            count_generated(units[i].module, 1);
     }
     LLVMDisposeBuilder(builder);
+    LLVMDisposeBuilder(allocaBuilder);
+    builder = allocaBuilder = NULL;
+    free_symtab();
+    if (run_jit) {
+        phase_begin(PHASE_RUN);
+        exit_status = run_in_jit();
+        phase_end(PHASE_RUN);
+        free(units);
+        units = NULL;
+        unit_count = unit_cap = 0;
+        LLVMOrcDisposeThreadSafeContext(jitContext);
+        return;
+    }
+    phase_begin(PHASE_EMIT);
+    emit_output(mainModule);
+    phase_end(PHASE_EMIT);
     LLVMContextDispose(context);
+    context = NULL;
+}
+
+// 0 after reporting an error, so the caller can clean up before failing
+static int emit_object(LLVMModuleRef m, const char* path) {
+    char *err = NULL;
+    if (LLVMTargetMachineEmitToFile(targetMachine, m, (char*)path, LLVMObjectFile, &err)) {
+        fprintf(stderr, "Error writing object file:\n%s\n", err);
+        LLVMDisposeMessage(err);
+        return 0;
+    }
+    return 1;
+}
+
+static int uses_runtime(LLVMModuleRef m) {
+    for (LLVMValueRef f = LLVMGetFirstFunction(m); f; f = LLVMGetNextFunction(f)) {
+        size_t len;
+        if (LLVMIsDeclaration(f) && !strncmp(LLVMGetValueName2(f, &len), "chain_", 6))
+            return 1;
+    }
+    return 0;
+}
+
+// Where chainrt.c is: see CHAINRT_SOURCE. NULL after reporting that it is
+// missing
+static const char* runtime_source(void) {
+    static char path[4096];
+    const char* rt = getenv("CHAINRT");
+    if (!rt || !*rt) {
+        rt = CHAINRT_SOURCE;
+        ssize_t len = rt[0] == '/' ? -1 : readlink("/proc/self/exe", path, sizeof(path) - 1);
+        if (len > 0) {
+            path[len] = '\0';
+            char* slash = strrchr(path, '/');
+            if (slash && (size_t)(slash + 1 - path) + strlen(rt) < sizeof(path)) {
+                strcpy(slash + 1, rt);
+                rt = path;
+            }
+        }
+    }
+    if (access(rt, R_OK) != 0) {
+        fprintf(stderr, "Runtime source %s not found; set $CHAINRT to its path\n", rt);
+        return NULL;
+    }
+    return rt;
+}
+
+// Links a single object into an executable with the system C compiler
+// driver, which knows where the C runtime and libc live; 0 if that failed
+static int link_executable(const char* objPath, const char* exePath, int runtime) {
+    const char* cc = getenv("CC");
+    if (!cc || !*cc)
+        cc = "cc";
+    const char* rt = runtime ? runtime_source() : NULL;
+    if (runtime && !rt)
+        return 0;
+    char* argv[10] = { (char*)cc, (char*)objPath };
+    int argc = 2;
+    if (runtime) {
+        argv[argc++] = "-O2";
+        argv[argc++] = (char*)rt;
+    }
+    argv[argc++] = "-o";
+    argv[argc++] = (char*)exePath;
+    argv[argc++] = "-lm";
+    if (runtime)
+        argv[argc++] = "-lpthread";
+    pid_t pid;
+    int status;
+    if (posix_spawnp(&pid, cc, NULL, NULL, argv, environ) != 0 ||
+        waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error linking executable with %s\n", cc);
+        return 0;
+    }
+    return 1;
+}
+
+void emit_output(LLVMModuleRef m) {
+    char *err = NULL;
+    switch (emit_format) {
+        case EMIT_LL: {
+            const char* path = output_path ? output_path : "output.ll";
+            if (LLVMPrintModuleToFile(m, path, &err) != 0) {
+                fprintf(stderr, "Error writing IR:\n%s\n", err);
+                LLVMDisposeMessage(err);
+                compile_failed();
+            }
+            break;
+        }
+        case EMIT_BC: {
+            const char* path = output_path ? output_path : "output.bc";
+            if (LLVMWriteBitcodeToFile(m, path) != 0) {
+                fprintf(stderr, "Error writing bitcode to %s\n", path);
+                compile_failed();
+            }
+            break;
+        }
+        case EMIT_OBJ:
+            if (!emit_object(m, output_path ? output_path : "output.o"))
+                compile_failed();
+            break;
+        case EMIT_EXE: {
+            char objPath[] = "/tmp/chainlangXXXXXX.o";
+            int fd = mkstemps(objPath, 2);
+            if (fd < 0) {
+                perror("mkstemps");
+                compile_failed();
+            }
+            close(fd);
+            int linked = emit_object(m, objPath) &&
+                         link_executable(objPath, output_path ? output_path : "a.out", uses_runtime(m));
+            unlink(objPath);
+            if (!linked)
+                compile_failed();
+            break;
+        }
+    }
+}
+
+// The LLVM type of values inference gave kind; unknown is int
+static LLVMTypeRef kind_type(TypeKind kind) {
+    switch (kind) {
+        case TY_BOOL:        return LLVMInt1TypeInContext(context);
+        case TY_LONG:        return LLVMInt64TypeInContext(context);
+        case TY_FLOAT:       return LLVMFloatTypeInContext(context);
+        case TY_INT_ARRAY:   return array_type(LLVMInt32TypeInContext(context));
+        case TY_FLOAT_ARRAY: return array_type(LLVMFloatTypeInContext(context));
+        default:             return LLVMInt32TypeInContext(context);
+    }
+}
+
+static TypeKind value_kind(LLVMTypeRef ty) {
+    if (ty == LLVMInt1TypeInContext(context))
+        return TY_BOOL;
+    if (ty == LLVMInt32TypeInContext(context))
+        return TY_INT;
+    if (ty == LLVMInt64TypeInContext(context))
+        return TY_LONG;
+    if (ty == LLVMFloatTypeInContext(context))
+        return TY_FLOAT;
+    if (ty == array_type(LLVMInt32TypeInContext(context)))
+        return TY_INT_ARRAY;
+    if (ty == array_type(LLVMFloatTypeInContext(context)))
+        return TY_FLOAT_ARRAY;
+    return TY_NONE;
+}
+
+static const char* type_name(LLVMTypeRef ty) {
+    static const char* names[] = { "?", "bool", "int", "long", "float", "int array", "float array" };
+    return names[value_kind(ty)];
+}
+
+static LLVMTypeRef function_type(Instance* inst) {
+    int param_count = inst->decl->func_decl.params.count;
+    LLVMTypeRef* param_types = malloc((param_count + 1) * sizeof(LLVMTypeRef));
+    for (int i = 0; i < param_count; i++)
+        param_types[i] = kind_type(inst->params[i]);
+    LLVMTypeRef func_type = LLVMFunctionType(kind_type(inst->ret), param_types, param_count, 0);
+    free(param_types);
+    return func_type;
+}
+
+static int find_job(const char* name) {
+    if (!job_map_cap)
+        return -1;
+    unsigned i = hash_name(name) & (job_map_cap - 1);
+    while (job_map[i] >= 0) {
+        if (jobs[job_map[i]].decl->func_decl.name == name)
+            return job_map[i];
+        i = (i + 1) & (job_map_cap - 1);
+    }
+    return -1;
+}
+
+// The parameter count of the prototype a call to name resolves to on a
+// worker, or -1 if it is not visible; part of a function's --cache key
+int callee_arity(const char* name) {
+    int index = find_job(name);
+    return index >= 0 && index < visible_jobs ? jobs[index].decl->func_decl.params.count : -1;
+}
+
+// Declares inst in m with what pure.c found: a pure instance reads and
+// writes no memory (a memo function's own table aside) and cannot unwind
+static LLVMValueRef add_instance(LLVMModuleRef m, Instance* inst) {
+    LLVMValueRef fn = LLVMAddFunction(m, inst->symbol, function_type(inst));
+    if (inst->pure) {
+        add_function_attribute(fn, "nounwind");
+        if (!inst->decl->func_decl.memo)
+            add_function_attribute(fn, "readnone");
+        if (inst->decl->func_decl.returns)
+            add_function_attribute(fn, "willreturn");
+    }
+    return fn;
+}
+
+LLVMValueRef get_instance(Instance* inst) {
+    const char* name = inst->symbol;
+    LLVMValueRef func = LLVMGetNamedFunction(module, name);
+    if (!func && module != mainModule) {
+        // Declared in its own module; import the prototype
+        if (LLVMGetNamedFunction(mainModule, name))
+            func = add_instance(module, inst);
+    }
+    if (!func && visible_jobs) {
+        // Generated on another worker; only earlier declarations are visible
+        int index = find_job(inst->decl->func_decl.name);
+        if (index >= 0 && index < visible_jobs)
+            func = add_instance(module, inst);
+    }
+    if (!func) {
+        compile_error("Undefined function: %s\n", inst->decl->func_decl.name);
+        compile_failed();
+    }
+    return func;
+}
+
+// The instance of decl (what name resolved to) that takes args
+static Instance* called_instance(Stmt* decl, const char* name, const TypeKind* args, int count) {
+    if (!decl) {
+        compile_error("Undefined function: %s\n", name);
+        compile_failed();
+    }
+    if (decl->func_decl.params.count != count) {
+        compile_error("Function %s takes %d arguments\n", name, decl->func_decl.params.count);
+        compile_failed();
+    }
+    Instance* inst = find_instance(decl, args);
+    if (!inst) {
+        compile_error("Function %s has no version for these argument types\n", name);
+        compile_failed();
+    }
+    return inst;
+}
+
+int count_instructions(LLVMModuleRef m) {
+    int n = 0;
+    for (LLVMValueRef fn = LLVMGetFirstFunction(m); fn; fn = LLVMGetNextFunction(fn))
+        for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(fn); bb; bb = LLVMGetNextBasicBlock(bb))
+            for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst; inst = LLVMGetNextInstruction(inst))
+                n++;
+    return n;
+}
+
+static void run_pipeline(LLVMModuleRef m) {
+    // default<On> is the standard new-pass-manager pipeline: SROA/mem2reg,
+    // instcombine, GVN, LICM, inlining, loop unrolling and vectorization
+    char passes[16];
+    snprintf(passes, sizeof(passes), "default<O%d>", opt_level);
+
+    LLVMPassBuilderOptionsRef opts = LLVMCreatePassBuilderOptions();
+    LLVMPassBuilderOptionsSetLoopUnrolling(opts, opt_level >= 2);
+    LLVMPassBuilderOptionsSetLoopVectorization(opts, opt_level >= 2);
+    LLVMPassBuilderOptionsSetLoopInterleaving(opts, opt_level >= 2);
+    LLVMPassBuilderOptionsSetSLPVectorization(opts, opt_level >= 2);
+    LLVMErrorRef err = LLVMRunPasses(m, passes, targetMachine, opts);
+    LLVMDisposePassBuilderOptions(opts);
+    if (err) {
+        char *msg = LLVMGetErrorMessage(err);
+        fprintf(stderr, "Optimization failed:\n%s\n", msg);
+        LLVMDisposeErrorMessage(msg);
+        compile_failed();
+    }
+}
+
+void optimize_module(LLVMModuleRef m) {
+    int before = count_instructions(m);
+    run_pipeline(m);
+    if (opt_report) {
+        int after = count_instructions(m);
+        fprintf(stderr, "-O%d: %d -> %d instructions (%+d)\n",
+                opt_level, before, after, after - before);
+    }
+}
+
+void add_function_attribute(LLVMValueRef fn, const char* name) {
+    unsigned kind = LLVMGetEnumAttributeKindForName(name, strlen(name));
+    LLVMAddAttributeAtIndex(fn, LLVMAttributeFunctionIndex, LLVMCreateEnumAttribute(context, kind, 0));
+}
+
+// Declares a chainrt.c entry point in the current module on first use
+LLVMValueRef get_runtime_function(const char* name, LLVMTypeRef type) {
+    LLVMValueRef fn = LLVMGetNamedFunction(module, name);
+    return fn ? fn : LLVMAddFunction(module, name, type);
+}
+
+// output of a scalar appends one line to the runtime's output buffer
+void generate_output_value(LLVMValueRef val) {
+    LLVMTypeRef ty = LLVMTypeOf(val);
+    if (ty == LLVMInt1TypeInContext(context)) {
+        ty = LLVMInt32TypeInContext(context);
+        val = LLVMBuildZExt(builder, val, ty, "");
+    }
+    LLVMTypeRef fnTy = LLVMFunctionType(LLVMVoidTypeInContext(context), &ty, 1, 0);
+    const char* name = ty == LLVMFloatTypeInContext(context) ? "chain_output_float"
+                     : ty == LLVMInt64TypeInContext(context) ? "chain_output_long"
+                                                             : "chain_output_int";
+    LLVMBuildCall2(builder, fnTy, get_runtime_function(name, fnTy), &val, 1, "");
+}
+
+InputKind input_builtin(const char* name, int args) {
+    if (args == 0)
+        return !strcmp(name, "input")       ? INPUT_INT
+             : !strcmp(name, "input_float") ? INPUT_FLOAT
+             : !strcmp(name, "has_input")   ? INPUT_MORE
+                                            : INPUT_NONE;
+    if (args == 1)
+        return !strcmp(name, "read_ints")   ? INPUT_INTS
+             : !strcmp(name, "read_floats") ? INPUT_FLOATS
+                                            : INPUT_NONE;
+    return INPUT_NONE;
+}
+
+// The next number, whether there is one, or an array of up to count of them
+LLVMValueRef generate_input(InputKind kind, LLVMValueRef count) {
+    if (kind == INPUT_INTS || kind == INPUT_FLOATS)
+        return generate_array_input(kind == INPUT_FLOATS, count);
+    LLVMTypeRef ty = kind == INPUT_FLOAT ? LLVMFloatTypeInContext(context) : LLVMInt32TypeInContext(context);
+    LLVMTypeRef fnTy = LLVMFunctionType(ty, NULL, 0, 0);
+    const char* name = kind == INPUT_FLOAT ? "chain_input_float"
+                     : kind == INPUT_MORE  ? "chain_has_input"
+                                           : "chain_input_int";
+    return LLVMBuildCall2(builder, fnTy, get_runtime_function(name, fnTy), NULL, 0, "input");
 }
 
 LLVMValueRef create_int(int n) {
@@ -63,54 +715,655 @@ LLVMValueRef create_float(float f) {
     return LLVMConstReal(LLVMFloatTypeInContext(context), f);
 }
 
+// Allocas all live in the entry block, so a let inside a loop reuses one
+// stack slot instead of growing the frame every iteration, and mem2reg can
+// promote every variable
+static LLVMValueRef create_entry_alloca(LLVMTypeRef ty, const char* name) {
+    LLVMBasicBlockRef entry = LLVMGetEntryBasicBlock(currentFunction);
+    LLVMValueRef first = LLVMGetFirstInstruction(entry);
+    if (first)
+        LLVMPositionBuilderBefore(allocaBuilder, first);
+    else
+        LLVMPositionBuilderAtEnd(allocaBuilder, entry);
+    // Not the location of whatever it was last positioned before, which
+    // may be in another function
+    LLVMSetCurrentDebugLocation2(allocaBuilder, LLVMGetCurrentDebugLocation2(builder));
+    return LLVMBuildAlloca(allocaBuilder, ty, name);
+}
+
+// Inside an outlined parallel for body: the bindings holding each chunk's
+// partial sums, which the body may only add to
+typedef struct {
+    int* reductions;   // symtab.symbols index of each accumulator
+    int* fields;       // its env field
+    int  count;
+} ParallelRegion;
+
+static _Thread_local ParallelRegion* currentRegion = NULL;
+
+static int is_reduction(int index) {
+    for (int i = 0; currentRegion && i < currentRegion->count; i++)
+        if (currentRegion->reductions[i] == index)
+            return 1;
+    return 0;
+}
+
+static LLVMValueRef read_binding(int index) {
+    Symbol* sym = &symtab.symbols[index];
+    if (ssa_mode)
+        return sym->ptr;
+    return LLVMBuildLoad2(builder, LLVMGetElementType(LLVMTypeOf(sym->ptr)), sym->ptr, sym->name);
+}
+
+static LLVMTypeRef binding_type(int index) {
+    LLVMTypeRef ty = LLVMTypeOf(symtab.symbols[index].ptr);
+    return ssa_mode ? ty : LLVMGetElementType(ty);
+}
+
+// val as a variable, parameter or result of type ty holds it: bools widen
+// to ints and ints to 64 bits; NULL if it does not fit
+static LLVMValueRef convert_value(LLVMValueRef val, LLVMTypeRef ty) {
+    LLVMTypeRef from = LLVMTypeOf(val);
+    if (from == ty)
+        return val;
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+    if (from == LLVMInt1TypeInContext(context) && (ty == LLVMInt32TypeInContext(context) || ty == i64))
+        return LLVMBuildZExt(builder, val, ty, "");
+    if (from == LLVMInt32TypeInContext(context) && ty == i64)
+        return LLVMBuildSExt(builder, val, ty, "");
+    return NULL;
+}
+
+static LLVMValueRef convert_to(LLVMValueRef val, LLVMTypeRef ty, const char* what) {
+    LLVMValueRef converted = convert_value(val, ty);
+    if (!converted) {
+        compile_error("Type mismatch: %s is %s, not %s\n", what, type_name(ty),
+                type_name(LLVMTypeOf(val)));
+        compile_failed();
+    }
+    return converted;
+}
+
+static void write_binding(int index, LLVMValueRef val) {
+    if (ssa_mode)
+        symtab.symbols[index].ptr = val;
+    else
+        LLVMBuildStore(builder, val, symtab.symbols[index].ptr);
+}
+
 LLVMValueRef get_variable(const char* name) {
-    for (int i = 0; i < symcount; i++) {
-        if (!strcmp(symtab[i].name, name)) {
-            return LLVMBuildLoad2(builder, LLVMGetElementType(LLVMTypeOf(symtab[i].ptr)), symtab[i].ptr, name);
-        }
+    int index = lookup_variable_index(name);
+    if (index < 0) {
+        compile_error("Undefined variable: %s\n", name);
+        compile_failed();
     }
-    fprintf(stderr, "Undefined variable: %s\n", name);
-    exit(1);
+    if (is_reduction(index)) {
+        compile_error("%s can only be updated as %s = %s + ... inside parallel for\n",
+                name, name, name);
+        compile_failed();
+    }
+    return read_binding(index);
 }
 
 void declare_variable(const char* name, LLVMValueRef val) {
+    if (ssa_mode) {
+        bind_variable(name, val);
+        return;
+    }
     LLVMTypeRef ty = LLVMTypeOf(val);
-    LLVMValueRef ptr = LLVMBuildAlloca(builder, ty, name);
+    LLVMValueRef ptr = create_entry_alloca(ty, name);
     LLVMBuildStore(builder, val, ptr);
-    symtab[symcount++] = (Symbol){ strdup(name), ptr };
+    bind_variable(name, ptr);
+}
+
+static void assign_variable(const char* name, LLVMValueRef val) {
+    int index = lookup_variable_index(name);
+    if (index < 0) {
+        compile_error("Undefined variable: %s\n", name);
+        compile_failed();
+    }
+    write_binding(index, convert_to(val, binding_type(index), name));
+}
+
+/*
+ * --ssa mode: variables are bound straight to SSA values. Every construct
+ * that joins control flow (if.merge, loop headers, try/catch) first collects
+ * the names its body assigns, and only those outer bindings get phi nodes.
+ */
+
+typedef struct {
+    int*          index;     // symtab.symbols index of each joined binding
+    LLVMValueRef* phi;
+    int           count;
+} PhiSet;
+
+typedef struct TryContext {
+    LLVMBasicBlockRef catchBB;
+    PhiSet            phis;  // catch-entry phis fed by each division check
+} TryContext;
+
+static _Thread_local TryContext* currentTry = NULL;
+
+static void push_name(const char*** names, int* count, int* cap, const char* name) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        *names = realloc(*names, *cap * sizeof(const char*));
+    }
+    (*names)[(*count)++] = name;
+}
+
+static void collect_assigned(StmtList list, const char*** names, int* count, int* cap) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_ASSIGN:
+                push_name(names, count, cap, s->assign.name);
+                break;
+            case STMT_IF:
+                collect_assigned(s->if_stmt.then_stmt, names, count, cap);
+                collect_assigned(s->if_stmt.else_stmt, names, count, cap);
+                break;
+            case STMT_FOR:
+                collect_assigned(s->for_stmt.body, names, count, cap);
+                break;
+            case STMT_WHILE:
+                collect_assigned(s->while_stmt.body, names, count, cap);
+                break;
+            case STMT_TRY_CATCH:
+                collect_assigned(s->try_catch.try_stmt, names, count, cap);
+                collect_assigned(s->try_catch.catch_stmt, names, count, cap);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static int compare_int(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+// Resolves names to the distinct bindings they currently refer to, in
+// binding order
+static PhiSet resolve_bindings(const char** names, int count) {
+    PhiSet set = { malloc((count + 1) * sizeof(int)), malloc((count + 1) * sizeof(LLVMValueRef)), 0 };
+    for (int i = 0; i < count; i++) {
+        int index = lookup_variable_index(names[i]);
+        if (index >= 0)
+            set.index[set.count++] = index;
+    }
+    qsort(set.index, set.count, sizeof(int), compare_int);
+    int unique = 0;
+    for (int i = 0; i < set.count; i++)
+        if (!unique || set.index[unique - 1] != set.index[i])
+            set.index[unique++] = set.index[i];
+    set.count = unique;
+    return set;
+}
+
+static PhiSet assigned_bindings(StmtList a, StmtList b) {
+    const char** names = NULL;
+    int count = 0, cap = 0;
+    collect_assigned(a, &names, &count, &cap);
+    collect_assigned(b, &names, &count, &cap);
+    PhiSet set = resolve_bindings(names, count);
+    free(names);
+    return set;
+}
+
+static void snapshot_values(PhiSet* set, LLVMValueRef* out) {
+    for (int i = 0; i < set->count; i++)
+        out[i] = symtab.symbols[set->index[i]].ptr;
+}
+
+static void restore_values(PhiSet* set, LLVMValueRef* vals) {
+    for (int i = 0; i < set->count; i++)
+        symtab.symbols[set->index[i]].ptr = vals[i];
+}
+
+// Creates a phi per binding at the start of header, seeded with the current
+// value flowing in from pred (if any), and rebinds the variables to them
+static void begin_phis(PhiSet* set, LLVMBasicBlockRef header, LLVMBasicBlockRef pred) {
+    LLVMBasicBlockRef saved = LLVMGetInsertBlock(builder);
+    LLVMPositionBuilderAtEnd(builder, header);
+    for (int i = 0; i < set->count; i++) {
+        Symbol* sym = &symtab.symbols[set->index[i]];
+        set->phi[i] = LLVMBuildPhi(builder, LLVMTypeOf(sym->ptr), sym->name);
+        if (pred)
+            LLVMAddIncoming(set->phi[i], &sym->ptr, &pred, 1);
+        sym->ptr = set->phi[i];
+    }
+    LLVMPositionBuilderAtEnd(builder, saved);
+}
+
+static void add_incoming(PhiSet* set, LLVMBasicBlockRef pred) {
+    for (int i = 0; i < set->count; i++)
+        LLVMAddIncoming(set->phi[i], &symtab.symbols[set->index[i]].ptr, &pred, 1);
+}
+
+// Rebinds the variables to their phis and folds away phis whose incoming
+// values are all the same (ignoring self-references) or that have none
+static void finish_phis(PhiSet* set) {
+    for (int i = 0; i < set->count; i++) {
+        LLVMValueRef phi = set->phi[i];
+        LLVMValueRef same = NULL;
+        int trivial = 1;
+        for (unsigned j = 0; j < LLVMCountIncoming(phi); j++) {
+            LLVMValueRef v = LLVMGetIncomingValue(phi, j);
+            if (v == phi || v == same)
+                continue;
+            if (same) {
+                trivial = 0;
+                break;
+            }
+            same = v;
+        }
+        if (trivial) {
+            // No incoming values at all means the block is unreachable
+            if (!same)
+                same = LLVMGetUndef(LLVMTypeOf(phi));
+            LLVMReplaceAllUsesWith(phi, same);
+            LLVMInstructionEraseFromParent(phi);
+            phi = same;
+        }
+        symtab.symbols[set->index[i]].ptr = phi;
+    }
+}
+
+static void free_phis(PhiSet* set) {
+    free(set->index);
+    free(set->phi);
+}
+
+// Joins the values live at the end of two branches into mergeBB
+static void merge_values(PhiSet* set, LLVMBasicBlockRef mergeBB,
+                         LLVMValueRef* a, LLVMBasicBlockRef aBB,
+                         LLVMValueRef* b, LLVMBasicBlockRef bBB) {
+    LLVMPositionBuilderAtEnd(builder, mergeBB);
+    for (int i = 0; i < set->count; i++) {
+        Symbol* sym = &symtab.symbols[set->index[i]];
+        if (aBB && bBB && a[i] != b[i]) {
+            LLVMValueRef phi = LLVMBuildPhi(builder, LLVMTypeOf(a[i]), sym->name);
+            LLVMAddIncoming(phi, &a[i], &aBB, 1);
+            LLVMAddIncoming(phi, &b[i], &bBB, 1);
+            sym->ptr = phi;
+        } else if (aBB) {
+            sym->ptr = a[i];
+        } else if (bBB) {
+            sym->ptr = b[i];
+        }
+    }
+}
+
+// The whole pipeline runs as one loop: each element of the range flows
+// through every stage into the sink before the next one is produced, so no
+// intermediate sequence is ever materialized
+static LLVMValueRef generate_pipeline(Expr* e, LLVMBasicBlockRef catchBB) {
+    if (e->pipeline.sink == SINK_NONE) {
+        compile_error("Pipeline must end in sum or count\n");
+        compile_failed();
+    }
+    StageList stages = e->pipeline.stages;
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMValueRef* funcs = malloc((stages.count + 1) * sizeof(LLVMValueRef));
+    for (int i = 0; i < stages.count; i++) {
+        Stage* stage = &stages.stages[i];
+        if (stage->decl && stage->decl->func_decl.params.count != 1) {
+            compile_error("Pipeline stage function must take one argument: %s\n", stage->func_name);
+            compile_failed();
+        }
+        TypeKind arg = TY_INT;
+        funcs[i] = get_instance(called_instance(stage->decl, stage->func_name, &arg, 1));
+        if (LLVMGetReturnType(LLVMGetElementType(LLVMTypeOf(funcs[i]))) != i32) {
+            compile_error("Pipeline stage function must return an int: %s\n", stage->func_name);
+            compile_failed();
+        }
+    }
+
+    LLVMValueRef from = generate_expression(e->pipeline.from, catchBB);
+    LLVMValueRef to = generate_expression(e->pipeline.to, catchBB);
+    LLVMValueRef zero = LLVMConstInt(i32, 0, 0);
+    LLVMBasicBlockRef preBB = LLVMGetInsertBlock(builder);
+    LLVMBasicBlockRef condBB = LLVMAppendBasicBlockInContext(context, currentFunction, "pipe.cond");
+    LLVMBasicBlockRef bodyBB = LLVMAppendBasicBlockInContext(context, currentFunction, "pipe.body");
+    LLVMBasicBlockRef nextBB = LLVMAppendBasicBlockInContext(context, currentFunction, "pipe.next");
+    LLVMBasicBlockRef endBB = LLVMAppendBasicBlockInContext(context, currentFunction, "pipe.end");
+    LLVMBuildBr(builder, condBB);
+
+    // Like for, the range is inclusive
+    LLVMPositionBuilderAtEnd(builder, condBB);
+    LLVMValueRef index = LLVMBuildPhi(builder, i32, "pipe.i");
+    LLVMValueRef acc = LLVMBuildPhi(builder, i32, "pipe.acc");
+    LLVMAddIncoming(index, &from, &preBB, 1);
+    LLVMAddIncoming(acc, &zero, &preBB, 1);
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntSLE, index, to, "pipe.more"), bodyBB, endBB);
+
+    // Rejected elements skip to pipe.next with the accumulator unchanged
+    LLVMPositionBuilderAtEnd(builder, nextBB);
+    LLVMValueRef nextAcc = LLVMBuildPhi(builder, i32, "pipe.acc.next");
+    LLVMPositionBuilderAtEnd(builder, bodyBB);
+    LLVMValueRef value = index;
+    for (int i = 0; i < stages.count; i++) {
+        LLVMValueRef call = LLVMBuildCall2(builder, LLVMGetElementType(LLVMTypeOf(funcs[i])),
+                                           funcs[i], &value, 1, "");
+        if (stages.stages[i].kind == STAGE_MAP) {
+            value = call;
+            continue;
+        }
+        LLVMBasicBlockRef keepBB = LLVMAppendBasicBlockInContext(context, currentFunction, "pipe.keep");
+        LLVMValueRef keep = LLVMBuildICmp(builder, LLVMIntNE, call, zero, "pipe.keep");
+        LLVMBasicBlockRef here = LLVMGetInsertBlock(builder);
+        LLVMBuildCondBr(builder, keep, keepBB, nextBB);
+        LLVMAddIncoming(nextAcc, &acc, &here, 1);
+        LLVMPositionBuilderAtEnd(builder, keepBB);
+    }
+    LLVMValueRef step = e->pipeline.sink == SINK_SUM ? value : LLVMConstInt(i32, 1, 0);
+    LLVMValueRef updated = LLVMBuildAdd(builder, acc, step, "pipe.acc");
+    LLVMBasicBlockRef here = LLVMGetInsertBlock(builder);
+    LLVMBuildBr(builder, nextBB);
+    LLVMAddIncoming(nextAcc, &updated, &here, 1);
+
+    LLVMPositionBuilderAtEnd(builder, nextBB);
+    LLVMValueRef nextIndex = LLVMBuildAdd(builder, index, LLVMConstInt(i32, 1, 0), "pipe.i.next");
+    LLVMBuildBr(builder, condBB);
+    LLVMAddIncoming(index, &nextIndex, &nextBB, 1);
+    LLVMAddIncoming(acc, &nextAcc, &nextBB, 1);
+
+    LLVMPositionBuilderAtEnd(builder, endBB);
+    free(funcs);
+    return acc;
+}
+
+// Runtime errors inside try: jumps to catchBB when fail holds, otherwise
+// continues in a new block
+void branch_to_catch(LLVMValueRef fail, LLVMBasicBlockRef catchBB, const char* name) {
+    LLVMBasicBlockRef okBB = LLVMAppendBasicBlockInContext(context, currentFunction, name);
+    // The catch block is shared, so failures are counted here
+    int failSite = profile_site_if(fail);
+    LLVMValueRef branch = LLVMBuildCondBr(builder, fail, catchBB, okBB);
+    if (ssa_mode && currentTry && currentTry->catchBB == catchBB)
+        add_incoming(&currentTry->phis, LLVMGetInsertBlock(builder));
+    LLVMPositionBuilderAtEnd(builder, okBB);
+    profile_weights(branch, failSite, profile_site());
+}
+
+/*
+ * memo function: each instance has a direct-mapped table of MEMO_SLOTS
+ *     { i32 seq, arguments..., result }
+ * entries, indexed by a hash of the arguments, which are compared as
+ * integers (floats by their bits). An entry is a seqlock, since parallel
+ * for bodies may call the function at once: a writer takes an even seq to
+ * odd, stores, and releases it as the next even number; a reader only takes
+ * what it read between two equal even seqs. Slot conflicts replace the
+ * older result.
+ */
+#define MEMO_BITS  12
+#define MEMO_SLOTS (1 << MEMO_BITS)
+
+typedef struct {
+    LLVMTypeRef   type;     // the entry
+    LLVMValueRef  entry;    // this call's
+    LLVMValueRef* keys;     // the arguments, as integers
+    int           count;
+} MemoEntry;
+
+static _Thread_local MemoEntry* currentMemo;   // NULL outside memo functions
+
+static LLVMValueRef memo_bits(LLVMValueRef val) {
+    if (LLVMTypeOf(val) != LLVMFloatTypeInContext(context))
+        return val;
+    return LLVMBuildBitCast(builder, val, LLVMInt32TypeInContext(context), "");
+}
+
+static LLVMValueRef memo_field(MemoEntry* m, int field) {
+    return LLVMBuildStructGEP2(builder, m->type, m->entry, field, "");
+}
+
+static LLVMValueRef memo_load(MemoEntry* m, int field, LLVMAtomicOrdering order) {
+    LLVMValueRef load = LLVMBuildLoad2(builder, LLVMStructGetTypeAtIndex(m->type, field),
+                                       memo_field(m, field), "");
+    LLVMSetOrdering(load, order);
+    return load;
+}
+
+static void memo_store(MemoEntry* m, int field, LLVMValueRef val, LLVMAtomicOrdering order) {
+    LLVMSetOrdering(LLVMBuildStore(builder, val, memo_field(m, field)), order);
+}
+
+// Returns the remembered result if this call's entry holds one
+static MemoEntry* begin_memo(Instance* inst, LLVMValueRef func) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+    MemoEntry* m = malloc(sizeof(MemoEntry));
+    m->count = inst->decl->func_decl.params.count;
+    m->keys = malloc((m->count + 1) * sizeof(LLVMValueRef));
+    LLVMTypeRef* fields = malloc((m->count + 2) * sizeof(LLVMTypeRef));
+    fields[0] = i32;
+    LLVMValueRef hash = LLVMConstNull(i64);
+    for (int i = 0; i < m->count; i++) {
+        m->keys[i] = memo_bits(LLVMGetParam(func, i));
+        fields[i + 1] = LLVMTypeOf(m->keys[i]);
+        LLVMValueRef wide = LLVMTypeOf(m->keys[i]) == i64 ? m->keys[i]
+                          : LLVMBuildZExt(builder, m->keys[i], i64, "");
+        hash = LLVMBuildMul(builder, LLVMBuildXor(builder, hash, wide, ""),
+                            LLVMConstInt(i64, 0x9e3779b97f4a7c15ull, 0), "memo.hash");
+    }
+    LLVMTypeRef ret = kind_type(inst->ret);
+    fields[m->count + 1] = ret == LLVMFloatTypeInContext(context) ? i32 : ret;
+    m->type = LLVMStructTypeInContext(context, fields, m->count + 2, 0);
+    free(fields);
+
+    char* name = malloc(strlen(inst->symbol) + sizeof(".memo"));
+    sprintf(name, "%s.memo", inst->symbol);
+    LLVMTypeRef tableType = LLVMArrayType(m->type, MEMO_SLOTS);
+    LLVMValueRef table = LLVMAddGlobal(module, tableType, name);
+    free(name);
+    LLVMSetInitializer(table, LLVMConstNull(tableType));
+    LLVMSetLinkage(table, LLVMInternalLinkage);
+    LLVMValueRef index[] = {
+        LLVMConstNull(i64), LLVMBuildLShr(builder, hash, LLVMConstInt(i64, 64 - MEMO_BITS, 0), "")
+    };
+    m->entry = LLVMBuildInBoundsGEP2(builder, tableType, table, index, 2, "memo.entry");
+
+    LLVMValueRef seq = memo_load(m, 0, LLVMAtomicOrderingAcquire);
+    LLVMValueRef hit = LLVMBuildAnd(builder,
+        LLVMBuildICmp(builder, LLVMIntNE, seq, LLVMConstNull(i32), ""),
+        LLVMBuildICmp(builder, LLVMIntEQ, LLVMBuildAnd(builder, seq, LLVMConstInt(i32, 1, 0), ""),
+                      LLVMConstNull(i32), ""), "");
+    for (int i = 0; i < m->count; i++)
+        hit = LLVMBuildAnd(builder, hit,
+                           LLVMBuildICmp(builder, LLVMIntEQ,
+                                         memo_load(m, i + 1, LLVMAtomicOrderingMonotonic),
+                                         m->keys[i], ""), "");
+    LLVMValueRef result = memo_load(m, m->count + 1, LLVMAtomicOrderingMonotonic);
+    LLVMBuildFence(builder, LLVMAtomicOrderingAcquire, 0, "");
+    LLVMValueRef again = memo_load(m, 0, LLVMAtomicOrderingMonotonic);
+    hit = LLVMBuildAnd(builder, hit, LLVMBuildICmp(builder, LLVMIntEQ, seq, again, ""), "memo.hit");
+
+    LLVMBasicBlockRef hitBB = LLVMAppendBasicBlockInContext(context, func, "memo.hit");
+    LLVMBasicBlockRef missBB = LLVMAppendBasicBlockInContext(context, func, "memo.miss");
+    LLVMBuildCondBr(builder, hit, hitBB, missBB);
+    LLVMPositionBuilderAtEnd(builder, hitBB);
+    LLVMBuildRet(builder, ret == LLVMTypeOf(result) ? result
+                                                    : LLVMBuildBitCast(builder, result, ret, ""));
+    LLVMPositionBuilderAtEnd(builder, missBB);
+    return m;
+}
+
+// Stores val in this call's entry, unless another call is writing it
+static void store_memo(MemoEntry* m, LLVMValueRef val) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMBasicBlockRef claimBB = LLVMAppendBasicBlockInContext(context, currentFunction, "memo.claim");
+    LLVMBasicBlockRef writeBB = LLVMAppendBasicBlockInContext(context, currentFunction, "memo.write");
+    LLVMBasicBlockRef doneBB = LLVMAppendBasicBlockInContext(context, currentFunction, "memo.done");
+    LLVMValueRef seq = memo_load(m, 0, LLVMAtomicOrderingMonotonic);
+    LLVMValueRef busy = LLVMBuildAnd(builder, seq, LLVMConstInt(i32, 1, 0), "");
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntNE, busy, LLVMConstNull(i32), ""),
+                    doneBB, claimBB);
+    LLVMPositionBuilderAtEnd(builder, claimBB);
+    LLVMValueRef claim = LLVMBuildAtomicCmpXchg(builder, memo_field(m, 0), seq,
+                                                LLVMBuildAdd(builder, seq, LLVMConstInt(i32, 1, 0), ""),
+                                                LLVMAtomicOrderingAcquire,
+                                                LLVMAtomicOrderingMonotonic, 0);
+    LLVMBuildCondBr(builder, LLVMBuildExtractValue(builder, claim, 1, ""), writeBB, doneBB);
+    LLVMPositionBuilderAtEnd(builder, writeBB);
+    for (int i = 0; i < m->count; i++)
+        memo_store(m, i + 1, m->keys[i], LLVMAtomicOrderingMonotonic);
+    memo_store(m, m->count + 1, memo_bits(val), LLVMAtomicOrderingMonotonic);
+    memo_store(m, 0, LLVMBuildAdd(builder, seq, LLVMConstInt(i32, 2, 0), ""),
+               LLVMAtomicOrderingRelease);
+    LLVMBuildBr(builder, doneBB);
+    LLVMPositionBuilderAtEnd(builder, doneBB);
+}
+
+static void generate_return(LLVMValueRef val) {
+    if (currentMemo)
+        store_memo(currentMemo, val);
+    LLVMBuildRet(builder, val);
+}
+
+/*
+ * Tail calls. `return f(...)` from f's own instance rebinds the parameters
+ * and branches back to a header after the entry block, so self-recursion
+ * runs in constant stack at every -O level. Other calls in return position
+ * whose result is returned unchanged are marked tail, which lets the
+ * backend turn them into jumps. Memo functions keep plain calls: their
+ * result is stored after the call returns.
+ */
+typedef struct {
+    LLVMBasicBlockRef header;
+    PhiSet            params;   // the parameters' bindings; --ssa joins them in header
+} TailLoop;
+
+static _Thread_local TailLoop* currentTail;     // NULL unless the function calls itself last
+static _Thread_local Expr*     tailCall;        // the call a return is generating
+
+static int calls_itself_last(StmtList list, Stmt* decl) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_RETURN: {
+                Expr* e = s->return_stmt.expr;
+                if (e->type == EXPR_FUNC_CALL && e->func_call.decl == decl)
+                    return 1;
+                break;
+            }
+            case STMT_IF:
+                if (calls_itself_last(s->if_stmt.then_stmt, decl) ||
+                    calls_itself_last(s->if_stmt.else_stmt, decl))
+                    return 1;
+                break;
+            case STMT_FOR:
+                if (calls_itself_last(s->for_stmt.body, decl))
+                    return 1;
+                break;
+            case STMT_WHILE:
+                if (calls_itself_last(s->while_stmt.body, decl))
+                    return 1;
+                break;
+            case STMT_TRY_CATCH:
+                if (calls_itself_last(s->try_catch.try_stmt, decl) ||
+                    calls_itself_last(s->try_catch.catch_stmt, decl))
+                    return 1;
+                break;
+            default:
+                break;
+        }
+    }
+    return 0;
+}
+
+static TailLoop* begin_tail_loop(Stmt* decl) {
+    TailLoop* loop = malloc(sizeof(TailLoop));
+    int count = decl->func_decl.params.count;
+    loop->params = (PhiSet){ malloc((count + 1) * sizeof(int)), malloc((count + 1) * sizeof(LLVMValueRef)), count };
+    for (int i = 0; i < count; i++)
+        loop->params.index[i] = lookup_variable_index(decl->func_decl.params.args[i]);
+    LLVMBasicBlockRef entry = LLVMGetInsertBlock(builder);
+    loop->header = LLVMAppendBasicBlockInContext(context, currentFunction, "tailrecurse");
+    LLVMBuildBr(builder, loop->header);
+    if (ssa_mode)
+        begin_phis(&loop->params, loop->header, entry);
+    LLVMPositionBuilderAtEnd(builder, loop->header);
+    return loop;
+}
+
+static void end_tail_loop(TailLoop* loop) {
+    if (ssa_mode)
+        finish_phis(&loop->params);
+    free_phis(&loop->params);
+    free(loop);
+}
+
+static void tail_call_remark(Expr* e, Instance* callee, const char* what) {
+    if (opt_report)
+        fprintf(stderr, "%s:%d:%d: tail call to %s %s\n", debug_source ? debug_source : "<stdin>",
+                e->line, e->column, callee->symbol, what);
 }
 
-LLVMValueRef generate_expression(Expr* e, LLVMBasicBlockRef catchBB) {
+// The parameters take the arguments (all evaluated first) and the function
+// starts over
+static void generate_tail_loop(Expr* e, LLVMValueRef* args) {
+    PhiSet* params = &currentTail->params;
+    LLVMValueRef* vals = malloc((params->count + 1) * sizeof(LLVMValueRef));
+    for (int i = 0; i < params->count; i++)
+        vals[i] = convert_to(args[i], kind_type(currentInstance->vars[i]),
+                             currentInstance->decl->func_decl.params.args[i]);
+    if (ssa_mode) {
+        LLVMValueRef* saved = malloc((params->count + 1) * sizeof(LLVMValueRef));
+        snapshot_values(params, saved);
+        restore_values(params, vals);
+        add_incoming(params, LLVMGetInsertBlock(builder));
+        restore_values(params, saved);
+        free(saved);
+    } else {
+        for (int i = 0; i < params->count; i++)
+            LLVMBuildStore(builder, vals[i], symtab.symbols[params->index[i]].ptr);
+    }
+    free(vals);
+    LLVMBuildBr(builder, currentTail->header);
+    tail_loops++;
+    tail_call_remark(e, currentInstance, "runs as a loop");
+}
+
+static LLVMValueRef generate_node(Expr* e, LLVMBasicBlockRef catchBB) {
     switch (e->type) {
         case EXPR_INT:
             return create_int(e->ival);
         case EXPR_FLOAT:
             return create_float(e->fval);
+        case EXPR_LONG:
+            return LLVMConstInt(LLVMInt64TypeInContext(context), e->lval, 1);
+        case EXPR_BOOL:
+            return LLVMConstInt(LLVMInt1TypeInContext(context), e->ival, 0);
         case EXPR_VAR:
             return get_variable(e->var_name);
         case EXPR_BINOP: {
-            if (!strcmp(e->binop.op, "&&")) {
-                LLVMBasicBlockRef thenBB = LLVMAppendBasicBlock(currentFunction, "and.then");
-                LLVMBasicBlockRef elseBB = LLVMAppendBasicBlock(currentFunction, "and.else");
-                LLVMBasicBlockRef mergeBB = LLVMAppendBasicBlock(currentFunction, "and.merge");
+            if (e->binop.op == OP_AND) {
+                LLVMBasicBlockRef thenBB = LLVMAppendBasicBlockInContext(context, currentFunction, "and.then");
+                LLVMBasicBlockRef elseBB = LLVMAppendBasicBlockInContext(context, currentFunction, "and.else");
+                LLVMBasicBlockRef mergeBB = LLVMAppendBasicBlockInContext(context, currentFunction, "and.merge");
 
                 // Evaluate left operand and ensure it’s i1
                 LLVMValueRef left = generate_expression(e->binop.left, catchBB);
                 if (LLVMTypeOf(left) != LLVMInt1TypeInContext(context)) {
-                    left = LLVMBuildICmp(builder, LLVMIntNE, left, LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0), "tobool");
+                    left = LLVMBuildICmp(builder, LLVMIntNE, left, LLVMConstNull(LLVMTypeOf(left)), "tobool");
                 }
-                LLVMBuildCondBr(builder, left, thenBB, elseBB);
+                LLVMValueRef branch = LLVMBuildCondBr(builder, left, thenBB, elseBB);
 
                 // Then branch: evaluate right operand and ensure it’s i1
                 LLVMPositionBuilderAtEnd(builder, thenBB);
+                int thenSite = profile_site();
                 LLVMValueRef right = generate_expression(e->binop.right, catchBB);
                 if (LLVMTypeOf(right) != LLVMInt1TypeInContext(context)) {
-                    right = LLVMBuildICmp(builder, LLVMIntNE, right, LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0), "tobool");
+                    right = LLVMBuildICmp(builder, LLVMIntNE, right, LLVMConstNull(LLVMTypeOf(right)), "tobool");
                 }
+                thenBB = LLVMGetInsertBlock(builder);
                 LLVMBuildBr(builder, mergeBB);
 
                 // Else branch: constant false (i1)
                 LLVMPositionBuilderAtEnd(builder, elseBB);
+                profile_weights(branch, thenSite, profile_site());
                 LLVMValueRef falseVal = LLVMConstInt(LLVMInt1TypeInContext(context), 0, 0);
                 LLVMBuildBr(builder, mergeBB);
 
@@ -120,29 +1373,32 @@ LLVMValueRef generate_expression(Expr* e, LLVMBasicBlockRef catchBB) {
                 LLVMAddIncoming(phi, &right, &thenBB, 1);
                 LLVMAddIncoming(phi, &falseVal, &elseBB, 1);
                 return phi;
-            } else if (!strcmp(e->binop.op, "||")) {
-                LLVMBasicBlockRef thenBB = LLVMAppendBasicBlock(currentFunction, "or.then");
-                LLVMBasicBlockRef elseBB = LLVMAppendBasicBlock(currentFunction, "or.else");
-                LLVMBasicBlockRef mergeBB = LLVMAppendBasicBlock(currentFunction, "or.merge");
+            } else if (e->binop.op == OP_OR) {
+                LLVMBasicBlockRef thenBB = LLVMAppendBasicBlockInContext(context, currentFunction, "or.then");
+                LLVMBasicBlockRef elseBB = LLVMAppendBasicBlockInContext(context, currentFunction, "or.else");
+                LLVMBasicBlockRef mergeBB = LLVMAppendBasicBlockInContext(context, currentFunction, "or.merge");
 
                 // Evaluate left operand and ensure it’s i1
                 LLVMValueRef left = generate_expression(e->binop.left, catchBB);
                 if (LLVMTypeOf(left) != LLVMInt1TypeInContext(context)) {
-                    left = LLVMBuildICmp(builder, LLVMIntNE, left, LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0), "tobool");
+                    left = LLVMBuildICmp(builder, LLVMIntNE, left, LLVMConstNull(LLVMTypeOf(left)), "tobool");
                 }
-                LLVMBuildCondBr(builder, left, thenBB, elseBB);
+                LLVMValueRef branch = LLVMBuildCondBr(builder, left, thenBB, elseBB);
 
                 // Then branch: constant true (i1)
                 LLVMPositionBuilderAtEnd(builder, thenBB);
+                int thenSite = profile_site();
                 LLVMValueRef trueVal = LLVMConstInt(LLVMInt1TypeInContext(context), 1, 0);
                 LLVMBuildBr(builder, mergeBB);
 
                 // Else branch: evaluate right operand and ensure it’s i1
                 LLVMPositionBuilderAtEnd(builder, elseBB);
+                profile_weights(branch, thenSite, profile_site());
                 LLVMValueRef right = generate_expression(e->binop.right, catchBB);
                 if (LLVMTypeOf(right) != LLVMInt1TypeInContext(context)) {
-                    right = LLVMBuildICmp(builder, LLVMIntNE, right, LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0), "tobool");
+                    right = LLVMBuildICmp(builder, LLVMIntNE, right, LLVMConstNull(LLVMTypeOf(right)), "tobool");
                 }
+                elseBB = LLVMGetInsertBlock(builder);
                 LLVMBuildBr(builder, mergeBB);
 
                 // Merge branch: create PHI node with i1 type
@@ -151,334 +1407,1448 @@ LLVMValueRef generate_expression(Expr* e, LLVMBasicBlockRef catchBB) {
                 LLVMAddIncoming(phi, &trueVal, &thenBB, 1);
                 LLVMAddIncoming(phi, &right, &elseBB, 1);
                 return phi;
-            } else {
-                LLVMValueRef left = generate_expression(e->binop.left, catchBB);
-                LLVMValueRef right = generate_expression(e->binop.right, catchBB);
-                LLVMTypeRef leftType = LLVMTypeOf(left);
-
-                if (!strcmp(e->binop.op, "+")) {
-                    if (leftType == LLVMInt32TypeInContext(context))
-                        return LLVMBuildAdd(builder, left, right, "addtmp");
-                    else if (leftType == LLVMFloatTypeInContext(context))
-                        return LLVMBuildFAdd(builder, left, right, "faddtmp");
-                } else if (!strcmp(e->binop.op, "-")) {
-                    if (leftType == LLVMInt32TypeInContext(context))
-                        return LLVMBuildSub(builder, left, right, "subtmp");
-                    else if (leftType == LLVMFloatTypeInContext(context))
-                        return LLVMBuildFSub(builder, left, right, "fsubtmp");
-                } else if (!strcmp(e->binop.op, "*")) {
-                    if (leftType == LLVMInt32TypeInContext(context))
-                        return LLVMBuildMul(builder, left, right, "multmp");
-                    else if (leftType == LLVMFloatTypeInContext(context))
-                        return LLVMBuildFMul(builder, left, right, "fmultmp");
-                } else if (!strcmp(e->binop.op, "/")) {
-                    if (leftType == LLVMInt32TypeInContext(context)) {
-                        if (catchBB != NULL) {
-                            LLVMBasicBlockRef currentBB = LLVMGetInsertBlock(builder);
-                            LLVMBasicBlockRef divBB = LLVMAppendBasicBlock(currentFunction, "div");
-                            LLVMValueRef zero = LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0);
-                            LLVMValueRef isZero = LLVMBuildICmp(builder, LLVMIntEQ, right, zero, "isZero");
-                            LLVMBuildCondBr(builder, isZero, catchBB, divBB);
-                            LLVMPositionBuilderAtEnd(builder, divBB);
-                            return LLVMBuildSDiv(builder, left, right, "divtmp");
-                        } else {
-                            return LLVMBuildSDiv(builder, left, right, "divtmp");
-                        }
-                    } else if (leftType == LLVMFloatTypeInContext(context)) {
+            }
+
+            LLVMValueRef left = generate_expression(e->binop.left, catchBB);
+            LLVMValueRef right = generate_expression(e->binop.right, catchBB);
+            if (is_array_type(LLVMTypeOf(left)) || is_array_type(LLVMTypeOf(right)))
+                return generate_array_binop(e->binop.op, left, right);
+            // A 64-bit operand widens a 32-bit one; nothing else converts
+            LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+            LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+            if (LLVMTypeOf(left) == i64 && LLVMTypeOf(right) == i32)
+                right = LLVMBuildSExt(builder, right, i64, "");
+            else if (LLVMTypeOf(left) == i32 && LLVMTypeOf(right) == i64)
+                left = LLVMBuildSExt(builder, left, i64, "");
+            LLVMTypeRef leftType = LLVMTypeOf(left);
+            int isFloat = leftType == LLVMFloatTypeInContext(context);
+            if (!isFloat && leftType != i32 && leftType != i64) {
+                compile_error("Unsupported binary operator or type\n");
+                compile_failed();
+            }
+            if (LLVMTypeOf(right) != leftType) {
+                compile_error("Operands of different types: %s and %s\n", type_name(leftType),
+                        type_name(LLVMTypeOf(right)));
+                compile_failed();
+            }
+
+            switch (e->binop.op) {
+                case OP_ADD:
+                    return isFloat ? LLVMBuildFAdd(builder, left, right, "faddtmp")
+                                   : LLVMBuildAdd(builder, left, right, "addtmp");
+                case OP_SUB:
+                    return isFloat ? LLVMBuildFSub(builder, left, right, "fsubtmp")
+                                   : LLVMBuildSub(builder, left, right, "subtmp");
+                case OP_MUL:
+                    return isFloat ? LLVMBuildFMul(builder, left, right, "fmultmp")
+                                   : LLVMBuildMul(builder, left, right, "multmp");
+                case OP_DIV:
+                    if (isFloat)
                         return LLVMBuildFDiv(builder, left, right, "fdivtmp");
+                    if (catchBB != NULL) {
+                        LLVMValueRef zero = LLVMConstNull(leftType);
+                        LLVMValueRef isZero = LLVMBuildICmp(builder, LLVMIntEQ, right, zero, "isZero");
+                        branch_to_catch(isZero, catchBB, "div");
                     }
-                } else if (!strcmp(e->binop.op, "==")) {
-                    if (leftType == LLVMInt32TypeInContext(context))
-                        return LLVMBuildICmp(builder, LLVMIntEQ, left, right, "eqtmp");
-                    else if (leftType == LLVMFloatTypeInContext(context))
-                        return LLVMBuildFCmp(builder, LLVMRealOEQ, left, right, "feqtmp");
-                } else if (!strcmp(e->binop.op, "!=")) {
-                    if (leftType == LLVMInt32TypeInContext(context))
-                        return LLVMBuildICmp(builder, LLVMIntNE, left, right, "netmp");
-                    else if (leftType == LLVMFloatTypeInContext(context))
-                        return LLVMBuildFCmp(builder, LLVMRealONE, left, right, "fnetmp");
-                } else if (!strcmp(e->binop.op, "<")) {
-                    if (leftType == LLVMInt32TypeInContext(context))
-                        return LLVMBuildICmp(builder, LLVMIntSLT, left, right, "lttmp");
-                    else if (leftType == LLVMFloatTypeInContext(context))
-                        return LLVMBuildFCmp(builder, LLVMRealOLT, left, right, "flttmp");
-                } else if (!strcmp(e->binop.op, ">")) {
-                    if (leftType == LLVMInt32TypeInContext(context))
-                        return LLVMBuildICmp(builder, LLVMIntSGT, left, right, "gttmp");
-                    else if (leftType == LLVMFloatTypeInContext(context))
-                        return LLVMBuildFCmp(builder, LLVMRealOGT, left, right, "fgttmp");
-                } else if (!strcmp(e->binop.op, "<=")) {
-                    if (leftType == LLVMInt32TypeInContext(context))
-                        return LLVMBuildICmp(builder, LLVMIntSLE, left, right, "letmp");
-                    else if (leftType == LLVMFloatTypeInContext(context))
-                        return LLVMBuildFCmp(builder, LLVMRealOLE, left, right, "fletmp");
-                } else if (!strcmp(e->binop.op, ">=")) {
-                    if (leftType == LLVMInt32TypeInContext(context))
-                        return LLVMBuildICmp(builder, LLVMIntSGE, left, right, "getmp");
-                    else if (leftType == LLVMFloatTypeInContext(context))
-                        return LLVMBuildFCmp(builder, LLVMRealOGE, left, right, "fgetmp");
-                }
-                fprintf(stderr, "Unsupported binary operator or type\n");
-                exit(1);
+                    return LLVMBuildSDiv(builder, left, right, "divtmp");
+                case OP_EQ:
+                    return isFloat ? LLVMBuildFCmp(builder, LLVMRealOEQ, left, right, "feqtmp")
+                                   : LLVMBuildICmp(builder, LLVMIntEQ, left, right, "eqtmp");
+                case OP_NE:
+                    return isFloat ? LLVMBuildFCmp(builder, LLVMRealONE, left, right, "fnetmp")
+                                   : LLVMBuildICmp(builder, LLVMIntNE, left, right, "netmp");
+                case OP_LT:
+                    return isFloat ? LLVMBuildFCmp(builder, LLVMRealOLT, left, right, "flttmp")
+                                   : LLVMBuildICmp(builder, LLVMIntSLT, left, right, "lttmp");
+                case OP_GT:
+                    return isFloat ? LLVMBuildFCmp(builder, LLVMRealOGT, left, right, "fgttmp")
+                                   : LLVMBuildICmp(builder, LLVMIntSGT, left, right, "gttmp");
+                case OP_LE:
+                    return isFloat ? LLVMBuildFCmp(builder, LLVMRealOLE, left, right, "fletmp")
+                                   : LLVMBuildICmp(builder, LLVMIntSLE, left, right, "letmp");
+                case OP_GE:
+                    return isFloat ? LLVMBuildFCmp(builder, LLVMRealOGE, left, right, "fgetmp")
+                                   : LLVMBuildICmp(builder, LLVMIntSGE, left, right, "getmp");
+                case OP_AND:
+                case OP_OR:
+                    break;
             }
+            compile_error("Unsupported binary operator or type\n");
+            compile_failed();
         }
         case EXPR_UNARYOP: {
-            if (!strcmp(e->unaryop.op, "!")) {
-                LLVMValueRef operand = generate_expression(e->unaryop.operand, catchBB);
-                // Ensure operand is i1 before applying NOT
-                if (LLVMTypeOf(operand) != LLVMInt1TypeInContext(context)) {
-                    operand = LLVMBuildICmp(builder, LLVMIntNE, operand, LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0), "tobool");
+            switch (e->unaryop.op) {
+                case OP_NOT: {
+                    LLVMValueRef operand = generate_expression(e->unaryop.operand, catchBB);
+                    // Ensure operand is i1 before applying NOT
+                    if (LLVMTypeOf(operand) != LLVMInt1TypeInContext(context)) {
+                        operand = LLVMBuildICmp(builder, LLVMIntNE, operand, LLVMConstNull(LLVMTypeOf(operand)), "tobool");
+                    }
+                    return LLVMBuildNot(builder, operand, "not");
                 }
-                return LLVMBuildNot(builder, operand, "not");
-            } else {
-                fprintf(stderr, "Unsupported unary operator: %s\n", e->unaryop.op);
-                exit(1);
             }
+            compile_error("Unsupported unary operator\n");
+            compile_failed();
         }
         case EXPR_FUNC_CALL: {
-            LLVMValueRef func = LLVMGetNamedFunction(module, e->func_call.func_name);
-            if (!func) {
-                fprintf(stderr, "Undefined function: %s\n", e->func_call.func_name);
-                exit(1);
-            }
+            const char* name = e->func_call.func_name;
             ExprList args = e->func_call.args;
-            LLVMValueRef* arg_vals = malloc(args.count * sizeof(LLVMValueRef));
-            for (int i = 0; i < args.count; i++)
-                arg_vals[i] = generate_expression(args.exprs[i], catchBB);
+            // Array builtins: array(n), and len/sum/min/max of an array
+            if (args.count == 1 && !strcmp(name, "array"))
+                return generate_array_new(generate_expression(args.exprs[0], catchBB));
+            // long(x): x widened to 64 bits
+            if (args.count == 1 && !strcmp(name, "long")) {
+                LLVMValueRef val = generate_expression(args.exprs[0], catchBB);
+                LLVMValueRef wide = convert_value(val, LLVMInt64TypeInContext(context));
+                if (!wide) {
+                    compile_error("long() takes an int, not %s\n", type_name(LLVMTypeOf(val)));
+                    compile_failed();
+                }
+                return wide;
+            }
+            InputKind input = input_builtin(name, args.count);
+            if (input)
+                return generate_input(input, args.count ? generate_expression(args.exprs[0], catchBB) : NULL);
+            LLVMValueRef first = NULL;
+            if (args.count == 1 && is_array_builtin(name)) {
+                first = generate_expression(args.exprs[0], catchBB);
+                if (is_array_type(LLVMTypeOf(first)))
+                    return generate_array_builtin(name, first);
+            }
+            // The instance taking the arguments' types; bools are passed as ints
+            LLVMValueRef* arg_vals = malloc((args.count + 1) * sizeof(LLVMValueRef));
+            TypeKind* kinds = malloc((args.count + 1) * sizeof(TypeKind));
+            for (int i = 0; i < args.count; i++) {
+                arg_vals[i] = i == 0 && first ? first : generate_expression(args.exprs[i], catchBB);
+                if (LLVMTypeOf(arg_vals[i]) == LLVMInt1TypeInContext(context))
+                    arg_vals[i] = LLVMBuildZExt(builder, arg_vals[i], LLVMInt32TypeInContext(context), "");
+                kinds[i] = value_kind(LLVMTypeOf(arg_vals[i]));
+            }
+            Instance* callee = called_instance(e->func_call.decl, name, kinds, args.count);
+            free(kinds);
+            if (e == tailCall && currentTail && callee == currentInstance) {
+                generate_tail_loop(e, arg_vals);
+                free(arg_vals);
+                return LLVMGetUndef(kind_type(callee->ret));
+            }
+            LLVMValueRef func = get_instance(callee);
+            LLVMTypeRef funcType = LLVMGetElementType(LLVMTypeOf(func));
             LLVMValueRef call = LLVMBuildCall2(builder,
-                                               LLVMGetElementType(LLVMTypeOf(func)),
+                                               funcType,
                                                func,
                                                arg_vals,
                                                args.count,
                                                "calltmp");
             free(arg_vals);
+            if (e == tailCall && !currentMemo &&
+                LLVMGetReturnType(funcType) == LLVMGetReturnType(LLVMGetElementType(LLVMTypeOf(currentFunction)))) {
+                LLVMSetTailCall(call, 1);
+                tail_calls++;
+                tail_call_remark(e, callee, "is marked tail");
+            }
             return call;
         }
+        case EXPR_PIPELINE:
+            return generate_pipeline(e, catchBB);
+        case EXPR_ARRAY:
+            return generate_array_literal(e->array.elems, catchBB);
+        case EXPR_INDEX: {
+            LLVMValueRef arr = generate_expression(e->index.array, catchBB);
+            LLVMValueRef index = generate_expression(e->index.index, catchBB);
+            LLVMValueRef ptr = array_element_ptr(arr, index, catchBB);
+            return LLVMBuildLoad2(builder, LLVMGetElementType(LLVMTypeOf(ptr)), ptr, "elem");
+        }
     }
     return NULL;
 }
 
+LLVMValueRef generate_expression(Expr* e, LLVMBasicBlockRef catchBB) {
+    LLVMMetadataRef outer = debug_enter(e->line, e->column);
+    ErrorPos outerPos = error_enter(e->line, e->column);
+    LLVMValueRef val = generate_node(e, catchBB);
+    error_leave(outerPos);
+    debug_leave(outer);
+    return val;
+}
+
+void generate_statement(Stmt* s, LLVMBasicBlockRef currentBB, LLVMBasicBlockRef catchBB);
+
+// A parameter that is assigned wider values than it is passed (a long
+// into an int) is widened on entry
+static void generate_function_body(Instance* inst, LLVMValueRef func) {
+    Stmt* s = inst->decl;
+    Instance* outerInstance = currentInstance;
+    currentInstance = inst;
+    currentFunction = func;
+    LLVMBasicBlockRef entryBB = LLVMAppendBasicBlockInContext(context, func, "entry");
+    LLVMPositionBuilderAtEnd(builder, entryBB);
+    DebugScope outer = debug_begin_function(func, s->line);
+    profile_begin_function(func, s);
+
+    int outerBase = push_function_scope();
+    for (int i = 0; i < s->func_decl.params.count; i++) {
+        char* param_name = s->func_decl.params.args[i];
+        LLVMValueRef param_val = LLVMGetParam(func, i);
+        LLVMSetValueName2(param_val, param_name, strlen(param_name));
+        declare_variable(param_name, convert_to(param_val, kind_type(inst->vars[i]), param_name));
+    }
+    MemoEntry* outerMemo = currentMemo;
+    currentMemo = s->func_decl.memo ? begin_memo(inst, func) : NULL;
+    TailLoop* outerTail = currentTail;
+    currentTail = !currentMemo && calls_itself_last(s->func_decl.body, s) ? begin_tail_loop(s) : NULL;
+    entryBB = LLVMGetInsertBlock(builder);
+
+    StmtList body = s->func_decl.body;
+    for (int i = 0; i < body.count; i++) {
+        generate_statement(body.stmts[i], entryBB, NULL);
+        entryBB = LLVMGetInsertBlock(builder);
+    }
+
+    if (!LLVMGetBasicBlockTerminator(LLVMGetInsertBlock(builder)))
+        generate_return(LLVMConstNull(kind_type(inst->ret)));
+    if (currentMemo) {
+        free(currentMemo->keys);
+        free(currentMemo);
+    }
+    currentMemo = outerMemo;
+    if (currentTail)
+        end_tail_loop(currentTail);
+    currentTail = outerTail;
+    pop_function_scope(outerBase);
+    profile_end_function();
+    debug_end_function(outer);
+    currentInstance = outerInstance;
+}
+
+// Counts var from startV up to endV inclusive around body
+static void generate_for_loop(const char* var, LLVMValueRef startV, LLVMValueRef endV,
+                              StmtList body, LLVMBasicBlockRef catchBB) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    push_scope();
+    declare_variable(var, startV);
+    int counterIndex = lookup_variable_index(var);
+
+    LLVMBasicBlockRef condBB = LLVMAppendBasicBlockInContext(context, currentFunction, "for.cond");
+    LLVMBasicBlockRef bodyBB = LLVMAppendBasicBlockInContext(context, currentFunction, "for.body");
+    LLVMBasicBlockRef incBB = LLVMAppendBasicBlockInContext(context, currentFunction, "for.inc");
+    LLVMBasicBlockRef endBB = LLVMAppendBasicBlockInContext(context, currentFunction, "for.end");
+
+    PhiSet loop = { NULL, NULL, 0 };
+    if (ssa_mode) {
+        // The counter always changes, so it is joined even if the
+        // body never assigns it
+        Stmt counterUpdate = { .type = STMT_ASSIGN, .assign = { (char*)var, NULL } };
+        Stmt* counterList[] = { &counterUpdate };
+        loop = assigned_bindings(body, (StmtList){ counterList, 1, 1 });
+        begin_phis(&loop, condBB, LLVMGetInsertBlock(builder));
+    }
+
+    LLVMBuildBr(builder, condBB);
+    LLVMPositionBuilderAtEnd(builder, condBB);
+    LLVMValueRef cur = get_variable(var);
+    LLVMValueRef cmp = LLVMBuildICmp(builder, LLVMIntSLE, cur, endV, "for.cond");
+    LLVMValueRef branch = LLVMBuildCondBr(builder, cmp, bodyBB, endBB);
+
+    LLVMPositionBuilderAtEnd(builder, bodyBB);
+    int bodySite = profile_site();
+    push_scope();
+    for (int i = 0; i < body.count; i++) {
+        generate_statement(body.stmts[i], bodyBB, catchBB);
+        bodyBB = LLVMGetInsertBlock(builder);
+    }
+    pop_scope();
+    if (!LLVMGetBasicBlockTerminator(bodyBB))
+        LLVMBuildBr(builder, incBB);
+
+    LLVMPositionBuilderAtEnd(builder, incBB);
+    LLVMValueRef loadedCounter = get_variable(var);
+    LLVMValueRef next = LLVMBuildAdd(builder, loadedCounter, LLVMConstInt(i32, 1, 0), "for.inc");
+    if (ssa_mode) {
+        symtab.symbols[counterIndex].ptr = next;
+        add_incoming(&loop, incBB);
+    } else {
+        LLVMBuildStore(builder, next, symtab.symbols[counterIndex].ptr);
+    }
+    LLVMBuildBr(builder, condBB);
+
+    LLVMPositionBuilderAtEnd(builder, endBB);
+    profile_weights(branch, bodySite, profile_site());
+    if (ssa_mode) {
+        finish_phis(&loop);
+        free_phis(&loop);
+    }
+    pop_scope();
+}
+
+static void collect_expr_names(Expr* e, const char*** names, int* count, int* cap) {
+    switch (e->type) {
+        case EXPR_VAR:
+            push_name(names, count, cap, e->var_name);
+            break;
+        case EXPR_BINOP:
+            collect_expr_names(e->binop.left, names, count, cap);
+            collect_expr_names(e->binop.right, names, count, cap);
+            break;
+        case EXPR_UNARYOP:
+            collect_expr_names(e->unaryop.operand, names, count, cap);
+            break;
+        case EXPR_FUNC_CALL:
+            for (int i = 0; i < e->func_call.args.count; i++)
+                collect_expr_names(e->func_call.args.exprs[i], names, count, cap);
+            break;
+        case EXPR_PIPELINE:
+            collect_expr_names(e->pipeline.from, names, count, cap);
+            collect_expr_names(e->pipeline.to, names, count, cap);
+            break;
+        case EXPR_ARRAY:
+            for (int i = 0; i < e->array.elems.count; i++)
+                collect_expr_names(e->array.elems.exprs[i], names, count, cap);
+            break;
+        case EXPR_INDEX:
+            collect_expr_names(e->index.array, names, count, cap);
+            collect_expr_names(e->index.index, names, count, cap);
+            break;
+        default:
+            break;
+    }
+}
+
+// Every variable name a parallel for body mentions; the body becomes a
+// function of its own, so it cannot return or declare functions
+static void collect_names(StmtList list, const char*** names, int* count, int* cap) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_LET:
+                collect_expr_names(s->let.expr, names, count, cap);
+                break;
+            case STMT_ASSIGN:
+                push_name(names, count, cap, s->assign.name);
+                collect_expr_names(s->assign.expr, names, count, cap);
+                break;
+            case STMT_INDEX_ASSIGN:
+                push_name(names, count, cap, s->index_assign.name);
+                collect_expr_names(s->index_assign.index, names, count, cap);
+                collect_expr_names(s->index_assign.expr, names, count, cap);
+                break;
+            case STMT_OUTPUT:
+                collect_expr_names(s->output.expr, names, count, cap);
+                break;
+            case STMT_IF:
+                collect_expr_names(s->if_stmt.cond, names, count, cap);
+                collect_names(s->if_stmt.then_stmt, names, count, cap);
+                collect_names(s->if_stmt.else_stmt, names, count, cap);
+                break;
+            case STMT_FOR:
+                collect_names(s->for_stmt.body, names, count, cap);
+                break;
+            case STMT_WHILE:
+                collect_expr_names(s->while_stmt.cond, names, count, cap);
+                collect_names(s->while_stmt.body, names, count, cap);
+                break;
+            case STMT_TRY_CATCH:
+                collect_names(s->try_catch.try_stmt, names, count, cap);
+                collect_names(s->try_catch.catch_stmt, names, count, cap);
+                break;
+            case STMT_RETURN:
+                compile_error("return is not allowed inside parallel for\n");
+                compile_failed();
+            case STMT_FUNC_DECL:
+                compile_error("Function %s cannot be declared inside parallel for\n",
+                        s->func_decl.name);
+                compile_failed();
+        }
+    }
+}
+
+// Adds the terms of sum + a + b, which parses as (sum + a) + b, to acc;
+// NULL if e is not of that shape
+static LLVMValueRef add_reduction_terms(Expr* e, const char* name, LLVMValueRef acc,
+                                        LLVMBasicBlockRef catchBB) {
+    if (e->type == EXPR_VAR && e->var_name == name)
+        return acc;
+    if (e->type != EXPR_BINOP || e->binop.op != OP_ADD)
+        return NULL;
+    acc = add_reduction_terms(e->binop.left, name, acc, catchBB);
+    if (!acc)
+        return NULL;
+    LLVMValueRef val = convert_value(generate_expression(e->binop.right, catchBB), LLVMTypeOf(acc));
+    if (!val) {
+        compile_error("Type mismatch in reduction %s\n", name);
+        compile_failed();
+    }
+    return LLVMTypeOf(acc) == LLVMFloatTypeInContext(context)
+               ? LLVMBuildFAdd(builder, acc, val, "red")
+               : LLVMBuildAdd(builder, acc, val, "red");
+}
+
+// sum = sum + e inside a parallel for body adds e to the chunk's partial sum
+static void generate_reduction_update(Stmt* s, int index, LLVMBasicBlockRef catchBB) {
+    const char* name = s->assign.name;
+    LLVMValueRef acc = add_reduction_terms(s->assign.expr, name, read_binding(index), catchBB);
+    if (!acc) {
+        compile_error("%s can only be updated as %s = %s + ... inside parallel for\n",
+                name, name, name);
+        compile_failed();
+    }
+    write_binding(index, acc);
+}
+
+/*
+ * parallel for: the body is outlined into
+ *     void parallel.body(i32 lo, i32 hi, i8* env)
+ * which runs iterations lo..hi, and chain_parallel_for() (chainrt.c) deals
+ * chunks of the range out to its work-stealing pool. env holds a snapshot of
+ * every outer variable the body reads. Outer variables the body assigns are
+ * reductions: each chunk sums into a private accumulator starting at 0 and
+ * atomically adds it into env, and the caller adds env's totals back. Inside
+ * a try, a failed check in any chunk sets env's last field, which the caller
+ * turns into a jump to the catch block before adding any totals.
+ */
+static void generate_parallel_for(Stmt* s, LLVMBasicBlockRef catchBB) {
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMTypeRef i8ptr = LLVMPointerType(LLVMInt8TypeInContext(context), 0);
+    StmtList body = s->for_stmt.body;
+
+    const char** names = NULL;
+    int count = 0, cap = 0;
+    collect_names(body, &names, &count, &cap);
+    PhiSet captured = resolve_bindings(names, count);
+    count = 0;
+    collect_assigned(body, &names, &count, &cap);
+    PhiSet assigned = resolve_bindings(names, count);
+    free(names);
+
+    int n = captured.count;
+    LLVMTypeRef* fields = malloc((n + 1) * sizeof(LLVMTypeRef));
+    int* reduction = malloc((n + 1) * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        int index = captured.index[i];
+        fields[i] = binding_type(index);
+        reduction[i] = bsearch(&index, assigned.index, assigned.count, sizeof(int), compare_int) != NULL;
+        if (reduction[i] && fields[i] != i32 && fields[i] != LLVMInt64TypeInContext(context) &&
+            fields[i] != LLVMFloatTypeInContext(context)) {
+            compile_error("Only int, long and float variables can be reduced in parallel for: %s\n",
+                    symtab.symbols[index].name);
+            compile_failed();
+        }
+    }
+    fields[n] = i32;
+    LLVMTypeRef envTy = LLVMStructTypeInContext(context, fields, n + 1, 0);
+    LLVMValueRef env = create_entry_alloca(envTy, "par.env");
+    for (int i = 0; i < n; i++) {
+        LLVMValueRef init = reduction[i] ? LLVMConstNull(fields[i])
+                                         : get_variable(symtab.symbols[captured.index[i]].name);
+        LLVMBuildStore(builder, init, LLVMBuildStructGEP2(builder, envTy, env, i, ""));
+    }
+    LLVMValueRef failed = LLVMBuildStructGEP2(builder, envTy, env, n, "par.failed");
+    LLVMBuildStore(builder, LLVMConstInt(i32, 0, 0), failed);
+
+    LLVMTypeRef params[] = { i32, i32, i8ptr };
+    LLVMTypeRef bodyTy = LLVMFunctionType(LLVMVoidTypeInContext(context), params, 3, 0);
+    LLVMValueRef fn = LLVMAddFunction(module, "parallel.body", bodyTy);
+    LLVMSetLinkage(fn, LLVMInternalLinkage);
+
+    LLVMValueRef oldFunction = currentFunction;
+    LLVMBasicBlockRef oldBB = LLVMGetInsertBlock(builder);
+    TryContext* oldTry = currentTry;
+    ParallelRegion* oldRegion = currentRegion;
+    currentFunction = fn;
+    currentTry = NULL;
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(context, fn, "entry"));
+    DebugScope outerScope = debug_begin_function(fn, s->line);
+    LLVMValueRef bodyEnv = LLVMBuildBitCast(builder, LLVMGetParam(fn, 2),
+                                            LLVMPointerType(envTy, 0), "env");
+    LLVMBasicBlockRef bodyCatch = catchBB ? LLVMAppendBasicBlockInContext(context, fn, "par.catch")
+                                          : NULL;
+
+    push_scope();
+    ParallelRegion region = { malloc((n + 1) * sizeof(int)), malloc((n + 1) * sizeof(int)), 0 };
+    for (int i = 0; i < n; i++) {
+        const char* name = symtab.symbols[captured.index[i]].name;
+        if (reduction[i]) {
+            declare_variable(name, LLVMConstNull(fields[i]));
+            region.reductions[region.count] = lookup_variable_index(name);
+            region.fields[region.count++] = i;
+        } else {
+            LLVMValueRef field = LLVMBuildStructGEP2(builder, envTy, bodyEnv, i, "");
+            declare_variable(name, LLVMBuildLoad2(builder, fields[i], field, name));
+        }
+    }
+    currentRegion = &region;
+    generate_for_loop(s->for_stmt.var, LLVMGetParam(fn, 0), LLVMGetParam(fn, 1), body, bodyCatch);
+    for (int i = 0; i < region.count; i++) {
+        LLVMValueRef acc = read_binding(region.reductions[i]);
+        LLVMValueRef field = LLVMBuildStructGEP2(builder, envTy, bodyEnv, region.fields[i], "");
+        LLVMBuildAtomicRMW(builder,
+                           LLVMTypeOf(acc) == LLVMFloatTypeInContext(context) ? LLVMAtomicRMWBinOpFAdd
+                                                                              : LLVMAtomicRMWBinOpAdd,
+                           field, acc, LLVMAtomicOrderingMonotonic, 0);
+    }
+    LLVMBuildRetVoid(builder);
+    if (bodyCatch) {
+        LLVMPositionBuilderAtEnd(builder, bodyCatch);
+        LLVMValueRef flag = LLVMBuildStructGEP2(builder, envTy, bodyEnv, n, "");
+        LLVMValueRef store = LLVMBuildStore(builder, LLVMConstInt(i32, 1, 0), flag);
+        LLVMSetOrdering(store, LLVMAtomicOrderingMonotonic);
+        LLVMSetAlignment(store, 4);
+        LLVMBuildRetVoid(builder);
+    }
+    pop_scope();
+    debug_end_function(outerScope);
+    currentRegion = oldRegion;
+    currentTry = oldTry;
+    currentFunction = oldFunction;
+    LLVMPositionBuilderAtEnd(builder, oldBB);
+
+    LLVMTypeRef runtimeParams[] = { i32, i32, LLVMPointerType(bodyTy, 0), i8ptr };
+    LLVMTypeRef runtimeTy = LLVMFunctionType(LLVMVoidTypeInContext(context), runtimeParams, 4, 0);
+    LLVMValueRef runtime = get_runtime_function("chain_parallel_for", runtimeTy);
+    LLVMValueRef args[] = { create_int(s->for_stmt.start), create_int(s->for_stmt.end), fn,
+                            LLVMBuildBitCast(builder, env, i8ptr, "") };
+    LLVMBuildCall2(builder, runtimeTy, runtime, args, 4, "");
+
+    // A failed check discards the totals, whichever chunks finished
+    if (catchBB) {
+        LLVMValueRef flag = LLVMBuildLoad2(builder, i32, failed, "par.failed");
+        branch_to_catch(LLVMBuildICmp(builder, LLVMIntNE, flag, LLVMConstInt(i32, 0, 0), ""),
+                        catchBB, "par.ok");
+    }
+    for (int i = 0; i < n; i++) {
+        if (!reduction[i])
+            continue;
+        int index = captured.index[i];
+        LLVMValueRef field = LLVMBuildStructGEP2(builder, envTy, env, i, "");
+        LLVMValueRef total = LLVMBuildLoad2(builder, fields[i], field, "par.total");
+        LLVMValueRef cur = read_binding(index);
+        write_binding(index, fields[i] == LLVMFloatTypeInContext(context)
+                                 ? LLVMBuildFAdd(builder, cur, total, "")
+                                 : LLVMBuildAdd(builder, cur, total, ""));
+    }
+
+    free(region.reductions);
+    free(region.fields);
+    free(fields);
+    free(reduction);
+    free_phis(&captured);
+    free_phis(&assigned);
+}
+
+// With -g, what a statement or expression builds is attributed to it, and
+// the enclosing node's location is restored afterwards, so a loop's
+// increment and back edge belong to the loop rather than its last statement
 void generate_statement(Stmt* s, LLVMBasicBlockRef currentBB, LLVMBasicBlockRef catchBB) {
     LLVMPositionBuilderAtEnd(builder, currentBB);
+    LLVMMetadataRef outerLocation = debug_enter(s->line, s->column);
+    ErrorPos outerPos = error_enter(s->line, s->column);
     switch (s->type) {
         case STMT_LET: {
             LLVMValueRef val = generate_expression(s->let.expr, catchBB);
+            // The type inference settled on; a loop handed over by --tier
+            // has no instance and keeps the value's
+            if (currentInstance && currentInstance->vars[s->let.slot] != TY_NONE)
+                val = convert_to(val, kind_type(currentInstance->vars[s->let.slot]), s->let.name);
             declare_variable(s->let.name, val);
             break;
         }
         case STMT_ASSIGN: {
-            LLVMValueRef val = generate_expression(s->assign.expr, catchBB);
-            LLVMValueRef ptr = NULL;
-            for (int i = 0; i < symcount; i++) {
-                if (!strcmp(symtab[i].name, s->assign.name)) {
-                    ptr = symtab[i].ptr;
+            if (currentRegion) {
+                int index = lookup_variable_index(s->assign.name);
+                if (index >= 0 && is_reduction(index)) {
+                    generate_reduction_update(s, index, catchBB);
                     break;
                 }
             }
-            if (!ptr) {
-                fprintf(stderr, "Undefined variable: %s\n", s->assign.name);
-                exit(1);
+            LLVMValueRef val = generate_expression(s->assign.expr, catchBB);
+            assign_variable(s->assign.name, val);
+            break;
+        }
+        case STMT_INDEX_ASSIGN: {
+            LLVMValueRef arr = get_variable(s->index_assign.name);
+            LLVMValueRef index = generate_expression(s->index_assign.index, catchBB);
+            LLVMValueRef val = generate_expression(s->index_assign.expr, catchBB);
+            LLVMValueRef ptr = array_element_ptr(arr, index, catchBB);
+            if (LLVMTypeOf(val) == LLVMInt1TypeInContext(context))
+                val = LLVMBuildZExt(builder, val, LLVMInt32TypeInContext(context), "");
+            if (LLVMTypeOf(val) != LLVMGetElementType(LLVMTypeOf(ptr))) {
+                compile_error("Element type mismatch in %s[...] =\n", s->index_assign.name);
+                compile_failed();
             }
             LLVMBuildStore(builder, val, ptr);
             break;
         }
         case STMT_OUTPUT: {
             LLVMValueRef val = generate_expression(s->output.expr, catchBB);
-            LLVMTypeRef i8ptr = LLVMPointerType(LLVMInt8TypeInContext(context), 0);
-            LLVMTypeRef printfTy = LLVMFunctionType(LLVMInt32TypeInContext(context), &i8ptr, 1, 1);
-            LLVMValueRef fmt;
-            if (LLVMTypeOf(val) == LLVMFloatTypeInContext(context))
-                fmt = LLVMBuildGlobalStringPtr(builder, "%f\n", "fmt");
-            else
-                fmt = LLVMBuildGlobalStringPtr(builder, "%d\n", "fmt");
-            LLVMBuildCall2(builder, printfTy, printfFn, (LLVMValueRef[]){fmt, val}, 2, "");
+            if (is_array_type(LLVMTypeOf(val))) {
+                generate_array_output(val);
+                break;
+            }
+            generate_output_value(val);
             break;
         }
         case STMT_IF: {
             LLVMValueRef cond = generate_expression(s->if_stmt.cond, catchBB);
             // Ensure cond is i1
             if (LLVMTypeOf(cond) != LLVMInt1TypeInContext(context)) {
-                cond = LLVMBuildICmp(builder, LLVMIntNE, cond, LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0), "tobool");
+                cond = LLVMBuildICmp(builder, LLVMIntNE, cond, LLVMConstNull(LLVMTypeOf(cond)), "tobool");
+            }
+            if (LLVMIsAConstantInt(cond)) {
+                // Folded condition: only the taken branch is emitted
+                StmtList taken = LLVMConstIntGetZExtValue(cond) ? s->if_stmt.then_stmt
+                                                                : s->if_stmt.else_stmt;
+                push_scope();
+                for (int i = 0; i < taken.count; i++)
+                    generate_statement(taken.stmts[i], LLVMGetInsertBlock(builder), catchBB);
+                pop_scope();
+                break;
+            }
+            LLVMBasicBlockRef thenBB = LLVMAppendBasicBlockInContext(context, currentFunction, "if.then");
+            LLVMBasicBlockRef elseBB = LLVMAppendBasicBlockInContext(context, currentFunction, "if.else");
+            LLVMBasicBlockRef mergeBB = LLVMAppendBasicBlockInContext(context, currentFunction, "if.merge");
+            LLVMValueRef branch = LLVMBuildCondBr(builder, cond, thenBB, elseBB);
+
+            PhiSet joined = { NULL, NULL, 0 };
+            LLVMValueRef *before = NULL, *thenVals = NULL, *elseVals = NULL;
+            if (ssa_mode) {
+                joined = assigned_bindings(s->if_stmt.then_stmt, s->if_stmt.else_stmt);
+                before = malloc((joined.count + 1) * sizeof(LLVMValueRef) * 3);
+                thenVals = before + joined.count + 1;
+                elseVals = thenVals + joined.count;
+                snapshot_values(&joined, before);
             }
-            LLVMBasicBlockRef thenBB = LLVMAppendBasicBlock(currentFunction, "if.then");
-            LLVMBasicBlockRef elseBB = LLVMAppendBasicBlock(currentFunction, "if.else");
-            LLVMBasicBlockRef mergeBB = LLVMAppendBasicBlock(currentFunction, "if.merge");
-            LLVMBuildCondBr(builder, cond, thenBB, elseBB);
 
             LLVMPositionBuilderAtEnd(builder, thenBB);
+            int thenSite = profile_site();
+            profile_layout(thenBB, thenSite);
+            push_scope();
             for (int i = 0; i < s->if_stmt.then_stmt.count; i++) {
                 generate_statement(s->if_stmt.then_stmt.stmts[i], thenBB, catchBB);
                 thenBB = LLVMGetInsertBlock(builder);
             }
-            LLVMBuildBr(builder, mergeBB);
+            pop_scope();
+            if (!LLVMGetBasicBlockTerminator(thenBB))
+                LLVMBuildBr(builder, mergeBB);
+            else
+                thenBB = NULL;
+
+            if (ssa_mode) {
+                snapshot_values(&joined, thenVals);
+                restore_values(&joined, before);
+            }
 
             LLVMPositionBuilderAtEnd(builder, elseBB);
+            int elseSite = profile_site();
+            profile_layout(elseBB, elseSite);
+            profile_weights(branch, thenSite, elseSite);
+            push_scope();
             for (int i = 0; i < s->if_stmt.else_stmt.count; i++) {
                 generate_statement(s->if_stmt.else_stmt.stmts[i], elseBB, catchBB);
                 elseBB = LLVMGetInsertBlock(builder);
             }
-            LLVMBuildBr(builder, mergeBB);
+            pop_scope();
+            if (!LLVMGetBasicBlockTerminator(elseBB))
+                LLVMBuildBr(builder, mergeBB);
+            else
+                elseBB = NULL;
+
+            if (ssa_mode) {
+                snapshot_values(&joined, elseVals);
+                merge_values(&joined, mergeBB, thenVals, thenBB, elseVals, elseBB);
+                free(before);
+                free_phis(&joined);
+            }
 
             LLVMPositionBuilderAtEnd(builder, mergeBB);
             break;
         }
         case STMT_FOR: {
-            const char* var = s->for_stmt.var;
-            int start = s->for_stmt.start;
-            int end = s->for_stmt.end;
-            StmtList body = s->for_stmt.body;
-            LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
-
-            LLVMValueRef startV = LLVMConstInt(i32, start, 0);
-            LLVMValueRef endV = LLVMConstInt(i32, end, 0);
-            LLVMValueRef counter = LLVMBuildAlloca(builder, i32, var);
-            LLVMBuildStore(builder, startV, counter);
-            symtab[symcount++] = (Symbol){ strdup(var), counter };
-
-            LLVMBasicBlockRef condBB = LLVMAppendBasicBlock(currentFunction, "for.cond");
-            LLVMBasicBlockRef bodyBB = LLVMAppendBasicBlock(currentFunction, "for.body");
-            LLVMBasicBlockRef incBB = LLVMAppendBasicBlock(currentFunction, "for.inc");
-            LLVMBasicBlockRef endBB = LLVMAppendBasicBlock(currentFunction, "for.end");
-
-            LLVMBuildBr(builder, condBB);
-            LLVMPositionBuilderAtEnd(builder, condBB);
-            LLVMValueRef cur = LLVMBuildLoad2(builder, i32, counter, "current");
-            LLVMValueRef cmp = LLVMBuildICmp(builder, LLVMIntSLE, cur, endV, "for.cond");
-            LLVMBuildCondBr(builder, cmp, bodyBB, endBB);
-
-            LLVMPositionBuilderAtEnd(builder, bodyBB);
-            for (int i = 0; i < body.count; i++) {
-                generate_statement(body.stmts[i], bodyBB, catchBB);
-                bodyBB = LLVMGetInsertBlock(builder);
+            if (s->for_stmt.parallel) {
+                generate_parallel_for(s, catchBB);
+                break;
             }
-            LLVMBuildBr(builder, incBB);
-
-            LLVMPositionBuilderAtEnd(builder, incBB);
-            LLVMValueRef loadedCounter = LLVMBuildLoad2(builder, i32, counter, "current.inc");
-            LLVMValueRef next = LLVMBuildAdd(builder, loadedCounter, LLVMConstInt(i32, 1, 0), "for.inc");
-            LLVMBuildStore(builder, next, counter);
-            LLVMBuildBr(builder, condBB);
-
-            LLVMPositionBuilderAtEnd(builder, endBB);
-            symcount--;
+            generate_for_loop(s->for_stmt.var, create_int(s->for_stmt.start),
+                              create_int(s->for_stmt.end), s->for_stmt.body, catchBB);
             break;
         }
         case STMT_FUNC_DECL: {
-            int param_count = s->func_decl.params.count;
-            LLVMTypeRef* param_types = malloc(param_count * sizeof(LLVMTypeRef));
-            for (int i = 0; i < param_count; i++)
-                param_types[i] = LLVMInt32TypeInContext(context);
-
-            LLVMTypeRef ret_type = LLVMInt32TypeInContext(context);
-            LLVMTypeRef func_type = LLVMFunctionType(ret_type, param_types, param_count, 0);
-            LLVMValueRef func = LLVMAddFunction(module, s->func_decl.name, func_type);
-            LLVMSetLinkage(func, LLVMExternalLinkage);
-
-            LLVMBasicBlockRef entryBB = LLVMAppendBasicBlockInContext(context, func, "entry");
-            LLVMBasicBlockRef oldBB = LLVMGetInsertBlock(builder);
-            LLVMPositionBuilderAtEnd(builder, entryBB);
-
-            int old_symcount = symcount;
-            for (int i = 0; i < param_count; i++) {
-                char* param_name = s->func_decl.params.args[i];
-                LLVMValueRef param_val = LLVMGetParam(func, i);
-                LLVMValueRef alloc = LLVMBuildAlloca(builder, LLVMInt32TypeInContext(context), param_name);
-                LLVMBuildStore(builder, param_val, alloc);
-                symtab[symcount++] = (Symbol){ strdup(param_name), alloc };
+            // Every instance is declared before any body is generated, so
+            // they can call each other
+            int count = 0;
+            for (Instance* inst = s->func_decl.instances; inst; inst = inst->next)
+                count++;
+            LLVMValueRef* funcs = malloc((count + 1) * sizeof(LLVMValueRef));
+            count = 0;
+            for (Instance* inst = s->func_decl.instances; inst; inst = inst->next) {
+                funcs[count] = add_instance(mainModule, inst);
+                LLVMSetLinkage(funcs[count++], LLVMExternalLinkage);
             }
-
-            StmtList body = s->func_decl.body;
-            for (int i = 0; i < body.count; i++) {
-                generate_statement(body.stmts[i], entryBB, NULL);
-                entryBB = LLVMGetInsertBlock(builder);
+            // With -j the bodies are generated by a worker (see generate_program)
+            if (job_count > 0 && !visible_jobs) {
+                free(funcs);
+                break;
             }
 
-            if (!LLVMGetBasicBlockTerminator(LLVMGetInsertBlock(builder)))
-                LLVMBuildRet(builder, LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0));
-
-            symcount = old_symcount;
+            LLVMModuleRef oldModule = module;
+            LLVMValueRef oldFunction = currentFunction;
+            LLVMBasicBlockRef oldBB = LLVMGetInsertBlock(builder);
+            count = 0;
+            for (Instance* inst = s->func_decl.instances; inst; inst = inst->next) {
+                LLVMValueRef func = funcs[count++];
+                if (run_jit && !visible_jobs) {
+                    module = create_module(inst->symbol);
+                    debug_begin_module(module);
+                    func = add_instance(module, inst);
+                    if (unit_count == unit_cap) {
+                        unit_cap = unit_cap ? unit_cap * 2 : 16;
+                        units = realloc(units, unit_cap * sizeof(FunctionUnit));
+                    }
+                    units[unit_count++] = (FunctionUnit){ s, module, NULL, NULL, 0 };
+                } else if (inst->pure) {
+                    // Its callers are all in this module, so the optimizer
+                    // may drop it once they no longer call it
+                    LLVMSetLinkage(func, LLVMInternalLinkage);
+                }
+                generate_function_body(inst, func);
+                if (module != oldModule)
+                    debug_end_module();
+                module = oldModule;
+            }
+            free(funcs);
+            currentFunction = oldFunction;
             LLVMPositionBuilderAtEnd(builder, oldBB);
-            free(param_types);
             break;
         }
         case STMT_RETURN: {
+            Expr* outerTailCall = tailCall;
+            tailCall = s->return_stmt.expr;
             LLVMValueRef val = generate_expression(s->return_stmt.expr, catchBB);
-            LLVMBuildRet(builder, val);
+            tailCall = outerTailCall;
+            // return f(...) inside f: already branched back to the top
+            if (LLVMGetBasicBlockTerminator(LLVMGetInsertBlock(builder)))
+                break;
+            // Bools are returned as ints, so predicates (e.g. for filter)
+            // return 0/1
+            LLVMTypeRef retType = LLVMGetReturnType(LLVMGetElementType(LLVMTypeOf(currentFunction)));
+            const char* what = currentInstance && currentInstance->decl
+                                   ? currentInstance->decl->func_decl.name : "main's result";
+            generate_return(convert_to(val, retType, what));
             break;
         }
         case STMT_TRY_CATCH: {
-            LLVMBasicBlockRef tryBB = LLVMAppendBasicBlock(currentFunction, "try");
-            LLVMBasicBlockRef catchBBLocal = LLVMAppendBasicBlock(currentFunction, "catch");
-            LLVMBasicBlockRef afterBB = LLVMAppendBasicBlock(currentFunction, "after");
+            LLVMBasicBlockRef tryBB = LLVMAppendBasicBlockInContext(context, currentFunction, "try");
+            LLVMBasicBlockRef catchBBLocal = LLVMAppendBasicBlockInContext(context, currentFunction, "catch");
+            LLVMBasicBlockRef afterBB = LLVMAppendBasicBlockInContext(context, currentFunction, "after");
+
+            TryContext tryCtx = { catchBBLocal, { NULL, NULL, 0 } };
+            TryContext* outerTry = currentTry;
+            LLVMValueRef *before = NULL, *tryVals = NULL;
+            if (ssa_mode) {
+                tryCtx.phis = assigned_bindings(s->try_catch.try_stmt, s->try_catch.catch_stmt);
+                before = malloc((tryCtx.phis.count + 1) * sizeof(LLVMValueRef) * 2);
+                tryVals = before + tryCtx.phis.count + 1;
+                snapshot_values(&tryCtx.phis, before);
+                begin_phis(&tryCtx.phis, catchBBLocal, NULL);
+                restore_values(&tryCtx.phis, before);
+                currentTry = &tryCtx;
+            }
 
             LLVMBuildBr(builder, tryBB);
             LLVMPositionBuilderAtEnd(builder, tryBB);
+            push_scope();
             for (int i = 0; i < s->try_catch.try_stmt.count; i++) {
                 generate_statement(s->try_catch.try_stmt.stmts[i], tryBB, catchBBLocal);
                 tryBB = LLVMGetInsertBlock(builder);
                 if (LLVMGetBasicBlockTerminator(tryBB)) break;
             }
+            pop_scope();
             if (!LLVMGetBasicBlockTerminator(tryBB))
                 LLVMBuildBr(builder, afterBB);
+            else
+                tryBB = NULL;
+
+            if (ssa_mode) {
+                currentTry = outerTry;
+                snapshot_values(&tryCtx.phis, tryVals);
+                finish_phis(&tryCtx.phis);
+            }
 
             LLVMPositionBuilderAtEnd(builder, catchBBLocal);
+            profile_layout(catchBBLocal, profile_site());
+            push_scope();
             for (int i = 0; i < s->try_catch.catch_stmt.count; i++) {
                 generate_statement(s->try_catch.catch_stmt.stmts[i], catchBBLocal, NULL);
                 catchBBLocal = LLVMGetInsertBlock(builder);
                 if (LLVMGetBasicBlockTerminator(catchBBLocal)) break;
             }
+            pop_scope();
             if (!LLVMGetBasicBlockTerminator(catchBBLocal))
                 LLVMBuildBr(builder, afterBB);
+            else
+                catchBBLocal = NULL;
+
+            if (ssa_mode) {
+                LLVMValueRef* catchVals = before;
+                snapshot_values(&tryCtx.phis, catchVals);
+                merge_values(&tryCtx.phis, afterBB, tryVals, tryBB, catchVals, catchBBLocal);
+                free(before);
+                free_phis(&tryCtx.phis);
+            }
 
             LLVMPositionBuilderAtEnd(builder, afterBB);
             break;
         }
         case STMT_WHILE: {
-            LLVMBasicBlockRef condBB = LLVMAppendBasicBlock(currentFunction, "while.cond");
-            LLVMBasicBlockRef bodyBB = LLVMAppendBasicBlock(currentFunction, "while.body");
-            LLVMBasicBlockRef endBB = LLVMAppendBasicBlock(currentFunction, "while.end");
+            LLVMBasicBlockRef condBB = LLVMAppendBasicBlockInContext(context, currentFunction, "while.cond");
+            LLVMBasicBlockRef bodyBB = LLVMAppendBasicBlockInContext(context, currentFunction, "while.body");
+            LLVMBasicBlockRef endBB = LLVMAppendBasicBlockInContext(context, currentFunction, "while.end");
+
+            PhiSet loop = { NULL, NULL, 0 };
+            if (ssa_mode) {
+                loop = assigned_bindings(s->while_stmt.body, (StmtList){ NULL, 0, 0 });
+                begin_phis(&loop, condBB, LLVMGetInsertBlock(builder));
+            }
 
             LLVMBuildBr(builder, condBB);
             LLVMPositionBuilderAtEnd(builder, condBB);
             LLVMValueRef cond = generate_expression(s->while_stmt.cond, catchBB);
             // Ensure cond is i1
             if (LLVMTypeOf(cond) != LLVMInt1TypeInContext(context)) {
-                cond = LLVMBuildICmp(builder, LLVMIntNE, cond, LLVMConstInt(LLVMInt32TypeInContext(context), 0, 0), "tobool");
+                cond = LLVMBuildICmp(builder, LLVMIntNE, cond, LLVMConstNull(LLVMTypeOf(cond)), "tobool");
             }
-            LLVMBuildCondBr(builder, cond, bodyBB, endBB);
+            LLVMValueRef branch = LLVMBuildCondBr(builder, cond, bodyBB, endBB);
 
             LLVMPositionBuilderAtEnd(builder, bodyBB);
+            int bodySite = profile_site();
             StmtList body = s->while_stmt.body;
+            push_scope();
             for (int i = 0; i < body.count; i++) {
                 generate_statement(body.stmts[i], bodyBB, catchBB);
                 bodyBB = LLVMGetInsertBlock(builder);
             }
-            LLVMBuildBr(builder, condBB);
+            pop_scope();
+            if (!LLVMGetBasicBlockTerminator(bodyBB)) {
+                if (ssa_mode)
+                    add_incoming(&loop, bodyBB);
+                LLVMBuildBr(builder, condBB);
+            }
 
             LLVMPositionBuilderAtEnd(builder, endBB);
+            profile_weights(branch, bodySite, profile_site());
+            if (ssa_mode) {
+                finish_phis(&loop);
+                free_phis(&loop);
+            }
+            break;
+        }
+    }
+    error_leave(outerPos);
+    debug_leave(outerLocation);
+}
+
+// Takes a cached, already optimized function in place of generating it
+static void load_cached_job(FunctionUnit* unit, LLVMMemoryBufferRef bitcode) {
+    if (run_jit) {
+        unit->jitContext = LLVMOrcCreateNewThreadSafeContext();
+        context = LLVMOrcThreadSafeContextGetContext(unit->jitContext);
+        if (LLVMParseBitcodeInContext2(context, bitcode, &unit->module)) {
+            fprintf(stderr, "Error reading cached function %s\n", unit->decl->func_decl.name);
+            compile_failed();
+        }
+        LLVMDisposeMemoryBuffer(bitcode);
+    } else {
+        unit->bitcode = bitcode;
+    }
+    unit->optimized = 1;
+}
+
+// Generates one function into a private context and module on a worker
+static void generate_job(int index) {
+    FunctionUnit* unit = &jobs[index];
+    Stmt* s = unit->decl;
+    visible_jobs = index + 1;
+    CacheKey key;
+    if (cache_dir) {
+        key = cache_key_function(s);
+        LLVMMemoryBufferRef cached = cache_load(key);
+        if (cached) {
+            load_cached_job(unit, cached);
+            return;
+        }
+    }
+    if (run_jit) {
+        unit->jitContext = LLVMOrcCreateNewThreadSafeContext();
+        context = LLVMOrcThreadSafeContextGetContext(unit->jitContext);
+    } else {
+        context = LLVMContextCreate();
+    }
+    module = mainModule = create_module(s->func_decl.name);
+    builder = LLVMCreateBuilderInContext(context);
+    allocaBuilder = LLVMCreateBuilderInContext(context);
+    debug_begin_module(module);
+
+    for (Instance* inst = s->func_decl.instances; inst; inst = inst->next)
+        add_instance(module, inst);
+    for (Instance* inst = s->func_decl.instances; inst; inst = inst->next)
+        generate_function_body(inst, LLVMGetNamedFunction(module, inst->symbol));
+    debug_end_module();
+    count_generated(module, 0);
+    verify_module(module);
+    if (opt_level > 0)
+        run_pipeline(module);
+    if (cache_dir)
+        cache_store(key, module);
+    LLVMDisposeBuilder(builder);
+    LLVMDisposeBuilder(allocaBuilder);
+    builder = allocaBuilder = NULL;
+
+    if (run_jit) {
+        unit->module = module;
+    } else {
+        unit->bitcode = LLVMWriteBitcodeToMemoryBuffer(module);
+        LLVMDisposeModule(module);
+        LLVMContextDispose(context);
+    }
+    context = NULL;
+    unit->optimized = 1;
+}
+
+// In batch mode a compile error in one function stops this worker and, via
+// share->failed, the others; the thread compiling the program then fails it
+static void* codegen_worker(void* arg) {
+    WorkerShare* share = arg;
+    jobs = share->jobs;
+    job_count = share->job_count;
+    job_map = share->job_map;
+    job_map_cap = share->job_map_cap;
+    debug_source = share->source;
+    begin_codegen_thread();
+    jmp_buf recovery;
+    if (share->recover) {
+        compile_recovery = &recovery;
+        if (setjmp(recovery)) {
+            atomic_store(&share->failed, 1);
+            jobs = NULL;           // the table belongs to the program's thread
+            job_map = NULL;
+            job_count = job_map_cap = 0;
+            abandon_codegen();
+            goto done;
+        }
+    }
+    while (!atomic_load(&share->failed)) {
+        int index = atomic_fetch_add(&share->next_job, 1);
+        if (index >= job_count)
             break;
+        generate_job(index);
+    }
+done:
+    compile_recovery = NULL;
+    jobs = NULL;
+    job_map = NULL;
+    job_count = job_map_cap = 0;
+    end_codegen_thread();
+    return NULL;
+}
+
+// Collects the functions declared in the main program (outside other
+// function bodies) in program order
+static void collect_jobs(StmtList list) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_FUNC_DECL:
+                if (job_count == job_cap) {
+                    job_cap = job_cap ? job_cap * 2 : 16;
+                    jobs = realloc(jobs, job_cap * sizeof(FunctionUnit));
+                }
+                jobs[job_count++] = (FunctionUnit){ s, NULL, NULL, NULL, 0 };
+                break;
+            case STMT_IF:
+                collect_jobs(s->if_stmt.then_stmt);
+                collect_jobs(s->if_stmt.else_stmt);
+                break;
+            case STMT_FOR:
+                collect_jobs(s->for_stmt.body);
+                break;
+            case STMT_WHILE:
+                collect_jobs(s->while_stmt.body);
+                break;
+            case STMT_TRY_CATCH:
+                collect_jobs(s->try_catch.try_stmt);
+                collect_jobs(s->try_catch.catch_stmt);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Moves the workers' output into the main program in declaration order, so
+// the result does not depend on scheduling. Each link walks the whole
+// destination module, so functions are merged pairwise, as a balanced tree,
+// and the result is linked into main once, rather than one at a time
+static void link_jobs(void) {
+    LLVMModuleRef* parts = malloc((job_count + 1) * sizeof(LLVMModuleRef));
+    int part_count = 0;
+    for (int i = 0; i < job_count; i++) {
+        if (run_jit) {
+            if (unit_count == unit_cap) {
+                unit_cap = unit_cap ? unit_cap * 2 : 16;
+                units = realloc(units, unit_cap * sizeof(FunctionUnit));
+            }
+            units[unit_count++] = jobs[i];
+            continue;
+        }
+        if (LLVMParseBitcodeInContext2(context, jobs[i].bitcode, &parts[part_count])) {
+            fprintf(stderr, "Error reading back function %s\n", jobs[i].decl->func_decl.name);
+            compile_failed();
         }
+        LLVMDisposeMemoryBuffer(jobs[i].bitcode);
+        jobs[i].bitcode = NULL;
+        part_count++;
     }
+    for (int step = 1; step < part_count; step *= 2)
+        for (int i = 0; i + step < part_count; i += 2 * step)
+            if (LLVMLinkModules2(parts[i], parts[i + step])) {
+                fprintf(stderr, "Error linking functions\n");
+                compile_failed();
+            }
+    if (part_count && LLVMLinkModules2(mainModule, parts[0])) {
+        fprintf(stderr, "Error linking functions\n");
+        compile_failed();
+    }
+    free(parts);
+    free(jobs);
+    free(job_map);
+    jobs = NULL;
+    job_map = NULL;
+    job_count = job_cap = job_map_cap = 0;
+}
+
+// Replaces the empty main module with a cached, already optimized one
+static void load_cached_main(LLVMMemoryBufferRef bitcode) {
+    LLVMModuleRef m;
+    if (LLVMParseBitcodeInContext2(context, bitcode, &m)) {
+        fprintf(stderr, "Error reading cached main\n");
+        compile_failed();
+    }
+    LLVMDisposeMemoryBuffer(bitcode);
+    LLVMClearInsertionPosition(builder);
+    debug_abandon();
+    LLVMDisposeModule(mainModule);
+    module = mainModule = m;
+    currentFunction = LLVMGetNamedFunction(m, "main");
+    main_finished = 1;
 }
 
+// With --cache every function is a job, even without -j, so each one is
+// generated (or loaded) and optimized on its own; main is optimized before
+// the functions are linked in, so they are not inlined into it
 void generate_program(StmtList program) {
-    LLVMBasicBlockRef currentBB = LLVMGetInsertBlock(builder);
-    for (int i = 0; i < program.count; i++) {
-        generate_statement(program.stmts[i], currentBB, NULL);
-        currentBB = LLVMGetInsertBlock(builder);
+    pthread_t* workers = NULL;
+    WorkerShare* share = NULL;
+    int worker_count = 0;
+    if (codegen_jobs > 1 || cache_dir) {
+        collect_jobs(program);
+
+        job_map_cap = 16;
+        while (job_map_cap < 2 * job_count)
+            job_map_cap *= 2;
+        job_map = malloc(job_map_cap * sizeof(int));
+        memset(job_map, -1, job_map_cap * sizeof(int));
+        for (int i = 0; i < job_count; i++) {
+            const char* name = jobs[i].decl->func_decl.name;
+            if (find_job(name) >= 0)
+                continue;
+            unsigned slot = hash_name(name) & (job_map_cap - 1);
+            while (job_map[slot] >= 0)
+                slot = (slot + 1) & (job_map_cap - 1);
+            job_map[slot] = i;
+        }
+
+        share = malloc(sizeof(WorkerShare));
+        *share = (WorkerShare){ jobs, job_count, job_map, job_map_cap, 0, 0,
+                                compile_recovery != NULL, debug_source };
+        worker_count = codegen_jobs < job_count ? codegen_jobs : job_count;
+        workers = malloc((worker_count + 1) * sizeof(pthread_t));
+        for (int i = 0; i < worker_count; i++)
+            if (pthread_create(&workers[i], NULL, codegen_worker, share)) {
+                fprintf(stderr, "Could not start codegen worker\n");
+                exit(1);
+            }
+    }
+
+    // An error in main while the workers run must wait for them before
+    // the program is abandoned
+    jmp_buf recovery;
+    jmp_buf* outer = compile_recovery;
+    if (outer && worker_count) {
+        compile_recovery = &recovery;
+        if (setjmp(recovery)) {
+            compile_recovery = outer;
+            atomic_store(&share->failed, 1);
+            for (int i = 0; i < worker_count; i++)
+                pthread_join(workers[i], NULL);
+            free(workers);
+            free(share);
+            compile_failed();
+        }
+    }
+
+    CacheKey key;
+    LLVMMemoryBufferRef cached = NULL;
+    if (cache_dir) {
+        key = cache_key_main(program);
+        cached = cache_load(key);
+    }
+    if (cached) {
+        load_cached_main(cached);
+    } else {
+        currentInstance = main_instance;
+        profile_begin_function(currentFunction, NULL);
+        LLVMBasicBlockRef currentBB = LLVMGetInsertBlock(builder);
+        for (int i = 0; i < program.count; i++) {
+            generate_statement(program.stmts[i], currentBB, NULL);
+            currentBB = LLVMGetInsertBlock(builder);
+        }
+
+        // Workers count their own functions before they are linked in
+        count_generated(mainModule, 0);
+        for (int i = 0; i < unit_count; i++)
+            count_generated(units[i].module, 0);
+        if (cache_dir) {
+            finish_main();
+            cache_store(key, mainModule);
+        }
+    }
+
+    compile_recovery = outer;
+    if (codegen_jobs > 1 || cache_dir) {
+        for (int i = 0; i < worker_count; i++)
+            pthread_join(workers[i], NULL);
+        free(workers);
+        int failed = atomic_load(&share->failed);
+        free(share);
+        if (failed)
+            compile_failed();
+        link_jobs();
+    }
+}
+
+// Drops whatever a failed compile left on this thread, so it can take the
+// next program (batch mode)
+void abandon_codegen(void) {
+    if (builder)
+        LLVMDisposeBuilder(builder);
+    if (allocaBuilder)
+        LLVMDisposeBuilder(allocaBuilder);
+    builder = allocaBuilder = NULL;
+    for (int i = 0; i < job_count; i++)
+        if (jobs[i].bitcode)
+            LLVMDisposeMemoryBuffer(jobs[i].bitcode);
+    free(jobs);
+    free(job_map);
+    free(units);
+    jobs = units = NULL;
+    job_map = NULL;
+    job_count = job_cap = job_map_cap = unit_count = unit_cap = 0;
+    if (context)
+        LLVMContextDispose(context);
+    context = NULL;
+    module = mainModule = NULL;
+    debug_abandon();
+    currentTry = NULL;
+    currentRegion = NULL;
+    currentInstance = NULL;
+    currentMemo = NULL;
+    currentTail = NULL;
+    tailCall = NULL;
+    visible_jobs = 0;
+    main_finished = 0;
+    free_symtab();
+}
+
+/*
+ * --tier: the interpreter (interp.c) hands hot functions and while loops to
+ * a lazy JIT. It is set up on the first tier-up: every function in the
+ * program is generated, verified and optimized as for --run, and each
+ * compiles on its first native call. A hot loop becomes
+ *     i32 tier.loop(i8** vars)
+ * which runs the whole loop from its condition on, reading and writing the
+ * interpreter's registers through vars. It returns 1 where a failed check
+ * inside try jumps to catch, and 0 when the loop ends.
+ */
+static StmtList tier_program;
+static LazyJIT  tier;
+static int      tier_started;
+static int      tier_loops;
+
+void tier_begin(StmtList program) {
+    tier_program = program;
+}
+
+// Generates the functions declared in list, and those nested in their
+// bodies, in program order
+static void generate_declarations(StmtList list, LLVMBasicBlockRef entryBB) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_FUNC_DECL:
+                generate_statement(s, entryBB, NULL);
+                break;
+            case STMT_IF:
+                generate_declarations(s->if_stmt.then_stmt, entryBB);
+                generate_declarations(s->if_stmt.else_stmt, entryBB);
+                break;
+            case STMT_FOR:
+                generate_declarations(s->for_stmt.body, entryBB);
+                break;
+            case STMT_WHILE:
+                generate_declarations(s->while_stmt.body, entryBB);
+                break;
+            case STMT_TRY_CATCH:
+                generate_declarations(s->try_catch.try_stmt, entryBB);
+                generate_declarations(s->try_catch.catch_stmt, entryBB);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void start_tier(void) {
+    phase_begin(PHASE_SETUP);
+    init_target();
+    begin_codegen_thread();
+    phase_end(PHASE_SETUP);
+    phase_begin(PHASE_CODEGEN);
+    run_jit = 1;
+    init_codegen();
+    generate_declarations(tier_program, LLVMGetInsertBlock(builder));
+    for (int i = 0; i < unit_count; i++)
+        count_generated(units[i].module, 0);
+    phase_end(PHASE_CODEGEN);
+    phase_begin(PHASE_VERIFY);
+    for (int i = 0; i < unit_count; i++)
+        verify_module(units[i].module);
+    phase_end(PHASE_VERIFY);
+    if (opt_level > 0) {
+        phase_begin(PHASE_OPTIMIZE);
+        for (int i = 0; i < unit_count; i++)
+            optimize_module(units[i].module);
+        phase_end(PHASE_OPTIMIZE);
+    }
+    start_lazy_jit(&tier);
+    tier_started = 1;
+}
+
+static void* tier_lookup(const char* name) {
+    LLVMOrcJITTargetAddress addr;
+    check_jit_error(LLVMOrcLLJITLookup(tier.jit, &addr, name), "lookup");
+    return (void*)(uintptr_t)addr;
+}
+
+void* tier_function(const char* name) {
+    if (!tier_started)
+        start_tier();
+    return tier_lookup(name);
+}
+
+static LLVMTypeRef tier_var_type(ValueType type) {
+    switch (type) {
+        case VAL_BOOL:        return LLVMInt1TypeInContext(context);
+        case VAL_INT:         return LLVMInt32TypeInContext(context);
+        case VAL_FLOAT:       return LLVMFloatTypeInContext(context);
+        case VAL_INT_ARRAY:   return array_type(LLVMInt32TypeInContext(context));
+        case VAL_FLOAT_ARRAY: return array_type(LLVMFloatTypeInContext(context));
     }
+    return NULL;
+}
+
+// The loop is generated with variables in memory, whatever --ssa says, so
+// its reads and writes go straight to the interpreter's registers
+void* tier_loop(Stmt* loop, TierVar* vars, int count, int in_try) {
+    if (!tier_started)
+        start_tier();
+    char name[32];
+    snprintf(name, sizeof(name), "tier.loop.%d", tier_loops++);
+    phase_begin(PHASE_CODEGEN);
+    module = create_module(name);
+    debug_begin_module(module);
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMTypeRef i8ptr = LLVMPointerType(LLVMInt8TypeInContext(context), 0);
+    LLVMTypeRef varsTy = LLVMPointerType(i8ptr, 0);
+    LLVMValueRef fn = LLVMAddFunction(module, name, LLVMFunctionType(i32, &varsTy, 1, 0));
+    currentFunction = fn;
+    LLVMBasicBlockRef entryBB = LLVMAppendBasicBlockInContext(context, fn, "entry");
+    LLVMBasicBlockRef catchBB = in_try ? LLVMAppendBasicBlockInContext(context, fn, "tier.catch")
+                                       : NULL;
+    LLVMPositionBuilderAtEnd(builder, entryBB);
+    DebugScope outer = debug_begin_function(fn, loop->line);
+    int savedSsa = ssa_mode;
+    ssa_mode = 0;
+    currentInstance = NULL;
+    push_scope();
+    for (int i = 0; i < count; i++) {
+        LLVMValueRef index = LLVMConstInt(i32, i, 0);
+        LLVMValueRef slot = LLVMBuildGEP2(builder, i8ptr, LLVMGetParam(fn, 0), &index, 1, "");
+        LLVMValueRef raw = LLVMBuildLoad2(builder, i8ptr, slot, "");
+        LLVMTypeRef ptrTy = LLVMPointerType(tier_var_type(vars[i].type), 0);
+        bind_variable(vars[i].name, LLVMBuildBitCast(builder, raw, ptrTy, vars[i].name));
+    }
+    generate_statement(loop, entryBB, catchBB);
+    LLVMBuildRet(builder, LLVMConstInt(i32, 0, 0));
+    if (catchBB) {
+        LLVMPositionBuilderAtEnd(builder, catchBB);
+        LLVMBuildRet(builder, LLVMConstInt(i32, 1, 0));
+    }
+    pop_scope();
+    ssa_mode = savedSsa;
+    debug_end_function(outer);
+    debug_end_module();
+    count_generated(module, 0);
+    phase_end(PHASE_CODEGEN);
+    phase_begin(PHASE_VERIFY);
+    verify_module(module);
+    phase_end(PHASE_VERIFY);
+    if (opt_level > 0) {
+        phase_begin(PHASE_OPTIMIZE);
+        optimize_module(module);
+        phase_end(PHASE_OPTIMIZE);
+    }
+    check_jit_error(LLVMOrcLLJITAddLLVMIRModule(tier.jit, tier.dylib,
+                        LLVMOrcCreateNewThreadSafeModule(module, jitContext)),
+                    "add loop");
+    module = mainModule;
+    currentFunction = NULL;
+    return tier_lookup(name);
+}
+
+void tier_end(void) {
+    if (!tier_started)
+        return;
+    stop_lazy_jit(&tier);
+    tier_started = 0;
+    debug_abandon();
+    LLVMDisposeBuilder(builder);
+    LLVMDisposeBuilder(allocaBuilder);
+    builder = allocaBuilder = NULL;
+    LLVMDisposeModule(mainModule);
+    module = mainModule = NULL;
+    free(units);
+    units = NULL;
+    unit_count = unit_cap = 0;
+    free_symtab();
+    LLVMOrcDisposeThreadSafeContext(jitContext);
+    context = NULL;
+}
+
+// The arena does not zero memory. Nodes fold makes keep position 0; the
+// parser sets its own with expr_at() and stmt_at()
+Stmt* new_stmt(StmtType type) {
+    Stmt* s = arena_alloc(&ast_arena, sizeof(Stmt));
+    ast_nodes++;
+    s->type = type;
+    s->line = s->column = 0;
+    return s;
+}
+
+Expr* new_expr(ExprType type) {
+    Expr* e = arena_alloc(&ast_arena, sizeof(Expr));
+    ast_nodes++;
+    e->type = type;
+    e->line = e->column = 0;
+    return e;
+}
+
+Expr* new_binop(BinOp op, Expr* left, Expr* right) {
+    Expr* e = new_expr(EXPR_BINOP);
+    e->binop.op = op;
+    e->binop.left = left;
+    e->binop.right = right;
+    return e;
+}
+
+// List storage lives in the arena too; growing doubles the capacity and
+// abandons the old array, which costs at most as much as the final array
+static void* grow_array(void* items, int count, int* cap, size_t elem) {
+    int newCap = *cap ? *cap * 2 : 1;
+    void* grown = arena_alloc(&ast_arena, newCap * elem);
+    if (count)
+        memcpy(grown, items, count * elem);
+    *cap = newCap;
+    return grown;
 }
 
 StmtList make_stmt_list(int cnt, Stmt** arr) {
-    StmtList list;
-    list.stmts = malloc(cnt * sizeof(Stmt*));
-    memcpy(list.stmts, arr, cnt * sizeof(Stmt*));
-    list.count = cnt;
+    StmtList list = { NULL, 0, 0 };
+    for (int i = 0; i < cnt; i++)
+        add_stmt(&list, arr[i]);
     return list;
 }
 
 void add_stmt(StmtList* L, Stmt* s) {
-    LLVMBasicBlockRef currentBB = LLVMGetInsertBlock(builder);
-    L->stmts = realloc(L->stmts, (L->count + 1) * sizeof(Stmt*));
+    if (L->count == L->cap)
+        L->stmts = grow_array(L->stmts, L->count, &L->cap, sizeof(Stmt*));
     L->stmts[L->count++] = s;
 }
+
+void add_param(ParamList* L, char* name) {
+    if (L->count == L->cap)
+        L->args = grow_array(L->args, L->count, &L->cap, sizeof(char*));
+    L->args[L->count++] = name;
+}
+
+void add_expr(ExprList* L, Expr* e) {
+    if (L->count == L->cap)
+        L->exprs = grow_array(L->exprs, L->count, &L->cap, sizeof(Expr*));
+    L->exprs[L->count++] = e;
+}
+
+// Appends "-> stage" to a pipeline; the first stage turns the range(from, to)
+// call on its left into the pipeline's source
+Expr* add_pipeline_stage(Expr* source, char* stage, char* func_name) {
+    Expr* e = source;
+    if (e->type != EXPR_PIPELINE) {
+        if (e->type != EXPR_FUNC_CALL || strcmp(e->func_call.func_name, "range") ||
+            e->func_call.args.count != 2) {
+            compile_error_at(source->line, source->column, "Pipeline must start with range(from, to)\n");
+            compile_failed();
+        }
+        e = new_expr(EXPR_PIPELINE);
+        e->pipeline.from = source->func_call.args.exprs[0];
+        e->pipeline.to = source->func_call.args.exprs[1];
+        e->pipeline.stages = (StageList){ NULL, 0, 0 };
+        e->pipeline.sink = SINK_NONE;
+    }
+    if (e->pipeline.sink != SINK_NONE) {
+        compile_error_at(source->line, source->column, "Pipeline stage after sink: %s\n", stage);
+        compile_failed();
+    }
+
+    if (!func_name) {
+        if (!strcmp(stage, "sum"))
+            e->pipeline.sink = SINK_SUM;
+        else if (!strcmp(stage, "count"))
+            e->pipeline.sink = SINK_COUNT;
+        else {
+            compile_error_at(source->line, source->column, "Unknown pipeline sink: %s\n", stage);
+            compile_failed();
+        }
+        return e;
+    }
+
+    StageKind kind;
+    if (!strcmp(stage, "map"))
+        kind = STAGE_MAP;
+    else if (!strcmp(stage, "filter"))
+        kind = STAGE_FILTER;
+    else {
+        compile_error_at(source->line, source->column, "Unknown pipeline stage: %s\n", stage);
+        compile_failed();
+    }
+    StageList* L = &e->pipeline.stages;
+    if (L->count == L->cap)
+        L->stages = grow_array(L->stages, L->count, &L->cap, sizeof(Stage));
+    L->stages[L->count++] = (Stage){ .kind = kind, .func_name = func_name };
+    return e;
+}
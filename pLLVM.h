@@ -3,38 +3,224 @@
 #ifndef PLLVM_H
 #define PLLVM_H
 #include <llvm-c/Core.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/TargetMachine.h>
+#include <setjmp.h>
+#include <stdio.h>
 
 typedef struct Expr Expr;
 typedef struct Stmt Stmt;
 
+// Bump-pointer arena; the whole AST (nodes and list storage) lives in
+// ast_arena and is released in one arena_free() after codegen
+typedef struct ArenaBlock ArenaBlock;
+typedef struct {
+    ArenaBlock* head;
+    char*       ptr;
+    char*       end;
+} Arena;
+
 typedef struct {
     Stmt** stmts;
     int count;
+    int cap;
 } StmtList;
 
+// Names are interned (see intern()), so symbols are keyed by pointer
 typedef struct {
-    char     *name;
-    LLVMValueRef ptr;
+    const char  *name;
+    LLVMValueRef ptr;        // alloca, or the current value in --ssa mode
+    int          shadowed;   // index of the binding this one hides, or -1
 } Symbol;
 
+typedef struct {
+    const char *name;
+    int         index;       // innermost binding in SymbolTable.symbols, or -1
+} NameSlot;
+
+typedef struct {
+    Symbol   *symbols;       // binding stack
+    int       count, cap;
+    int      *scopes;        // binding stack height at each push_scope()
+    int       scope_count, scope_cap;
+    NameSlot *slots;         // open-addressing name -> binding index
+    int       slot_used, slot_cap;
+    int       base;          // codegen: bindings below it belong to enclosing functions
+} SymbolTable;
+
 typedef struct {
     char** args;
     int count;
+    int cap;
 } ParamList;
 
 typedef struct {
     Expr** exprs;
     int count;
+    int cap;
 } ExprList;
 
-extern Symbol         symtab[128];
-extern int            symcount;
-extern LLVMBuilderRef builder;
-extern LLVMContextRef context;
-extern LLVMModuleRef  module;
-extern LLVMValueRef   currentFunction;
-extern LLVMValueRef   printfFn;
-extern StmtList       global_program;
+typedef enum {
+    EMIT_LL,
+    EMIT_BC,
+    EMIT_OBJ,
+    EMIT_EXE
+} EmitFormat;
+
+typedef enum {
+    REPORT_NONE,
+    REPORT_TEXT,
+    REPORT_JSON
+} ReportFormat;
+
+// --time-report phases, in pipeline order
+typedef enum {
+    PHASE_SETUP,
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_FOLD,
+    PHASE_CODEGEN,
+    PHASE_VERIFY,
+    PHASE_OPTIMIZE,
+    PHASE_EMIT,
+    PHASE_RUN,
+    PHASE_COUNT
+} Phase;
+
+typedef struct {
+    unsigned long source_bytes;
+    unsigned long tokens;
+    unsigned long ast_nodes;
+    unsigned long symbol_lookups;
+    unsigned long functions;               // defined, as generated
+    unsigned long basic_blocks;
+    unsigned long instructions;
+    unsigned long instructions_optimized;  // after -O1..-O3
+    unsigned long cache_hits;              // --cache lookups, functions and main
+    unsigned long cache_misses;
+    unsigned long calls_evaluated;         // constant calls to pure functions (pure.c)
+    unsigned long tail_loops;              // self tail calls generated as branches
+    unsigned long tail_calls;              // other calls in return position, marked tail
+} CompileStats;
+
+// Program text as the lexer scans it, followed by two NUL bytes (flex's
+// yy_scan_buffer() needs them); mapped from regular files, else read
+typedef struct {
+    char*  text;
+    size_t size;        // without the NULs
+    size_t mapped;      // length of the mapping, or 0 if text was malloc'd
+} Source;
+
+// --cache entry name: 128 bits of AST and option hash
+typedef struct {
+    unsigned long long a, b;
+} CacheKey;
+
+// Static types of the interpreter's values (interp.c)
+typedef enum {
+    VAL_BOOL,
+    VAL_INT,
+    VAL_FLOAT,
+    VAL_INT_ARRAY,
+    VAL_FLOAT_ARRAY
+} ValueType;
+
+// Static types from inference (infer.c). Bools passed to or returned from
+// functions travel as ints
+typedef enum {
+    TY_NONE,        // not known
+    TY_BOOL,
+    TY_INT,
+    TY_LONG,        // 64-bit: literals past 32 bits, long(x), and what they reach
+    TY_FLOAT,
+    TY_INT_ARRAY,
+    TY_FLOAT_ARRAY
+} TypeKind;
+
+// input builtins: input(), input_float(), has_input(), read_ints(n) and
+// read_floats(n), which read numbers through chainrt.c
+typedef enum {
+    INPUT_NONE,
+    INPUT_INT,
+    INPUT_FLOAT,
+    INPUT_MORE,
+    INPUT_INTS,
+    INPUT_FLOATS
+} InputKind;
+
+// One specialization of a function, for one list of argument types it is
+// called with. The all-int one keeps the function's name; the others are
+// name.<signature>, e.g. scale.f or add.il
+typedef struct Instance {
+    Stmt*            decl;      // NULL for main
+    TypeKind*        params;
+    TypeKind         ret;
+    TypeKind*        vars;      // by slot: the parameters, then each let
+    int              var_count;
+    char*            symbol;
+    int              pure;      // no effects and no arrays (pure.c)
+    struct Instance* next;      // decl's other instances
+} Instance;
+
+// A variable that a while loop handed to the JIT (--tier) shares with the
+// interpreter; the loop reads and writes it in the interpreter's register
+typedef struct {
+    const char* name;
+    ValueType   type;
+} TierVar;
+
+// The debug scope and location debug_begin_function() replaced, for
+// debug_end_function() to restore
+typedef struct {
+    LLVMMetadataRef scope;
+    LLVMMetadataRef location;
+} DebugScope;
+
+// Codegen state is per thread so -j workers can generate functions side by
+// side, and batch mode can compile several programs at once
+extern _Thread_local SymbolTable    symtab;
+extern _Thread_local LLVMBuilderRef builder;
+extern _Thread_local LLVMContextRef context;
+extern _Thread_local LLVMModuleRef  module;
+extern _Thread_local LLVMModuleRef  mainModule;
+extern _Thread_local LLVMValueRef   currentFunction;
+extern _Thread_local LLVMTargetMachineRef targetMachine;
+extern _Thread_local StmtList global_program;
+extern _Thread_local Arena    ast_arena;
+extern _Thread_local Instance* main_instance;
+extern int            opt_level;
+extern int            opt_report;
+extern int            run_jit;
+extern int            ssa_mode;
+extern int            exit_status;
+extern EmitFormat     emit_format;
+extern _Thread_local const char* output_path;
+extern int            codegen_jobs;
+extern int            batch_jobs;
+extern int            interp_mode;
+extern unsigned       tier_threshold;
+extern ReportFormat   time_report;
+extern ReportFormat   stats_report;
+extern CompileStats   stats;
+extern const char*    cache_dir;
+extern int            debug_info;
+extern int            perf_map;
+extern int            jitdump;
+extern _Thread_local const char* debug_source;
+extern const char*    profile_generate;
+extern const char*    profile_use;
+extern _Thread_local unsigned long symbol_lookups;
+extern _Thread_local unsigned long ast_nodes;
+extern _Thread_local unsigned long calls_evaluated;
+extern _Thread_local unsigned long tail_loops;
+extern _Thread_local unsigned long tail_calls;
+extern _Thread_local unsigned long lexed_tokens;
+extern _Thread_local unsigned long lexed_bytes;
+extern _Thread_local jmp_buf*      compile_recovery;
+
+// The node semantic errors are reported at, like debug_enter()'s location
+typedef struct { int line, column; } ErrorPos;
+extern _Thread_local ErrorPos      error_pos;
 
 typedef enum {
     STMT_LET,
@@ -45,44 +231,111 @@ typedef enum {
     STMT_FUNC_DECL,
     STMT_RETURN,
     STMT_TRY_CATCH,
-    STMT_WHILE
+    STMT_WHILE,
+    STMT_INDEX_ASSIGN
 } StmtType;
 
 typedef enum {
     EXPR_INT,
     EXPR_FLOAT,
+    EXPR_LONG,     // int literal too big for 32 bits
     EXPR_VAR,
     EXPR_BINOP,
     EXPR_UNARYOP,  // Added for unary operations
-    EXPR_FUNC_CALL
+    EXPR_FUNC_CALL,
+    EXPR_BOOL,     // i1 literal (ival 0/1) produced by constant folding
+    EXPR_PIPELINE, // range(from, to) -> stage -> ... -> sink
+    EXPR_ARRAY,    // [e1, e2, ...]
+    EXPR_INDEX     // a[i]
 } ExprType;
 
+typedef enum {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_GT,
+    OP_LE,
+    OP_GE,
+    OP_AND,
+    OP_OR
+} BinOp;
+
+typedef enum {
+    OP_NOT
+} UnaryOp;
+
+typedef enum {
+    STAGE_MAP,
+    STAGE_FILTER
+} StageKind;
+
+typedef enum {
+    SINK_NONE,
+    SINK_SUM,
+    SINK_COUNT
+} SinkKind;
+
+typedef struct {
+    StageKind kind;
+    char* func_name;
+    Stmt* decl;         // what func_name resolves to (infer.c)
+} Stage;
+
+typedef struct {
+    Stage* stages;
+    int count;
+    int cap;
+} StageList;
+
+// line and column (from 1) are where a node starts in the source; nodes
+// made by fold have none (0)
 struct Expr {
     ExprType type;
+    int      line, column;
     union {
         int ival;
         float fval;
+        long long lval;
         char* var_name;
         struct {
-            char* op;
+            BinOp op;
             Expr* left;
             Expr* right;
         } binop;
         struct {
-            char* op;
+            UnaryOp op;
             Expr* operand;
         } unaryop;  // Added for unary operations
         struct {
             char* func_name;
             ExprList args;
+            Stmt* decl;     // the function called, or NULL (infer.c)
         } func_call;
+        struct {
+            Expr* from;
+            Expr* to;
+            StageList stages;
+            SinkKind sink;
+        } pipeline;
+        struct {
+            ExprList elems;
+        } array;
+        struct {
+            Expr* array;
+            Expr* index;
+        } index;
     };
 };
 
 struct Stmt {
     StmtType type;
+    int      line, column;
     union {
-        struct { char* name; Expr* expr; } let;
+        struct { char* name; Expr* expr; int slot; } let;
         struct { char* name; Expr* expr; } assign;
         struct { Expr* expr; } output;
         struct { Expr* cond; StmtList then_stmt; StmtList else_stmt; } if_stmt;
@@ -91,30 +344,136 @@ struct Stmt {
             int start;
             int end;
             StmtList body;
+            int parallel;   // parallel for: chunks of the range run on the runtime's pool
         } for_stmt;
         struct {
             char* name;
             ParamList params;
             StmtList body;
+            int var_count;          // parameters and lets
+            Instance* instances;
+            int memo;               // memo function: results kept in a table
+            int pure;               // no output, arrays or outer writes, and pure callees
+            int returns;            // no while and no recursion: always returns
         } func_decl;
         struct {
             Expr* expr;
         } return_stmt;
         struct { StmtList try_stmt; StmtList catch_stmt; } try_catch;
         struct { Expr* cond; StmtList body; } while_stmt;
+        struct { char* name; Expr* index; Expr* expr; } index_assign;
     };
 };
 
+void* arena_alloc(Arena* a, size_t size);
+void arena_free(Arena* a);
+Stmt* new_stmt(StmtType type);
+Expr* new_expr(ExprType type);
+Expr* new_binop(BinOp op, Expr* left, Expr* right);
+Expr* add_pipeline_stage(Expr* source, char* stage, char* func_name);
 StmtList make_stmt_list(int cnt, Stmt** arr);
 void add_stmt(StmtList* L, Stmt* s);
+void add_param(ParamList* L, char* name);
+void add_expr(ExprList* L, Expr* e);
+void fold_program(StmtList* program);
+void infer_program(StmtList program);
+Instance* find_instance(Stmt* decl, const TypeKind* args);
+void pure_program(StmtList program);
+void init_target(void);
+void begin_codegen_thread(void);
+void end_codegen_thread(void);
 void init_codegen();
 void finalize_codegen();
+void abandon_codegen(void);
+_Noreturn void compile_failed(void);
+ErrorPos error_enter(int line, int column);
+void error_leave(ErrorPos outer);
+void compile_error(const char* fmt, ...);
+void compile_error_at(int line, int column, const char* fmt, ...);
+int compile_file(const char* path);
+int load_source(Source* src, int fd);
+void release_source(Source* src);
+void abandon_compile(void);
+int run_batch(char** files, int count, int from_stdin);
+char* output_name(const char* input);
 void generate_program(StmtList program);
 void generate_statement(Stmt* s, LLVMBasicBlockRef currentBB, LLVMBasicBlockRef catchBB);
 LLVMValueRef generate_expression(Expr* e, LLVMBasicBlockRef catchBB);
 LLVMValueRef create_int(int n);
 LLVMValueRef create_float(float f);
 LLVMValueRef get_variable(const char* name);
+LLVMValueRef get_instance(Instance* inst);
 void declare_variable(const char* name, LLVMValueRef val);
+const char* intern(const char* s);
+const char* intern_len(const char* s, size_t len);
+void free_interned(void);
+unsigned hash_name(const char* name);
+void free_symtab(void);
+void table_bind(SymbolTable* t, const char* name, LLVMValueRef ptr);
+int table_lookup(SymbolTable* t, const char* name);
+void table_truncate(SymbolTable* t, int count);
+void table_free(SymbolTable* t);
+void push_scope(void);
+void pop_scope(void);
+int push_function_scope(void);
+void pop_function_scope(int outer_base);
+void bind_variable(const char* name, LLVMValueRef ptr);
+int lookup_variable_index(const char* name);
+LLVMValueRef lookup_variable(const char* name);
+LLVMValueRef get_runtime_function(const char* name, LLVMTypeRef type);
+void add_function_attribute(LLVMValueRef fn, const char* name);
+void generate_output_value(LLVMValueRef val);
+InputKind input_builtin(const char* name, int args);
+LLVMValueRef generate_input(InputKind kind, LLVMValueRef count);
+void branch_to_catch(LLVMValueRef fail, LLVMBasicBlockRef catchBB, const char* name);
+int is_array_type(LLVMTypeRef t);
+int is_array_builtin(const char* name);
+LLVMTypeRef array_type(LLVMTypeRef elem);
+unsigned lanes_for_features(const char* features);
+LLVMValueRef generate_array_literal(ExprList elems, LLVMBasicBlockRef catchBB);
+LLVMValueRef generate_array_new(LLVMValueRef length);
+LLVMValueRef generate_array_input(int isFloat, LLVMValueRef length);
+LLVMValueRef array_element_ptr(LLVMValueRef a, LLVMValueRef index, LLVMBasicBlockRef catchBB);
+LLVMValueRef generate_array_binop(BinOp op, LLVMValueRef left, LLVMValueRef right);
+LLVMValueRef generate_array_builtin(const char* name, LLVMValueRef arr);
+void generate_array_output(LLVMValueRef arr);
+int count_instructions(LLVMModuleRef m);
+void phase_begin(Phase phase);
+void phase_end(Phase phase);
+void count_generated(LLVMModuleRef m, int optimized);
+void merge_thread_stats(void);
+void print_reports(void);
+void optimize_module(LLVMModuleRef m);
+int callee_arity(const char* name);
+void cache_init(void);
+CacheKey cache_key_function(Stmt* decl);
+CacheKey cache_key_main(StmtList program);
+unsigned long long checksum_function(Stmt* decl);
+unsigned long long checksum_main(StmtList program);
+LLVMMemoryBufferRef cache_load(CacheKey key);
+void cache_store(CacheKey key, LLVMModuleRef m);
+void emit_output(LLVMModuleRef m);
+int interpret_program(StmtList program);
+void tier_begin(StmtList program);
+void* tier_function(const char* name);
+void* tier_loop(Stmt* loop, TierVar* vars, int count, int in_try);
+void tier_end(void);
+void debug_begin_module(LLVMModuleRef m);
+void debug_end_module(void);
+void debug_abandon(void);
+DebugScope debug_begin_function(LLVMValueRef fn, int line);
+void debug_end_function(DebugScope outer);
+LLVMMetadataRef debug_enter(int line, int column);
+void debug_leave(LLVMMetadataRef outer);
+LLVMOrcLLJITBuilderRef create_jit_builder(void);
+void write_perf_map(void);
+void load_profile(void);
+void profile_begin_function(LLVMValueRef fn, Stmt* decl);
+void profile_end_function(void);
+void profile_finish_main(void);
+int profile_site(void);
+int profile_site_if(LLVMValueRef cond);
+void profile_weights(LLVMValueRef branch, int taken, int other);
+void profile_layout(LLVMBasicBlockRef block, int site);
 
 #endif
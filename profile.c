@@ -0,0 +1,433 @@
+// profile.c - --profile-generate: counters the program bumps as it runs and
+// writes out at exit; --profile-use: branch weights, block layout and
+// inlining hints from those counts
+
+#include "pLLVM.h"
+#include "chainrt.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char* profile_generate = NULL;   // where the instrumented program writes its counts
+const char* profile_use = NULL;
+
+// One function's counts from --profile-use. Counter 0 is entries; the rest
+// are sites in the order codegen reached them
+typedef struct {
+    char*     name;
+    uint64_t  checksum;
+    int       count;
+    uint64_t* counts;
+} ProfileRecord;
+
+static ProfileRecord* records;
+static int            record_count;
+static int*           record_map;      // open addressing by name, -1 empty
+static int            record_map_cap;
+static uint64_t       hot_count;       // entry counts from here up are hot
+
+typedef struct {
+    LLVMValueRef branch;
+    int          taken, other;         // the sites counting each successor
+} WeightedBranch;
+
+typedef struct {
+    LLVMBasicBlockRef block;
+    int               site;
+} LaidOutBlock;
+
+// The function whose counters codegen is placing. Nested function
+// declarations stack; parallel for bodies count into their enclosing one
+typedef struct ProfiledFunction {
+    LLVMValueRef             fn;
+    const char*              name;
+    uint64_t                 checksum;
+    LLVMValueRef             counters;   // [0 x i64] stand-in until the site count is known
+    ProfileRecord*           record;
+    int                      sites;
+    WeightedBranch*          branches;
+    int                      branch_count, branch_cap;
+    LaidOutBlock*            blocks;
+    int                      block_count, block_cap;
+    struct ProfiledFunction* outer;
+} ProfiledFunction;
+
+static _Thread_local ProfiledFunction* profiled;
+
+static unsigned hash_string(const char* s) {
+    unsigned h = 2166136261u;
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+static ProfileRecord* find_record(const char* name) {
+    if (!record_map_cap)
+        return NULL;
+    unsigned i = hash_string(name) & (record_map_cap - 1);
+    while (record_map[i] >= 0) {
+        if (!strcmp(records[record_map[i]].name, name))
+            return &records[record_map[i]];
+        i = (i + 1) & (record_map_cap - 1);
+    }
+    return NULL;
+}
+
+static int compare_count(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// As LLVM's profile summary does: the smallest count among the sites that
+// together account for 99% of everything counted
+static void find_hot_count(void) {
+    int total = 0;
+    for (int i = 0; i < record_count; i++)
+        total += records[i].count;
+    uint64_t* all = malloc((total + 1) * sizeof(uint64_t));
+    uint64_t sum = 0;
+    int n = 0;
+    for (int i = 0; i < record_count; i++)
+        for (int j = 0; j < records[i].count; j++)
+            sum += all[n++] = records[i].counts[j];
+    qsort(all, n, sizeof(uint64_t), compare_count);
+    uint64_t seen = 0;
+    hot_count = UINT64_MAX;
+    for (int i = 0; i < n && all[i] && seen < sum / 100 * 99; i++) {
+        seen += all[i];
+        hot_count = all[i];
+    }
+    free(all);
+}
+
+// Reads profile_use (the format chain_profile_write() writes) before
+// anything is compiled
+void load_profile(void) {
+    FILE* in = fopen(profile_use, "r");
+    if (!in) {
+        perror(profile_use);
+        exit(1);
+    }
+    char* line = NULL;
+    size_t size = 0;
+    if (getline(&line, &size, in) < 0 || strcmp(line, CHAIN_PROFILE_HEADER "\n")) {
+        fprintf(stderr, "%s: not a ChainLang profile\n", profile_use);
+        exit(1);
+    }
+    int cap = 0;
+    while (getline(&line, &size, in) > 0) {
+        char* p = line;
+        char* end = strchr(p, ' ');
+        if (!end)
+            break;
+        // Separate statements: an initializer list's order of evaluation
+        // is unspecified, and each strto* moves p
+        uint64_t checksum = strtoull(end, &p, 16);
+        int count = (int)strtol(p, &p, 10);
+        ProfileRecord r = { strndup(line, end - line), checksum, count, NULL };
+        if (r.count <= 0) {
+            fprintf(stderr, "%s: bad profile record for %s\n", profile_use, r.name);
+            exit(1);
+        }
+        r.counts = malloc((r.count + 1) * sizeof(uint64_t));
+        for (int i = 0; i < r.count; i++)
+            r.counts[i] = strtoull(p, &p, 10);
+        if (record_count == cap) {
+            cap = cap ? cap * 2 : 16;
+            records = realloc(records, cap * sizeof(ProfileRecord));
+        }
+        records[record_count++] = r;
+    }
+    free(line);
+    fclose(in);
+
+    record_map_cap = 16;
+    while (record_map_cap < 2 * record_count)
+        record_map_cap *= 2;
+    record_map = malloc(record_map_cap * sizeof(int));
+    memset(record_map, -1, record_map_cap * sizeof(int));
+    for (int i = 0; i < record_count; i++) {
+        unsigned slot = hash_string(records[i].name) & (record_map_cap - 1);
+        while (record_map[slot] >= 0)
+            slot = (slot + 1) & (record_map_cap - 1);
+        record_map[slot] = i;
+    }
+    find_hot_count();
+}
+
+// counters[site] += amount (1, or cond zero-extended). Parallel for bodies
+// run on many threads, so they add atomically
+static int count_site(LLVMValueRef cond) {
+    if (!profiled)
+        return -1;
+    int site = profiled->sites++;
+    if (!profiled->counters)
+        return site;
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+    LLVMValueRef index[] = { LLVMConstInt(i64, 0, 0), LLVMConstInt(i64, site, 0) };
+    LLVMValueRef ptr = LLVMConstInBoundsGEP2(LLVMArrayType(i64, 0), profiled->counters, index, 2);
+    LLVMValueRef amount = cond ? LLVMBuildZExt(builder, cond, i64, "") : LLVMConstInt(i64, 1, 0);
+    if (LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder)) != profiled->fn) {
+        LLVMBuildAtomicRMW(builder, LLVMAtomicRMWBinOpAdd, ptr, amount, LLVMAtomicOrderingMonotonic, 0);
+    } else {
+        LLVMValueRef old = LLVMBuildLoad2(builder, i64, ptr, "");
+        LLVMBuildStore(builder, LLVMBuildAdd(builder, old, amount, ""), ptr);
+    }
+    return site;
+}
+
+// Counts arrivals at the builder's position; returns the site, or -1 when
+// nothing is profiled
+int profile_site(void) {
+    return count_site(NULL);
+}
+
+// Counts the times cond holds here, without branching on it
+int profile_site_if(LLVMValueRef cond) {
+    return count_site(cond);
+}
+
+// Starts the counters of fn, declared by decl (NULL for main); its entry
+// count is the first
+void profile_begin_function(LLVMValueRef fn, Stmt* decl) {
+    if (!profile_generate && !profile_use)
+        return;
+    ProfiledFunction* p = calloc(1, sizeof(ProfiledFunction));
+    size_t len;
+    p->fn = fn;
+    p->name = LLVMGetValueName2(fn, &len);
+    p->checksum = decl ? checksum_function(decl) : checksum_main(global_program);
+    p->outer = profiled;
+    profiled = p;
+    if (profile_generate) {
+        LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+        p->counters = LLVMAddGlobal(module, LLVMArrayType(i64, 0), "");
+    } else {
+        p->record = find_record(p->name);
+        if (p->record && p->record->checksum != p->checksum) {
+            fprintf(stderr, "%s: profile for %s does not match its code; not used\n",
+                    profile_use, p->name);
+            p->record = NULL;
+        }
+    }
+    count_site(NULL);
+}
+
+// branch's first successor is reached as often as site taken counts, its
+// second as other does
+void profile_weights(LLVMValueRef branch, int taken, int other) {
+    ProfiledFunction* p = profiled;
+    if (!p || !p->record)
+        return;
+    if (p->branch_count == p->branch_cap) {
+        p->branch_cap = p->branch_cap ? p->branch_cap * 2 : 16;
+        p->branches = realloc(p->branches, p->branch_cap * sizeof(WeightedBranch));
+    }
+    p->branches[p->branch_count++] = (WeightedBranch){ branch, taken, other };
+}
+
+// block, entered as often as site counts, moves to the end of its function
+// if it never ran
+void profile_layout(LLVMBasicBlockRef block, int site) {
+    ProfiledFunction* p = profiled;
+    if (!p || !p->record)
+        return;
+    if (p->block_count == p->block_cap) {
+        p->block_cap = p->block_cap ? p->block_cap * 2 : 16;
+        p->blocks = realloc(p->blocks, p->block_cap * sizeof(LaidOutBlock));
+    }
+    p->blocks[p->block_count++] = (LaidOutBlock){ block, site };
+}
+
+static LLVMMetadataRef md_int(LLVMTypeRef type, uint64_t n) {
+    return LLVMValueAsMetadata(LLVMConstInt(type, n, 0));
+}
+
+// Branch weights are 32-bit; scaled as clang does, keeping never-taken
+// edges at 1 rather than 0
+static void apply_weights(WeightedBranch* b, const uint64_t* counts) {
+    uint64_t taken = counts[b->taken], other = counts[b->other];
+    uint64_t most = taken > other ? taken : other;
+    uint64_t scale = most < UINT32_MAX ? 1 : most / UINT32_MAX + 1;
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMMetadataRef weights[] = {
+        LLVMMDStringInContext2(context, "branch_weights", 14),
+        md_int(i32, taken / scale + 1),
+        md_int(i32, other / scale + 1),
+    };
+    unsigned prof = LLVMGetMDKindIDInContext(context, "prof", 4);
+    LLVMSetMetadata(b->branch, prof, LLVMMetadataAsValue(context, LLVMMDNodeInContext2(context, weights, 3)));
+}
+
+static void apply_profile(ProfiledFunction* p) {
+    const uint64_t* counts = p->record->counts;
+    for (int i = 0; i < p->branch_count; i++)
+        apply_weights(&p->branches[i], counts);
+
+    // Never-run blocks (untaken if arms, catch blocks that never caught) go
+    // last, out of the way of the code that runs
+    if (counts[0])
+        for (int i = 0; i < p->block_count; i++)
+            if (!counts[p->blocks[i].site]) {
+                LLVMBasicBlockRef b = p->blocks[i].block;
+                LLVMMoveBasicBlockAfter(b, LLVMGetLastBasicBlock(LLVMGetBasicBlockParent(b)));
+            }
+
+    LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+    LLVMMetadataRef entry[] = {
+        LLVMMDStringInContext2(context, "function_entry_count", 20),
+        md_int(i64, counts[0]),
+    };
+    LLVMGlobalSetMetadata(p->fn, LLVMGetMDKindIDInContext(context, "prof", 4),
+                          LLVMMDNodeInContext2(context, entry, 2));
+    if (!strcmp(p->name, "main"))
+        return;
+    // Inline what is called often; keep what never ran out of its callers
+    if (counts[0] >= hot_count) {
+        add_function_attribute(p->fn, "hot");
+        add_function_attribute(p->fn, "inlinehint");
+    } else if (!counts[0]) {
+        add_function_attribute(p->fn, "cold");
+        add_function_attribute(p->fn, "noinline");
+    }
+}
+
+// Once fn is generated: with --profile-generate its counters get their real
+// size and a descriptor (a ChainProfile) the program can find them by; with
+// --profile-use the counts are applied if the sites still line up
+void profile_end_function(void) {
+    ProfiledFunction* p = profiled;
+    if (!p)
+        return;
+    if (p->counters) {
+        LLVMTypeRef i8p = LLVMPointerType(LLVMInt8TypeInContext(context), 0);
+        LLVMTypeRef i64 = LLVMInt64TypeInContext(context);
+        LLVMTypeRef fields[] = { i8p, i64, i64, LLVMArrayType(i64, p->sites) };
+        LLVMTypeRef descType = LLVMStructTypeInContext(context, fields, 4, 0);
+        char* descName = malloc(strlen(p->name) + sizeof(CHAIN_PROFILE_PREFIX));
+        sprintf(descName, CHAIN_PROFILE_PREFIX "%s", p->name);
+        LLVMValueRef desc = LLVMAddGlobal(module, descType, descName);
+        free(descName);
+
+        LLVMValueRef nameStr = LLVMConstStringInContext(context, p->name, strlen(p->name), 0);
+        LLVMValueRef nameVar = LLVMAddGlobal(module, LLVMTypeOf(nameStr), "");
+        LLVMSetInitializer(nameVar, nameStr);
+        LLVMSetGlobalConstant(nameVar, 1);
+        LLVMSetLinkage(nameVar, LLVMPrivateLinkage);
+        LLVMValueRef init[] = {
+            LLVMConstBitCast(nameVar, i8p),
+            LLVMConstInt(i64, p->checksum, 0),
+            LLVMConstInt(i64, p->sites, 0),
+            LLVMConstNull(fields[3]),
+        };
+        LLVMSetInitializer(desc, LLVMConstNamedStruct(descType, init, 4));
+
+        LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+        LLVMValueRef index[] = { LLVMConstInt(i32, 0, 0), LLVMConstInt(i32, 3, 0) };
+        LLVMValueRef counts = LLVMConstInBoundsGEP2(descType, desc, index, 2);
+        LLVMReplaceAllUsesWith(p->counters, LLVMConstBitCast(counts, LLVMTypeOf(p->counters)));
+        LLVMDeleteGlobal(p->counters);
+    } else if (p->record) {
+        if (p->record->count == p->sites)
+            apply_profile(p);
+        else
+            fprintf(stderr, "%s: profile for %s does not match its code; not used\n",
+                    profile_use, p->name);
+    }
+    profiled = p->outer;
+    free(p->branches);
+    free(p->blocks);
+    free(p);
+}
+
+static void collect_functions(StmtList list, const char*** names, int* count, int* cap) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        StmtList inner[2] = { { NULL, 0, 0 }, { NULL, 0, 0 } };
+        switch (s->type) {
+            case STMT_FUNC_DECL:
+                // Each instance counts on its own
+                for (Instance* inst = s->func_decl.instances; inst; inst = inst->next) {
+                    if (*count == *cap) {
+                        *cap = *cap ? *cap * 2 : 16;
+                        *names = realloc(*names, *cap * sizeof(char*));
+                    }
+                    (*names)[(*count)++] = inst->symbol;
+                }
+                inner[0] = s->func_decl.body;
+                break;
+            case STMT_IF:
+                inner[0] = s->if_stmt.then_stmt;
+                inner[1] = s->if_stmt.else_stmt;
+                break;
+            case STMT_FOR:
+                inner[0] = s->for_stmt.body;
+                break;
+            case STMT_WHILE:
+                inner[0] = s->while_stmt.body;
+                break;
+            case STMT_TRY_CATCH:
+                inner[0] = s->try_catch.try_stmt;
+                inner[1] = s->try_catch.catch_stmt;
+                break;
+            default:
+                break;
+        }
+        collect_functions(inner[0], names, count, cap);
+        collect_functions(inner[1], names, count, cap);
+    }
+}
+
+// --profile-generate: main writes every function's counts before each
+// return. Functions generated in their own modules (--run, -j) are declared
+// and resolved at link time
+void profile_finish_main(void) {
+    if (!profile_generate)
+        return;
+    const char** names = NULL;
+    int count = 0, cap = 0;
+    collect_functions(global_program, &names, &count, &cap);
+
+    LLVMTypeRef i8 = LLVMInt8TypeInContext(context);
+    LLVMTypeRef i8p = LLVMPointerType(i8, 0);
+    LLVMValueRef* descs = malloc((count + 1) * sizeof(LLVMValueRef));
+    for (int i = 0; i <= count; i++) {
+        const char* name = i ? names[i - 1] : "main";
+        char* descName = malloc(strlen(name) + sizeof(CHAIN_PROFILE_PREFIX));
+        sprintf(descName, CHAIN_PROFILE_PREFIX "%s", name);
+        LLVMValueRef desc = LLVMGetNamedGlobal(mainModule, descName);
+        if (!desc)
+            desc = LLVMAddGlobal(mainModule, i8, descName);
+        free(descName);
+        descs[i] = LLVMConstBitCast(desc, i8p);
+    }
+    LLVMValueRef table = LLVMAddGlobal(mainModule, LLVMArrayType(i8p, count + 1), "chain.profile");
+    LLVMSetInitializer(table, LLVMConstArray(i8p, descs, count + 1));
+    LLVMSetGlobalConstant(table, 1);
+    LLVMSetLinkage(table, LLVMPrivateLinkage);
+    free(descs);
+    free(names);
+
+    LLVMTypeRef i32 = LLVMInt32TypeInContext(context);
+    LLVMTypeRef params[] = { i8p, LLVMPointerType(i8p, 0), i32 };
+    LLVMTypeRef writeType = LLVMFunctionType(LLVMVoidTypeInContext(context), params, 3, 0);
+    LLVMValueRef write = get_runtime_function("chain_profile_write", writeType);
+    LLVMValueRef path = NULL;
+    LLVMValueRef zero[] = { LLVMConstInt(i32, 0, 0), LLVMConstInt(i32, 0, 0) };
+    LLVMValueRef mainFn = LLVMGetNamedFunction(mainModule, "main");
+    for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(mainFn); bb; bb = LLVMGetNextBasicBlock(bb)) {
+        LLVMValueRef ret = LLVMGetBasicBlockTerminator(bb);
+        if (!ret || LLVMGetInstructionOpcode(ret) != LLVMRet)
+            continue;
+        LLVMPositionBuilderBefore(builder, ret);
+        if (!path)
+            path = LLVMBuildGlobalStringPtr(builder, profile_generate, "chain.profile.path");
+        LLVMValueRef args[] = {
+            path,
+            LLVMConstInBoundsGEP2(LLVMArrayType(i8p, count + 1), table, zero, 2),
+            LLVMConstInt(i32, count + 1, 0),
+        };
+        LLVMBuildCall2(builder, writeType, write, args, 3, "");
+    }
+}
@@ -0,0 +1,906 @@
+// pure.c - which functions only compute their result: no output or input,
+// no arrays, no writes outside their own variables, and only pure callees. Codegen
+// marks their instances readnone, calls to them with constant arguments are
+// evaluated here at compile time, and `memo function` needs one
+
+#include "pLLVM.h"
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Evaluation steps (expressions and statements) one constant call may take,
+// and all of them in one program, before the call is left to run time
+#define CALL_STEPS    (1L << 20)
+#define PROGRAM_STEPS (1L << 24)
+#define MAX_DEPTH     1000
+
+static void* grow(void* items, int count, int* cap, size_t elem) {
+    if (count < *cap)
+        return items;
+    *cap = *cap ? *cap * 2 : 16;
+    return realloc(items, *cap * elem);
+}
+
+static unsigned hash_pointer(const void* p) {
+    unsigned long long h = (unsigned long long)(uintptr_t)p * 0x9e3779b97f4a7c15ull;
+    return (unsigned)(h >> 32);
+}
+
+/*
+ * Analysis. Each function is summarized once: what it calls, whether it
+ * has a while loop, and the first thing that makes it impure. Purity then
+ * only falls and termination only rises until neither changes, so
+ * recursive functions stay pure but are never known to return.
+ */
+
+typedef struct {
+    Stmt*       decl;
+    Stmt**      callees;
+    int         callee_count, callee_cap;
+    int         loops;
+    const char* why;        // first reason it is not pure, or NULL
+    const char* what;       // the name involved, if any
+} Summary;
+
+static _Thread_local Summary*     summaries;
+static _Thread_local int          summary_count, summary_cap;
+static _Thread_local Summary*     summary;    // the one being collected
+static _Thread_local SymbolTable  names;      // its variables in scope
+
+static void impure(const char* why, const char* what) {
+    if (!summary->why) {
+        summary->why = why;
+        summary->what = what;
+    }
+}
+
+static void add_callee(Stmt* decl) {
+    summary->callees = grow(summary->callees, summary->callee_count, &summary->callee_cap,
+                            sizeof(Stmt*));
+    summary->callees[summary->callee_count++] = decl;
+}
+
+static void add_name(const char* name) {
+    table_bind(&names, name, NULL);
+}
+
+static int is_local(const char* name) {
+    return table_lookup(&names, name) >= 0;
+}
+
+static void scan_expr(Expr* e) {
+    switch (e->type) {
+        case EXPR_BINOP:
+            scan_expr(e->binop.left);
+            scan_expr(e->binop.right);
+            break;
+        case EXPR_UNARYOP:
+            scan_expr(e->unaryop.operand);
+            break;
+        case EXPR_FUNC_CALL: {
+            const char* name = e->func_call.func_name;
+            if (input_builtin(name, e->func_call.args.count))
+                impure("reads input", NULL);
+            else if (e->func_call.decl)
+                add_callee(e->func_call.decl);
+            else if (!strcmp(name, "array") || is_array_builtin(name))
+                impure("uses arrays", NULL);
+            else if (strcmp(name, "long"))
+                impure("calls undefined", name);
+            for (int i = 0; i < e->func_call.args.count; i++)
+                scan_expr(e->func_call.args.exprs[i]);
+            break;
+        }
+        case EXPR_PIPELINE:
+            scan_expr(e->pipeline.from);
+            scan_expr(e->pipeline.to);
+            for (int i = 0; i < e->pipeline.stages.count; i++) {
+                Stage* st = &e->pipeline.stages.stages[i];
+                if (st->decl)
+                    add_callee(st->decl);
+                else
+                    impure("calls undefined", st->func_name);
+            }
+            break;
+        case EXPR_ARRAY:
+        case EXPR_INDEX:
+            impure("uses arrays", NULL);
+            break;
+        default:
+            break;
+    }
+}
+
+static void scan_list(StmtList list);
+
+static void scan_scoped(StmtList list) {
+    int mark = names.count;
+    scan_list(list);
+    table_truncate(&names, mark);
+}
+
+static void scan_stmt(Stmt* s) {
+    switch (s->type) {
+        case STMT_LET:
+            scan_expr(s->let.expr);
+            add_name(s->let.name);
+            break;
+        case STMT_ASSIGN:
+            scan_expr(s->assign.expr);
+            if (!is_local(s->assign.name))
+                impure("assigns", s->assign.name);
+            break;
+        case STMT_INDEX_ASSIGN:
+            impure("uses arrays", NULL);
+            break;
+        case STMT_OUTPUT:
+            impure("has output", NULL);
+            break;
+        case STMT_IF:
+            scan_expr(s->if_stmt.cond);
+            scan_scoped(s->if_stmt.then_stmt);
+            scan_scoped(s->if_stmt.else_stmt);
+            break;
+        case STMT_FOR: {
+            if (s->for_stmt.parallel)
+                impure("runs a parallel for", NULL);
+            int mark = names.count;
+            add_name(s->for_stmt.var);
+            scan_scoped(s->for_stmt.body);
+            table_truncate(&names, mark);
+            break;
+        }
+        case STMT_WHILE:
+            summary->loops = 1;
+            scan_expr(s->while_stmt.cond);
+            scan_scoped(s->while_stmt.body);
+            break;
+        case STMT_TRY_CATCH:
+            scan_scoped(s->try_catch.try_stmt);
+            scan_scoped(s->try_catch.catch_stmt);
+            break;
+        case STMT_RETURN:
+            if (s->return_stmt.expr)
+                scan_expr(s->return_stmt.expr);
+            break;
+        case STMT_FUNC_DECL:
+            // Summarized on its own
+            break;
+    }
+}
+
+static void scan_list(StmtList list) {
+    for (int i = 0; i < list.count; i++)
+        scan_stmt(list.stmts[i]);
+}
+
+static void summarize(Stmt* decl) {
+    summaries = grow(summaries, summary_count, &summary_cap, sizeof(Summary));
+    summary = &summaries[summary_count++];
+    *summary = (Summary){ decl, NULL, 0, 0, 0, NULL, NULL };
+    table_truncate(&names, 0);
+    for (int i = 0; i < decl->func_decl.params.count; i++)
+        add_name(decl->func_decl.params.args[i]);
+    scan_list(decl->func_decl.body);
+}
+
+static void summarize_list(StmtList list) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_FUNC_DECL:
+                summarize(s);
+                summarize_list(s->func_decl.body);
+                break;
+            case STMT_IF:
+                summarize_list(s->if_stmt.then_stmt);
+                summarize_list(s->if_stmt.else_stmt);
+                break;
+            case STMT_FOR:
+                summarize_list(s->for_stmt.body);
+                break;
+            case STMT_WHILE:
+                summarize_list(s->while_stmt.body);
+                break;
+            case STMT_TRY_CATCH:
+                summarize_list(s->try_catch.try_stmt);
+                summarize_list(s->try_catch.catch_stmt);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static int is_array_kind(TypeKind t) {
+    return t == TY_INT_ARRAY || t == TY_FLOAT_ARRAY;
+}
+
+static void analyze(void) {
+    for (int i = 0; i < summary_count; i++) {
+        summaries[i].decl->func_decl.pure = !summaries[i].why;
+        summaries[i].decl->func_decl.returns = 0;
+    }
+    int changed;
+    do {
+        changed = 0;
+        for (int i = 0; i < summary_count; i++) {
+            Summary* s = &summaries[i];
+            Stmt* decl = s->decl;
+            int returns = !s->loops;
+            for (int j = 0; j < s->callee_count; j++) {
+                Stmt* callee = s->callees[j];
+                if (decl->func_decl.pure && !callee->func_decl.pure) {
+                    decl->func_decl.pure = 0;
+                    s->why = "calls";
+                    s->what = callee->func_decl.name;
+                    changed = 1;
+                }
+                returns &= callee != decl && callee->func_decl.returns;
+            }
+            if (returns && !decl->func_decl.returns) {
+                decl->func_decl.returns = 1;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    // An instance that takes or makes arrays reads and writes memory
+    for (int i = 0; i < summary_count; i++) {
+        Stmt* decl = summaries[i].decl;
+        for (Instance* inst = decl->func_decl.instances; inst; inst = inst->next) {
+            inst->pure = decl->func_decl.pure && !is_array_kind(inst->ret);
+            for (int j = 0; j < inst->var_count; j++)
+                inst->pure &= !is_array_kind(inst->vars[j]);
+            if (decl->func_decl.memo && !inst->pure) {
+                compile_error_at(decl->line, decl->column, "memo function %s ", decl->func_decl.name);
+                if (decl->func_decl.pure)
+                    fprintf(stderr, "cannot take arrays\n");
+                else if (summaries[i].what)
+                    fprintf(stderr, "is not pure: it %s %s\n", summaries[i].why, summaries[i].what);
+                else
+                    fprintf(stderr, "is not pure: it %s\n", summaries[i].why);
+                compile_failed();
+            }
+        }
+    }
+}
+
+/*
+ * Evaluation of calls to pure instances with literal arguments, exactly as
+ * the generated code would compute them: ints wrap at 32 or 64 bits, floats
+ * round to single precision, and a zero divisor inside try goes to catch.
+ * Anything codegen would reject, or that would trap at run time, leaves the
+ * call in place.
+ */
+
+typedef struct {
+    TypeKind  type;
+    long long i;        // ints and bools, sign-extended
+    float     f;
+} Value;
+
+typedef enum {
+    EV_OK,
+    EV_RETURN,
+    EV_CATCH,           // a zero divisor inside try
+    EV_FAIL
+} Outcome;
+
+typedef struct {
+    const char* name;
+    Value       value;
+} Binding;
+
+// Results of memo instances, so `memo function` recursion evaluates in
+// linear time here as it runs at run time
+typedef struct {
+    Instance*  inst;
+    long long* args;
+    Value      result;
+} Memo;
+
+static _Thread_local Binding*  env;
+static _Thread_local int       env_count, env_cap;
+static _Thread_local SymbolTable env_names;     // env[i] is bound as env_names.symbols[i]
+static _Thread_local int       frame;            // env index of the current call's parameters
+static _Thread_local Instance* evaluating;
+static _Thread_local long      steps, program_steps;
+static _Thread_local int       depth;
+static _Thread_local Memo*     memos;
+static _Thread_local int       memo_count, memo_cap;
+
+static Value make_value(TypeKind type, long long i) {
+    Value v = { type, 0, 0 };
+    v.i = type == TY_INT ? (int)(unsigned)(unsigned long long)i : i;
+    return v;
+}
+
+static int spend(void) {
+    return --steps >= 0;
+}
+
+static int is_literal(Expr* e) {
+    return e->type == EXPR_INT || e->type == EXPR_LONG || e->type == EXPR_FLOAT ||
+           e->type == EXPR_BOOL;
+}
+
+static Value literal(Expr* e) {
+    switch (e->type) {
+        case EXPR_LONG:
+            return make_value(TY_LONG, e->lval);
+        case EXPR_FLOAT: {
+            Value v = { TY_FLOAT, 0, e->fval };
+            return v;
+        }
+        case EXPR_BOOL:
+            return make_value(TY_BOOL, e->ival);
+        default:
+            return make_value(TY_INT, e->ival);
+    }
+}
+
+// As convert_value() in codegen: bools widen to ints, ints to 64 bits
+static int convert(Value* v, TypeKind type) {
+    if (v->type == type)
+        return 1;
+    if ((v->type == TY_BOOL && (type == TY_INT || type == TY_LONG)) ||
+        (v->type == TY_INT && type == TY_LONG)) {
+        v->type = type;
+        return 1;
+    }
+    return 0;
+}
+
+// Conditions are ints or bools; codegen rejects floats
+static int truth(Value v, int* out) {
+    if (v.type == TY_FLOAT)
+        return 0;
+    *out = v.i != 0;
+    return 1;
+}
+
+// Only the current call's bindings are visible
+static Binding* find_binding(const char* name) {
+    int i = table_lookup(&env_names, name);
+    return i >= frame ? &env[i] : NULL;
+}
+
+static void push_binding(const char* name, Value v) {
+    env = grow(env, env_count, &env_cap, sizeof(Binding));
+    env[env_count++] = (Binding){ name, v };
+    table_bind(&env_names, name, NULL);
+}
+
+static void pop_bindings(int mark) {
+    env_count = mark;
+    table_truncate(&env_names, mark);
+}
+
+static Outcome eval_expr(Expr* e, int in_try, Value* out);
+static Outcome eval_call(Instance* inst, Value* args, Value* out);
+
+static Outcome eval_arith(BinOp op, Value l, Value r, int in_try, Value* out) {
+    if (l.type == TY_LONG && r.type == TY_INT)
+        r.type = TY_LONG;
+    else if (l.type == TY_INT && r.type == TY_LONG)
+        l.type = TY_LONG;
+    if (l.type != r.type || (l.type != TY_INT && l.type != TY_LONG && l.type != TY_FLOAT))
+        return EV_FAIL;
+    if (l.type == TY_FLOAT) {
+        float a = l.f, b = r.f, f;
+        int unordered = isnan(a) || isnan(b);
+        switch (op) {
+            case OP_ADD: f = a + b; break;
+            case OP_SUB: f = a - b; break;
+            case OP_MUL: f = a * b; break;
+            case OP_DIV: f = a / b; break;
+            case OP_EQ:  *out = make_value(TY_BOOL, a == b); return EV_OK;
+            case OP_NE:  *out = make_value(TY_BOOL, !unordered && a != b); return EV_OK;
+            case OP_LT:  *out = make_value(TY_BOOL, a < b); return EV_OK;
+            case OP_GT:  *out = make_value(TY_BOOL, a > b); return EV_OK;
+            case OP_LE:  *out = make_value(TY_BOOL, a <= b); return EV_OK;
+            case OP_GE:  *out = make_value(TY_BOOL, a >= b); return EV_OK;
+            default:     return EV_FAIL;
+        }
+        *out = (Value){ TY_FLOAT, 0, f };
+        return EV_OK;
+    }
+    unsigned long long a = l.i, b = r.i;
+    long long min = l.type == TY_INT ? INT_MIN : LLONG_MIN;
+    switch (op) {
+        case OP_ADD: *out = make_value(l.type, (long long)(a + b)); return EV_OK;
+        case OP_SUB: *out = make_value(l.type, (long long)(a - b)); return EV_OK;
+        case OP_MUL: *out = make_value(l.type, (long long)(a * b)); return EV_OK;
+        case OP_DIV:
+            if (r.i == 0)
+                return in_try ? EV_CATCH : EV_FAIL;
+            if (l.i == min && r.i == -1)
+                return EV_FAIL;
+            *out = make_value(l.type, l.i / r.i);
+            return EV_OK;
+        case OP_EQ: *out = make_value(TY_BOOL, l.i == r.i); return EV_OK;
+        case OP_NE: *out = make_value(TY_BOOL, l.i != r.i); return EV_OK;
+        case OP_LT: *out = make_value(TY_BOOL, l.i < r.i); return EV_OK;
+        case OP_GT: *out = make_value(TY_BOOL, l.i > r.i); return EV_OK;
+        case OP_LE: *out = make_value(TY_BOOL, l.i <= r.i); return EV_OK;
+        case OP_GE: *out = make_value(TY_BOOL, l.i >= r.i); return EV_OK;
+        default:    return EV_FAIL;
+    }
+}
+
+static Outcome eval_logical(Expr* e, int in_try, Value* out) {
+    int is_and = e->binop.op == OP_AND, t;
+    Value v;
+    Outcome o = eval_expr(e->binop.left, in_try, &v);
+    if (o != EV_OK)
+        return o;
+    if (!truth(v, &t))
+        return EV_FAIL;
+    if (t == is_and) {
+        o = eval_expr(e->binop.right, in_try, &v);
+        if (o != EV_OK)
+            return o;
+        if (!truth(v, &t))
+            return EV_FAIL;
+    }
+    *out = make_value(TY_BOOL, t);
+    return EV_OK;
+}
+
+// A call as codegen picks it: bools passed as ints, to the instance taking
+// the arguments' types
+static Outcome eval_call_expr(Expr* e, int in_try, Value* out) {
+    ExprList args = e->func_call.args;
+    if (args.count == 1 && !strcmp(e->func_call.func_name, "long")) {
+        Outcome o = eval_expr(args.exprs[0], in_try, out);
+        if (o == EV_OK && !convert(out, TY_LONG))
+            return EV_FAIL;
+        return o;
+    }
+    Stmt* decl = e->func_call.decl;
+    if (!decl || decl->func_decl.params.count != args.count)
+        return EV_FAIL;
+    Value* vals = malloc((args.count + 1) * sizeof(Value));
+    TypeKind* kinds = malloc((args.count + 1) * sizeof(TypeKind));
+    Outcome o = EV_OK;
+    for (int i = 0; i < args.count && o == EV_OK; i++) {
+        o = eval_expr(args.exprs[i], in_try, &vals[i]);
+        if (o != EV_OK)
+            break;
+        if (vals[i].type == TY_BOOL)
+            vals[i].type = TY_INT;
+        kinds[i] = vals[i].type;
+    }
+    if (o == EV_OK) {
+        Instance* inst = find_instance(decl, kinds);
+        o = inst && inst->pure ? eval_call(inst, vals, out) : EV_FAIL;
+    }
+    free(vals);
+    free(kinds);
+    return o;
+}
+
+static Outcome eval_expr(Expr* e, int in_try, Value* out) {
+    if (!spend())
+        return EV_FAIL;
+    switch (e->type) {
+        case EXPR_INT:
+        case EXPR_LONG:
+        case EXPR_FLOAT:
+        case EXPR_BOOL:
+            *out = literal(e);
+            return EV_OK;
+        case EXPR_VAR: {
+            Binding* b = find_binding(e->var_name);
+            if (!b)
+                return EV_FAIL;
+            *out = b->value;
+            return EV_OK;
+        }
+        case EXPR_BINOP: {
+            if (e->binop.op == OP_AND || e->binop.op == OP_OR)
+                return eval_logical(e, in_try, out);
+            Value l, r;
+            Outcome o = eval_expr(e->binop.left, in_try, &l);
+            if (o == EV_OK)
+                o = eval_expr(e->binop.right, in_try, &r);
+            return o == EV_OK ? eval_arith(e->binop.op, l, r, in_try, out) : o;
+        }
+        case EXPR_UNARYOP: {
+            int t;
+            Outcome o = eval_expr(e->unaryop.operand, in_try, out);
+            if (o != EV_OK)
+                return o;
+            if (!truth(*out, &t))
+                return EV_FAIL;
+            *out = make_value(TY_BOOL, !t);
+            return EV_OK;
+        }
+        case EXPR_FUNC_CALL:
+            return eval_call_expr(e, in_try, out);
+        default:
+            return EV_FAIL;
+    }
+}
+
+static Outcome eval_list(StmtList list, int in_try, Value* ret);
+
+static Outcome eval_scoped(StmtList list, int in_try, Value* ret) {
+    int mark = env_count;
+    Outcome o = eval_list(list, in_try, ret);
+    pop_bindings(mark);
+    return o;
+}
+
+static Outcome eval_stmt(Stmt* s, int in_try, Value* ret) {
+    if (!spend())
+        return EV_FAIL;
+    Value v;
+    Outcome o;
+    int t;
+    switch (s->type) {
+        case STMT_LET: {
+            o = eval_expr(s->let.expr, in_try, &v);
+            if (o != EV_OK)
+                return o;
+            TypeKind type = evaluating->vars[s->let.slot];
+            if (type != TY_NONE && !convert(&v, type))
+                return EV_FAIL;
+            push_binding(s->let.name, v);
+            return EV_OK;
+        }
+        case STMT_ASSIGN: {
+            o = eval_expr(s->assign.expr, in_try, &v);
+            if (o != EV_OK)
+                return o;
+            Binding* b = find_binding(s->assign.name);
+            if (!b || !convert(&v, b->value.type))
+                return EV_FAIL;
+            b->value = v;
+            return EV_OK;
+        }
+        case STMT_IF:
+            o = eval_expr(s->if_stmt.cond, in_try, &v);
+            if (o != EV_OK)
+                return o;
+            if (!truth(v, &t))
+                return EV_FAIL;
+            return eval_scoped(t ? s->if_stmt.then_stmt : s->if_stmt.else_stmt, in_try, ret);
+        case STMT_FOR: {
+            if (s->for_stmt.parallel)
+                return EV_FAIL;
+            int mark = env_count;
+            push_binding(s->for_stmt.var, make_value(TY_INT, s->for_stmt.start));
+            o = EV_OK;
+            // The counter is re-read after the body, which may assign it
+            while (o == EV_OK && env[mark].value.i <= s->for_stmt.end) {
+                o = eval_scoped(s->for_stmt.body, in_try, ret);
+                env[mark].value = make_value(TY_INT, env[mark].value.i + 1);
+            }
+            pop_bindings(mark);
+            return o;
+        }
+        case STMT_WHILE:
+            for (;;) {
+                o = eval_expr(s->while_stmt.cond, in_try, &v);
+                if (o != EV_OK)
+                    return o;
+                if (!truth(v, &t))
+                    return EV_FAIL;
+                if (!t)
+                    return EV_OK;
+                o = eval_scoped(s->while_stmt.body, in_try, ret);
+                if (o != EV_OK)
+                    return o;
+            }
+        case STMT_TRY_CATCH:
+            o = eval_scoped(s->try_catch.try_stmt, 1, ret);
+            // The catch block is outside this try, and any other
+            return o == EV_CATCH ? eval_scoped(s->try_catch.catch_stmt, 0, ret) : o;
+        case STMT_RETURN:
+            o = eval_expr(s->return_stmt.expr, in_try, ret);
+            return o == EV_OK ? EV_RETURN : o;
+        case STMT_FUNC_DECL:
+            return EV_OK;
+        default:
+            return EV_FAIL;
+    }
+}
+
+static Outcome eval_list(StmtList list, int in_try, Value* ret) {
+    for (int i = 0; i < list.count; i++) {
+        Outcome o = eval_stmt(list.stmts[i], in_try, ret);
+        if (o != EV_OK)
+            return o;
+    }
+    return EV_OK;
+}
+
+// Arguments as compared: int bits, then float bits
+static void memo_key(Instance* inst, Value* args, long long* key) {
+    int count = inst->decl->func_decl.params.count;
+    for (int j = 0; j < count; j++) {
+        unsigned bits;
+        memcpy(&bits, &args[j].f, sizeof(bits));
+        key[2 * j] = args[j].i;
+        key[2 * j + 1] = bits;
+    }
+}
+
+static unsigned hash_memo(Instance* inst, const long long* key) {
+    unsigned long long h = hash_pointer(inst);
+    for (int j = 0; j < 2 * inst->decl->func_decl.params.count; j++)
+        h = (h ^ (unsigned long long)key[j]) * 0x9e3779b97f4a7c15ull;
+    return (unsigned)(h >> 32);
+}
+
+// The slot holding inst's result for key, or the empty slot where it goes
+static Memo* memo_slot(Instance* inst, const long long* key) {
+    size_t size = 2 * inst->decl->func_decl.params.count * sizeof(long long);
+    unsigned i = hash_memo(inst, key) & (memo_cap - 1);
+    while (memos[i].inst && (memos[i].inst != inst || memcmp(memos[i].args, key, size)))
+        i = (i + 1) & (memo_cap - 1);
+    return &memos[i];
+}
+
+static Memo* find_memo(Instance* inst, Value* args) {
+    if (!memo_cap)
+        return NULL;
+    long long* key = malloc((2 * inst->decl->func_decl.params.count + 1) * sizeof(long long));
+    memo_key(inst, args, key);
+    Memo* m = memo_slot(inst, key);
+    free(key);
+    return m->inst ? m : NULL;
+}
+
+static void add_memo(Instance* inst, Value* args, Value result) {
+    if (2 * (memo_count + 1) > memo_cap) {
+        Memo* old = memos;
+        int old_cap = memo_cap;
+        memo_cap = memo_cap ? memo_cap * 2 : 64;
+        memos = calloc(memo_cap, sizeof(Memo));
+        for (int i = 0; i < old_cap; i++)
+            if (old[i].inst)
+                *memo_slot(old[i].inst, old[i].args) = old[i];
+        free(old);
+    }
+    long long* key = malloc((2 * inst->decl->func_decl.params.count + 1) * sizeof(long long));
+    memo_key(inst, args, key);
+    Memo* m = memo_slot(inst, key);
+    if (m->inst) {
+        free(key);
+        return;
+    }
+    *m = (Memo){ inst, key, result };
+    memo_count++;
+}
+
+// The body runs with no try around it, as generated code does: a zero
+// divisor outside the function's own try blocks traps
+static Outcome eval_call(Instance* inst, Value* args, Value* out) {
+    Stmt* decl = inst->decl;
+    int memo = decl->func_decl.memo;
+    if (memo) {
+        Memo* m = find_memo(inst, args);
+        if (m) {
+            *out = m->result;
+            return EV_OK;
+        }
+    }
+    if (depth == MAX_DEPTH)
+        return EV_FAIL;
+    int outer_frame = frame, mark = env_count;
+    Instance* outer = evaluating;
+    frame = env_count;
+    evaluating = inst;
+    depth++;
+    Outcome o = EV_OK;
+    for (int i = 0; i < decl->func_decl.params.count && o == EV_OK; i++) {
+        Value v = args[i];
+        if (!convert(&v, inst->vars[i]))
+            o = EV_FAIL;
+        push_binding(decl->func_decl.params.args[i], v);
+    }
+    Value ret = make_value(inst->ret, 0);
+    if (o == EV_OK)
+        o = eval_list(decl->func_decl.body, 0, &ret);
+    depth--;
+    evaluating = outer;
+    frame = outer_frame;
+    pop_bindings(mark);
+    if (o == EV_RETURN || o == EV_OK)
+        o = convert(&ret, inst->ret) ? EV_OK : EV_FAIL;
+    else
+        o = EV_FAIL;
+    if (o == EV_OK) {
+        *out = ret;
+        if (memo)
+            add_memo(inst, args, ret);
+    }
+    return o;
+}
+
+/*
+ * Folding. The program is walked in the order codegen generates it, and a
+ * call is only evaluated if its function was declared earlier, since
+ * codegen rejects calls to functions declared later.
+ */
+
+// Declarations seen so far, as a set of pointers (open addressing)
+static _Thread_local Stmt** visible;
+static _Thread_local int    visible_count, visible_cap;
+
+static Stmt** visible_slot(Stmt* decl) {
+    unsigned i = hash_pointer(decl) & (visible_cap - 1);
+    while (visible[i] && visible[i] != decl)
+        i = (i + 1) & (visible_cap - 1);
+    return &visible[i];
+}
+
+static void make_visible(Stmt* decl) {
+    if (2 * (visible_count + 1) > visible_cap) {
+        Stmt** old = visible;
+        int old_cap = visible_cap;
+        visible_cap = visible_cap ? visible_cap * 2 : 64;
+        visible = calloc(visible_cap, sizeof(Stmt*));
+        for (int i = 0; i < old_cap; i++)
+            if (old[i])
+                *visible_slot(old[i]) = old[i];
+        free(old);
+    }
+    Stmt** slot = visible_slot(decl);
+    if (!*slot) {
+        *slot = decl;
+        visible_count++;
+    }
+}
+
+static int is_visible(Stmt* decl) {
+    return visible_cap && *visible_slot(decl) == decl;
+}
+
+// e becomes the literal the call evaluates to
+static void try_evaluate(Expr* e) {
+    ExprList args = e->func_call.args;
+    int is_long = args.count == 1 && !strcmp(e->func_call.func_name, "long");
+    if (input_builtin(e->func_call.func_name, args.count))
+        return;
+    if (!is_long && (!e->func_call.decl || !is_visible(e->func_call.decl)))
+        return;
+    for (int i = 0; i < args.count; i++)
+        if (!is_literal(args.exprs[i]))
+            return;
+    if (program_steps <= 0)
+        return;
+    steps = CALL_STEPS < program_steps ? CALL_STEPS : program_steps;
+    long budget = steps;
+    Value v;
+    Outcome o = eval_call_expr(e, 0, &v);
+    program_steps -= budget - (steps > 0 ? steps : 0);
+    if (o != EV_OK)
+        return;
+    switch (v.type) {
+        case TY_INT:
+            e->type = EXPR_INT;
+            e->ival = (int)v.i;
+            break;
+        case TY_LONG:
+            e->type = EXPR_LONG;
+            e->lval = v.i;
+            break;
+        case TY_FLOAT:
+            e->type = EXPR_FLOAT;
+            e->fval = v.f;
+            break;
+        default:
+            return;
+    }
+    calls_evaluated++;
+}
+
+static void fold_calls_expr(Expr* e) {
+    switch (e->type) {
+        case EXPR_BINOP:
+            fold_calls_expr(e->binop.left);
+            fold_calls_expr(e->binop.right);
+            break;
+        case EXPR_UNARYOP:
+            fold_calls_expr(e->unaryop.operand);
+            break;
+        case EXPR_FUNC_CALL:
+            for (int i = 0; i < e->func_call.args.count; i++)
+                fold_calls_expr(e->func_call.args.exprs[i]);
+            try_evaluate(e);
+            break;
+        case EXPR_PIPELINE:
+            fold_calls_expr(e->pipeline.from);
+            fold_calls_expr(e->pipeline.to);
+            break;
+        case EXPR_ARRAY:
+            for (int i = 0; i < e->array.elems.count; i++)
+                fold_calls_expr(e->array.elems.exprs[i]);
+            break;
+        case EXPR_INDEX:
+            fold_calls_expr(e->index.array);
+            fold_calls_expr(e->index.index);
+            break;
+        default:
+            break;
+    }
+}
+
+static void fold_calls(StmtList list) {
+    for (int i = 0; i < list.count; i++) {
+        Stmt* s = list.stmts[i];
+        switch (s->type) {
+            case STMT_LET:
+                fold_calls_expr(s->let.expr);
+                break;
+            case STMT_ASSIGN:
+                fold_calls_expr(s->assign.expr);
+                break;
+            case STMT_INDEX_ASSIGN:
+                fold_calls_expr(s->index_assign.index);
+                fold_calls_expr(s->index_assign.expr);
+                break;
+            case STMT_OUTPUT:
+                fold_calls_expr(s->output.expr);
+                break;
+            case STMT_IF:
+                fold_calls_expr(s->if_stmt.cond);
+                fold_calls(s->if_stmt.then_stmt);
+                fold_calls(s->if_stmt.else_stmt);
+                break;
+            case STMT_FOR:
+                fold_calls(s->for_stmt.body);
+                break;
+            case STMT_WHILE:
+                fold_calls_expr(s->while_stmt.cond);
+                fold_calls(s->while_stmt.body);
+                break;
+            case STMT_TRY_CATCH:
+                fold_calls(s->try_catch.try_stmt);
+                fold_calls(s->try_catch.catch_stmt);
+                break;
+            case STMT_RETURN:
+                if (s->return_stmt.expr)
+                    fold_calls_expr(s->return_stmt.expr);
+                break;
+            case STMT_FUNC_DECL:
+                make_visible(s);
+                fold_calls(s->func_decl.body);
+                break;
+        }
+    }
+}
+
+// After inference, before codegen or the interpreter
+void pure_program(StmtList program) {
+    summarize_list(program);
+    analyze();
+    program_steps = PROGRAM_STEPS;
+    fold_calls(program);
+
+    for (int i = 0; i < summary_count; i++)
+        free(summaries[i].callees);
+    for (int i = 0; i < memo_cap; i++)
+        free(memos[i].args);
+    free(summaries);
+    table_free(&names);
+    table_free(&env_names);
+    free(env);
+    free(memos);
+    free(visible);
+    summaries = NULL;
+    env = NULL;
+    memos = NULL;
+    visible = NULL;
+    summary = NULL;
+    evaluating = NULL;
+    summary_count = summary_cap = env_count = env_cap = 0;
+    memo_count = memo_cap = visible_count = visible_cap = frame = depth = 0;
+}
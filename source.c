@@ -0,0 +1,77 @@
+// source.c - program text for the lexer: regular files are mapped rather
+// than read, and scanned in place
+
+#include "pLLVM.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A private, writable mapping (flex writes into the buffer it scans) on top
+// of a zeroed reservation one page longer than needed, so the two NULs
+// after the text exist even when the file ends on a page boundary
+static int map_source(Source* src, int fd, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (size + 2 + page - 1) & ~(page - 1);
+    char* base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, len);
+        return -1;
+    }
+    src->text = base;
+    src->size = size;
+    src->mapped = len;
+    return 0;
+}
+
+// Pipes and terminals, or a file read from somewhere other than its start
+static int read_source(Source* src, int fd) {
+    size_t cap = 64 * 1024, size = 0;
+    char* text = malloc(cap);
+    for (;;) {
+        if (cap - size < 2) {
+            cap *= 2;
+            text = realloc(text, cap);
+        }
+        ssize_t n = read(fd, text + size, cap - size - 2);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            free(text);
+            return -1;
+        }
+        if (!n)
+            break;
+        size += n;
+    }
+    text[size] = text[size + 1] = '\0';
+    src->text = text;
+    src->size = size;
+    src->mapped = 0;
+    return 0;
+}
+
+// 0 on success; otherwise errno says why
+int load_source(Source* src, int fd) {
+    struct stat st;
+    if (fstat(fd, &st))
+        return -1;
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0 &&
+        !map_source(src, fd, st.st_size))
+        return 0;
+    return read_source(src, fd);
+}
+
+void release_source(Source* src) {
+    if (src->mapped)
+        munmap(src->text, src->mapped);
+    else
+        free(src->text);
+    src->text = NULL;
+    src->size = src->mapped = 0;
+}
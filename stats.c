@@ -0,0 +1,208 @@
+// stats.c - --time-report / --stats: per-phase wall and CPU time, peak
+// memory, and compiler counters
+
+#include "pLLVM.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+ReportFormat time_report = REPORT_NONE;
+ReportFormat stats_report = REPORT_NONE;
+CompileStats stats;
+_Thread_local unsigned long symbol_lookups;
+_Thread_local unsigned long ast_nodes;
+_Thread_local unsigned long calls_evaluated;
+_Thread_local unsigned long tail_loops;
+_Thread_local unsigned long tail_calls;
+_Thread_local unsigned long lexed_tokens;
+_Thread_local unsigned long lexed_bytes;
+
+static const char* phase_names[PHASE_COUNT] = {
+    "setup", "lex", "parse", "fold", "codegen", "verify", "optimize", "emit", "run"
+};
+
+typedef struct {
+    double wall, cpu;    // seconds spent in the phase itself, not in phases it started
+    long   peak_kb;      // growth of peak RSS while the phase ran
+    int    used;
+} PhaseTimes;
+
+static PhaseTimes phases[PHASE_COUNT];
+static Phase      phase_stack[16];
+static int        phase_depth;
+static double     start_wall, start_cpu, last_wall, last_cpu;
+static long       start_peak_kb, last_peak_kb;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;  // -j workers add counts too
+
+static double seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Charges the time and peak RSS growth since the last phase change to the
+// running phase. CPU time is process-wide, so -j workers count towards the
+// phase that waits for them (codegen)
+static void charge(void) {
+    double wall = seconds(CLOCK_MONOTONIC);
+    double cpu = seconds(CLOCK_PROCESS_CPUTIME_ID);
+    long peak_kb = peak_rss_kb();
+    if (!start_wall) {
+        start_wall = wall;
+        start_cpu = cpu;
+        start_peak_kb = peak_kb;
+    }
+    if (phase_depth) {
+        PhaseTimes* p = &phases[phase_stack[phase_depth - 1]];
+        p->wall += wall - last_wall;
+        p->cpu += cpu - last_cpu;
+        p->peak_kb += peak_kb - last_peak_kb;
+    }
+    last_wall = wall;
+    last_cpu = cpu;
+    last_peak_kb = peak_kb;
+}
+
+// Phases nest (codegen runs verify and optimize for main); only one thread
+// calls these, which is why batch --time-report needs -j 1
+void phase_begin(Phase phase) {
+    if (!time_report)
+        return;
+    charge();
+    phases[phase].used = 1;
+    phase_stack[phase_depth++] = phase;
+}
+
+void phase_end(Phase phase) {
+    if (!time_report)
+        return;
+    charge();
+    if (phase_depth && phase_stack[phase_depth - 1] == phase)
+        phase_depth--;
+}
+
+// Adds m's defined functions, basic blocks and instructions to the counters:
+// as generated, or after optimization
+void count_generated(LLVMModuleRef m, int optimized) {
+    if (!time_report && !stats_report)
+        return;
+    unsigned long functions = 0, blocks = 0, instructions = 0;
+    for (LLVMValueRef f = LLVMGetFirstFunction(m); f; f = LLVMGetNextFunction(f)) {
+        if (LLVMIsDeclaration(f))
+            continue;
+        functions++;
+        for (LLVMBasicBlockRef bb = LLVMGetFirstBasicBlock(f); bb; bb = LLVMGetNextBasicBlock(bb)) {
+            blocks++;
+            for (LLVMValueRef inst = LLVMGetFirstInstruction(bb); inst;
+                 inst = LLVMGetNextInstruction(inst))
+                instructions++;
+        }
+    }
+    pthread_mutex_lock(&stats_lock);
+    if (optimized) {
+        stats.instructions_optimized += instructions;
+    } else {
+        stats.functions += functions;
+        stats.basic_blocks += blocks;
+        stats.instructions += instructions;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Folds this thread's lexer, AST node and symbol lookup counts into the
+// totals
+void merge_thread_stats(void) {
+    pthread_mutex_lock(&stats_lock);
+    stats.source_bytes += lexed_bytes;
+    stats.tokens += lexed_tokens;
+    stats.ast_nodes += ast_nodes;
+    stats.symbol_lookups += symbol_lookups;
+    stats.calls_evaluated += calls_evaluated;
+    stats.tail_loops += tail_loops;
+    stats.tail_calls += tail_calls;
+    lexed_bytes = lexed_tokens = ast_nodes = symbol_lookups = calls_evaluated = 0;
+    tail_loops = tail_calls = 0;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void print_counters_text(void) {
+    fprintf(stderr, "%-24s %12lu\n", "source bytes", stats.source_bytes);
+    fprintf(stderr, "%-24s %12lu\n", "tokens", stats.tokens);
+    fprintf(stderr, "%-24s %12lu\n", "ast nodes", stats.ast_nodes);
+    fprintf(stderr, "%-24s %12lu\n", "symbol lookups", stats.symbol_lookups);
+    fprintf(stderr, "%-24s %12lu\n", "calls evaluated", stats.calls_evaluated);
+    fprintf(stderr, "%-24s %12lu\n", "tail calls to loops", stats.tail_loops);
+    fprintf(stderr, "%-24s %12lu\n", "tail calls", stats.tail_calls);
+    fprintf(stderr, "%-24s %12lu\n", "functions", stats.functions);
+    fprintf(stderr, "%-24s %12lu\n", "basic blocks", stats.basic_blocks);
+    fprintf(stderr, "%-24s %12lu\n", "instructions", stats.instructions);
+    if (opt_level > 0)
+        fprintf(stderr, "%-24s %12lu\n", "instructions optimized", stats.instructions_optimized);
+    if (cache_dir) {
+        fprintf(stderr, "%-24s %12lu\n", "cache hits", stats.cache_hits);
+        fprintf(stderr, "%-24s %12lu\n", "cache misses", stats.cache_misses);
+    }
+}
+
+static void print_counters_json(void) {
+    fprintf(stderr, "\"counters\": {\"source_bytes\": %lu, \"tokens\": %lu, \"ast_nodes\": %lu, "
+                    "\"symbol_lookups\": %lu, \"calls_evaluated\": %lu, \"tail_loops\": %lu, "
+                    "\"tail_calls\": %lu, \"functions\": %lu, \"basic_blocks\": %lu, \"instructions\": %lu",
+            stats.source_bytes, stats.tokens, stats.ast_nodes, stats.symbol_lookups,
+            stats.calls_evaluated, stats.tail_loops, stats.tail_calls, stats.functions,
+            stats.basic_blocks, stats.instructions);
+    if (opt_level > 0)
+        fprintf(stderr, ", \"instructions_optimized\": %lu", stats.instructions_optimized);
+    if (cache_dir)
+        fprintf(stderr, ", \"cache_hits\": %lu, \"cache_misses\": %lu",
+                stats.cache_hits, stats.cache_misses);
+    fprintf(stderr, "}");
+}
+
+// Printed to stderr so --run output on stdout stays clean
+void print_reports(void) {
+    merge_thread_stats();
+    double total_wall = seconds(CLOCK_MONOTONIC) - start_wall;
+    double total_cpu = seconds(CLOCK_PROCESS_CPUTIME_ID) - start_cpu;
+    long peak_kb = peak_rss_kb();
+
+    if (time_report == REPORT_TEXT || stats_report == REPORT_TEXT) {
+        if (time_report == REPORT_TEXT) {
+            fprintf(stderr, "%-10s %12s %12s %14s\n", "phase", "wall ms", "cpu ms", "+peak RSS KiB");
+            for (int i = 0; i < PHASE_COUNT; i++)
+                if (phases[i].used)
+                    fprintf(stderr, "%-10s %12.3f %12.3f %14ld\n", phase_names[i],
+                            phases[i].wall * 1e3, phases[i].cpu * 1e3, phases[i].peak_kb);
+            fprintf(stderr, "%-10s %12.3f %12.3f %14ld\n", "total",
+                    total_wall * 1e3, total_cpu * 1e3, peak_kb - start_peak_kb);
+            fprintf(stderr, "%-24s %12ld\n", "peak RSS KiB", peak_kb);
+        }
+        print_counters_text();
+    }
+    if (time_report == REPORT_JSON || stats_report == REPORT_JSON) {
+        fprintf(stderr, "{");
+        if (time_report == REPORT_JSON) {
+            fprintf(stderr, "\"phases\": {");
+            const char* sep = "";
+            for (int i = 0; i < PHASE_COUNT; i++) {
+                if (!phases[i].used)
+                    continue;
+                fprintf(stderr, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"peak_rss_growth_kb\": %ld}",
+                        sep, phase_names[i], phases[i].wall * 1e3, phases[i].cpu * 1e3,
+                        phases[i].peak_kb);
+                sep = ", ";
+            }
+            fprintf(stderr, "}, \"total\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"peak_rss_kb\": %ld}, ",
+                    total_wall * 1e3, total_cpu * 1e3, peak_kb);
+        }
+        print_counters_json();
+        fprintf(stderr, "}\n");
+    }
+}
@@ -0,0 +1,196 @@
+// symtab.c - interned identifiers and the scoped symbol table used by codegen
+
+#include "pLLVM.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    const char* str;
+    unsigned    hash;
+} InternSlot;
+
+// Per thread, so batch mode lexes programs side by side without a lock.
+// Names are only compared within one program, which one thread lexes, so
+// the table is emptied after each (see free_interned())
+static _Thread_local InternSlot* interned = NULL;
+static _Thread_local unsigned    intern_cap = 0;
+static _Thread_local unsigned    intern_count = 0;
+
+_Thread_local SymbolTable symtab;
+
+static unsigned hash_string(const char* s, size_t len) {
+    // FNV-1a
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Interned names are compared by pointer, so hash the pointer itself
+unsigned hash_name(const char* p) {
+    uint64_t x = (uint64_t)(uintptr_t)p;
+    return (unsigned)((x * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static void intern_grow(void) {
+    unsigned cap = intern_cap ? intern_cap * 2 : 1024;
+    InternSlot* slots = calloc(cap, sizeof(InternSlot));
+    for (unsigned i = 0; i < intern_cap; i++) {
+        if (!interned[i].str)
+            continue;
+        unsigned j = interned[i].hash & (cap - 1);
+        while (slots[j].str)
+            j = (j + 1) & (cap - 1);
+        slots[j] = interned[i];
+    }
+    free(interned);
+    interned = slots;
+    intern_cap = cap;
+}
+
+const char* intern(const char* s) {
+    return intern_len(s, strlen(s));
+}
+
+// s need not be NUL-terminated (the lexer passes yytext and yyleng)
+const char* intern_len(const char* s, size_t len) {
+    if (2 * (intern_count + 1) > intern_cap)
+        intern_grow();
+    unsigned h = hash_string(s, len);
+    unsigned i = h & (intern_cap - 1);
+    while (interned[i].str) {
+        if (interned[i].hash == h && !strncmp(interned[i].str, s, len) && !interned[i].str[len])
+            return interned[i].str;
+        i = (i + 1) & (intern_cap - 1);
+    }
+    char* copy = malloc(len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    interned[i].str = copy;
+    interned[i].hash = h;
+    intern_count++;
+    return copy;
+}
+
+// Once the program's AST is gone nothing points at its names, and a batch
+// thread would otherwise keep every name it has ever lexed
+void free_interned(void) {
+    for (unsigned i = 0; i < intern_cap; i++)
+        free((char*)interned[i].str);
+    free(interned);
+    interned = NULL;
+    intern_cap = intern_count = 0;
+}
+
+// Returns the slot holding name, or the empty slot where it would go
+static NameSlot* find_slot(SymbolTable* t, const char* name) {
+    unsigned i = hash_name(name) & (t->slot_cap - 1);
+    while (t->slots[i].name && t->slots[i].name != name)
+        i = (i + 1) & (t->slot_cap - 1);
+    return &t->slots[i];
+}
+
+static void slots_grow(SymbolTable* t) {
+    int cap = t->slot_cap ? t->slot_cap * 2 : 256;
+    NameSlot* old = t->slots;
+    int old_cap = t->slot_cap;
+    t->slots = calloc(cap, sizeof(NameSlot));
+    t->slot_cap = cap;
+    for (int i = 0; i < old_cap; i++)
+        if (old[i].name)
+            *find_slot(t, old[i].name) = old[i];
+    free(old);
+}
+
+void push_scope(void) {
+    SymbolTable* t = &symtab;
+    if (t->scope_count == t->scope_cap) {
+        t->scope_cap = t->scope_cap ? t->scope_cap * 2 : 16;
+        t->scopes = realloc(t->scopes, t->scope_cap * sizeof(int));
+    }
+    t->scopes[t->scope_count++] = t->count;
+}
+
+void pop_scope(void) {
+    SymbolTable* t = &symtab;
+    table_truncate(t, t->scopes[--t->scope_count]);
+}
+
+// A function body sees its parameters and locals but none of the bindings
+// around its declaration, as with -j, where it is generated on its own.
+// Returns the base for pop_function_scope() to restore
+int push_function_scope(void) {
+    int outer = symtab.base;
+    push_scope();
+    symtab.base = symtab.count;
+    return outer;
+}
+
+void pop_function_scope(int outer_base) {
+    pop_scope();
+    symtab.base = outer_base;
+}
+
+// The table_* functions serve any pass that binds names in nested scopes:
+// the n-th binding made is symbols[n], so a pass can keep what it knows
+// about each in a parallel array indexed the same way
+void table_truncate(SymbolTable* t, int count) {
+    while (t->count > count) {
+        Symbol* sym = &t->symbols[--t->count];
+        find_slot(t, sym->name)->index = sym->shadowed;
+    }
+}
+
+void table_bind(SymbolTable* t, const char* name, LLVMValueRef ptr) {
+    if (2 * (t->slot_used + 1) > t->slot_cap)
+        slots_grow(t);
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 64;
+        t->symbols = realloc(t->symbols, t->cap * sizeof(Symbol));
+    }
+    NameSlot* slot = find_slot(t, name);
+    if (!slot->name) {
+        slot->name = name;
+        slot->index = -1;
+        t->slot_used++;
+    }
+    t->symbols[t->count] = (Symbol){ name, ptr, slot->index };
+    slot->index = t->count++;
+}
+
+// The innermost binding of name, or -1
+int table_lookup(SymbolTable* t, const char* name) {
+    if (!t->slot_cap)
+        return -1;
+    NameSlot* slot = find_slot(t, name);
+    return slot->name ? slot->index : -1;
+}
+
+void table_free(SymbolTable* t) {
+    free(t->symbols);
+    free(t->scopes);
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
+
+void bind_variable(const char* name, LLVMValueRef ptr) {
+    table_bind(&symtab, name, ptr);
+}
+
+int lookup_variable_index(const char* name) {
+    symbol_lookups++;
+    int index = table_lookup(&symtab, name);
+    return index >= symtab.base ? index : -1;
+}
+
+LLVMValueRef lookup_variable(const char* name) {
+    int index = lookup_variable_index(name);
+    return index >= 0 ? symtab.symbols[index].ptr : NULL;
+}
+
+void free_symtab(void) {
+    table_free(&symtab);
+}